@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "aof.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void put_u32(std::string &out, uint32_t v){
+    out.append((const char*)&v, 4);
+}
+
+void aof_put_cmd(std::string &out, const std::vector<std::string> &cmd){
+    size_t len = 4;
+    for(const std::string &s : cmd){
+        len += 4 + s.size();
+    }
+    put_u32(out, (uint32_t)len);
+    put_u32(out, (uint32_t)cmd.size());
+    for(const std::string &s : cmd){
+        put_u32(out, (uint32_t)s.size());
+        out.append(s);
+    }
+}
+
+int aof_next(const std::string &data, size_t* pos, size_t max_len,
+    const uint8_t** payload, size_t* len)
+{
+    size_t left = data.size() - *pos;
+    if(left == 0){
+        return AOF_NEXT_END;
+    }
+    uint32_t n = 0;
+    if(left < 4){
+        return AOF_NEXT_TRUNCATED;
+    }
+    memcpy(&n, data.data() + *pos, 4);
+    if(n > max_len || left - 4 < n){
+        return AOF_NEXT_TRUNCATED;
+    }
+    *payload = (const uint8_t*)data.data() + *pos + 4;
+    *len = n;
+    *pos += 4 + n;
+    return AOF_NEXT_OK;
+}
+
+bool aof_open(const std::string &path, int* fd, std::string &err){
+#ifdef _WIN32
+    *fd = _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    *fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0644);
+#endif
+    if(*fd < 0){
+        err = "can't open " + path + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool aof_write(int fd, const char* data, size_t len, size_t* written){
+    *written = 0;
+    while(*written < len){
+#ifdef _WIN32
+        int rv = _write(fd, data + *written, (unsigned)std::min<size_t>(len - *written, 1 << 30));
+#else
+        ssize_t rv = write(fd, data + *written, len - *written);
+#endif
+        if(rv < 0 && errno == EINTR){
+            continue;
+        }
+        if(rv <= 0){
+            return false;
+        }
+        *written += (size_t)rv;
+    }
+    return true;
+}
+
+void aof_close(int fd){
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+bool aof_read(const std::string &path, std::string &data, std::string &err){
+    err.clear();
+    FILE* fp = fopen(path.c_str(), "rb");
+    if(!fp){
+        if(errno != ENOENT){
+            err = "can't open " + path + ": " + strerror(errno);
+        }
+        return false;
+    }
+    data.clear();
+    char buf[64 * 1024];
+    size_t n = 0;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0){
+        data.append(buf, n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    if(!ok){
+        err = "read error on " + path;
+    }
+    return ok;
+}
+
+bool aof_truncate(const std::string &path, size_t size){
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+    if(fd < 0){
+        return false;
+    }
+    bool ok = _chsize_s(fd, (__int64)size) == 0;
+    _close(fd);
+    return ok;
+#else
+    return truncate(path.c_str(), (off_t)size) == 0;
+#endif
+}
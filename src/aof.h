@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the append-only file is a sequence of write commands in the request framing:
+//   | len (4) | nstr (4) | len | str1 | len | str2 | ... |
+// so replaying it is parse_req() + do_request() per command.
+
+// append one command to `out`
+void aof_put_cmd(std::string &out, const std::vector<std::string> &cmd);
+
+enum{
+    AOF_NEXT_OK = 0,
+    AOF_NEXT_END = 1,       // no more commands
+    AOF_NEXT_TRUNCATED = 2, // a partial command at the end, from a crash
+};
+
+// the payload (after the length) of the command at `*pos`, and advance `*pos`
+int aof_next(const std::string &data, size_t* pos, size_t max_len,
+    const uint8_t** payload, size_t* len);
+
+// low-level file ops, false on failure. fsync and rename are in fileio.h
+bool aof_open(const std::string &path, int* fd, std::string &err); // append, create
+// write everything, `written` tells how far it got on a failure
+bool aof_write(int fd, const char* data, size_t len, size_t* written);
+void aof_close(int fd);
+// the whole file, false if it can't be read (`err`) or doesn't exist (empty `err`)
+bool aof_read(const std::string &path, std::string &data, std::string &err);
+// cut a file back to `size` bytes, to drop a partial command
+bool aof_truncate(const std::string &path, size_t size);
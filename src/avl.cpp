@@ -10,6 +10,19 @@ static void avl_update(AVLNode *node) {
   node->height =
       1 + max(avl_height(node->left), avl_height(node->right));
   node->cnt = 1 + avl_cnt(node->left) + avl_cnt(node->right);
+  if (node->aug) {
+    AVLAug *a = avl_aug(node);
+    a->sum = a->min = a->max = a->val;
+    AVLNode *kids[2] = {node->left, node->right};
+    for (AVLNode *kid : kids) {
+      if (kid) {
+        AVLAug *k = avl_aug(kid);
+        a->sum += k->sum;
+        a->min = k->min < a->min ? k->min : a->min;
+        a->max = k->max > a->max ? k->max : a->max;
+      }
+    }
+  }
 }
 
 //   B                                D
@@ -153,6 +166,12 @@ AVLNode* avl_del(AVLNode* node){
     from = parent->left == node ? &parent->left : &parent->right;
   }
   *from = victim;
+  // the aggregates on the path still count `node` instead of the successor
+  if(victim->aug){
+    for(AVLNode* cur = victim; cur; cur = cur->parent){
+      avl_update(cur);
+    }
+  }
   return root;
 }
 
@@ -213,3 +232,173 @@ AVLNode* avl_offset(AVLNode* node, int64_t offset){
 // 从节点 3 出发，offset = +2 (也就是要找 5 节点)
 // 我们发现 3 的右子树的大小是 2 (5 节点和 4 节点)，也就是P所指的位置可以向右移动 2 个位置，刚好可以移动到 5 节点
 // 那我们就进入右子树。
+
+
+// the number of nodes before this one in the whole tree: the left subtree,
+// plus each ancestor (and its left subtree) that we reach from the right
+uint64_t avl_rank(AVLNode* node){
+  uint64_t rank = avl_cnt(node->left);
+  for(AVLNode* parent = node->parent; parent; node = parent, parent = parent->parent){
+    if(parent->right == node){
+      rank += avl_cnt(parent->left) + 1;
+    }
+  }
+  return rank;
+}
+
+// all of `left` < mid < all of `right`, the heights differ by at most 1
+static AVLNode* avl_join_even(AVLNode* left, AVLNode* mid, AVLNode* right){
+  mid->left = left;
+  mid->right = right;
+  if(left){
+    left->parent = mid;
+  }
+  if(right){
+    right->parent = mid;
+  }
+  avl_update(mid);
+  return mid;
+}
+
+// join 2 trees with `mid` in between. walk down the spine of the taller tree
+// to a subtree as tall as the other tree, join them there, and rebalance
+// upwards like an insertion. O(height difference).
+AVLNode* avl_join(AVLNode* left, AVLNode* mid, AVLNode* right){
+  uint32_t lh = avl_height(left);
+  uint32_t rh = avl_height(right);
+  mid->parent = nullptr;
+  if(lh <= rh + 1 && rh <= lh + 1){
+    return avl_join_even(left, mid, right);
+  }
+  if(lh > rh){
+    AVLNode* parent = nullptr; // `cur` may end up as an empty subtree
+    AVLNode* cur = left;
+    while(avl_height(cur) > rh + 1){
+      parent = cur;
+      cur = cur->right;
+    }
+    parent->right = avl_join_even(cur, mid, right);
+    mid->parent = parent;
+    return avl_fix(parent);
+  }else{
+    AVLNode* parent = nullptr;
+    AVLNode* cur = right;
+    while(avl_height(cur) > lh + 1){
+      parent = cur;
+      cur = cur->left;
+    }
+    parent->left = avl_join_even(left, mid, cur);
+    mid->parent = parent;
+    return avl_fix(parent);
+  }
+}
+
+// concatenate 2 trees, using the first node of `right` as the middle
+AVLNode* avl_concat(AVLNode* left, AVLNode* right){
+  if(!left || !right){
+    return left ? left : right;
+  }
+  AVLNode* first = right;
+  while(first->left){
+    first = first->left;
+  }
+  right = avl_del(first);
+  avl_init(first);
+  return avl_join(left, first, right);
+}
+
+// split off the first `rank` nodes. each level joins the pieces of the
+// level below, the joins telescope to O(log n) in total.
+void avl_split(AVLNode* root, uint64_t rank, AVLNode** left, AVLNode** right){
+  if(!root){
+    *left = *right = nullptr;
+    return;
+  }
+  AVLNode* l = root->left;
+  AVLNode* r = root->right;
+  if(l){
+    l->parent = nullptr;
+  }
+  if(r){
+    r->parent = nullptr;
+  }
+  if(rank <= avl_cnt(l)){
+    AVLNode* mid = nullptr;
+    avl_split(l, rank, left, &mid);
+    *right = avl_join(mid, root, r);
+  }else{
+    AVLNode* mid = nullptr;
+    avl_split(r, rank - avl_cnt(l) - 1, &mid, right);
+    *left = avl_join(l, root, mid);
+  }
+}
+
+// a perfectly balanced tree from nodes in order, O(n)
+static AVLNode* avl_build_range(AVLNode** nodes, size_t n, AVLNode* parent){
+  if(n == 0){
+    return nullptr;
+  }
+  size_t mid = n / 2;
+  AVLNode* node = nodes[mid];
+  node->parent = parent;
+  node->left = avl_build_range(nodes, mid, node);
+  node->right = avl_build_range(nodes + mid + 1, n - mid - 1, node);
+  avl_update(node);
+  return node;
+}
+
+AVLNode* avl_build(AVLNode** nodes, size_t n){
+  return avl_build_range(nodes, n, nullptr);
+}
+
+struct AVLAggOut{
+  uint64_t count = 0;
+  double sum = 0;
+  double min = 0;
+  double max = 0;
+};
+
+static void agg_add(AVLAggOut* out, uint64_t count, double sum, double min, double max){
+  if(out->count == 0){
+    out->sum = sum;
+    out->min = min;
+    out->max = max;
+  }else{
+    out->sum += sum;
+    out->min = min < out->min ? min : out->min;
+    out->max = max > out->max ? max : out->max;
+  }
+  out->count += count;
+}
+
+// [lo, hi) are ranks within the subtree. whole subtrees are taken from their
+// aggregates, so only the 2 paths to the boundaries are visited.
+static void avl_agg_range(AVLNode* node, uint64_t lo, uint64_t hi, AVLAggOut* out){
+  if(!node || lo >= hi){
+    return;
+  }
+  if(lo == 0 && hi >= node->cnt){
+    AVLAug* a = avl_aug(node);
+    agg_add(out, node->cnt, a->sum, a->min, a->max);
+    return;
+  }
+  uint64_t l = avl_cnt(node->left);
+  avl_agg_range(node->left, lo, hi < l ? hi : l, out);
+  if(lo <= l && l < hi){
+    double val = avl_aug(node)->val;
+    agg_add(out, 1, val, val, val);
+  }
+  if(hi > l + 1){
+    avl_agg_range(node->right, lo > l + 1 ? lo - l - 1 : 0, hi - l - 1, out);
+  }
+}
+
+uint64_t avl_aggregate(AVLNode* root, uint64_t lo, uint64_t hi, double* sum, double* min, double* max){
+  assert(!root || root->aug);
+  AVLAggOut out;
+  avl_agg_range(root, lo, hi, &out);
+  *sum = out.sum;
+  *min = out.min;
+  *max = out.max;
+  return out.count;
+}
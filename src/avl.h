@@ -1,19 +1,40 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 struct AVLNode{
     AVLNode* parent = nullptr;
     AVLNode* left = nullptr;
     AVLNode* right = nullptr;
-    uint32_t height = 0; //subtree height
+    uint32_t height : 31; //subtree height
+    uint32_t aug : 1;     // an AVLAug is placed right before the node
     uint32_t cnt = 0; // subtree size
+
+    AVLNode() : height(0), aug(0) {}
+};
+
+// the optional augmentation: a value per node and its aggregates over the
+// subtree, kept up to date by every rebalance. all nodes of a tree have it or none.
+struct AVLAug{
+    double val = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
 };
 
+inline AVLAug* avl_aug(AVLNode* node){
+    return (AVLAug*)node - 1;
+}
+
 inline void avl_init(AVLNode* node){
     node->left = nullptr;
     node->right = nullptr;
     node->parent = nullptr;
     node->height = 1;
     node->cnt = 1;
+    if(node->aug){
+        AVLAug* a = avl_aug(node);
+        a->sum = a->min = a->max = a->val;
+    }
 }
 
 //helps
@@ -28,4 +49,16 @@ inline uint32_t avl_cnt(AVLNode* node){
 //API
 AVLNode* avl_fix(AVLNode* node);
 AVLNode* avl_del(AVLNode* node);
-AVLNode* avl_offset(AVLNode* node, int64_t offset);
\ No newline at end of file
+AVLNode* avl_offset(AVLNode* node, int64_t offset);
+uint64_t avl_rank(AVLNode* node);
+// join 2 trees with `mid` in between, all of `left` < mid < all of `right`
+AVLNode* avl_join(AVLNode* left, AVLNode* mid, AVLNode* right);
+// join 2 trees, all of `left` < all of `right`
+AVLNode* avl_concat(AVLNode* left, AVLNode* right);
+// split the tree into the first `rank` nodes and the rest, O(log n)
+void avl_split(AVLNode* root, uint64_t rank, AVLNode** left, AVLNode** right);
+// a balanced tree from `n` nodes that are already in order, O(n)
+AVLNode* avl_build(AVLNode** nodes, size_t n);
+// aggregate the values of the nodes ranked [lo, hi) in the tree, O(log n).
+// augmented trees only, returns the number of nodes.
+uint64_t avl_aggregate(AVLNode* root, uint64_t lo, uint64_t hi, double* sum, double* min, double* max);
@@ -0,0 +1,659 @@
+#include <cassert>
+#include <cstring>
+#include <new>
+#include "btree.h"
+#include "slab.h"
+
+static BLeaf* leaf_new(BTree* tree){
+    BLeaf* leaf = new (slab_alloc(sizeof(BLeaf))) BLeaf();
+    leaf->hdr.leaf = 1;
+    tree->nleaf++;
+    return leaf;
+}
+
+static BInner* inner_new(BTree* tree){
+    BInner* inner = new (slab_alloc(sizeof(BInner))) BInner();
+    tree->ninner++;
+    return inner;
+}
+
+static void node_free(BTree* tree, BNode* node){
+    if(node->leaf){
+        tree->nleaf--;
+        slab_free(node, sizeof(BLeaf));
+    }else{
+        tree->ninner--;
+        slab_free(node, sizeof(BInner));
+    }
+}
+
+static void* node_min(BNode* node){
+    return node->leaf ? ((BLeaf*)node)->items[0] : ((BInner*)node)->keys[0];
+}
+
+static uint32_t node_size(BNode* node){
+    if(node->leaf){
+        return node->n;
+    }
+    BInner* inner = (BInner*)node;
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        size += inner->cnt[i];
+    }
+    return size;
+}
+
+static uint32_t child_idx(BInner* parent, BNode* child){
+    for(uint32_t i = 0; i < parent->hdr.n; ++i){
+        if(parent->kids[i] == child){
+            return i;
+        }
+    }
+    assert(!"not a child");
+    return 0;
+}
+
+// the smallest item under `node` has changed, update the keys above it
+static void fix_min(BNode* node){
+    void* min = node_min(node);
+    for(BNode* p = node->parent; p; node = p, p = p->parent){
+        uint32_t i = child_idx((BInner*)p, node);
+        ((BInner*)p)->keys[i] = min;
+        if(i != 0){
+            break;
+        }
+    }
+}
+
+static void add_count(BNode* node, int32_t delta){
+    for(BNode* p = node->parent; p; node = p, p = p->parent){
+        ((BInner*)p)->cnt[child_idx((BInner*)p, node)] += delta;
+    }
+}
+
+// the first item >= key, or the end of the leaf
+static uint32_t leaf_lower_bound(BLeaf* leaf, const void* key, BCmp cmp){
+    uint32_t lo = 0, hi = leaf->hdr.n;
+    while(lo < hi){
+        uint32_t mid = (lo + hi) / 2;
+        if(cmp(leaf->items[mid], key) < 0){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the leaf where `key` is or would be
+static BLeaf* find_leaf(BTree* tree, const void* key, BCmp cmp){
+    BNode* node = tree->root;
+    while(node && !node->leaf){
+        BInner* inner = (BInner*)node;
+        // the last child whose smallest item is <= key
+        uint32_t i = 0;
+        while(i + 1 < node->n && cmp(inner->keys[i + 1], key) <= 0){
+            ++i;
+        }
+        node = inner->kids[i];
+    }
+    return (BLeaf*)node;
+}
+
+static void split_inner(BTree* tree, BInner* node);
+
+// link the new right half of a split node into the parent
+static void parent_insert(BTree* tree, BNode* left, BNode* right){
+    BInner* parent = (BInner*)left->parent;
+    uint32_t i = 0;
+    if(!parent){
+        // the root was split, grow a level
+        parent = inner_new(tree);
+        parent->hdr.n = 1;
+        parent->kids[0] = left;
+        parent->keys[0] = node_min(left);
+        left->parent = &parent->hdr;
+        tree->root = &parent->hdr;
+    }else{
+        i = child_idx(parent, left);
+    }
+    uint32_t n = parent->hdr.n;
+    memmove(&parent->kids[i + 2], &parent->kids[i + 1], (n - i - 1) * sizeof(BNode*));
+    memmove(&parent->keys[i + 2], &parent->keys[i + 1], (n - i - 1) * sizeof(void*));
+    memmove(&parent->cnt[i + 2], &parent->cnt[i + 1], (n - i - 1) * sizeof(uint32_t));
+    parent->kids[i + 1] = right;
+    parent->keys[i + 1] = node_min(right);
+    parent->cnt[i] = node_size(left);
+    parent->cnt[i + 1] = node_size(right);
+    right->parent = &parent->hdr;
+    parent->hdr.n++;
+    if(parent->hdr.n == k_binner_max){
+        split_inner(tree, parent);
+    }
+}
+
+static void split_leaf(BTree* tree, BLeaf* leaf){
+    BLeaf* right = leaf_new(tree);
+    uint32_t keep = leaf->hdr.n / 2;
+    right->hdr.n = leaf->hdr.n - keep;
+    memcpy(right->items, &leaf->items[keep], right->hdr.n * sizeof(void*));
+    leaf->hdr.n = keep;
+    // link the leaves
+    right->prev = leaf;
+    right->next = leaf->next;
+    if(leaf->next){
+        leaf->next->prev = right;
+    }
+    leaf->next = right;
+    parent_insert(tree, &leaf->hdr, &right->hdr);
+}
+
+static void split_inner(BTree* tree, BInner* node){
+    BInner* right = inner_new(tree);
+    uint32_t keep = node->hdr.n / 2;
+    uint32_t n = node->hdr.n - keep;
+    memcpy(right->kids, &node->kids[keep], n * sizeof(BNode*));
+    memcpy(right->keys, &node->keys[keep], n * sizeof(void*));
+    memcpy(right->cnt, &node->cnt[keep], n * sizeof(uint32_t));
+    right->hdr.n = n;
+    node->hdr.n = keep;
+    for(uint32_t i = 0; i < n; ++i){
+        right->kids[i]->parent = &right->hdr;
+    }
+    parent_insert(tree, &node->hdr, &right->hdr);
+}
+
+void btree_insert(BTree* tree, void* item, const void* key, BCmp cmp){
+    if(!tree->root){
+        BLeaf* leaf = leaf_new(tree);
+        tree->root = &leaf->hdr;
+        tree->first = leaf;
+    }
+    BLeaf* leaf = find_leaf(tree, key, cmp);
+    uint32_t i = leaf_lower_bound(leaf, key, cmp);
+    memmove(&leaf->items[i + 1], &leaf->items[i], (leaf->hdr.n - i) * sizeof(void*));
+    leaf->items[i] = item;
+    leaf->hdr.n++;
+    tree->size++;
+    add_count(&leaf->hdr, 1);
+    if(i == 0){
+        fix_min(&leaf->hdr);
+    }
+    // split when full, so there is always room for the next insert
+    if(leaf->hdr.n == k_bleaf_max){
+        split_leaf(tree, leaf);
+    }
+}
+
+static void node_remove(BTree* tree, BNode* node);
+
+// move everything from `right` into its left sibling `left`
+static void node_merge(BTree* tree, BNode* left, BNode* right){
+    BInner* parent = (BInner*)left->parent;
+    uint32_t i = child_idx(parent, left);
+    assert(parent->kids[i + 1] == right);
+    if(left->leaf){
+        BLeaf* l = (BLeaf*)left;
+        BLeaf* r = (BLeaf*)right;
+        memcpy(&l->items[l->hdr.n], r->items, r->hdr.n * sizeof(void*));
+    }else{
+        BInner* l = (BInner*)left;
+        BInner* r = (BInner*)right;
+        memcpy(&l->kids[l->hdr.n], r->kids, r->hdr.n * sizeof(BNode*));
+        memcpy(&l->keys[l->hdr.n], r->keys, r->hdr.n * sizeof(void*));
+        memcpy(&l->cnt[l->hdr.n], r->cnt, r->hdr.n * sizeof(uint32_t));
+        for(uint32_t k = 0; k < r->hdr.n; ++k){
+            r->kids[k]->parent = left;
+        }
+    }
+    left->n += right->n;
+    right->n = 0;
+    parent->cnt[i] += parent->cnt[i + 1];
+    parent->cnt[i + 1] = 0;
+    node_remove(tree, right);
+}
+
+// merge an underfull node with a sibling when they fit in one node
+static void node_rebalance(BTree* tree, BNode* node){
+    uint32_t max = node->leaf ? k_bleaf_max : k_binner_max;
+    BInner* parent = (BInner*)node->parent;
+    if(!parent || node->n >= max / 2){
+        return;
+    }
+    uint32_t i = child_idx(parent, node);
+    if(i + 1 < parent->hdr.n && node->n + parent->kids[i + 1]->n < max){
+        node_merge(tree, node, parent->kids[i + 1]);
+    }else if(i > 0 && parent->kids[i - 1]->n + node->n < max){
+        node_merge(tree, parent->kids[i - 1], node);
+    }
+}
+
+// unlink an empty node from its parent and free it
+static void node_remove(BTree* tree, BNode* node){
+    assert(node->n == 0);
+    BInner* parent = (BInner*)node->parent;
+    if(node->leaf){
+        BLeaf* leaf = (BLeaf*)node;
+        if(leaf->prev){
+            leaf->prev->next = leaf->next;
+        }else{
+            tree->first = leaf->next;
+        }
+        if(leaf->next){
+            leaf->next->prev = leaf->prev;
+        }
+    }
+    if(!parent){
+        tree->root = nullptr;
+        node_free(tree, node);
+        return;
+    }
+    uint32_t i = child_idx(parent, node);
+    node_free(tree, node);
+
+    uint32_t n = parent->hdr.n;
+    memmove(&parent->kids[i], &parent->kids[i + 1], (n - i - 1) * sizeof(BNode*));
+    memmove(&parent->keys[i], &parent->keys[i + 1], (n - i - 1) * sizeof(void*));
+    memmove(&parent->cnt[i], &parent->cnt[i + 1], (n - i - 1) * sizeof(uint32_t));
+    parent->hdr.n--;
+    if(parent->hdr.n == 0){
+        node_remove(tree, &parent->hdr);
+        return;
+    }
+    if(i == 0){
+        fix_min(&parent->hdr);
+    }
+    if(!parent->hdr.parent && parent->hdr.n == 1){
+        // a root with a single child, drop a level
+        tree->root = parent->kids[0];
+        tree->root->parent = nullptr;
+        parent->hdr.n = 0;
+        node_free(tree, &parent->hdr);
+        return;
+    }
+    node_rebalance(tree, &parent->hdr);
+}
+
+bool btree_delete(BTree* tree, const void* key, BCmp cmp){
+    BLeaf* leaf = find_leaf(tree, key, cmp);
+    if(!leaf){
+        return false;
+    }
+    uint32_t i = leaf_lower_bound(leaf, key, cmp);
+    if(i == leaf->hdr.n || cmp(leaf->items[i], key) != 0){
+        return false;
+    }
+    memmove(&leaf->items[i], &leaf->items[i + 1], (leaf->hdr.n - i - 1) * sizeof(void*));
+    leaf->hdr.n--;
+    tree->size--;
+    add_count(&leaf->hdr, -1);
+    if(leaf->hdr.n == 0){
+        node_remove(tree, &leaf->hdr);
+        return true;
+    }
+    if(i == 0){
+        fix_min(&leaf->hdr);
+    }
+    node_rebalance(tree, &leaf->hdr);
+    return true;
+}
+
+bool btree_seekge(BTree* tree, const void* key, BCmp cmp, BIter* it){
+    BLeaf* leaf = find_leaf(tree, key, cmp);
+    uint32_t i = leaf ? leaf_lower_bound(leaf, key, cmp) : 0;
+    if(leaf && i == leaf->hdr.n){
+        // everything here is smaller, the next leaf starts after the key
+        leaf = leaf->next;
+        i = 0;
+    }
+    it->leaf = leaf;
+    it->idx = i;
+    return leaf != nullptr;
+}
+
+void btree_replace(BIter* it, void* item){
+    it->leaf->items[it->idx] = item;
+    if(it->idx == 0){
+        fix_min(&it->leaf->hdr);
+    }
+}
+
+size_t btree_rank(BIter* it){
+    size_t rank = it->idx;
+    BNode* node = &it->leaf->hdr;
+    for(BNode* p = node->parent; p; node = p, p = p->parent){
+        BInner* inner = (BInner*)p;
+        for(uint32_t i = 0; inner->kids[i] != node; ++i){
+            rank += inner->cnt[i];
+        }
+    }
+    return rank;
+}
+
+bool btree_select(BTree* tree, size_t rank, BIter* it){
+    it->leaf = nullptr;
+    it->idx = 0;
+    if(rank >= tree->size){
+        return false;
+    }
+    BNode* node = tree->root;
+    while(!node->leaf){
+        BInner* inner = (BInner*)node;
+        uint32_t i = 0;
+        while(rank >= inner->cnt[i]){
+            rank -= inner->cnt[i];
+            ++i;
+        }
+        node = inner->kids[i];
+    }
+    it->leaf = (BLeaf*)node;
+    it->idx = (uint32_t)rank;
+    return true;
+}
+
+bool btree_offset(BTree* tree, BIter* it, int64_t offset){
+    if(!it->leaf){
+        return false;
+    }
+    int64_t idx = (int64_t)it->idx + offset;
+    if(idx >= 0 && idx < (int64_t)it->leaf->hdr.n){
+        it->idx = (uint32_t)idx; // same leaf
+        return true;
+    }
+    if(offset == 1){
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+        return it->leaf != nullptr;
+    }
+    if(offset == -1){
+        it->leaf = it->leaf->prev;
+        it->idx = it->leaf ? it->leaf->hdr.n - 1 : 0;
+        return it->leaf != nullptr;
+    }
+    // a far jump, go through the counts
+    int64_t rank = (int64_t)btree_rank(it) + offset;
+    if(rank < 0){
+        it->leaf = nullptr;
+        return false;
+    }
+    return btree_select(tree, (size_t)rank, it);
+}
+
+// the levels above the leaves
+static uint32_t node_height(BNode* node){
+    uint32_t h = 0;
+    for(; !node->leaf; node = ((BInner*)node)->kids[0]){
+        ++h;
+    }
+    return h;
+}
+
+static BLeaf* first_leaf(BNode* node){
+    while(!node->leaf){
+        node = ((BInner*)node)->kids[0];
+    }
+    return (BLeaf*)node;
+}
+
+static BLeaf* last_leaf(BNode* node){
+    while(!node->leaf){
+        node = ((BInner*)node)->kids[node->n - 1];
+    }
+    return (BLeaf*)node;
+}
+
+// a subtree changes trees, count its nodes without visiting the leaves
+static void move_count(BTree* from, BTree* to, BNode* node){
+    if(node->leaf){
+        from->nleaf--;
+        to->nleaf++;
+        return;
+    }
+    from->ninner--;
+    to->ninner++;
+    BInner* inner = (BInner*)node;
+    if(inner->kids[0]->leaf){
+        from->nleaf -= node->n;
+        to->nleaf += node->n;
+        return;
+    }
+    for(uint32_t i = 0; i < node->n; ++i){
+        move_count(from, to, inner->kids[i]);
+    }
+}
+
+// `node` keeps its first `rank` items (*lo, null if none), the rest go to a
+// new subtree of `right` (*hi). only the nodes on the path are touched.
+static void node_split(BTree* tree, BTree* right, BNode* node, size_t rank,
+    BNode** lo, BNode** hi)
+{
+    if(rank == 0){
+        move_count(tree, right, node);
+        *lo = nullptr;
+        *hi = node;
+        return;
+    }
+    if(node->leaf){
+        BLeaf* leaf = (BLeaf*)node;
+        BLeaf* r = leaf_new(right);
+        r->hdr.n = leaf->hdr.n - (uint32_t)rank;
+        memcpy(r->items, &leaf->items[rank], r->hdr.n * sizeof(void*));
+        leaf->hdr.n = (uint32_t)rank;
+        // the leaves are cut apart by btree_split()
+        r->prev = leaf;
+        r->next = leaf->next;
+        if(leaf->next){
+            leaf->next->prev = r;
+        }
+        leaf->next = r;
+        *lo = node;
+        *hi = &r->hdr;
+        return;
+    }
+    BInner* inner = (BInner*)node;
+    uint32_t i = 0;
+    while(rank >= inner->cnt[i]){
+        rank -= inner->cnt[i];
+        ++i;
+    }
+    BNode* clo = nullptr;
+    BNode* chi = nullptr;
+    node_split(tree, right, inner->kids[i], rank, &clo, &chi);
+    BInner* r = inner_new(right);
+    r->kids[0] = chi;
+    r->keys[0] = node_min(chi);
+    r->cnt[0] = inner->cnt[i] - (uint32_t)rank;
+    chi->parent = &r->hdr;
+    uint32_t m = 1;
+    for(uint32_t j = i + 1; j < node->n; ++j, ++m){
+        r->kids[m] = inner->kids[j];
+        r->keys[m] = inner->keys[j];
+        r->cnt[m] = inner->cnt[j];
+        r->kids[m]->parent = &r->hdr;
+        move_count(tree, right, r->kids[m]);
+    }
+    r->hdr.n = m;
+    // i > 0 if the whole child moved
+    node->n = clo ? i + 1 : i;
+    inner->cnt[i] = (uint32_t)rank;
+    *lo = node;
+    *hi = &r->hdr;
+}
+
+// a root with a single child is a level too many
+static void trim_root(BTree* tree){
+    while(tree->root && !tree->root->leaf && tree->root->n == 1){
+        BNode* old = tree->root;
+        tree->root = ((BInner*)old)->kids[0];
+        tree->root->parent = nullptr;
+        old->n = 0;
+        node_free(tree, old);
+    }
+}
+
+// the nodes on the edge of a split or a join may be almost empty. merge those
+// on the path to `rank` with a sibling where they fit, from the top down
+static void path_rebalance(BTree* tree, size_t rank){
+    BNode* node = tree->root;
+    size_t r = rank;
+    while(node && !node->leaf){
+        BInner* inner = (BInner*)node;
+        uint32_t i = 0;
+        while(i + 1 < node->n && r >= inner->cnt[i]){
+            r -= inner->cnt[i];
+            ++i;
+        }
+        size_t nodes = tree->nleaf + tree->ninner;
+        node_rebalance(tree, inner->kids[i]);
+        if(tree->nleaf + tree->ninner != nodes){
+            // merged, the levels above may have changed too
+            node = tree->root;
+            r = rank;
+            continue;
+        }
+        node = inner->kids[i];
+    }
+}
+
+void btree_split(BTree* tree, size_t rank, BTree* right){
+    assert(!right->root);
+    if(rank >= tree->size){
+        return;
+    }
+    if(rank == 0){
+        *right = *tree;
+        *tree = BTree{};
+        return;
+    }
+    BNode* lo = nullptr;
+    BNode* hi = nullptr;
+    node_split(tree, right, tree->root, rank, &lo, &hi);
+    hi->parent = nullptr;
+    right->root = hi;
+    right->size = tree->size - rank;
+    tree->size = rank;
+    trim_root(tree);
+    trim_root(right);
+
+    BLeaf* last = last_leaf(tree->root);
+    BLeaf* first = first_leaf(right->root);
+    last->next = nullptr;
+    first->prev = nullptr;
+    right->first = first;
+    path_rebalance(tree, tree->size - 1);
+    path_rebalance(right, 0);
+}
+
+void btree_join(BTree* tree, BTree* right){
+    if(!right->root){
+        return;
+    }
+    if(!tree->root){
+        *tree = *right;
+        *right = BTree{};
+        return;
+    }
+    BNode* lroot = tree->root;
+    BNode* rroot = right->root;
+    size_t lsize = tree->size;
+    size_t rsize = right->size;
+    uint32_t hl = node_height(lroot);
+    uint32_t hr = node_height(rroot);
+    BLeaf* last = last_leaf(lroot);
+    BLeaf* first = right->first;
+    last->next = first;
+    first->prev = last;
+    tree->size += rsize;
+    tree->nleaf += right->nleaf;
+    tree->ninner += right->ninner;
+    *right = BTree{};
+
+    BInner* p = nullptr;
+    if(hl == hr){
+        uint32_t max = lroot->leaf ? k_bleaf_max : k_binner_max;
+        if(lroot->n + rroot->n >= max){
+            parent_insert(tree, lroot, rroot); // grows a level
+        }else if(lroot->leaf){
+            memcpy(&last->items[last->hdr.n], first->items, first->hdr.n * sizeof(void*));
+            last->hdr.n += first->hdr.n;
+            last->next = nullptr;
+            first->hdr.n = 0;
+            node_free(tree, rroot);
+        }else{
+            BInner* l = (BInner*)lroot;
+            BInner* r = (BInner*)rroot;
+            memcpy(&l->kids[l->hdr.n], r->kids, r->hdr.n * sizeof(BNode*));
+            memcpy(&l->keys[l->hdr.n], r->keys, r->hdr.n * sizeof(void*));
+            memcpy(&l->cnt[l->hdr.n], r->cnt, r->hdr.n * sizeof(uint32_t));
+            for(uint32_t k = 0; k < r->hdr.n; ++k){
+                r->kids[k]->parent = lroot;
+            }
+            l->hdr.n += r->hdr.n;
+            r->hdr.n = 0;
+            node_free(tree, rroot);
+        }
+    }else if(hl > hr){
+        // hang the right tree under the right spine, at its height
+        p = (BInner*)lroot;
+        for(uint32_t h = hl; h > hr + 1; --h){
+            p = (BInner*)p->kids[p->hdr.n - 1];
+        }
+        uint32_t n = p->hdr.n;
+        p->kids[n] = rroot;
+        p->keys[n] = node_min(rroot);
+        p->cnt[n] = (uint32_t)rsize;
+        p->hdr.n++;
+        rroot->parent = &p->hdr;
+        add_count(&p->hdr, (int32_t)rsize);
+    }else{
+        // or the left tree under the left spine of the right one
+        p = (BInner*)rroot;
+        for(uint32_t h = hr; h > hl + 1; --h){
+            p = (BInner*)p->kids[0];
+        }
+        uint32_t n = p->hdr.n;
+        memmove(&p->kids[1], &p->kids[0], n * sizeof(BNode*));
+        memmove(&p->keys[1], &p->keys[0], n * sizeof(void*));
+        memmove(&p->cnt[1], &p->cnt[0], n * sizeof(uint32_t));
+        p->kids[0] = lroot;
+        p->keys[0] = node_min(lroot);
+        p->cnt[0] = (uint32_t)lsize;
+        p->hdr.n++;
+        lroot->parent = &p->hdr;
+        add_count(&p->hdr, (int32_t)lsize);
+        fix_min(&p->hdr);
+        tree->root = rroot;
+    }
+    if(p && p->hdr.n == k_binner_max){
+        split_inner(tree, p);
+    }
+    path_rebalance(tree, lsize - 1);
+    path_rebalance(tree, lsize);
+}
+
+static void node_dispose(BTree* tree, BNode* node, void (*f)(void*, void*), void* arg){
+    if(node->leaf){
+        BLeaf* leaf = (BLeaf*)node;
+        for(uint32_t i = 0; i < node->n; ++i){
+            f(leaf->items[i], arg);
+        }
+    }else{
+        BInner* inner = (BInner*)node;
+        for(uint32_t i = 0; i < node->n; ++i){
+            node_dispose(tree, inner->kids[i], f, arg);
+        }
+    }
+    node_free(tree, node);
+}
+
+void btree_clear(BTree* tree, void (*f)(void*, void*), void* arg){
+    if(tree->root){
+        node_dispose(tree, tree->root, f, arg);
+    }
+    *tree = BTree{};
+}
+
+size_t btree_mem_usage(BTree* tree){
+    return tree->nleaf * slab_usable_size(sizeof(BLeaf))
+        + tree->ninner * slab_usable_size(sizeof(BInner));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// an order-statistic B+tree of opaque item pointers.
+// the nodes are a few cache lines wide, inner nodes keep the size of each
+// subtree for O(log n) rank and offset, and the leaves are linked for scans.
+// inner nodes refer to the smallest item of each child, so the items must
+// stay alive while they are in the tree.
+
+const uint32_t k_bleaf_max = 28;  // items per leaf, a leaf is 256 bytes
+const uint32_t k_binner_max = 12; // children per inner node, also 256 bytes
+
+struct BNode{
+    BNode* parent = nullptr;
+    uint32_t n = 0;     // items or children
+    uint32_t leaf = 0;
+};
+
+struct BLeaf{
+    BNode hdr;
+    BLeaf* prev = nullptr;
+    BLeaf* next = nullptr;
+    void* items[k_bleaf_max];
+};
+
+struct BInner{
+    BNode hdr;
+    void* keys[k_binner_max];   // the smallest item under each child
+    BNode* kids[k_binner_max];
+    uint32_t cnt[k_binner_max]; // the number of items under each child
+};
+
+// compares an item with a search key like memcmp()
+typedef int (*BCmp)(void* item, const void* key);
+
+struct BTree{
+    BNode* root = nullptr;
+    BLeaf* first = nullptr;
+    size_t size = 0;
+    size_t nleaf = 0;
+    size_t ninner = 0;
+};
+
+// a position in the tree, valid until the tree is modified
+struct BIter{
+    BLeaf* leaf = nullptr; // nullptr when out of range
+    uint32_t idx = 0;
+};
+
+inline void* biter_item(BIter* it){
+    return it->leaf ? it->leaf->items[it->idx] : nullptr;
+}
+
+// `key` is the search key of `item`, keys must be unique
+void btree_insert(BTree* tree, void* item, const void* key, BCmp cmp);
+// remove the item equal to `key`
+bool btree_delete(BTree* tree, const void* key, BCmp cmp);
+// the first item >= key
+bool btree_seekge(BTree* tree, const void* key, BCmp cmp, BIter* it);
+// replace the item at `it` with an equal one, e.g. after moving it in memory
+void btree_replace(BIter* it, void* item);
+bool btree_offset(BTree* tree, BIter* it, int64_t offset);
+// the number of items before `it`
+size_t btree_rank(BIter* it);
+bool btree_select(BTree* tree, size_t rank, BIter* it);
+// move the items ranked `rank` and after into the empty `right`.
+// O(log n): only the nodes on the path to the rank are split.
+void btree_split(BTree* tree, size_t rank, BTree* right);
+// append the items of `right`, all greater than those of `tree`, leaving
+// `right` empty. O(log n) as well.
+void btree_join(BTree* tree, BTree* right);
+// free the nodes and pass every item to `f`
+void btree_clear(BTree* tree, void (*f)(void*, void*), void* arg);
+// bytes used by the nodes
+size_t btree_mem_usage(BTree* tree);
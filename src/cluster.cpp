@@ -0,0 +1,71 @@
+#include <cstdlib>
+#include "cluster.h"
+
+static uint16_t g_crc16_table[256];
+
+static bool crc16_init(){
+    for(uint32_t i = 0; i < 256; ++i){
+        uint16_t crc = (uint16_t)(i << 8);
+        for(int k = 0; k < 8; ++k){
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        g_crc16_table[i] = crc;
+    }
+    return true;
+}
+
+static bool g_crc16_ready = crc16_init();
+
+uint16_t crc16(const char* data, size_t len){
+    uint16_t crc = 0;
+    for(size_t i = 0; i < len; ++i){
+        crc = (uint16_t)((crc << 8) ^ g_crc16_table[((crc >> 8) ^ (uint8_t)data[i]) & 0xff]);
+    }
+    return crc;
+}
+
+uint32_t key_hash_slot(const char* key, size_t len){
+    size_t open = 0;
+    while(open < len && key[open] != '{'){
+        open++;
+    }
+    if(open < len){
+        size_t close = open + 1;
+        while(close < len && key[close] != '}'){
+            close++;
+        }
+        if(close < len && close > open + 1){
+            key += open + 1;
+            len = close - open - 1;
+        }
+    }
+    return crc16(key, len) & (k_cluster_slots - 1);
+}
+
+static bool parse_slot(const char* s, const char* end, uint32_t* out){
+    if(s == end || end - s > 5){
+        return false;
+    }
+    uint32_t v = 0;
+    for(; s < end; ++s){
+        if(*s < '0' || *s > '9'){
+            return false;
+        }
+        v = v * 10 + (uint32_t)(*s - '0');
+    }
+    *out = v;
+    return v < k_cluster_slots;
+}
+
+bool parse_slot_range(const std::string &s, uint32_t* first, uint32_t* last){
+    const char* p = s.c_str();
+    const char* end = p + s.size();
+    const char* dash = p;
+    while(dash < end && *dash != '-'){
+        dash++;
+    }
+    if(dash == end){
+        return parse_slot(p, end, first) && parse_slot(p, end, last);
+    }
+    return parse_slot(p, dash, first) && parse_slot(dash + 1, end, last) && *first <= *last;
+}
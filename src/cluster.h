@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// cluster mode splits the keys over 16384 hash slots, as Redis Cluster does:
+// slot = crc16(key) mod 16384. if the key has a non-empty "{...}" the slot is
+// of the part inside the first pair of braces only, so related keys can be
+// put on the same node ("user:{42}:name", "user:{42}:scores").
+const uint32_t k_cluster_slots = 16384;
+
+// crc16-ccitt (xmodem), the one Redis Cluster uses
+uint16_t crc16(const char* data, size_t len);
+
+uint32_t key_hash_slot(const char* key, size_t len);
+
+// "5" or "0-8191", false if not a slot or not a range of them
+bool parse_slot_range(const std::string &s, uint32_t* first, uint32_t* last);
@@ -0,0 +1,120 @@
+#define _WIN32_WINNT 0x0600
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "completion.h"
+
+static bool sock_set_nb(SOCKET fd){
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0;
+}
+
+// a connected pair of loopback sockets, there's no socketpair() on Windows
+static bool sock_pair(SOCKET* rfd, SOCKET* wfd, std::string &err){
+    SOCKET lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(lfd == INVALID_SOCKET){
+        err = "socket() failed";
+        return false;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0; // any
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int len = sizeof(addr);
+    if(bind(lfd, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR
+        || listen(lfd, 1) == SOCKET_ERROR
+        || getsockname(lfd, (sockaddr*)&addr, &len) == SOCKET_ERROR)
+    {
+        closesocket(lfd);
+        err = "can't listen on the loopback";
+        return false;
+    }
+    *wfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(*wfd == INVALID_SOCKET || connect(*wfd, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR){
+        if(*wfd != INVALID_SOCKET){
+            closesocket(*wfd);
+        }
+        closesocket(lfd);
+        err = "can't connect to the loopback";
+        return false;
+    }
+    sockaddr_in peer{};
+    int peer_len = sizeof(peer);
+    *rfd = accept(lfd, (sockaddr*)&peer, &peer_len);
+    closesocket(lfd);
+    if(*rfd == INVALID_SOCKET){
+        closesocket(*wfd);
+        err = "accept() failed";
+        return false;
+    }
+    // a wakeup is one byte, don't let it wait for an ack
+    int opt = 1;
+    setsockopt(*wfd, IPPROTO_TCP, TCP_NODELAY, (const char*)&opt, sizeof(opt));
+    if(!sock_set_nb(*rfd) || !sock_set_nb(*wfd)){
+        closesocket(*rfd);
+        closesocket(*wfd);
+        err = "ioctlsocket FIONBIO failed";
+        return false;
+    }
+    return true;
+}
+
+bool cq_init(CompletionQueue* cq, std::string &err){
+    if(!sock_pair(&cq->rfd, &cq->wfd, err)){
+        return false;
+    }
+    pthread_mutex_init(&cq->mutex, nullptr);
+    return true;
+}
+
+static void cq_push(CompletionQueue* cq, CqJob* job){
+    pthread_mutex_lock(&cq->mutex);
+    bool wake = cq->finished.empty(); // else a wakeup is pending already
+    cq->finished.push_back(job);
+    pthread_mutex_unlock(&cq->mutex);
+    if(wake){
+        char b = 1;
+        // if the pipe is full the loop has something to read anyway
+        (void)send(cq->wfd, &b, 1, 0);
+    }
+}
+
+static void cq_task(void* arg){
+    CqJob* job = (CqJob*)arg;
+    job->work(job);
+    cq_push(job->cq, job);
+}
+
+void cq_submit(CompletionQueue* cq, TheadPool* tp, uint32_t prio, CqJob* job){
+    job->cq = cq;
+    cq->inflight.fetch_add(1, std::memory_order_relaxed);
+    thread_pool_submit(tp, prio, &cq_task, job);
+}
+
+size_t cq_run(CompletionQueue* cq){
+    // drain the wakeups before taking the jobs, so one pushed meanwhile
+    // leaves a byte for the next poll
+    char buf[256];
+    while(true){
+        int rv = recv(cq->rfd, buf, sizeof(buf), 0);
+        if(rv <= 0){
+            break;
+        }
+        cq->wakeups += (uint64_t)rv;
+    }
+    std::vector<CqJob*> jobs;
+    pthread_mutex_lock(&cq->mutex);
+    jobs.swap(cq->finished);
+    pthread_mutex_unlock(&cq->mutex);
+    for(CqJob* job : jobs){
+        cq->inflight.fetch_sub(1, std::memory_order_relaxed);
+        job->done(job);
+    }
+    return jobs.size();
+}
+
+void cq_close(CompletionQueue* cq){
+    closesocket(cq->rfd);
+    closesocket(cq->wfd);
+    cq->rfd = cq->wfd = INVALID_SOCKET;
+    pthread_mutex_destroy(&cq->mutex);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <winsock2.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "thread_pool.h"
+
+// a completion queue hands the results of the thread pool back to the event
+// loop. a worker runs the job, pushes it and wakes the loop by writing a
+// byte to a loopback socket pair the loop polls along with the clients
+// (Linux would use an eventfd, Windows has none). the loop then runs what
+// comes after the job itself, so only the loop touches the keyspace.
+struct CompletionQueue;
+
+struct CqJob{
+    void (*work)(CqJob*) = nullptr; // on a worker
+    void (*done)(CqJob*) = nullptr; // then on the event loop, may free the job
+    CompletionQueue* cq = nullptr;
+};
+
+struct CompletionQueue{
+    SOCKET rfd = INVALID_SOCKET;     // polled by the event loop
+    SOCKET wfd = INVALID_SOCKET;     // written by the workers
+    pthread_mutex_t mutex;
+    std::vector<CqJob*> finished;    // not handed back yet
+    std::atomic<size_t> inflight{0}; // submitted, `done` not run yet
+    uint64_t wakeups = 0;            // bytes read from rfd
+};
+
+// after WSAStartup()
+bool cq_init(CompletionQueue* cq, std::string &err);
+// run job->work on the thread pool, then job->done on the loop
+void cq_submit(CompletionQueue* cq, TheadPool* tp, uint32_t prio, CqJob* job);
+// on the loop, when rfd polls readable: run `done` of the finished jobs,
+// returns how many
+size_t cq_run(CompletionQueue* cq);
+// nothing in flight
+void cq_close(CompletionQueue* cq);
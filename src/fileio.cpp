@@ -0,0 +1,35 @@
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "fileio.h"
+
+bool file_fsync(int fd){
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+bool file_fsync(FILE* fp){
+    if(fflush(fp) != 0){
+        return false;
+    }
+#ifdef _WIN32
+    return file_fsync(_fileno(fp));
+#else
+    return file_fsync(fileno(fp));
+#endif
+}
+
+bool file_rename(const std::string &from, const std::string &to){
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// the file operations the snapshot and the append-only file share, false on failure
+
+// flush a file to the disk, not just to the OS
+bool file_fsync(int fd);
+// the same for a stdio file, its buffer first
+bool file_fsync(FILE* fp);
+// replace `to` with `from`, neither may be open on Windows
+bool file_rename(const std::string &from, const std::string &to);
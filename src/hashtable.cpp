@@ -1,4 +1,5 @@
 #include "hashtable.h"
+#include "zmalloc.h"
 #include <cassert>
 #include <cstdlib>
 #include <cstddef>   // for size_t
@@ -6,7 +7,7 @@
 
 static void h_init(HTab* htab, size_t n){ // n must be power of 2
     assert(n > 0 && ((n-1) & n) == 0);
-    htab->tab = (HNode* *)calloc(n,sizeof(HNode* ));
+    htab->tab = (HNode* *)zcalloc(n,sizeof(HNode* ));
     htab->mask = n-1;
     htab->size = 0;
 }
@@ -52,7 +53,7 @@ static void hm_help_rehashing(HMap* hmap){
         nwork++;
 
         if(hmap->older.size == 0 && hmap->older.tab){ // C 风格数组不会有“空数组就是 false”这种说法
-            free(hmap->older.tab);
+            zfree(hmap->older.tab);
             hmap->older = HTab{};
         }
     }
@@ -69,6 +70,10 @@ static void hm_trigger_rehashing(HMap* hmap){
 
 HNode* hm_lookup(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*)){
     hm_help_rehashing(hmap);
+    return hm_find(hmap, key, eq);
+}
+
+HNode* hm_find(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*)){
     HNode* *from = h_lookup(&hmap->newer,key,eq); 
     if(!from){
         from = h_lookup(&hmap->older,key,eq);
@@ -108,15 +113,102 @@ HNode* hm_delete(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*)){
 }
 
 void hm_clear(HMap* hmap){
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    zfree(hmap->newer.tab);
+    zfree(hmap->older.tab);
+    *hmap = HMap{};
+}
+
+void hm_reserve(HMap* hmap, size_t n){
+    size_t slots = 4;
+    while(slots * k_max_load_factor <= n){
+        slots *= 2;
+    }
+    if(hmap->newer.tab && hmap->newer.mask + 1 >= slots){
+        return;
+    }
+    // move everything at once instead of an incremental rehash
+    HTab fresh;
+    h_init(&fresh, slots);
+    HTab* tabs[2] = {&hmap->newer, &hmap->older};
+    for(HTab* htab : tabs){
+        for(size_t i = 0; htab->tab && i <= htab->mask; ++i){
+            while(htab->tab[i]){
+                h_insert(&fresh, h_detach(htab, &htab->tab[i]));
+            }
+        }
+    }
+    zfree(hmap->newer.tab);
+    zfree(hmap->older.tab);
     *hmap = HMap{};
+    hmap->newer = fresh;
+}
+
+void hm_reserve_parts(HMap* hmap, size_t n, size_t nparts){
+    assert(nparts > 0 && (nparts & (nparts - 1)) == 0);
+    hm_reserve(hmap, n < nparts * k_max_load_factor ? nparts * k_max_load_factor : n);
+}
+
+void hm_insert_part(HMap* hmap, HNode* node){
+    assert(hmap->newer.tab && !hmap->older.tab);
+    HNode** slot = &hmap->newer.tab[node->hcode & hmap->newer.mask];
+    node->next = *slot;
+    *slot = node;
+}
+
+void hm_add_count(HMap* hmap, size_t n){
+    hmap->newer.size += n;
+}
+
+static void h_drain(HTab* htab, void (*f)(HNode*)){
+    for(size_t i = 0; htab->tab && i <= htab->mask; ++i){
+        HNode* node = htab->tab[i];
+        while(node){
+            HNode* next = node->next; // `f` may free the node
+            f(node);
+            node = next;
+        }
+    }
+}
+
+void hm_drain(HMap* hmap, void (*f)(HNode*)){
+    h_drain(&hmap->newer, f);
+    h_drain(&hmap->older, f);
+    hm_clear(hmap);
 }
 
 size_t hm_size(HMap* hmap){
     return hmap->newer.size + hmap->older.size;
 }
 
+static void h_scan_slot(HTab* htab, size_t pos, void (*f)(HNode**, void*), void* arg){
+    for(HNode* *from = &htab->tab[pos]; *from; from = &(*from)->next){
+        f(from, arg);
+    }
+}
+
+size_t hm_scan(HMap* hmap, size_t cursor, void (*f)(HNode**, void*), void* arg){
+    size_t n1 = hmap->newer.tab ? hmap->newer.mask + 1 : 0;
+    size_t n2 = hmap->older.tab ? hmap->older.mask + 1 : 0;
+    if(cursor < n1){
+        h_scan_slot(&hmap->newer, cursor, f, arg);
+    }else if(cursor - n1 < n2){
+        h_scan_slot(&hmap->older, cursor - n1, f, arg);
+    }
+    cursor++;
+    return cursor < n1 + n2 ? cursor : 0;
+}
+
+size_t hm_mem_usage(HMap* hmap){
+    size_t slots = 0;
+    if(hmap->newer.tab){
+        slots += hmap->newer.mask + 1;
+    }
+    if(hmap->older.tab){
+        slots += hmap->older.mask + 1;
+    }
+    return slots * sizeof(HNode*);
+}
+
 static bool h_foreach(HTab* htab,bool (*f)(HNode*, void*),void* arg){
     for(size_t i=0; htab->mask !=0 && i<= htab->mask; ++i){
         for(HNode* node=htab->tab[i]; node != nullptr; node= node->next){
@@ -128,7 +220,50 @@ static bool h_foreach(HTab* htab,bool (*f)(HNode*, void*),void* arg){
     return true;
 }
 
+// a slot holds the nodes with hcode & mask == slot, so with enough slots
+// a part is every nparts-th slot, otherwise it's a filtered slot
+static void h_foreach_part(HTab* htab, size_t part, size_t nparts, void (*f)(HNode*, void*), void* arg){
+    if(!htab->tab){
+        return;
+    }
+    size_t nslots = htab->mask + 1;
+    size_t step = nslots < nparts ? nslots : nparts;
+    for(size_t i = part & htab->mask; i < nslots; i += step){
+        for(HNode* node = htab->tab[i]; node; node = node->next){
+            if((node->hcode & (nparts - 1)) == part){
+                f(node, arg);
+            }
+        }
+    }
+}
+
+void hm_foreach_part(HMap* hmap, size_t part, size_t nparts, void (*f)(HNode*, void*), void* arg){
+    assert(nparts > 0 && (nparts & (nparts - 1)) == 0 && part < nparts);
+    h_foreach_part(&hmap->newer, part, nparts, f, arg);
+    h_foreach_part(&hmap->older, part, nparts, f, arg);
+}
+
 void hm_foreach(HMap* hmap, bool (*f)(HNode*, void*),void* arg){
     h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
 
+
+static size_t h_sample(HTab* htab, uint64_t rnd, HNode** out, size_t n){
+    if(!htab->tab || htab->size == 0){
+        return 0;
+    }
+    size_t got = 0;
+    // up to a full pass: a sparse table still gives what it has
+    for(size_t i = 0; i <= htab->mask && got < n; ++i){
+        HNode* node = htab->tab[(rnd + i) & htab->mask];
+        for(; node && got < n; node = node->next){
+            out[got++] = node;
+        }
+    }
+    return got;
+}
+
+size_t hm_sample(HMap* hmap, uint64_t rnd, HNode** out, size_t n){
+    size_t got = h_sample(&hmap->newer, rnd, out, n);
+    return got + h_sample(&hmap->older, rnd, out + got, n - got);
+}
@@ -21,9 +21,36 @@ struct HMap
 };
 
 HNode *hm_lookup(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*));
+// hm_lookup() without its rehashing step: the map isn't modified, so threads
+// can look up at once while nothing writes it
+HNode *hm_find(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*));
 void hm_insert(HMap* hmap,HNode* node);
 HNode *hm_delete(HMap* hmap,HNode* key,bool (*eq)(HNode* , HNode*));
 void hm_clear(HMap* hmap);
+// make room for `n` nodes in total so that inserting them won't rehash
+void hm_reserve(HMap* hmap, size_t n);
+// hm_reserve() with at least `nparts` slots (a power of 2), so the nodes of
+// different parts (hcode & (nparts - 1), as in hm_foreach_part()) never share a slot
+void hm_reserve_parts(HMap* hmap, size_t n, size_t nparts);
+// insert into a table made by hm_reserve_parts() without counting the node
+// or growing the table. threads may insert the nodes of different parts at
+// once, then hm_add_count() counts all of them.
+void hm_insert_part(HMap* hmap, HNode* node);
+void hm_add_count(HMap* hmap, size_t n);
+// pass every node to `f`, which may free it, then clear the map
+void hm_drain(HMap* hmap, void (*f)(HNode*));
 size_t hm_size(HMap* hmap);
 // invoke the callback on each node until it returns false
 void hm_foreach(HMap* hmap,bool (*f)(HNode*, void*), void* arg);
+// visit the nodes with hcode & (nparts - 1) == part, `nparts` is a power of 2.
+// the map isn't modified, so threads can scan different parts at once.
+void hm_foreach_part(HMap* hmap, size_t part, size_t nparts, void (*f)(HNode*, void*), void* arg);
+// visit the chain of one slot per call. `f` gets the incoming link of each node,
+// so it may replace the node in place (but not remove it).
+// returns the next cursor, 0 after the last slot.
+size_t hm_scan(HMap* hmap, size_t cursor, void (*f)(HNode**, void*), void* arg);
+// bytes used by the slot arrays
+size_t hm_mem_usage(HMap* hmap);
+// collect up to `n` nodes from a random position, used for sampling keys.
+// fewer only if the map holds fewer: at most one pass over the slots.
+size_t hm_sample(HMap* hmap, uint64_t rnd, HNode** out, size_t n);
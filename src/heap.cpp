@@ -42,6 +42,8 @@ static void heap_down(HeapItem* a, size_t pos, size_t len){
         if(min_pos == pos) break;
         // swap with the kids
         a[pos] = a[min_pos];
+        *a[pos].ref = pos;
+        pos = min_pos;
     }
     a[pos] = t;
     *a[pos].ref = pos;
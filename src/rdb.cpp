@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "rdb.h"
+#include "fileio.h"
+
+// slicing-by-8: 8 tables, 8 input bytes per step
+static uint64_t g_crc_table[8][256];
+
+static bool crc64_init(){
+    const uint64_t poly = 0x95ac9329ac4bc9b5ULL; // reflected Jones polynomial
+    for(uint32_t i = 0; i < 256; ++i){
+        uint64_t crc = i;
+        for(int k = 0; k < 8; ++k){
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        }
+        g_crc_table[0][i] = crc;
+    }
+    for(uint32_t i = 0; i < 256; ++i){
+        for(int t = 1; t < 8; ++t){
+            uint64_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = g_crc_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+    return true;
+}
+
+static bool g_crc_ready = crc64_init();
+
+uint64_t crc64(uint64_t crc, const void* data, size_t len){
+    const uint8_t* p = (const uint8_t*)data;
+    for(; len >= 8; len -= 8, p += 8){
+        uint64_t word = 0;
+        memcpy(&word, p, 8); // little-endian
+        crc ^= word;
+        crc = g_crc_table[7][crc & 0xff] ^ g_crc_table[6][(crc >> 8) & 0xff]
+            ^ g_crc_table[5][(crc >> 16) & 0xff] ^ g_crc_table[4][(crc >> 24) & 0xff]
+            ^ g_crc_table[3][(crc >> 32) & 0xff] ^ g_crc_table[2][(crc >> 40) & 0xff]
+            ^ g_crc_table[1][(crc >> 48) & 0xff] ^ g_crc_table[0][crc >> 56];
+    }
+    for(; len > 0; --len, ++p){
+        crc = g_crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+void rdb_put_u8(std::string &out, uint8_t v){
+    out.push_back((char)v);
+}
+
+void rdb_put_u64(std::string &out, uint64_t v){
+    out.append((const char*)&v, 8);
+}
+
+void rdb_put_dbl(std::string &out, double v){
+    out.append((const char*)&v, 8);
+}
+
+void rdb_put_varint(std::string &out, uint64_t v){
+    while(v >= 0x80){
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+void rdb_put_str(std::string &out, const char* s, size_t len){
+    rdb_put_varint(out, len);
+    out.append(s, len);
+}
+
+static bool rdb_need(RdbReader* r, size_t n){
+    if(r->err || (size_t)(r->end - r->pos) < n){
+        r->err = true;
+        return false;
+    }
+    return true;
+}
+
+bool rdb_get_u8(RdbReader* r, uint8_t* v){
+    if(!rdb_need(r, 1)){
+        return false;
+    }
+    *v = *r->pos++;
+    return true;
+}
+
+bool rdb_get_u64(RdbReader* r, uint64_t* v){
+    if(!rdb_need(r, 8)){
+        return false;
+    }
+    memcpy(v, r->pos, 8);
+    r->pos += 8;
+    return true;
+}
+
+bool rdb_get_dbl(RdbReader* r, double* v){
+    if(!rdb_need(r, 8)){
+        return false;
+    }
+    memcpy(v, r->pos, 8);
+    r->pos += 8;
+    return true;
+}
+
+bool rdb_get_varint(RdbReader* r, uint64_t* v){
+    *v = 0;
+    for(uint32_t shift = 0; shift < 64; shift += 7){
+        uint8_t byte = 0;
+        if(!rdb_get_u8(r, &byte)){
+            return false;
+        }
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    r->err = true;
+    return false;
+}
+
+bool rdb_get_str(RdbReader* r, const char** s, size_t* len){
+    uint64_t n = 0;
+    if(!rdb_get_varint(r, &n) || !rdb_need(r, n)){
+        return false;
+    }
+    *s = (const char*)r->pos;
+    *len = (size_t)n;
+    r->pos += n;
+    return true;
+}
+
+const size_t k_rdb_chunk = 1 << 20;
+
+static bool write_chunks(FILE* fp, const char* data, size_t len){
+    for(size_t off = 0; off < len; off += k_rdb_chunk){
+        size_t n = len - off < k_rdb_chunk ? len - off : k_rdb_chunk;
+        if(fwrite(data + off, 1, n, fp) != n){
+            return false;
+        }
+    }
+    return true;
+}
+
+const size_t k_rdb_entry_size = 4 * 8; // a section table entry
+const size_t k_rdb_index_size = 2 * 8; // an index entry
+
+void rdb_put_index(RdbSection &sect, uint64_t hcode, size_t offset){
+    rdb_put_u64(sect.index, hcode);
+    rdb_put_u64(sect.index, offset);
+    sect.nkeys++;
+}
+
+void rdb_sort_section(RdbSection &sect, const std::vector<RdbIndexEntry> &recs){
+    std::vector<size_t> order(recs.size());
+    for(size_t i = 0; i < order.size(); ++i){
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+        return recs[a].hcode < recs[b].hcode;
+    });
+    std::string data;
+    data.reserve(sect.data.size());
+    for(size_t i : order){
+        // a record ends where the next one starts
+        size_t end = i + 1 < recs.size() ? recs[i + 1].offset : sect.data.size();
+        rdb_put_index(sect, recs[i].hcode, data.size());
+        data.append(sect.data, recs[i].offset, end - recs[i].offset);
+    }
+    sect.data.swap(data);
+}
+
+static uint64_t get_u64(const uint8_t* p){
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+void rdb_put_header(std::string &out, const std::vector<RdbSection> &sects){
+    // it needs the checksum of every section first
+    std::string head(k_rdb_sect_magic, sizeof(k_rdb_sect_magic));
+    rdb_put_u64(head, sects.size());
+    uint64_t offset = head.size() + sects.size() * k_rdb_entry_size + 8;
+    for(const RdbSection &sect : sects){
+        uint64_t size = sect.data.size() + sect.index.size();
+        rdb_put_u64(head, offset);
+        rdb_put_u64(head, size);
+        rdb_put_u64(head, sect.nkeys);
+        rdb_put_u64(head, crc64(crc64(0, sect.data.data(), sect.data.size()),
+            sect.index.data(), sect.index.size()));
+        offset += size;
+    }
+    rdb_put_u64(head, crc64(0, head.data(), head.size()));
+    out += head;
+}
+
+bool rdb_write_file(const std::string &path, const std::vector<RdbSection> &sects,
+    std::string &err)
+{
+    size_t nsect = sects.size();
+    if(nsect == 0 || (nsect & (nsect - 1)) != 0){
+        err = "bad number of sections";
+        return false;
+    }
+    std::string head;
+    rdb_put_header(head, sects);
+
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(!fp){
+        err = "can't open " + tmp;
+        return false;
+    }
+    // the sections are already large, don't copy them into stdio's buffer
+    setvbuf(fp, nullptr, _IONBF, 0);
+    bool ok = write_chunks(fp, head.data(), head.size());
+    for(size_t i = 0; ok && i < nsect; ++i){
+        ok = write_chunks(fp, sects[i].data.data(), sects[i].data.size())
+            && write_chunks(fp, sects[i].index.data(), sects[i].index.size());
+    }
+    ok = ok && file_fsync(fp);
+    ok = fclose(fp) == 0 && ok;
+    if(!ok){
+        err = "write error on " + tmp;
+        remove(tmp.c_str());
+        return false;
+    }
+    if(!file_rename(tmp, path)){
+        err = "can't rename " + tmp + " to " + path;
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool rdb_map_file(const std::string &path, RdbFile* file, std::string &err){
+    *file = RdbFile{};
+#ifdef _WIN32
+    HANDLE fh = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size;
+    if(fh == INVALID_HANDLE_VALUE || !GetFileSizeEx(fh, &size)){
+        if(fh != INVALID_HANDLE_VALUE){
+            CloseHandle(fh);
+        }
+        err = "can't open " + path;
+        return false;
+    }
+    file->size = (size_t)size.QuadPart;
+    if(file->size == 0){
+        CloseHandle(fh);
+        return true;
+    }
+    HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    void* view = mh ? MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if(!view){
+        if(mh){
+            CloseHandle(mh);
+        }
+        CloseHandle(fh);
+        err = "can't map " + path;
+        return false;
+    }
+    file->file = fh;
+    file->mapping = mh;
+    file->data = (const uint8_t*)view;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0){
+        if(fd >= 0){
+            close(fd);
+        }
+        err = "can't open " + path;
+        return false;
+    }
+    file->size = (size_t)st.st_size;
+    if(file->size == 0){
+        close(fd);
+        return true;
+    }
+    void* addr = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if(addr == MAP_FAILED){
+        err = "can't map " + path;
+        return false;
+    }
+    madvise(addr, file->size, MADV_WILLNEED);
+    file->data = (const uint8_t*)addr;
+#endif
+    return true;
+}
+
+void rdb_unmap_file(RdbFile* file){
+#ifdef _WIN32
+    if(file->data){
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+        CloseHandle(file->file);
+    }
+#else
+    if(file->data){
+        munmap((void*)file->data, file->size);
+    }
+#endif
+    *file = RdbFile{};
+}
+
+bool rdb_read_sections(const RdbFile &file, std::vector<RdbSectionInfo> &sects, std::string &err){
+    const uint8_t* p = file.data;
+    size_t fixed = sizeof(k_rdb_sect_magic) + 8;
+    if(file.size < fixed + 8 || memcmp(p, k_rdb_sect_magic, sizeof(k_rdb_sect_magic)) != 0){
+        err = "bad snapshot header";
+        return false;
+    }
+    uint64_t nsect = get_u64(p + sizeof(k_rdb_sect_magic));
+    if(nsect == 0 || (nsect & (nsect - 1)) != 0
+        || nsect > (file.size - fixed - 8) / k_rdb_entry_size)
+    {
+        err = "bad snapshot header";
+        return false;
+    }
+    size_t head = fixed + nsect * k_rdb_entry_size;
+    if(crc64(0, p, head) != get_u64(p + head)){
+        err = "bad snapshot header checksum";
+        return false;
+    }
+    sects.resize(nsect);
+    uint64_t expect = head + 8;
+    for(size_t i = 0; i < nsect; ++i){
+        const uint8_t* e = p + fixed + i * k_rdb_entry_size;
+        RdbSectionInfo &sect = sects[i];
+        sect.offset = get_u64(e);
+        sect.size = get_u64(e + 8);
+        sect.nkeys = get_u64(e + 16);
+        sect.crc = get_u64(e + 24);
+        // contiguous and inside the file, with room for the index
+        if(sect.offset != expect || sect.size > file.size - sect.offset
+            || sect.nkeys > sect.size / k_rdb_index_size)
+        {
+            err = "bad snapshot section table";
+            return false;
+        }
+        sect.index = sect.offset + sect.size - sect.nkeys * k_rdb_index_size;
+        expect += sect.size;
+    }
+    if(expect != file.size){
+        err = "bad snapshot size";
+        return false;
+    }
+    return true;
+}
+
+bool rdb_index_at(const RdbFile &file, const RdbSectionInfo &sect, size_t i, RdbIndexEntry* out){
+    const uint8_t* p = file.data + sect.index + i * k_rdb_index_size;
+    out->hcode = get_u64(p);
+    uint64_t offset = get_u64(p + 8);
+    out->offset = sect.offset + offset;
+    return offset < sect.index - sect.offset;
+}
+
+size_t rdb_index_lower_bound(const RdbFile &file, const RdbSectionInfo &sect, uint64_t hcode){
+    size_t lo = 0, hi = (size_t)sect.nkeys;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(get_u64(file.data + sect.index + mid * k_rdb_index_size) < hcode){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool rdb_read_stream(const RdbFile &file, RdbReader* r, std::string &err){
+    size_t min_size = sizeof(k_rdb_magic) + 1 + 8;
+    if(file.size < min_size || memcmp(file.data, k_rdb_magic, sizeof(k_rdb_magic)) != 0){
+        err = "bad snapshot header";
+        return false;
+    }
+    if(crc64(0, file.data, file.size - 8) != get_u64(file.data + file.size - 8)){
+        err = "bad snapshot checksum";
+        return false;
+    }
+    r->pos = file.data + sizeof(k_rdb_magic);
+    r->end = file.data + file.size - 8;
+    r->err = false;
+    return true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the snapshot file is split into sections that decode independently, so
+// loading runs on all threads:
+//   | magic (8) | nsect (8) | section table | crc64 of all before (8) | sections |
+//   the section table: nsect x | offset (8) | size (8) | nkeys (8) | crc64 (8) |
+// section i holds the keys with hcode & (nsect - 1) == i, nsect is a power of 2:
+//   | record | record | ... | index |
+// the records are in hcode order, and the index locates each of them for
+// loading single keys on demand:
+//   nkeys x | hcode (8) | offset of the record from the start of the section (8) |
+//
+// a record:
+//   | type (1) | flags (1) | [expire_at (8), ms of wall clock] | key | value |
+//   RDB_TYPE_STR:  | string |
+//   RDB_TYPE_ZSET: | count (varint) | score (8) | name | score | name | ... |
+//                  the members in (score, name) order, so loading is a bulk build
+// strings are | len (varint) | bytes |, integers are little-endian.
+//
+// the stream format is a single run of records, used by the preamble of a
+// rewritten append-only file and by older snapshots:
+//   | magic (8) | record | record | ... | RDB_OP_EOF | crc64 of all before (8) |
+
+const char k_rdb_magic[8] = {'M', 'I', 'N', 'I', 'R', 'D', 'B', '1'};      // stream
+const char k_rdb_sect_magic[8] = {'M', 'I', 'N', 'I', 'R', 'D', 'B', '2'}; // sections
+
+enum{
+    RDB_TYPE_STR = 0,
+    RDB_TYPE_ZSET = 1,
+    RDB_OP_EOF = 0xff,
+};
+
+enum{
+    RDB_FLAG_TTL = 1,
+};
+
+// crc-64-jones, the one Redis uses for RDB files
+uint64_t crc64(uint64_t crc, const void* data, size_t len);
+
+// encoding, appends to `out`
+void rdb_put_u8(std::string &out, uint8_t v);
+void rdb_put_u64(std::string &out, uint64_t v);
+void rdb_put_dbl(std::string &out, double v);
+void rdb_put_varint(std::string &out, uint64_t v);
+void rdb_put_str(std::string &out, const char* s, size_t len);
+
+// decoding, every call fails once the input is short or malformed
+struct RdbReader{
+    const uint8_t* pos = nullptr;
+    const uint8_t* end = nullptr;
+    bool err = false;
+};
+
+bool rdb_get_u8(RdbReader* r, uint8_t* v);
+bool rdb_get_u64(RdbReader* r, uint64_t* v);
+bool rdb_get_dbl(RdbReader* r, double* v);
+bool rdb_get_varint(RdbReader* r, uint64_t* v);
+// points into the input, no copy
+bool rdb_get_str(RdbReader* r, const char** s, size_t* len);
+
+// the encoded records of one section and their index, see rdb_put_index()
+struct RdbSection{
+    std::string data;
+    std::string index;
+    size_t nkeys = 0;
+};
+
+// add the record that starts at `offset` in `sect.data`
+void rdb_put_index(RdbSection &sect, uint64_t hcode, size_t offset);
+
+// an entry of the section table
+struct RdbSectionInfo{
+    uint64_t offset = 0; // from the start of the file
+    uint64_t size = 0;
+    uint64_t nkeys = 0;
+    uint64_t crc = 0;    // of the section alone
+    uint64_t index = 0;  // where the records end and the index starts
+};
+
+struct RdbIndexEntry{
+    uint64_t hcode = 0;
+    uint64_t offset = 0; // from the start of the file
+};
+
+// put the records of a section into hcode order and index them. `recs` has
+// the hcode and offset of each record in `sect.data` as they were appended,
+// back to back in any hcode order. the index of `sect` must be empty.
+void rdb_sort_section(RdbSection &sect, const std::vector<RdbIndexEntry> &recs);
+
+// the header of a sectioned snapshot, the sections follow it as
+// | data | index | each. `sects.size()` must be a power of 2.
+void rdb_put_header(std::string &out, const std::vector<RdbSection> &sects);
+
+// write the header and the sections to a temporary file in large sequential
+// chunks, fsync it and rename it to `path`. `sects.size()` must be a power of 2.
+// `err` describes the failure.
+bool rdb_write_file(const std::string &path, const std::vector<RdbSection> &sects,
+    std::string &err);
+
+// a read-only mapping of a whole file, or a snapshot received in memory
+struct RdbFile{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void* file = nullptr;    // HANDLE
+    void* mapping = nullptr; // HANDLE
+#endif
+};
+
+bool rdb_map_file(const std::string &path, RdbFile* file, std::string &err);
+void rdb_unmap_file(RdbFile* file);
+// check the header of a sectioned snapshot and read its section table. the
+// sections themselves are checked by whoever decodes them.
+bool rdb_read_sections(const RdbFile &file, std::vector<RdbSectionInfo> &sects, std::string &err);
+// index entry `i` of a section, false if it points outside the records
+bool rdb_index_at(const RdbFile &file, const RdbSectionInfo &sect, size_t i, RdbIndexEntry* out);
+// the first index entry with an hcode >= `hcode`, binary search
+size_t rdb_index_lower_bound(const RdbFile &file, const RdbSectionInfo &sect, uint64_t hcode);
+// check a stream snapshot, on success `r` covers the records, up to and including RDB_OP_EOF
+bool rdb_read_stream(const RdbFile &file, RdbReader* r, std::string &err);
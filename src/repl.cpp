@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstring>
+#include "repl.h"
+
+// copy `len` bytes that end `back` bytes before the write position
+static void ring_copy(const ReplBacklog* bl, size_t back, size_t len, char* out){
+    size_t cap = bl->buf.size();
+    size_t start = (bl->pos + cap - back) % cap;
+    size_t first = std::min(len, cap - start);
+    memcpy(out, bl->buf.data() + start, first);
+    memcpy(out + first, bl->buf.data(), len - first);
+}
+
+void backlog_resize(ReplBacklog* bl, size_t size){
+    if(size == bl->buf.size()){
+        return;
+    }
+    size_t keep = (size_t)std::min<uint64_t>(bl->histlen, size);
+    std::vector<char> buf(size);
+    if(keep){
+        ring_copy(bl, keep, keep, buf.data());
+    }
+    bl->buf.swap(buf);
+    bl->pos = size ? keep % size : 0;
+    bl->histlen = keep;
+}
+
+void backlog_reset(ReplBacklog* bl, uint64_t offset){
+    bl->pos = 0;
+    bl->offset = offset;
+    bl->histlen = 0;
+}
+
+void backlog_append(ReplBacklog* bl, const char* data, size_t len){
+    bl->offset += len;
+    size_t cap = bl->buf.size();
+    if(cap == 0){
+        return;
+    }
+    if(len > cap){
+        // only the tail fits
+        data += len - cap;
+        len = cap;
+    }
+    size_t first = std::min(len, cap - bl->pos);
+    memcpy(bl->buf.data() + bl->pos, data, first);
+    memcpy(bl->buf.data(), data + first, len - first);
+    bl->pos = (bl->pos + len) % cap;
+    bl->histlen = std::min<uint64_t>(bl->histlen + len, cap);
+}
+
+bool backlog_read(const ReplBacklog* bl, uint64_t offset, std::string &out){
+    if(offset > bl->offset || bl->offset - offset > bl->histlen){
+        return false;
+    }
+    size_t len = (size_t)(bl->offset - offset);
+    out.resize(len);
+    if(len){
+        ring_copy(bl, len, len, &out[0]);
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the replication stream is the write commands in the append-only file
+// framing (see aof.h), addressed by byte offset. the offset keeps counting
+// for as long as the replication id stays the same.
+//
+// the backlog keeps the newest bytes of the stream in a ring, so a replica
+// that lost its link for a moment continues from its offset instead of
+// taking a new snapshot.
+struct ReplBacklog{
+    std::vector<char> buf; // the ring, empty until the first replica
+    size_t pos = 0;        // where the next byte goes
+    uint64_t offset = 0;   // of the end of the stream
+    uint64_t histlen = 0;  // bytes in the ring, <= buf.size()
+};
+
+// set the size of the ring, keeping as much of the newest history as fits
+void backlog_resize(ReplBacklog* bl, size_t size);
+// drop the history and continue the stream at `offset`
+void backlog_reset(ReplBacklog* bl, uint64_t offset);
+// add to the stream, only the offset moves if there's no ring
+void backlog_append(ReplBacklog* bl, const char* data, size_t len);
+// the stream from `offset` to the end, false if the ring no longer (or
+// never) had it
+bool backlog_read(const ReplBacklog* bl, uint64_t offset, std::string &out);
@@ -4,20 +4,34 @@
 #include <windows.h>
 
 #include <iostream>
+#include <algorithm>
 #include <map>
 #include <cstring>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <cmath>
 #include <cassert>
+#include <cstdarg>
+#include <atomic>
+#include <random>
 #include <unistd.h>
 
 #include "hashtable.h"
 #include "common.h"
 #include "zset.h"
+#include "zcombine.h"
 #include "list.h"
 #include "heap.h"
 #include "thread_pool.h"
+#include "completion.h"
+#include "slab.h"
+#include "zmalloc.h"
+#include "rdb.h"
+#include "aof.h"
+#include "fileio.h"
+#include "repl.h"
+#include "cluster.h"
 #pragma comment(lib, "ws2_32.lib")
 
 #define container_of(ptr,T,member) \
@@ -75,6 +89,19 @@ static uint64_t get_monotonic_msec(){
     return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+static uint64_t get_monotonic_usec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// wall clock, for what outlives the process (TTLs in snapshots)
+static uint64_t get_wall_msec(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
 static void hex_dump(const uint8_t* p, size_t n) {
     for (size_t i = 0; i < n; ++i) {
         printf("%02X", p[i]);
@@ -93,9 +120,27 @@ static void fd_set_nb(SOCKET fd){
 }
 
 const size_t k_max_msg = 4096;
+// requests may carry bulk writes like a multi-pair ZADD
+const size_t k_max_req = 32 << 20;
+
+enum{
+    CONN_CLIENT = 0,
+    CONN_REPLICA = 1, // a replica's link to us, after its PSYNC
+    CONN_MASTER = 2,  // our link to the primary
+    CONN_MIGRATE = 3, // our link to the target of a slot migration
+};
+
+enum{
+    REPL_SYNC_NONE = 0, // gets the stream
+    REPL_SYNC_WAIT = 1, // for the next full sync to start
+    REPL_SYNC_SEND = 2, // gets the snapshot of the one in progress
+};
+
+struct AsyncCmd;
 
 struct Conn {
     SOCKET fd;
+    uint32_t role = CONN_CLIENT;
     bool want_read = true;
     bool want_write = false;
     bool want_close = false;
@@ -107,6 +152,167 @@ struct Conn {
     // timer
     uint64_t last_active_msec = 0;
     DList idle_node;
+
+    // a replica, see repl_psync()
+    uint64_t repl_ack_offset = 0; // the stream it has applied
+    uint64_t repl_ack_ms = 0;     // when it said so
+    bool repl_online = false;     // acked since its sync, so the snapshot is loaded
+    uint32_t repl_sync = 0;       // REPL_SYNC_*, the snapshot it still needs
+
+    bool asking = false;          // ASKING before this command, see cluster_route()
+
+    // parsed by an I/O thread, to run on the main thread, see io_handle_clients()
+    std::vector<std::vector<std::string>> pending;
+
+    AsyncCmd* async = nullptr;    // suspended until it's done, see async_suspend()
+    bool frozen_wait = false;     // a write waiting for a job to read a zset, see zset_freeze()
+    bool migrating = false;       // waiting for its CLUSTER MIGRATE batch, see cluster_migrate()
+    bool slot_wait = false;       // a write to the keys of that batch, see migrate_write_waits()
+};
+
+// a command finishing on the thread pool while its client waits. `job.work`
+// runs on a worker against a copy of the inputs, then `reply` on the main
+// thread writes the reply and the client goes on with its next request.
+struct AsyncCmd{
+    CqJob job;
+    Conn* conn = nullptr; // null once the client is gone
+    void (*reply)(AsyncCmd* ac, Ring_buf &buf) = nullptr;
+    void (*del)(AsyncCmd* ac) = nullptr;
+    // on the main thread once the work is done, before the reply, optional
+    void (*release)(AsyncCmd* ac) = nullptr;
+    uint64_t start_us = 0;
+};
+
+// the keys of a CLUSTER MIGRATE on their way to the target. they stay here
+// until it has them, the writes to their slot wait meanwhile
+struct MigrateBatch{
+    Conn* conn = nullptr; // the client waiting for it, null once gone
+    uint32_t slot = 0;
+    std::vector<std::string> keys;
+    uint64_t deadline_ms = 0;
+};
+
+// a zset read by a job off the event loop, see zset_freeze()
+struct FrozenZSet{
+    ZSet* zset = nullptr;
+    std::string key;
+};
+
+// a client polled ready, for the I/O threads
+struct IoReady{
+    Conn* conn;
+    uint32_t events;
+    bool write; // has replies to send
+};
+
+// the stream offset at the end of the writes made in one millisecond, for
+// telling how far behind in time a replica is
+struct ReplSample{
+    uint64_t offset = 0;
+    uint64_t ms = 0;
+};
+
+// a key picked by the eviction sampler, best candidate last
+struct EvictCandidate{
+    uint64_t idle = 0; // the larger the better to evict
+    std::string key;
+};
+
+// the incremental snapshots, each marks its own epoch in Entry::snap_epoch
+enum{
+    SNAP_BGSAVE = 0,
+    SNAP_REWRITE = 1,
+    SNAP_SYNC = 2,     // a replica's full sync
+    SNAP_KINDS = 3,
+};
+
+// where an incremental snapshot puts its records
+struct SnapSink{
+    // the buffer a record of `hcode` is appended to
+    std::string &(*buf)(void* arg, uint64_t hcode) = nullptr;
+    // a complete record was appended to it at `offset`
+    void (*added)(void* arg, uint64_t hcode, size_t offset) = nullptr;
+    void* arg = nullptr;
+};
+
+// the keyspace as of the start, encoded over many ticks, see snap_scan()
+struct SnapScan{
+    uint32_t kind = SNAP_BGSAVE;
+    SnapSink sink;
+    bool scanning = false;
+    std::string err;
+    size_t cursor = 0;                  // slot cursor into `db`
+    bool pass_stable = false;           // no resize since the pass started
+    HNode** pass_tab = nullptr;
+    std::string zkey;                   // a large zset encoded in batches
+    size_t zrank = 0;
+    uint64_t zhcode = 0;
+    std::string zrec;                   // its record so far
+    uint64_t pause_us = 0;              // the longest tick spent encoding
+    HMap* db = nullptr;                 // a keyspace detached by a flush, else g_data.db
+    std::vector<HeapItem> heap;         // and its TTLs
+};
+
+// a snapshot written by the thread pool, see do_bgsave()
+struct RdbJob{
+    std::vector<RdbSection> sects; // the encoded records
+    std::string path;
+    bool ok = false;
+    std::string err;
+    uint64_t start_us = 0;
+    TpFuture done;
+    // BGSAVE encodes the keyspace over many ticks first
+    SnapScan scan;
+    std::vector<std::vector<RdbIndexEntry>> recs; // per section, in the order written
+};
+
+// a full sync, streamed to the replicas that asked for it together while
+// the keyspace is scanned, see repl_sync_cycle()
+struct ReplSync{
+    SnapScan scan;
+    uint64_t offset = 0;    // of the stream at the start
+    std::string out;        // records not sent yet
+    uint64_t crc = 0;       // of those sent
+    std::string tail;       // the stream since the start, sent after the snapshot
+};
+
+struct Entry;
+struct WarmLoad;
+
+// a record decoded by the thread pool during a warm start
+struct WarmItem{
+    size_t idx = 0;       // in the section index
+    Entry* ent = nullptr; // null if it had expired
+    int64_t ttl_ms = -1;  // from the job's wall_ms
+};
+
+// a batch of records, or the checksum of a section, see warm_cycle()
+struct WarmJob{
+    const WarmLoad* wl = nullptr;
+    size_t sect = 0;
+    size_t first = 0;     // the index entries [first, last), the checksum if empty
+    size_t last = 0;
+    uint64_t wall_ms = 0;
+    uint32_t delay_us = 0; // key-load-delay
+    bool ok = false;
+    std::vector<WarmItem> items;
+    std::atomic<bool> done{false};
+};
+
+// the snapshot still being loaded while serving
+struct WarmLoad{
+    std::string path;
+    RdbFile file;
+    std::vector<RdbSectionInfo> sects;
+    // per index entry: in the keyspace already, or settled by a command
+    std::vector<std::vector<bool>> done;
+    size_t sect = 0;             // handing out batches of this section
+    size_t next = 0;             // from this index entry
+    std::vector<WarmJob*> jobs;  // in flight
+    size_t total_keys = 0;
+    size_t loaded_keys = 0;      // by the thread pool
+    size_t faulted_keys = 0;     // on demand
+    uint64_t start_us = 0;
 };
 
 static struct {
@@ -120,10 +326,189 @@ static struct {
     vector<HeapItem> heap;
     // the thread pool
     TheadPool thread_pool;
+    // eviction candidates, sorted by idle
+    vector<EvictCandidate> evict_pool;
+    uint64_t stat_evicted_keys = 0;
+    uint64_t stat_expired_keys = 0;
+    uint64_t stat_expired_time_cap = 0; // expire cycles that ran out of time
+    // lazy free, updated by the thread pool
+    std::atomic<uint64_t> lazyfree_pending{0};  // objects queued and not freed yet
+    std::atomic<uint64_t> lazyfree_pending_bytes{0}; // about what they hold
+    std::atomic<uint64_t> stat_lazyfreed{0};
+    // active defrag, see defrag_cycle()
+    bool defrag_running = false;
+    size_t defrag_cursor = 0;           // slot cursor into `db`
+    vector<std::string> defrag_zsets;   // large zsets walked over several ticks
+    size_t defrag_zcursor = 0;          // slot cursor into defrag_zsets.back()
+    uint64_t defrag_next_ms = 0;
+    uint64_t defrag_pass_hits = 0;      // stat_defrag_hits when the pass started
+    uint64_t stat_defrag_hits = 0;      // objects moved
+    uint64_t stat_defrag_scanned = 0;   // keys visited
+    // snapshots
+    RdbJob* bgsave_job = nullptr;       // the BGSAVE in progress
+    uint8_t snap_epoch[SNAP_KINDS] = {}; // each flips when its snapshot starts
+    uint64_t rdb_last_save_time = 0;    // wall clock seconds
+    bool rdb_last_bgsave_ok = true;
+    uint64_t rdb_last_bgsave_usec = 0;
+    uint64_t stat_fork_usec = 0;        // the last snapshot pause
+    size_t stat_rdb_cow_bytes = 0;      // the last snapshot copy
+    WarmLoad* warm = nullptr;           // a warm start in progress
+    // append-only file
+    int aof_fd = -1;
+    bool aof_loading = false;           // replaying, don't log again
+    std::string aof_buf;                // this tick's commands, written before sleeping
+    std::string aof_cmd;                // the command being executed
+    size_t aof_size = 0;
+    bool aof_dirty = false;             // written but not fsynced
+    bool aof_last_write_ok = true;
+    uint64_t aof_last_fsync_ms = 0;
+    std::atomic<bool> aof_fsync_pending{false}; // everysec: queued on the thread pool
+    std::atomic<uint64_t> stat_aof_fsyncs{0};
+    // AOF rewrite, see rewrite_cycle()
+    bool rewrite_running = false;
+    uint32_t rewrite_stage = 0;
+    bool rewrite_failed = false;        // keep scanning, but write nothing
+    int rewrite_fd = -1;                // the new file
+    size_t rewrite_size = 0;            // bytes written to it
+    std::string rewrite_out;            // the snapshot preamble, written in chunks
+    uint64_t rewrite_crc = 0;           // of the preamble
+    std::string rewrite_buf;            // the commands since the start
+    SnapScan rewrite_scan;              // of the preamble
+    uint64_t rewrite_start_us = 0;
+    TpFuture rewrite_fsync;             // of the new file, before the switch
+    size_t aof_base_size = 0;           // after the last rewrite or the startup
+    bool aof_last_rewrite_ok = true;
+    uint64_t aof_last_rewrite_usec = 0;
+    uint64_t stat_aof_rewrites = 0;
+    // replication, the primary side: see repl_feed()
+    std::string repl_id;                // names the history the stream offsets count in
+    std::string repl_id2;               // the history before a promotion
+    uint64_t repl_offset2 = 0;          // where that one ended
+    ReplBacklog repl_backlog;           // its offset is master_repl_offset
+    ReplSync* repl_sync_job = nullptr;  // the full sync in progress
+    std::vector<Conn*> replicas;
+    std::deque<ReplSample> repl_samples;
+    uint64_t repl_ping_ms = 0;          // the last heartbeat into the stream
+    bool repl_applying = false;         // running commands from the primary
+    uint64_t stat_sync_full = 0;
+    uint64_t stat_sync_partial_ok = 0;
+    uint64_t stat_sync_partial_err = 0;
+    // the replica side: see repl_read_master()
+    uint32_t repl_state = 0;
+    std::string repl_host;
+    uint16_t repl_port = 0;
+    Conn* repl_master = nullptr;        // the link
+    std::string repl_in;                // received and not processed yet
+    std::string repl_sync_id;           // the snapshot being loaded
+    uint64_t repl_sync_offset = 0;
+    uint64_t repl_sync_bytes = 0;       // of it so far
+    uint64_t repl_sync_crc = 0;
+    uint64_t repl_sync_start_us = 0;
+    uint64_t repl_retry_ms = 0;         // connect again after
+    uint64_t repl_last_io_ms = 0;
+    uint64_t repl_ack_sent_ms = 0;
+    uint64_t repl_down_since_ms = 0;
+    // cluster mode: see cluster_route()
+    std::vector<DList> slot_keys;       // the keys of each slot, linked by entry_slot_node()
+    std::vector<uint32_t> slot_nkeys;
+    std::vector<std::string> cluster_nodes; // "ip:port" of every node named so far, [0] is us
+    std::vector<uint16_t> slot_owner;   // index into cluster_nodes, or k_no_node
+    std::vector<uint16_t> slot_migrating; // moving its keys to this node
+    std::vector<uint16_t> slot_importing; // taking its keys from this node
+    Conn* migrate_link = nullptr;       // kept open to the last migration target
+    std::string migrate_addr;
+    std::string migrate_in;             // from it, short of a whole reply
+    MigrateBatch* migrate_batch = nullptr; // on its way, see cluster_migrate()
+    std::vector<Conn*> migrate_waiters; // clients with a write to its slot
+    uint64_t stat_migrated_keys = 0;
+    uint64_t stat_imported_keys = 0;
+    // I/O threads, see io_handle_clients()
+    TheadPool io_pool;
+    std::vector<IoReady> io_ready;      // this tick's clients
+    uint64_t stat_io_reads = 0;         // client reads and writes done by the I/O threads
+    uint64_t stat_io_writes = 0;
+    // commands finished by the thread pool, see async_suspend()
+    CompletionQueue cq;
+    Conn* cmd_conn = nullptr;           // the client of the command running, if it can wait
+    uint64_t stat_async_cmds = 0;
+    uint64_t stat_async_usec = 0;       // from suspending to the reply
+    // zsets read by the thread pool in place, see zset_freeze()
+    std::vector<FrozenZSet> frozen;
+    std::vector<ZSet*> frozen_orphans;  // their keys are gone, freed by zset_thaw()
+    std::vector<Conn*> frozen_waiters;  // clients with a write to one of them
+    bool started = false;               // the event loop is running
 } g_data;
 
+const uint16_t k_no_node = 0xffff;
+
+enum{
+    REPL_NONE = 0,      // a primary
+    REPL_CONNECT = 1,   // connecting, or waiting to retry
+    REPL_HANDSHAKE = 2, // PSYNC sent
+    REPL_TRANSFER = 3,  // receiving the snapshot
+    REPL_CONNECTED = 4, // applying the stream
+};
+
+enum{
+    AOF_FSYNC_NO = 0,       // leave it to the OS
+    AOF_FSYNC_ALWAYS = 1,   // before replying, once per event loop tick
+    AOF_FSYNC_EVERYSEC = 2, // by the thread pool
+};
+
+enum{
+    EVICT_NOEVICTION = 0,
+    EVICT_ALLKEYS_LRU = 1,
+    EVICT_ALLKEYS_LFU = 2,
+    EVICT_VOLATILE_LRU = 3,
+    EVICT_VOLATILE_TTL = 4,
+};
+
+// server settings, from the command line (--name value) or `config set`
+static struct {
+    size_t maxmemory = 0; // 0 means no limit
+    uint32_t maxmemory_policy = EVICT_NOEVICTION;
+    uint32_t maxmemory_samples = 5;
+    uint32_t lfu_log_factor = 10;
+    uint32_t lfu_decay_time = 1; // minutes per counter decrement
+    bool lazyfree_lazy_user_del = false; // DEL behaves like UNLINK
+    bool activedefrag = false;
+    size_t active_defrag_ignore_bytes = 100 << 20; // minimum wasted slab bytes
+    uint32_t active_defrag_threshold_lower = 10;   // minimum waste in % of used
+    uint32_t active_defrag_cycle_max = 25;         // max % of CPU time
+    std::string dbfilename = "dump.rdb";           // SAVE, BGSAVE and loading at startup
+    bool warm_start = false; // serve while the snapshot loads, keys are loaded on demand
+    uint32_t key_load_delay = 0; // usec per key decoded by a warm start, for the tests
+    bool appendonly = false; // log writes, and load the log instead of the snapshot
+    std::string appendfilename = "appendonly.aof";
+    uint32_t appendfsync = AOF_FSYNC_EVERYSEC;
+    uint32_t auto_aof_rewrite_percentage = 100;      // growth over the base size, 0 is off
+    size_t auto_aof_rewrite_min_size = 64 << 20;
+    size_t repl_backlog_size = 1 << 20; // the stream kept for partial resyncs
+    bool cluster_enabled = false;       // hash slots, and redirects for the keys of others
+    std::string cluster_announce_ip = "127.0.0.1"; // how the other nodes and clients reach us
+    uint32_t io_threads = 1; // the main thread included, more move client socket I/O off it
+} g_conf;
+
+// grow the ring and move the data to the front, logical positions
+// (relative to head) stay valid
+static void buf_grow(Ring_buf &buf, size_t need){
+    size_t n = buf.size();
+    size_t cap = buf.cap;
+    while(cap - n - 1 < need){
+        cap *= 2;
+    }
+    std::vector<uint8_t> data(cap);
+    size_t first = std::min(n, buf.cap - buf.head);
+    memcpy(&data[0], &buf.buf[buf.head], first);
+    memcpy(&data[first], &buf.buf[0], n - first);
+    buf.buf.swap(data);
+    buf.head = 0;
+    buf.tail = n;
+    buf.cap = cap;
+}
+
 static void buf_append(Ring_buf &buf, const uint8_t *data, size_t n){
-    if (n > buf.free_cap()) return;
+    if (n > buf.free_cap()) buf_grow(buf, n);
     size_t min = std::min(n,buf.cap - buf.tail);
     memcpy(&buf.buf[buf.tail], data, min);
     memcpy(&buf.buf[0], data + min, n - min);
@@ -134,6 +519,21 @@ static void buf_consume(Ring_buf &buf, size_t n){
     buf.head = (buf.head + n) % buf.cap;
 }
 
+// an accepted socket, or our link to the primary
+static Conn* conn_new(SOCKET fd){
+    Conn* conn = new Conn();
+    conn->fd = fd;
+    conn->want_read = true;
+    conn->last_active_msec = get_monotonic_msec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+
+
+    // put it into the map, over a null left by a lookup of a closed fd
+    assert(!g_data.fd2conn_map[conn->fd]);
+    g_data.fd2conn_map[conn->fd] = conn;
+    return conn;
+}
+
 static Conn* handle_accept(SOCKET listen_fd) {
     sockaddr_in client_addr{};
     int addrlen = sizeof(client_addr);
@@ -156,27 +556,36 @@ static Conn* handle_accept(SOCKET listen_fd) {
     );
 
     fd_set_nb(connfd);
-
-    Conn* conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;
-    conn->last_active_msec = get_monotonic_msec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
-
-
-    // put it into the map
-    if(!g_data.fd2conn_map.count(conn->fd)){
-        g_data.fd2conn_map[conn->fd] = conn;
-    }
-    assert(g_data.fd2conn_map.count(conn->fd));
-    return conn;
+    return conn_new(connfd);
 }
 
+static void repl_conn_closed(Conn* conn);
+static void migrate_link_closed();
+
 static void conn_destroy(Conn* conn){
+    if(conn->async){
+        conn->async->conn = nullptr; // nobody to reply to
+    }
+    if(conn->frozen_wait){
+        std::vector<Conn*> &waiters = g_data.frozen_waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), conn));
+    }
+    if(conn->migrating){
+        g_data.migrate_batch->conn = nullptr;
+    }
+    if(conn->slot_wait){
+        std::vector<Conn*> &waiters = g_data.migrate_waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), conn));
+    }
+    bool link = conn == g_data.migrate_link;
+    repl_conn_closed(conn);
     (void)close(conn->fd);
     g_data.fd2conn_map.erase(conn->fd);
     dlist_detach(&conn->idle_node);
     delete conn;
+    if(link){
+        migrate_link_closed(); // the batch on its way fails
+    }
 }
 
 const size_t k_max_args = 200 * 1000;
@@ -225,7 +634,14 @@ enum {
     ERR_UNKNOWN = 1, // unknown command
     ERR_TOO_BIG = 2,  // response too big
     ERR_BAD_TYP = 3, // wrong value type
-    ERR_BAD_ARG = 4 // wrong argument
+    ERR_BAD_ARG = 4, // wrong argument
+    ERR_OOM = 5, // over maxmemory and nothing to evict
+    ERR_BUSY = 6, // a background job is in progress
+    ERR_IO = 7, // persistence failed
+    ERR_READONLY = 8, // a write sent to a replica
+    ERR_MOVED = 9, // the key's slot is served by another node
+    ERR_ASK = 10, // the key's slot is moving, ask the other node this time
+    ERR_CLUSTERDOWN = 11, // the key's slot isn't served by any node
 };
 
 enum{
@@ -317,61 +733,233 @@ enum{
     T_ZSET = 2,
 };
 
-// +--------+---------+
-// | status | data... |
-// +--------+---------+
+// +------+-----+----------+----------+---------------------+
+// | node | key | type|lru | heap_idx | str / zset* (union) |
+// +------+-----+----------+----------+---------------------+
+// only the payload selected by `type` is alive, so a string key no longer
+// carries an empty zset (AVL root + a two-table HMap) around.
 
 struct Entry{
     struct HNode node; // hashtable node
     std::string key;
-    // std::string val;
 
     // value
-    uint32_t type = 0;
-    std::string str;
-    ZSet zset;
+    uint32_t type : 8;
+    // eviction: LRU clock in seconds, or for LFU policies
+    // the last decrement time in minutes (16 bits) + a log counter (8 bits)
+    uint32_t lru : 24;
+
+    // equals g_data.snap_epoch[kind] once the entry is in that snapshot
+    uint8_t snap_epoch[SNAP_KINDS] = {};
 
     // for TTL
     size_t heap_idx = -1; // array index to the heap item
+
+    union{
+        std::string str;  // T_STR
+        ZSet* zset;       // T_ZSET
+    };
+
+    // the payload is managed by entry_new() and entry_del_sync()
+    Entry() : type(T_INIT), lru(0) {}
+    ~Entry() {}
 };
 
+// cluster mode: every Entry is followed by its link in the list of its
+// slot's keys (g_data.slot_keys), so moving a slot doesn't scan the whole
+// keyspace. other servers don't pay for it.
+static size_t entry_size(){
+    return sizeof(Entry) + (g_conf.cluster_enabled ? sizeof(DList) : 0);
+}
+
+static DList* entry_slot_node(Entry* ent){
+    return (DList*)(ent + 1);
+}
+
+static Entry* slot_node_entry(DList* node){
+    return (Entry*)node - 1;
+}
+
+static uint32_t entry_slot(Entry* ent){
+    return key_hash_slot(ent->key.data(), ent->key.size());
+}
+
+static uint64_t rand64(){
+    static uint64_t x = get_monotonic_msec() | 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+const uint32_t k_lru_max = (1 << 24) - 1;
+const uint32_t k_lfu_init_val = 5;
+
+static bool policy_is_lfu(){
+    return g_conf.maxmemory_policy == EVICT_ALLKEYS_LFU;
+}
+
+static uint32_t lru_clock(){
+    return (uint32_t)(get_monotonic_msec() / 1000) & k_lru_max;
+}
+
+static uint64_t lru_idle_sec(uint32_t lru){
+    uint32_t now = lru_clock();
+    return now >= lru ? now - lru : k_lru_max - lru + now; // wrapped
+}
+
+static uint32_t lfu_minutes(){
+    return (uint32_t)(get_monotonic_msec() / 60000) & 0xFFFF;
+}
+
+// the counter after applying the decay since the last decrement
+static uint32_t lfu_decr(uint32_t lru){
+    uint32_t ldt = lru >> 8;
+    uint32_t counter = lru & 255;
+    uint32_t now = lfu_minutes();
+    uint32_t elapsed = now >= ldt ? now - ldt : 0xFFFF - ldt + now;
+    uint32_t periods = g_conf.lfu_decay_time ? elapsed / g_conf.lfu_decay_time : 0;
+    return periods > counter ? 0 : counter - periods;
+}
+
+// Morris counter, the more hits the less likely it increments
+static uint32_t lfu_log_incr(uint32_t counter){
+    if(counter == 255){
+        return 255;
+    }
+    double r = (double)(rand64() >> 11) / (double)(1ull << 53);
+    double base = counter > k_lfu_init_val ? counter - k_lfu_init_val : 0;
+    double p = 1.0 / (base * g_conf.lfu_log_factor + 1);
+    return r < p ? counter + 1 : counter;
+}
+
+// record an access for the eviction policy
+static void entry_touch(Entry* ent){
+    if(policy_is_lfu()){
+        uint32_t counter = lfu_log_incr(lfu_decr(ent->lru));
+        ent->lru = (lfu_minutes() << 8) | counter;
+    }else{
+        ent->lru = lru_clock();
+    }
+}
+
 static Entry* entry_new(uint32_t type){
-    Entry* ent = new Entry();
+    Entry* ent = new (slab_alloc(entry_size())) Entry();
     ent->type = type;
+    // not in a snapshot in progress
+    memcpy(ent->snap_epoch, g_data.snap_epoch, sizeof(ent->snap_epoch));
+    ent->lru = policy_is_lfu() ? (lfu_minutes() << 8) | k_lfu_init_val : lru_clock();
+    if(type == T_STR){
+        new (&ent->str) std::string();
+    }else if(type == T_ZSET){
+        ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+    }
     return ent;
 }
 
 static void entry_set_ttl(Entry* ent, int64_t ttl_ms);
+static void aof_feed_del(Entry* ent);
 
-// static void entry_delete(Entry* ent){
-//     if(ent->type == T_ZSET){
-//         zset_clear(&ent->zset);
-//     }
-//     entry_set_ttl(ent, -1);
-//     delete ent;
-// }
+static void zset_del_sync(ZSet* zset){
+    zset_clear(zset);
+    zset->~ZSet();
+    slab_free(zset, sizeof(ZSet));
+}
 
 static void entry_del_sync(Entry* ent){
-    if(ent->type == T_ZSET){
-        zset_clear(&ent->zset);
+    if(ent->type == T_STR){
+        ent->str.~basic_string();
+    }else if(ent->type == T_ZSET){
+        zset_del_sync(ent->zset);
     }
-    delete ent;
+    ent->~Entry();
+    slab_free(ent, entry_size());
+}
+
+// lazy free: values whose free effort (roughly the number of allocations
+// behind them) exceeds this are released by the thread pool
+const size_t k_lazyfree_threshold = 64;
+
+static size_t zset_free_effort(ZSet* zset){
+    return zset->encoding == ZSET_LISTPACK ? 1 : zset_size(zset);
+}
+
+static size_t entry_free_effort(Entry* ent){
+    return ent->type == T_ZSET ? zset_free_effort(ent->zset) : 1;
 }
 
+// a value handed to the thread pool by lazyfree_queue()
+struct LazyFree{
+    void (*f)(void*);
+    void* arg;
+    size_t bytes;
+};
+
+static void cb_lazyfree(void* arg){
+    LazyFree* lf = (LazyFree*)arg;
+    lf->f(lf->arg);
+    // hand the freed objects back to the pages instead of parking them in this worker
+    slab_thread_flush();
+    g_data.lazyfree_pending_bytes -= lf->bytes;
+    g_data.lazyfree_pending--;
+    g_data.stat_lazyfreed++;
+    delete lf;
+}
+
+// `f(arg)` frees about `bytes`, 0 if not known, which used_memory() still
+// counts until it's done
+static void lazyfree_queue(void (*f)(void*), void* arg, size_t bytes){
+    g_data.lazyfree_pending++;
+    g_data.lazyfree_pending_bytes += bytes;
+    thread_pool_submit(&g_data.thread_pool, TP_PRIO_LOW, &cb_lazyfree, new LazyFree{f, arg, bytes});
+}
+
+// the bytes of a value queued for lazy free, from a few members
+const size_t k_lazyfree_samples = 5;
+
+static size_t entry_mem_usage(Entry* ent, size_t samples);
+
 static void entry_del_func(void* arg){
     entry_del_sync((Entry*)arg);
 }
 
-static void entry_del(Entry* ent){
+static void zset_del_func(void* arg){
+    zset_del_sync((ZSet*)arg);
+}
+
+static void cb_db_del(HNode* node){
+    entry_del_sync(container_of(node, Entry, node));
+}
+
+// a whole keyspace detached by FLUSHALL
+static void db_del_func(void* arg){
+    HMap* db = (HMap*)arg;
+    hm_drain(db, &cb_db_del);
+    delete db;
+}
+
+// the old value of an overwritten key
+static void zset_del(ZSet* zset){
+    if(zset->readers){
+        g_data.frozen_orphans.push_back(zset); // see zset_thaw()
+    }else if(zset_free_effort(zset) > k_lazyfree_threshold){
+        lazyfree_queue(&zset_del_func, zset, zset_mem_usage(zset, k_lazyfree_samples));
+    }else{
+        zset_del_sync(zset);
+    }
+}
+
+// returns true if the memory is released later by the thread pool
+static bool entry_del(Entry* ent){
     // unlink it from any data structures
     entry_set_ttl(ent, -1); // remove from the heap data structure
     // run the destructor in a thread pool for large data structures
-    size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
-    const size_t k_large_container_size = 1000;
-    if(set_size > k_large_container_size){
-        thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
+    if(entry_free_effort(ent) > k_lazyfree_threshold){
+        lazyfree_queue(&entry_del_func, ent, entry_mem_usage(ent, k_lazyfree_samples));
+        return true;
     }else{
         entry_del_sync(ent); // small; avoid context switches
+        return false;
     }
 }
 
@@ -387,20 +975,98 @@ static bool entry_eq(HNode* lhs, HNode* rhs){
 }
 // static std::map<std::string,std::string> g_data;
 
+static bool hnode_same(HNode* node, HNode* key){
+    return node == key;
+}
+
+// every key goes into and out of the keyspace through these two
+static void db_insert(Entry* ent){
+    hm_insert(&g_data.db, &ent->node);
+    if(g_conf.cluster_enabled){
+        uint32_t slot = entry_slot(ent);
+        dlist_insert_before(&g_data.slot_keys[slot], entry_slot_node(ent));
+        g_data.slot_nkeys[slot]++;
+    }
+}
+
+// a zset read by a job stays until the job is done, see zset_freeze(). the
+// key going away keeps an empty one.
+static void entry_orphan_zset(Entry* ent){
+    if(ent->type == T_ZSET && ent->zset->readers){
+        g_data.frozen_orphans.push_back(ent->zset);
+        ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+    }
+}
+
+static void db_remove(Entry* ent){
+    entry_orphan_zset(ent);
+    HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    if(g_conf.cluster_enabled){
+        dlist_detach(entry_slot_node(ent));
+        g_data.slot_nkeys[entry_slot(ent)]--;
+    }
+}
+
+static void key_init(LookupKey &key, std::string &s){
+    key.key.swap(s);
+    key.node.hcode = str_hash((const uint8_t*)key.key.data(), key.key.size());
+}
+
+static bool entry_expired(Entry* ent, uint64_t now_ms){
+    return ent->heap_idx != (size_t)-1 && g_data.heap[ent->heap_idx].val <= now_ms;
+}
+
+static void entry_expire(Entry* ent){
+    aof_feed_del(ent);
+    db_remove(ent);
+    entry_del(ent);
+    g_data.stat_expired_keys++;
+}
+
+static HNode* warm_fault(LookupKey &key);
+
+// a key, loaded from the snapshot first if a warm start hasn't got to it yet
+static HNode* db_lookup(LookupKey &key){
+    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if(!node && g_data.warm){
+        node = warm_fault(key);
+    }
+    return node;
+}
+
+// keyspace lookup on behalf of a command
+static Entry* entry_lookup(LookupKey &key){
+    HNode* node = db_lookup(key);
+    if(!node){
+        return nullptr;
+    }
+    Entry* ent = container_of(node, Entry, node);
+    if(entry_expired(ent, get_monotonic_msec())){
+        if(g_data.repl_state != REPL_NONE){
+            // a replica waits for the primary's DEL, only its commands see the key
+            return g_data.repl_applying ? ent : nullptr;
+        }
+        // the timers haven't got to it yet, don't serve stale data
+        entry_expire(ent);
+        return nullptr;
+    }
+    entry_touch(ent);
+    return ent;
+}
+
 
 static void do_get(std::vector<std::string> &cmd, Ring_buf &buf){
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((const uint8_t*) key.key.data(), key.key.size());
+    LookupKey key;
+    key_init(key, cmd[1]);
     //hashtable lookup
-    HNode* node = hm_lookup(&g_data.db,&key.node,&entry_eq);
-    if(!node){
+    Entry* ent = entry_lookup(key);
+    if(!ent){
         out_nil(buf);
         return;
     }
 
     // copy the value
-    Entry* ent = container_of(node, Entry, node);
     if(ent->type != T_STR){
         return out_err(buf, ERR_BAD_TYP, "not a string value");
     }
@@ -410,24 +1076,30 @@ static void do_get(std::vector<std::string> &cmd, Ring_buf &buf){
     // out_str(buf, val->data(), val->size());
 }
 
-static void do_set(std::vector<std::string> &cmd, Ring_buf& buf){
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((const uint8_t*)key.key.data(),key.key.size());
+static bool evict_or_refuse(Ring_buf &buf);
 
-    HNode *node = hm_lookup(&g_data.db,&key.node,&entry_eq);
-    if(node){
-        Entry* ent = container_of(node, Entry, node);
-        if(ent->type != T_STR){
-            return out_err(buf,ERR_BAD_TYP,"a non-string value exists");
+static void do_set(std::vector<std::string> &cmd, Ring_buf& buf){
+    if(!evict_or_refuse(buf)){
+        return;
+    }
+    LookupKey key;
+    key_init(key, cmd[1]);
+
+    Entry* ent = entry_lookup(key);
+    if(ent){
+        if(ent->type == T_ZSET){
+            // overwrite the zset, a large one is freed in the background
+            zset_del(ent->zset);
+            ent->type = T_STR;
+            new (&ent->str) std::string();
         }
         ent->str.swap(cmd[2]);
     }else{
-        Entry* ent = entry_new(T_STR);
+        ent = entry_new(T_STR);
         ent->key.swap(key.key);
         ent->node.hcode = key.node.hcode;
         ent->str.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        db_insert(ent);
     }
     out_nil(buf);
 }
@@ -482,30 +1154,48 @@ static void do_expire(vector<string> &cmd, Ring_buf &buf){
     }
 
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    key_init(key, cmd[1]);
 
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(node){
-        Entry *ent = container_of(node, Entry, node);
+    Entry* ent = entry_lookup(key);
+    if(ent){
         entry_set_ttl(ent, ttl_ms);
     }
-    return out_int(buf, node? 1:0);
+    return out_int(buf, ent ? 1 : 0);
+}
+
+// pexpireat key unix-time-ms, a time in the past deletes the key
+static void do_pexpireat(vector<string> &cmd, Ring_buf &buf){
+    int64_t at_ms = 0;
+    if(!str2int(cmd[2], at_ms)){
+        return out_err(buf, ERR_BAD_ARG, "expect int64");
+    }
+
+    LookupKey key;
+    key_init(key, cmd[1]);
+
+    Entry* ent = entry_lookup(key);
+    if(ent){
+        int64_t ttl_ms = at_ms - (int64_t)get_wall_msec();
+        if(ttl_ms <= 0){
+            entry_expire(ent);
+        }else{
+            entry_set_ttl(ent, ttl_ms);
+        }
+    }
+    return out_int(buf, ent ? 1 : 0);
 }
 
 // pttl key
 
 static void do_ttl(vector<string> &cmd, Ring_buf &buf){
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
+    key_init(key, cmd[1]);
 
-    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(!node){
+    Entry* ent = entry_lookup(key);
+    if(!ent){
         return out_int(buf, -2); // not found
     }
 
-    Entry* ent = container_of(node, Entry, node);
     if(ent->heap_idx == (size_t)-1){
         return out_int(buf, -1); // no TTL
     }
@@ -515,30 +1205,102 @@ static void do_ttl(vector<string> &cmd, Ring_buf &buf){
     return out_int(buf, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
 
+// del key / unlink key
 static void do_del(std::vector<std::string> &cmd, Ring_buf& buf) {
-    // a dummy `Entry` just for the lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable delete
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node) { // deallocate the pair
-        delete container_of(node, Entry, node);
+    // UNLINK frees large values in the background, DEL only when configured so
+    bool lazy = cmd[0] == "unlink" || g_conf.lazyfree_lazy_user_del;
+    // a dummy key just for the lookup
+    LookupKey key;
+    key_init(key, cmd[1]);
+    Entry* ent = entry_lookup(key);
+    if (ent) { // deallocate the pair
+        db_remove(ent);
+        if(lazy){
+            entry_del(ent);
+        }else{
+            entry_set_ttl(ent, -1);
+            entry_del_sync(ent);
+        }
+    }
+
+    out_int(buf, ent ? 1 : 0);
+}
+
+static bool bgsave_adopt(HMap* db, std::vector<HeapItem> &heap);
+
+// detach the keyspace, the TTL heap goes with it. a BGSAVE still scanning
+// it takes both over and frees them once done
+static void db_flush(bool lazy){
+    // the zsets jobs read are freed by them, they may outlive the keyspace
+    for(FrozenZSet &frozen : g_data.frozen){
+        LookupKey key;
+        key.key = frozen.key;
+        key.node.hcode = str_hash((const uint8_t*)key.key.data(), key.key.size());
+        HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+        if(node){
+            entry_orphan_zset(container_of(node, Entry, node));
+        }
+    }
+    HMap* db = new HMap(g_data.db);
+    g_data.db = HMap{};
+    std::vector<HeapItem> heap;
+    heap.swap(g_data.heap);
+    g_data.evict_pool.clear();
+    g_data.defrag_running = false;
+    g_data.defrag_zsets.clear();
+    g_data.defrag_zcursor = 0;
+    for(DList &keys : g_data.slot_keys){
+        dlist_init(&keys);
+    }
+    std::fill(g_data.slot_nkeys.begin(), g_data.slot_nkeys.end(), 0);
+
+    if(bgsave_adopt(db, heap)){
+        return;
     }
+    if(lazy && hm_size(db) > 0){
+        lazyfree_queue(&db_del_func, db, 0);
+    }else{
+        hm_drain(db, &cb_db_del);
+        delete db;
+    }
+}
 
-    out_int(buf, node ? 1 : 0);
+// flushall [async|sync]
+static void do_flushall(std::vector<std::string> &cmd, Ring_buf &buf){
+    bool lazy = false;
+    if(cmd.size() == 2){
+        if(cmd[1] == "async"){
+            lazy = true;
+        }else if(cmd[1] != "sync"){
+            return out_err(buf, ERR_BAD_ARG, "expect async or sync");
+        }
+    }
+    db_flush(lazy);
+    out_nil(buf);
 }
 
+struct KeysArg{
+    Ring_buf* buf;
+    uint64_t now_ms;
+    uint32_t n;
+};
+
 static bool cb_keys(HNode* node, void* arg){
-    Ring_buf &buf = *(Ring_buf*)arg;
-    const std::string& key = container_of(node, Entry, node)->key;
-    out_str(buf, key.data(), key.size());
+    KeysArg* ka = (KeysArg*)arg;
+    Entry* ent = container_of(node, Entry, node);
+    if(entry_expired(ent, ka->now_ms)){
+        return true; // logically gone, left for the timers
+    }
+    out_str(*ka->buf, ent->key.data(), ent->key.size());
+    ka->n++;
     return true;
 }
 
 static void do_keys(std::vector<string>&, Ring_buf &buf){
-    out_arr(buf, (uint32_t)hm_size(&g_data.db));
-    hm_foreach(&g_data.db, &cb_keys, (void*)&buf);
+    KeysArg ka = {&buf, get_monotonic_msec(), 0};
+    size_t ctx = out_begin_arr(buf);
+    hm_foreach(&g_data.db, &cb_keys, (void*)&ka);
+    out_end_arr(buf, ctx, ka.n);
 }
 
 static bool str2dbl(const std::string &s, double &out){
@@ -549,68 +1311,164 @@ static bool str2dbl(const std::string &s, double &out){
 
 
 
-// zadd zset score name
+// a zset about to change. a job still reading it keeps it, the key gets a
+// copy: clients wait for the job instead, see zset_write_waits(), but the
+// primary's stream can't
+static void entry_zset_write(Entry* ent){
+    ZSet* zset = ent->zset;
+    if(!zset->readers){
+        return;
+    }
+    std::vector<ZAddItem> items;
+    items.reserve(zset_size(zset));
+    ZIter it;
+    for(zset_select(zset, 0, &it); it.valid; zset_offset(&it, 1)){
+        ZAddItem item;
+        item.score = it.score;
+        item.name = it.name;
+        item.len = it.len;
+        items.push_back(item);
+    }
+    ent->zset = new (slab_alloc(sizeof(ZSet))) ZSet();
+    bool sorted = zset_insert_sorted(ent->zset, items.data(), items.size());
+    assert(sorted);
+    (void)sorted;
+    g_data.frozen_orphans.push_back(zset);
+}
+
+// zadd zset [nx|xx] [gt|lt] [ch] [incr] score name [score name ...]
 static void do_zadd(std::vector<std::string> &cmd, Ring_buf &buf){
-    double score = 0;
-    if(!str2dbl(cmd[2], score)){
-        return out_err(buf, ERR_BAD_ARG, "expect float");
+    uint32_t flags = 0;
+    bool ch = false, incr = false;
+    size_t i = 2;
+    for(; i < cmd.size(); ++i){
+        if(cmd[i] == "nx"){
+            flags |= ZADD_NX;
+        }else if(cmd[i] == "xx"){
+            flags |= ZADD_XX;
+        }else if(cmd[i] == "gt"){
+            flags |= ZADD_GT;
+        }else if(cmd[i] == "lt"){
+            flags |= ZADD_LT;
+        }else if(cmd[i] == "ch"){
+            ch = true;
+        }else if(cmd[i] == "incr"){
+            incr = true;
+        }else{
+            break;
+        }
+    }
+    size_t npairs = (cmd.size() - i) / 2;
+    if(npairs == 0 || (cmd.size() - i) % 2 != 0){
+        return out_err(buf, ERR_BAD_ARG, "expect score name pairs");
+    }
+    if(((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT)))
+        || ((flags & ZADD_GT) && (flags & ZADD_LT)))
+    {
+        return out_err(buf, ERR_BAD_ARG, "nx, xx, gt and lt are not compatible");
+    }
+    if(incr && npairs > 1){
+        return out_err(buf, ERR_BAD_ARG, "incr takes a single pair");
+    }
+    std::vector<ZAddItem> items(npairs);
+    for(size_t k = 0; k < npairs; ++k){
+        const std::string &name = cmd[i + 2 * k + 1];
+        if(!str2dbl(cmd[i + 2 * k], items[k].score)){
+            return out_err(buf, ERR_BAD_ARG, "expect float");
+        }
+        items[k].name = name.data();
+        items[k].len = name.size();
+    }
+    if(!evict_or_refuse(buf)){
+        return;
     }
 
     // lookup the zset
     LookupKey key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-
-
-    Entry* ent = nullptr;
-    if(!hnode){
+    key_init(key, cmd[1]);
+    Entry* ent = entry_lookup(key);
+    if(ent && ent->type != T_ZSET){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    if(!ent && (flags & ZADD_XX)){
+        return incr ? out_nil(buf) : out_int(buf, 0);
+    }
+    if(!ent){
         // insert a new key
         ent = entry_new(T_ZSET);
         ent->key.swap(key.key);
         ent->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &ent->node);
+        db_insert(ent);
     }
-    else{
-        ent = container_of(hnode, Entry, node);
-        if(ent->type != T_ZSET){
-            return out_err(buf, ERR_BAD_TYP, "expect zset");
+    entry_zset_write(ent);
+
+    if(incr){
+        // like zincrby, nil if the conditions stop the update
+        ZIter it;
+        double score = items[0].score;
+        bool skip = (flags & ZADD_XX) != 0;
+        if(zset_lookup(ent->zset, items[0].name, items[0].len, &it)){
+            score += it.score;
+            if(isnan(score)){
+                return out_err(buf, ERR_BAD_ARG, "resulting score is not a number");
+            }
+            skip = (flags & ZADD_NX) || ((flags & ZADD_GT) && !(score > it.score))
+                || ((flags & ZADD_LT) && !(score < it.score));
+        }
+        if(skip){
+            return out_nil(buf);
         }
+        zset_insert(ent->zset, items[0].name, items[0].len, score);
+        return out_dbl(buf, score);
     }
 
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
-    return out_int(buf, (int64_t)added);
+    // add or update the tuples
+    size_t added = 0, updated = 0;
+    zset_insert_many(ent->zset, items.data(), items.size(), flags, &added, &updated);
+    return out_int(buf, (int64_t)(ch ? added + updated : added));
 }
 
 static const ZSet k_empty_zset;
 
 static ZSet* expect_zset(std::string &s){
     LookupKey key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(), key.key.size());
-    HNode* hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(!hnode){
+    key_init(key, s);
+    Entry* ent = entry_lookup(key);
+    if(!ent){
         // a non-existent key is treated as an empty zset
         return (ZSet*)&k_empty_zset;
     }
-    Entry* ent = container_of(hnode, Entry, node);
-    return ent->type == T_ZSET ? &ent->zset : nullptr;
+    return ent->type == T_ZSET ? ent->zset : nullptr;
 }
 
-static void do_zrem(std::vector<std::string> &cmd, Ring_buf &buf){
-    ZSet* zset = expect_zset(cmd[1]);
-    if(!zset){
+// expect_zset() for a command that modifies it
+static ZSet* expect_zset_write(std::string &s){
+    LookupKey key;
+    key_init(key, s);
+    Entry* ent = entry_lookup(key);
+    if(!ent){
+        return (ZSet*)&k_empty_zset;
+    }
+    if(ent->type != T_ZSET){
+        return nullptr;
+    }
+    entry_zset_write(ent);
+    return ent->zset;
+}
+
+static void do_zrem(std::vector<std::string> &cmd, Ring_buf &buf){
+    ZSet* zset = expect_zset_write(cmd[1]);
+    if(!zset){
         return out_err(buf, ERR_BAD_TYP, "expect zset");
     }
 
     const std::string &name = cmd[2];
-    ZNode* znode = zset_lookup(zset, name.data(), name.size());
-    if(znode){
-        zset_delete(zset, znode);
+    ZIter it;
+    bool found = zset_lookup(zset, name.data(), name.size(), &it);
+    if(found){
+        zset_delete(zset, &it);
     }
-    return out_int(buf, znode ? 1 : 0);
+    return out_int(buf, found ? 1 : 0);
 }
 
 static void do_zscore(std::vector<std::string> &cmd, Ring_buf &buf){
@@ -620,8 +1478,655 @@ static void do_zscore(std::vector<std::string> &cmd, Ring_buf &buf){
     }
 
     const std::string &name = cmd[2];
-    ZNode* znode = zset_lookup(zset, name.data(), name.size());
-    return znode ? out_dbl(buf, znode->score) : out_nil(buf);
+    ZIter it;
+    return zset_lookup(zset, name.data(), name.size(), &it) ? out_dbl(buf, it.score) : out_nil(buf);
+}
+
+// zcard key
+static void do_zcard(std::vector<std::string> &cmd, Ring_buf &buf){
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    return out_int(buf, (int64_t)zset_size(zset));
+}
+
+// zrank key name / zrevrank key name
+static void do_zrank(std::vector<std::string> &cmd, Ring_buf &buf){
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+
+    const std::string &name = cmd[2];
+    ZIter it;
+    if(!zset_lookup(zset, name.data(), name.size(), &it)){
+        return out_nil(buf);
+    }
+    size_t rank = zset_rank(&it);
+    if(cmd[0] == "zrevrank"){
+        rank = zset_size(zset) - 1 - rank;
+    }
+    return out_int(buf, (int64_t)rank);
+}
+
+// output the members with ranks in [lo, hi), or from hi-1 down to lo with rev
+static void out_zrange(Ring_buf &buf, ZSet* zset, size_t lo, size_t hi, bool rev, bool withscores){
+    if(lo >= hi){
+        return out_arr(buf, 0);
+    }
+    ZIter it;
+    zset_select(zset, rev ? hi - 1 : lo, &it);
+    size_t ctx = out_begin_arr(buf);
+    uint32_t cnt = 0;
+    for(size_t i = lo; i < hi && it.valid; ++i){
+        out_str(buf, it.name, it.len);
+        cnt++;
+        if(withscores){
+            out_dbl(buf, it.score);
+            cnt++;
+        }
+        zset_offset(&it, rev ? -1 : 1);
+    }
+    out_end_arr(buf, ctx, cnt);
+}
+
+// the inclusive indexes [start, stop] as ranks [lo, hi),
+// negative indexes count from the end
+static void index_range(int64_t start, int64_t stop, size_t size, size_t &lo, size_t &hi){
+    int64_t n = (int64_t)size;
+    if(start < 0){
+        start = std::max(start + n, (int64_t)0);
+    }
+    if(stop < 0){
+        stop += n;
+    }
+    stop = std::min(stop, n - 1);
+    if(start > stop){
+        lo = hi = 0;
+        return;
+    }
+    lo = (size_t)start;
+    hi = (size_t)stop + 1;
+}
+
+// zrange key start stop [rev] [withscores]
+static void do_zrange(std::vector<std::string> &cmd, Ring_buf &buf){
+    int64_t start = 0, stop = 0;
+    if(!str2int(cmd[2], start) || !str2int(cmd[3], stop)){
+        return out_err(buf, ERR_BAD_ARG, "expect int");
+    }
+    bool rev = false, withscores = false;
+    for(size_t i = 4; i < cmd.size(); ++i){
+        if(cmd[i] == "rev"){
+            rev = true;
+        }else if(cmd[i] == "withscores"){
+            withscores = true;
+        }else{
+            return out_err(buf, ERR_BAD_ARG, "expect rev or withscores");
+        }
+    }
+
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+
+    size_t n = zset_size(zset);
+    size_t lo = 0, hi = 0;
+    index_range(start, stop, n, lo, hi);
+    // with rev the indexes are ranks in the reversed order
+    if(rev){
+        std::swap(lo, hi);
+        lo = n - lo;
+        hi = n - hi;
+    }
+    return out_zrange(buf, zset, lo, hi, rev, withscores);
+}
+
+// the rank of the first (score, name) tuple that is >= key, the size if none
+static size_t zset_seek_rank(ZSet* zset, double score, const char* name, size_t len){
+    ZIter it;
+    return zset_seekge(zset, score, name, len, &it) ? zset_rank(&it) : zset_size(zset);
+}
+
+// a score bound: "1.5", "(1.5" (exclusive), "-inf" or "+inf"
+static bool str2score_bound(const std::string &s, double &val, bool &excl){
+    excl = !s.empty() && s[0] == '(';
+    return str2dbl(excl ? s.substr(1) : s, val);
+}
+
+// the ranks [lo, hi) of the members in a score range, two seeks and no iteration.
+// scores are discrete, so "> x" is ">= nextafter(x)".
+static void zset_score_range(ZSet* zset, double min, bool minex, double max, bool maxex,
+    size_t &lo, size_t &hi)
+{
+    size_t n = zset_size(zset);
+    if(minex && min == INFINITY){
+        lo = n;
+    }else{
+        lo = zset_seek_rank(zset, minex ? nextafter(min, INFINITY) : min, "", 0);
+    }
+    if(!maxex && max == INFINITY){
+        hi = n;
+    }else{
+        hi = zset_seek_rank(zset, maxex ? max : nextafter(max, INFINITY), "", 0);
+    }
+    hi = std::max(lo, hi);
+}
+
+// a lex bound: "[name", "(name" (exclusive), "-" or "+"
+static bool str2lex_bound(const std::string &s, std::string &name, bool &excl, int &inf){
+    inf = 0;
+    excl = false;
+    if(s == "-" || s == "+"){
+        inf = s == "-" ? -1 : 1;
+        return true;
+    }
+    if(s.empty() || (s[0] != '[' && s[0] != '(')){
+        return false;
+    }
+    excl = s[0] == '(';
+    name = s.substr(1);
+    return true;
+}
+
+// the ranks [lo, hi) of the members in a name range. like ZRANGEBYLEX in Redis,
+// this assumes that all members have the same score.
+// names compare by memcmp() and then length, so "> x" is ">= x + '\0'".
+static void zset_lex_range(ZSet* zset, std::string min, bool minex, int mininf,
+    std::string max, bool maxex, int maxinf, size_t &lo, size_t &hi)
+{
+    size_t n = zset_size(zset);
+    ZIter first;
+    if(!zset_select(zset, 0, &first) || mininf > 0 || maxinf < 0){
+        lo = hi = n;
+        return;
+    }
+    double score = first.score;
+    if(mininf < 0){
+        lo = 0;
+    }else{
+        if(minex){
+            min.push_back('\0');
+        }
+        lo = zset_seek_rank(zset, score, min.data(), min.size());
+    }
+    if(maxinf > 0){
+        hi = n;
+    }else{
+        if(!maxex){
+            max.push_back('\0');
+        }
+        hi = zset_seek_rank(zset, score, max.data(), max.size());
+    }
+    hi = std::max(lo, hi);
+}
+
+// the optional [withscores] [limit offset count] of the range commands
+static bool parse_range_opts(std::vector<std::string> &cmd, size_t i, bool allow_scores,
+    bool &withscores, int64_t &offset, int64_t &count)
+{
+    withscores = false;
+    offset = 0;
+    count = -1; // all
+    for(; i < cmd.size(); ++i){
+        if(allow_scores && cmd[i] == "withscores"){
+            withscores = true;
+        }else if(cmd[i] == "limit" && i + 2 < cmd.size()){
+            if(!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], count) || offset < 0){
+                return false;
+            }
+            i += 2;
+        }else{
+            return false;
+        }
+    }
+    return true;
+}
+
+// narrow the ranks [lo, hi) by LIMIT, counted from the other end with rev
+static void range_limit(size_t &lo, size_t &hi, bool rev, int64_t offset, int64_t count){
+    size_t n = hi - lo;
+    size_t skip = std::min((size_t)offset, n);
+    size_t take = count < 0 ? n - skip : std::min((size_t)count, n - skip);
+    if(rev){
+        hi -= skip;
+        lo = hi - take;
+    }else{
+        lo += skip;
+        hi = lo + take;
+    }
+}
+
+// zcount key min max
+static void do_zcount(std::vector<std::string> &cmd, Ring_buf &buf){
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if(!str2score_bound(cmd[2], min, minex) || !str2score_bound(cmd[3], max, maxex)){
+        return out_err(buf, ERR_BAD_ARG, "expect score bound");
+    }
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    size_t lo = 0, hi = 0;
+    zset_score_range(zset, min, minex, max, maxex, lo, hi);
+    return out_int(buf, (int64_t)(hi - lo));
+}
+
+// zrangebyscore key min max [withscores] [limit offset count]
+// zrevrangebyscore key max min [withscores] [limit offset count]
+static void do_zrangebyscore(std::vector<std::string> &cmd, Ring_buf &buf){
+    bool rev = cmd[0] == "zrevrangebyscore";
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if(!str2score_bound(cmd[rev ? 3 : 2], min, minex) || !str2score_bound(cmd[rev ? 2 : 3], max, maxex)){
+        return out_err(buf, ERR_BAD_ARG, "expect score bound");
+    }
+    bool withscores = false;
+    int64_t offset = 0, count = 0;
+    if(!parse_range_opts(cmd, 4, true, withscores, offset, count)){
+        return out_err(buf, ERR_BAD_ARG, "expect withscores or limit offset count");
+    }
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    size_t lo = 0, hi = 0;
+    zset_score_range(zset, min, minex, max, maxex, lo, hi);
+    range_limit(lo, hi, rev, offset, count);
+    return out_zrange(buf, zset, lo, hi, rev, withscores);
+}
+
+// zrangebylex key min max [limit offset count]
+static void do_zrangebylex(std::vector<std::string> &cmd, Ring_buf &buf){
+    std::string min, max;
+    bool minex = false, maxex = false;
+    int mininf = 0, maxinf = 0;
+    if(!str2lex_bound(cmd[2], min, minex, mininf) || !str2lex_bound(cmd[3], max, maxex, maxinf)){
+        return out_err(buf, ERR_BAD_ARG, "expect lex bound");
+    }
+    bool withscores = false;
+    int64_t offset = 0, count = 0;
+    if(!parse_range_opts(cmd, 4, false, withscores, offset, count)){
+        return out_err(buf, ERR_BAD_ARG, "expect limit offset count");
+    }
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    size_t lo = 0, hi = 0;
+    zset_lex_range(zset, min, minex, mininf, max, maxex, maxinf, lo, hi);
+    range_limit(lo, hi, false, offset, count);
+    return out_zrange(buf, zset, lo, hi, false, false);
+}
+
+static void zrange_free_func(void* arg){
+    ZRange* range = (ZRange*)arg;
+    zset_range_free(range);
+    delete range;
+}
+
+// remove the ranks [lo, hi), the members are freed by the thread pool when
+// many, and it takes the hashtable pass along when that's long too
+static int64_t zset_remove_lazy(ZSet* zset, size_t lo, size_t hi){
+    ZRange range;
+    size_t removed = zset_remove_range(zset, lo, hi, &range, k_lazyfree_threshold);
+    if(range.size > k_lazyfree_threshold){
+        lazyfree_queue(&zrange_free_func, new ZRange(range), 0);
+    }else{
+        zset_range_free(&range);
+    }
+    return (int64_t)removed;
+}
+
+// zremrangebyrank key start stop
+static void do_zremrangebyrank(std::vector<std::string> &cmd, Ring_buf &buf){
+    int64_t start = 0, stop = 0;
+    if(!str2int(cmd[2], start) || !str2int(cmd[3], stop)){
+        return out_err(buf, ERR_BAD_ARG, "expect int");
+    }
+    ZSet* zset = expect_zset_write(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    size_t lo = 0, hi = 0;
+    index_range(start, stop, zset_size(zset), lo, hi);
+    return out_int(buf, zset_remove_lazy(zset, lo, hi));
+}
+
+// zremrangebyscore key min max
+static void do_zremrangebyscore(std::vector<std::string> &cmd, Ring_buf &buf){
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if(!str2score_bound(cmd[2], min, minex) || !str2score_bound(cmd[3], max, maxex)){
+        return out_err(buf, ERR_BAD_ARG, "expect score bound");
+    }
+    ZSet* zset = expect_zset_write(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+    size_t lo = 0, hi = 0;
+    zset_score_range(zset, min, minex, max, maxex, lo, hi);
+    return out_int(buf, zset_remove_lazy(zset, lo, hi));
+}
+
+// zagg key sum|min|max start stop [byscore]
+// the aggregate of the scores ranked [start, stop], or with byscore, of the
+// scores in [start, stop]. O(log n) with zset-avl-aggregates, a scan otherwise.
+static void do_zagg(std::vector<std::string> &cmd, Ring_buf &buf){
+    const std::string &func = cmd[2];
+    if(func != "sum" && func != "min" && func != "max"){
+        return out_err(buf, ERR_BAD_ARG, "expect sum, min or max");
+    }
+    bool byscore = cmd.size() == 6;
+    if(byscore && cmd[5] != "byscore"){
+        return out_err(buf, ERR_BAD_ARG, "expect byscore");
+    }
+    int64_t start = 0, stop = 0;
+    double min = 0, max = 0;
+    bool minex = false, maxex = false;
+    if(byscore){
+        if(!str2score_bound(cmd[3], min, minex) || !str2score_bound(cmd[4], max, maxex)){
+            return out_err(buf, ERR_BAD_ARG, "expect score bound");
+        }
+    }else if(!str2int(cmd[3], start) || !str2int(cmd[4], stop)){
+        return out_err(buf, ERR_BAD_ARG, "expect int");
+    }
+    ZSet* zset = expect_zset(cmd[1]);
+    if(!zset){
+        return out_err(buf, ERR_BAD_TYP, "expect zset");
+    }
+
+    size_t lo = 0, hi = 0;
+    if(byscore){
+        zset_score_range(zset, min, minex, max, maxex, lo, hi);
+    }else{
+        index_range(start, stop, zset_size(zset), lo, hi);
+    }
+    ZAgg agg;
+    zset_aggregate(zset, lo, hi, &agg);
+    if(func == "sum"){
+        return out_dbl(buf, agg.sum);
+    }
+    if(agg.count == 0){
+        return out_nil(buf);
+    }
+    return out_dbl(buf, func == "min" ? agg.min : agg.max);
+}
+
+// ZUNIONSTORE, ZINTERSTORE and ZDIFFSTORE, and ZUNION, ZINTER, ZDIFF and
+// ZINTERCARD that only reply, see zcombine.h. the event loop waits for the
+// parts, so the inputs can't change meanwhile. ZUNION, ZINTER and ZDIFF
+// reply with the members, and no reply is larger than k_max_msg: inputs
+// large enough to be worth moving off the event loop would not fit anyway.
+// only ZINTERCARD leaves the event loop and lets its client wait, see
+// async_suspend(). it counts without building the result, and stops at its
+// limit. only the smallest input is copied, the workers look its members up
+// in the others in place, see zset_freeze().
+
+// a command on zsets combined
+struct ZCombineCmd{
+    AsyncCmd async;
+    ZCombine zc;
+    bool withscores = false;
+    std::vector<ZAddItem> result;  // sorted, the names point into the inputs
+    size_t count = 0;
+    std::vector<std::string> keys; // ZINTERCARD: of the inputs, in their order
+};
+
+// numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max] from
+// cmd[first], then the options of the commands that only reply
+static bool zcombine_parse(std::vector<std::string> &cmd, size_t first, ZCombineCmd &zcmd,
+    Ring_buf &buf)
+{
+    ZCombine &zc = zcmd.zc;
+    const std::string &name = cmd[0];
+    zc.op = name == "zunionstore" || name == "zunion" ? ZOP_UNION
+        : name == "zdiffstore" || name == "zdiff" ? ZOP_DIFF : ZOP_INTER;
+    zc.card = name == "zintercard";
+    bool store = first == 2;
+    int64_t numkeys = 0;
+    if(!str2int(cmd[first], numkeys) || numkeys <= 0 || (size_t)numkeys > cmd.size() - first - 1){
+        out_err(buf, ERR_BAD_ARG, "expect numkeys");
+        return false;
+    }
+    zc.weights.assign((size_t)numkeys, 1.0);
+    bool weighted = zc.op != ZOP_DIFF && !zc.card;
+    for(size_t i = first + 1 + (size_t)numkeys; i < cmd.size(); ++i){
+        if(weighted && cmd[i] == "weights" && i + (size_t)numkeys < cmd.size()){
+            for(size_t k = 0; k < (size_t)numkeys; ++k){
+                if(!str2dbl(cmd[++i], zc.weights[k])){
+                    out_err(buf, ERR_BAD_ARG, "expect float");
+                    return false;
+                }
+            }
+        }else if(weighted && cmd[i] == "aggregate" && i + 1 < cmd.size()){
+            const std::string &agg = cmd[++i];
+            if(agg == "sum"){
+                zc.aggregate = ZAGG_SUM;
+            }else if(agg == "min"){
+                zc.aggregate = ZAGG_MIN;
+            }else if(agg == "max"){
+                zc.aggregate = ZAGG_MAX;
+            }else{
+                out_err(buf, ERR_BAD_ARG, "expect sum, min or max");
+                return false;
+            }
+        }else if(!store && !zc.card && cmd[i] == "withscores"){
+            zcmd.withscores = true;
+        }else if(zc.card && cmd[i] == "limit" && i + 1 < cmd.size()){
+            int64_t limit = 0;
+            if(!str2int(cmd[++i], limit) || limit < 0){
+                out_err(buf, ERR_BAD_ARG, "expect int");
+                return false;
+            }
+            zc.limit = (size_t)limit;
+        }else{
+            out_err(buf, ERR_BAD_ARG, "syntax error");
+            return false;
+        }
+    }
+
+    if(store && !evict_or_refuse(buf)){
+        return false;
+    }
+    for(size_t k = 0; k < (size_t)numkeys; ++k){
+        if(zc.card){
+            zcmd.keys.push_back(cmd[first + 1 + k]); // the lookup takes the string
+        }
+        ZSet* zset = expect_zset(cmd[first + 1 + k]);
+        if(!zset){
+            out_err(buf, ERR_BAD_TYP, "expect zset");
+            return false;
+        }
+        zc.inputs.push_back(zset);
+    }
+    if(zc.card){
+        // the count is the same in any order, the lookups go from the smallest
+        std::vector<size_t> order((size_t)numkeys);
+        for(size_t k = 0; k < order.size(); ++k){
+            order[k] = k;
+        }
+        std::stable_sort(order.begin(), order.end(), [&zc](size_t a, size_t b){
+            return zset_size(zc.inputs[a]) < zset_size(zc.inputs[b]);
+        });
+        std::vector<ZSet*> inputs;
+        std::vector<std::string> keys;
+        for(size_t k : order){
+            inputs.push_back(zc.inputs[k]);
+            keys.push_back(zcmd.keys[k]);
+        }
+        zc.inputs.swap(inputs);
+        zcmd.keys.swap(keys);
+    }
+    return true;
+}
+
+// zunionstore dest numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max]
+// zinterstore (same)
+// zdiffstore dest numkeys key [key ...]
+static void do_zcombine(std::vector<std::string> &cmd, Ring_buf &buf){
+    ZCombineCmd zcmd;
+    if(!zcombine_parse(cmd, 2, zcmd, buf)){
+        return;
+    }
+    ZCombine &zc = zcmd.zc;
+    zcombine_run(&zc, &g_data.thread_pool);
+
+    // build the result aside, the inputs may include the destination
+    std::vector<ZAddItem> items;
+    for(std::vector<ZAddItem> &part : zc.out){
+        items.insert(items.end(), part.begin(), part.end());
+    }
+    ZSet* result = new (slab_alloc(sizeof(ZSet))) ZSet();
+    size_t added = 0, updated = 0;
+    zset_insert_many(result, items.data(), items.size(), 0, &added, &updated);
+
+    // and swap it in
+    LookupKey key;
+    key_init(key, cmd[1]);
+    Entry* ent = entry_lookup(key);
+    if(ent){
+        db_remove(ent);
+        entry_del(ent);
+    }
+    if(added == 0){
+        zset_del_sync(result); // an empty result deletes the key
+        return out_int(buf, 0);
+    }
+    ent = entry_new(T_ZSET);
+    zset_del_sync(ent->zset);
+    ent->zset = result;
+    ent->key.swap(key.key);
+    ent->node.hcode = key.node.hcode;
+    db_insert(ent);
+    return out_int(buf, (int64_t)added);
+}
+
+static bool zitem_less(const ZAddItem &lhs, const ZAddItem &rhs){
+    if(lhs.score != rhs.score){
+        return lhs.score < rhs.score;
+    }
+    int rv = memcmp(lhs.name, rhs.name, std::min(lhs.len, rhs.len));
+    return rv != 0 ? rv < 0 : lhs.len < rhs.len;
+}
+
+// the result of a command that only replies, sorted as a zset. ZINTERCARD
+// only counts, the parts may count a few past the limit.
+static void zcombine_result(ZCombineCmd* zcmd){
+    ZCombine &zc = zcmd->zc;
+    zcombine_run(&zc, &g_data.thread_pool);
+    if(zc.card){
+        size_t found = zc.found.load();
+        zcmd->count = zc.limit ? std::min(found, zc.limit) : found;
+        return;
+    }
+    for(std::vector<ZAddItem> &part : zc.out){
+        zcmd->result.insert(zcmd->result.end(), part.begin(), part.end());
+    }
+    zcmd->count = zcmd->result.size();
+    std::sort(zcmd->result.begin(), zcmd->result.end(), &zitem_less);
+}
+
+// the fewest members the result can have: a reply that can't fit fails
+// before the work
+static size_t zcombine_min_result(ZCombine* zc){
+    size_t most = 0, rest = 0;
+    for(size_t i = 0; i < zc->inputs.size(); ++i){
+        size_t n = zset_size(zc->inputs[i]);
+        most = std::max(most, n);
+        rest += i > 0 ? n : 0;
+    }
+    if(zc->op == ZOP_UNION){
+        return most;
+    }
+    size_t first = zset_size(zc->inputs[0]);
+    return zc->op == ZOP_DIFF && first > rest ? first - rest : 0;
+}
+
+static void zcombine_reply(ZCombineCmd* zcmd, Ring_buf &buf){
+    if(zcmd->zc.card){
+        return out_int(buf, (int64_t)zcmd->count);
+    }
+    size_t ctx = out_begin_arr(buf);
+    for(const ZAddItem &item : zcmd->result){
+        out_str(buf, item.name, item.len);
+        if(zcmd->withscores){
+            out_dbl(buf, item.score);
+        }
+    }
+    out_end_arr(buf, ctx, (uint32_t)(zcmd->result.size() * (zcmd->withscores ? 2 : 1)));
+}
+
+static void cb_zcombine_work(CqJob* job){
+    AsyncCmd* ac = container_of(job, AsyncCmd, job);
+    zcombine_result(container_of(ac, ZCombineCmd, async));
+}
+
+static void cb_zcombine_reply(AsyncCmd* ac, Ring_buf &buf){
+    zcombine_reply(container_of(ac, ZCombineCmd, async), buf);
+}
+
+static void cb_zcombine_del(AsyncCmd* ac){
+    delete container_of(ac, ZCombineCmd, async);
+}
+
+static void zset_freeze(ZSet* zset, const std::string &key);
+static void zset_thaw(ZSet* zset);
+static void zset_thaw_wake();
+
+static void cb_zcombine_release(AsyncCmd* ac){
+    ZCombine &zc = container_of(ac, ZCombineCmd, async)->zc;
+    for(size_t i = 1; i < zc.inputs.size(); ++i){
+        zset_thaw(zc.inputs[i]);
+    }
+    zset_thaw_wake();
+}
+
+static void async_suspend(AsyncCmd* ac);
+
+// zunion numkeys key [key ...] [weights w [w ...]] [aggregate sum|min|max] [withscores]
+// zinter (same)
+// zdiff numkeys key [key ...] [withscores]
+// zintercard numkeys key [key ...] [limit n]
+static void do_zcombine_reply(std::vector<std::string> &cmd, Ring_buf &buf){
+    ZCombineCmd* zcmd = new ZCombineCmd();
+    if(!zcombine_parse(cmd, 1, *zcmd, buf)){
+        delete zcmd;
+        return;
+    }
+    ZCombine &zc = zcmd->zc;
+    if(!zc.card){
+        // a tag and a length per member at least, and the score
+        size_t member_bytes = 1 + 4 + (zcmd->withscores ? 1 + 8 : 0);
+        if(zcombine_min_result(&zc) * member_bytes > k_max_msg){
+            out_err(buf, ERR_TOO_BIG, "response too big");
+        }else{
+            zcombine_result(zcmd);
+            zcombine_reply(zcmd, buf);
+        }
+        delete zcmd;
+        return;
+    }
+    // a small limit is often reached after a few lookups
+    size_t max_lookups = g_data.cmd_conn ? k_zcombine_parallel_min : SIZE_MAX;
+    if(zcombine_card(&zc, max_lookups, &zcmd->count)){
+        out_int(buf, (int64_t)zcmd->count);
+        delete zcmd;
+        return;
+    }
+    // the smallest input is copied, the others are read in place
+    zcombine_copy_first(&zc);
+    for(size_t i = 1; i < zc.inputs.size(); ++i){
+        zset_freeze(zc.inputs[i], zcmd->keys[i]);
+    }
+    zcmd->async.job.work = &cb_zcombine_work;
+    zcmd->async.reply = &cb_zcombine_reply;
+    zcmd->async.del = &cb_zcombine_del;
+    zcmd->async.release = &cb_zcombine_release;
+    async_suspend(&zcmd->async);
 }
 
 // zquery zset score name offset limit 
@@ -648,16 +2153,17 @@ static void do_zquery(std::vector<std::string> &cmd, Ring_buf &buf){
     if(limit <= 0){
         return out_arr(buf,0);
     }
-    ZNode* znode = zset_seekge(zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    ZIter it;
+    zset_seekge(zset, score, name.data(), name.size(), &it);
+    zset_offset(&it, offset);
 
     // output 
     size_t ctx = out_begin_arr(buf);
     int64_t n = 0;
-    while(znode && n < limit){
-        out_str(buf, znode->name, znode->len);
-        out_dbl(buf, znode->score);
-        znode = znode_offset(znode, 1);
+    while(it.valid && n < limit){
+        out_str(buf, it.name, it.len);
+        out_dbl(buf, it.score);
+        zset_offset(&it, 1);
         n += 2;
     }
     out_end_arr(buf, ctx, (uint32_t)n);
@@ -667,61 +2173,3222 @@ static void do_zquery(std::vector<std::string> &cmd, Ring_buf &buf){
 
 
 
-static void do_request(std::vector<std::string> &cmd,Ring_buf &buf){
-    if(cmd.size() == 2 && cmd[0] == "get"){
-        do_get(cmd, buf);
-    }else if(cmd.size() == 3 && cmd[0] == "set"){
-        do_set(cmd, buf);
-    }else if(cmd.size() == 2 && cmd[0] == "del"){
-        do_del(cmd, buf);
-    }else if(cmd.size() == 3 && cmd[0] == "pexpire"){
-        return do_expire(cmd, buf);
-    }else if(cmd.size() == 2 && cmd[0] == "pttl"){
-        return do_ttl(cmd, buf);
-    }else if(cmd.size() == 1 && cmd[0] == "keys"){
-        do_keys(cmd, buf);
-    }else if(cmd.size() == 4 && cmd[0] == "zadd"){
-        return do_zadd(cmd, buf);
-    }else if(cmd.size() == 3 && cmd[0] == "zrem"){
-        return do_zrem(cmd, buf);
-    }else if(cmd.size() == 3 && cmd[0] == "zscore"){
-        return do_zscore(cmd, buf);
-    }else if (cmd.size() == 6 && cmd[0] == "zquery"){
-        return do_zquery(cmd, buf);
-    }else{
-        return out_err(buf, ERR_UNKNOWN, "unknown command.");    
+// memory accounted against maxmemory
+static size_t used_memory(){
+    SlabStats st;
+    slab_stats(&st);
+    return zmalloc_used_memory() + st.used_bytes;
+}
+
+static bool policy_is_volatile(){
+    return g_conf.maxmemory_policy == EVICT_VOLATILE_LRU
+        || g_conf.maxmemory_policy == EVICT_VOLATILE_TTL;
+}
+
+// the larger the score, the better the candidate
+static uint64_t evict_score(Entry* ent){
+    switch(g_conf.maxmemory_policy){
+    case EVICT_ALLKEYS_LFU:
+        return 255 - lfu_decr(ent->lru);
+    case EVICT_VOLATILE_TTL:
+        return UINT64_MAX - g_data.heap[ent->heap_idx].val; // sooner is better
+    default:
+        return lru_idle_sec(ent->lru);
+    }
+}
+
+// insert into the pool if the key beats the worst candidate
+static void evict_pool_insert(Entry* ent){
+    vector<EvictCandidate> &pool = g_data.evict_pool;
+    const size_t k_evict_pool_size = 16;
+    uint64_t idle = evict_score(ent);
+    if(pool.size() == k_evict_pool_size && idle <= pool[0].idle){
+        return;
+    }
+    for(const EvictCandidate &c : pool){
+        if(c.key == ent->key){
+            return; // already there
+        }
+    }
+    size_t pos = 0;
+    while(pos < pool.size() && pool[pos].idle < idle){
+        pos++;
+    }
+    pool.insert(pool.begin() + pos, EvictCandidate{idle, ent->key});
+    if(pool.size() > k_evict_pool_size){
+        pool.erase(pool.begin()); // drop the worst
+    }
+}
+
+// sample a few keys into the candidate pool
+static void evict_pool_populate(){
+    size_t n = g_conf.maxmemory_samples;
+    if(policy_is_volatile()){
+        // keys with a TTL are exactly the ones in the heap
+        const vector<HeapItem> &heap = g_data.heap;
+        for(size_t i = 0; i < n && !heap.empty(); ++i){
+            Entry* ent = container_of(heap[rand64() % heap.size()].ref, Entry, heap_idx);
+            evict_pool_insert(ent);
+        }
+        return;
+    }
+    HNode* nodes[64];
+    n = std::min(n, sizeof(nodes) / sizeof(nodes[0]));
+    n = hm_sample(&g_data.db, rand64(), nodes, n);
+    for(size_t i = 0; i < n; ++i){
+        evict_pool_insert(container_of(nodes[i], Entry, node));
+    }
+}
+
+// evict the best key from the pool
+static bool evict_one(){
+    evict_pool_populate();
+    vector<EvictCandidate> &pool = g_data.evict_pool;
+    while(!pool.empty()){
+        LookupKey key;
+        key_init(key, pool.back().key);
+        pool.pop_back();
+        // the candidate may be gone or have lost its TTL since it was sampled
+        HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+        Entry* ent = node ? container_of(node, Entry, node) : nullptr;
+        if(!ent || (policy_is_volatile() && ent->heap_idx == (size_t)-1)){
+            continue;
+        }
+        aof_feed_del(ent);
+        db_remove(ent);
+        entry_del(ent);
+        g_data.stat_evicted_keys++;
+        return true;
+    }
+    return false;
+}
+
+// used_memory() without the values the thread pool is freeing
+static size_t evict_used_memory(){
+    size_t used = used_memory();
+    size_t pending = (size_t)g_data.lazyfree_pending_bytes.load();
+    return used > pending ? used - pending : 0;
+}
+
+// false if still over the limit
+static bool evict_to_fit(){
+    if(!g_conf.maxmemory){
+        return true;
+    }
+    while(evict_used_memory() > g_conf.maxmemory){
+        if(g_conf.maxmemory_policy == EVICT_NOEVICTION || !evict_one()){
+            return false; // nothing to evict
+        }
+    }
+    return true;
+}
+
+// called by the commands that can grow memory once their arguments are good,
+// before they look their keys up: an eviction may free them. false with
+// ERR_OOM if still over the limit. a replica's memory follows its primary,
+// it never evicts on its own.
+static bool evict_or_refuse(Ring_buf &buf){
+    if(g_data.repl_applying || evict_to_fit()){
+        return true;
+    }
+    out_err(buf, ERR_OOM, "OOM command not allowed when used memory > 'maxmemory'");
+    return false;
+}
+
+// the commands that can grow memory, see evict_or_refuse()
+static bool cmd_may_grow(const std::string &name){
+    return name == "set" || name == "zadd" || name == "zunionstore" || name == "zinterstore"
+        || name == "zdiffstore" || name == "restore";
+}
+
+// the commands that go to the append-only file
+static bool cmd_is_write(const std::string &name){
+    return cmd_may_grow(name) || name == "del" || name == "unlink" || name == "flushall"
+        || name == "pexpire" || name == "pexpireat" || name == "zrem"
+        || name == "zremrangebyrank" || name == "zremrangebyscore";
+}
+
+// commands that see every key, refused until a warm start is done
+static bool cmd_is_keyspace(const std::string &name){
+    return name == "keys" || name == "flushall" || name == "save" || name == "bgsave"
+        || name == "bgrewriteaof";
+}
+
+// the commands that don't touch the keyspace
+static bool cmd_is_admin(const std::string &name){
+    return name == "info" || name == "config" || name == "replicaof" || name == "cluster";
+}
+
+static const char* k_fsync_names[] = {"no", "always", "everysec"};
+
+static const char* k_policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu", "volatile-lru", "volatile-ttl",
+};
+
+// 100, 64kb, 100mb, 2gb
+static bool str2mem(const std::string &s, size_t &out){
+    char* endp = nullptr;
+    unsigned long long val = strtoull(s.c_str(), &endp, 10);
+    if(endp == s.c_str()){
+        return false;
+    }
+    std::string unit(endp);
+    for(char &c : unit){
+        c = (char)tolower(c);
+    }
+    unsigned long long mul = 1;
+    if(unit == "k" || unit == "kb"){
+        mul = 1024;
+    }else if(unit == "m" || unit == "mb"){
+        mul = 1024 * 1024;
+    }else if(unit == "g" || unit == "gb"){
+        mul = 1024 * 1024 * 1024;
+    }else if(!unit.empty()){
+        return false;
+    }
+    out = (size_t)(val * mul);
+    return true;
+}
+
+static bool str2u32(const std::string &s, uint32_t &out){
+    int64_t val = 0;
+    if(!str2int(s, val) || val < 0 || val > UINT32_MAX){
+        return false;
+    }
+    out = (uint32_t)val;
+    return true;
+}
+
+static bool str2bool(const std::string &s, bool &out){
+    if(s == "yes"){
+        out = true;
+    }else if(s == "no"){
+        out = false;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+static bool rewrite_start(std::string &err);
+
+static bool config_set(const std::string &name, const std::string &val){
+    if(name == "zset-engine"){
+        // only zsets that outgrow the listpack from now on use it
+        if(val == "avl"){
+            zset_set_engine(ZSET_AVL);
+        }else if(val == "btree"){
+            zset_set_engine(ZSET_BTREE);
+        }else{
+            return false;
+        }
+        return true;
+    }else if(name == "zset-avl-aggregates"){
+        // likewise, for the AVL indexes created from now on
+        bool on = false;
+        if(!str2bool(val, on)){
+            return false;
+        }
+        zset_set_avl_aggregates(on);
+        return true;
+    }else if(name == "lazyfree-lazy-user-del"){
+        return str2bool(val, g_conf.lazyfree_lazy_user_del);
+    }else if(name == "activedefrag"){
+        return str2bool(val, g_conf.activedefrag);
+    }else if(name == "active-defrag-ignore-bytes"){
+        return str2mem(val, g_conf.active_defrag_ignore_bytes);
+    }else if(name == "active-defrag-threshold-lower"){
+        return str2u32(val, g_conf.active_defrag_threshold_lower);
+    }else if(name == "active-defrag-cycle-max"){
+        return str2u32(val, g_conf.active_defrag_cycle_max)
+            && g_conf.active_defrag_cycle_max >= 1 && g_conf.active_defrag_cycle_max <= 100;
+    }else if(name == "maxmemory"){
+        return str2mem(val, g_conf.maxmemory);
+    }else if(name == "maxmemory-policy"){
+        for(uint32_t i = 0; i < sizeof(k_policy_names) / sizeof(k_policy_names[0]); ++i){
+            if(val == k_policy_names[i]){
+                g_conf.maxmemory_policy = i;
+                g_data.evict_pool.clear(); // the scores are not comparable
+                return true;
+            }
+        }
+        return false;
+    }else if(name == "maxmemory-samples"){
+        return str2u32(val, g_conf.maxmemory_samples) && g_conf.maxmemory_samples > 0;
+    }else if(name == "lfu-log-factor"){
+        return str2u32(val, g_conf.lfu_log_factor);
+    }else if(name == "lfu-decay-time"){
+        return str2u32(val, g_conf.lfu_decay_time);
+    }else if(name == "appendonly"){
+        bool on = false;
+        if(!str2bool(val, on)){
+            return false;
+        }
+        if(g_data.started && on != g_conf.appendonly){
+            if(!on || g_data.warm){
+                return false; // can't turn it off at runtime, or rewrite half a keyspace
+            }
+            // the log starts with a rewrite of the current keyspace
+            std::string err;
+            if(!g_data.rewrite_running && !rewrite_start(err)){
+                return false;
+            }
+        }
+        g_conf.appendonly = on;
+        return true;
+    }else if(name == "appendfilename"){
+        if(val.empty() || g_data.started){
+            return false;
+        }
+        g_conf.appendfilename = val;
+        return true;
+    }else if(name == "auto-aof-rewrite-percentage"){
+        return str2u32(val, g_conf.auto_aof_rewrite_percentage);
+    }else if(name == "auto-aof-rewrite-min-size"){
+        return str2mem(val, g_conf.auto_aof_rewrite_min_size);
+    }else if(name == "appendfsync"){
+        for(uint32_t i = 0; i < sizeof(k_fsync_names) / sizeof(k_fsync_names[0]); ++i){
+            if(val == k_fsync_names[i]){
+                g_conf.appendfsync = i;
+                return true;
+            }
+        }
+        return false;
+    }else if(name == "dbfilename"){
+        if(val.empty()){
+            return false;
+        }
+        g_conf.dbfilename = val;
+        return true;
+    }else if(name == "warm-start"){
+        return !g_data.started && str2bool(val, g_conf.warm_start);
+    }else if(name == "key-load-delay"){
+        return str2u32(val, g_conf.key_load_delay); // the batches handed out from now
+    }else if(name == "io-threads"){
+        const uint32_t k_io_threads_max = 64;
+        return !g_data.started && str2u32(val, g_conf.io_threads) && g_conf.io_threads > 0
+            && g_conf.io_threads <= k_io_threads_max;
+    }else if(name == "cluster-enabled"){
+        return !g_data.started && str2bool(val, g_conf.cluster_enabled);
+    }else if(name == "cluster-announce-ip"){
+        if(val.empty() || g_data.started){
+            return false;
+        }
+        g_conf.cluster_announce_ip = val;
+        return true;
+    }else if(name == "repl-backlog-size"){
+        size_t size = 0;
+        if(!str2mem(val, size) || size < 16 * 1024){
+            return false;
+        }
+        g_conf.repl_backlog_size = size;
+        if(!g_data.repl_backlog.buf.empty()){
+            backlog_resize(&g_data.repl_backlog, size);
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool config_get(const std::string &name, std::string &out){
+    if(name == "zset-engine"){
+        out = zset_engine() == ZSET_BTREE ? "btree" : "avl";
+    }else if(name == "zset-avl-aggregates"){
+        out = zset_avl_aggregates() ? "yes" : "no";
+    }else if(name == "lazyfree-lazy-user-del"){
+        out = g_conf.lazyfree_lazy_user_del ? "yes" : "no";
+    }else if(name == "activedefrag"){
+        out = g_conf.activedefrag ? "yes" : "no";
+    }else if(name == "active-defrag-ignore-bytes"){
+        out = std::to_string(g_conf.active_defrag_ignore_bytes);
+    }else if(name == "active-defrag-threshold-lower"){
+        out = std::to_string(g_conf.active_defrag_threshold_lower);
+    }else if(name == "active-defrag-cycle-max"){
+        out = std::to_string(g_conf.active_defrag_cycle_max);
+    }else if(name == "maxmemory"){
+        out = std::to_string(g_conf.maxmemory);
+    }else if(name == "maxmemory-policy"){
+        out = k_policy_names[g_conf.maxmemory_policy];
+    }else if(name == "maxmemory-samples"){
+        out = std::to_string(g_conf.maxmemory_samples);
+    }else if(name == "lfu-log-factor"){
+        out = std::to_string(g_conf.lfu_log_factor);
+    }else if(name == "lfu-decay-time"){
+        out = std::to_string(g_conf.lfu_decay_time);
+    }else if(name == "dbfilename"){
+        out = g_conf.dbfilename;
+    }else if(name == "appendonly"){
+        out = g_conf.appendonly ? "yes" : "no";
+    }else if(name == "appendfilename"){
+        out = g_conf.appendfilename;
+    }else if(name == "appendfsync"){
+        out = k_fsync_names[g_conf.appendfsync];
+    }else if(name == "auto-aof-rewrite-percentage"){
+        out = std::to_string(g_conf.auto_aof_rewrite_percentage);
+    }else if(name == "auto-aof-rewrite-min-size"){
+        out = std::to_string(g_conf.auto_aof_rewrite_min_size);
+    }else if(name == "warm-start"){
+        out = g_conf.warm_start ? "yes" : "no";
+    }else if(name == "key-load-delay"){
+        out = std::to_string(g_conf.key_load_delay);
+    }else if(name == "repl-backlog-size"){
+        out = std::to_string(g_conf.repl_backlog_size);
+    }else if(name == "io-threads"){
+        out = std::to_string(g_conf.io_threads);
+    }else if(name == "cluster-enabled"){
+        out = g_conf.cluster_enabled ? "yes" : "no";
+    }else if(name == "cluster-announce-ip"){
+        out = g_conf.cluster_announce_ip;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// config get name
+// config set name value
+static void do_config(std::vector<std::string> &cmd, Ring_buf &buf){
+    if(cmd.size() == 3 && cmd[1] == "get"){
+        std::string val;
+        return config_get(cmd[2], val) ? out_str(buf, val.data(), val.size()) : out_nil(buf);
+    }
+    if(cmd.size() == 4 && cmd[1] == "set"){
+        if(!config_set(cmd[2], cmd[3])){
+            return out_err(buf, ERR_BAD_ARG, "bad config");
+        }
+        return out_nil(buf);
+    }
+    return out_err(buf, ERR_UNKNOWN, "unknown command.");
+}
+
+static void append_fmt(std::string &out, const char* fmt, ...){
+    char tmp[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if(n > 0){
+        out.append(tmp, std::min((size_t)n, sizeof(tmp) - 1));
+    }
+}
+
+// memory malloc-stats
+static void do_malloc_stats(std::vector<std::string>&, Ring_buf &buf){
+    SlabStats st;
+    slab_stats(&st);
+    SlabClassStats cs[k_slab_nclass];
+    slab_class_stats(cs);
+
+    std::string out;
+    append_fmt(out, "slab_pages:%zu\n", st.pages);
+    append_fmt(out, "slab_reserved_bytes:%zu\n", st.reserved_bytes);
+    append_fmt(out, "slab_used_bytes:%zu\n", st.used_bytes);
+    append_fmt(out, "slab_fragmentation_ratio:%.2f\n",
+        st.used_bytes ? (double)st.reserved_bytes / st.used_bytes : 0.0);
+    append_fmt(out, "slab_allocs:%llu\n", (unsigned long long)st.allocs);
+    append_fmt(out, "slab_frees:%llu\n", (unsigned long long)st.frees);
+    append_fmt(out, "slab_page_allocs:%llu\n", (unsigned long long)st.page_allocs);
+    append_fmt(out, "slab_page_frees:%llu\n", (unsigned long long)st.page_frees);
+    append_fmt(out, "large_bytes:%zu\n", st.large_bytes);
+    for(size_t i = 0; i < k_slab_nclass; ++i){
+        if(cs[i].pages == 0 && cs[i].allocs == 0){
+            continue;
+        }
+        append_fmt(out, "class_%zu:pages=%zu,live=%zu,allocs=%llu,frees=%llu\n",
+            cs[i].obj_size, cs[i].pages, cs[i].live,
+            (unsigned long long)cs[i].allocs, (unsigned long long)cs[i].frees);
+    }
+    return out_str(buf, out.data(), out.size());
+}
+
+// heap bytes behind a std::string, 0 if it fits in the inline buffer
+static size_t str_mem_usage(const std::string &str){
+    return str.capacity() > 15 ? str.capacity() + 1 : 0;
+}
+
+// bytes attributed to a key, zset members are sampled
+static size_t entry_mem_usage(Entry* ent, size_t samples){
+    size_t bytes = slab_usable_size(entry_size()) + str_mem_usage(ent->key);
+    if(ent->type == T_STR){
+        bytes += str_mem_usage(ent->str);
+    }else if(ent->type == T_ZSET){
+        bytes += zset_mem_usage(ent->zset, samples);
+    }
+    if(ent->heap_idx != (size_t)-1){
+        bytes += sizeof(HeapItem);
+    }
+    return bytes;
+}
+
+// memory usage key [samples n]
+static void do_memory_usage(std::vector<std::string> &cmd, Ring_buf &buf){
+    int64_t samples = 5;
+    if(cmd.size() == 5){
+        if(cmd[3] != "samples" || !str2int(cmd[4], samples) || samples < 0){
+            return out_err(buf, ERR_BAD_ARG, "expect samples n");
+        }
+    }else if(cmd.size() != 3){
+        return out_err(buf, ERR_BAD_ARG, "wrong number of arguments");
+    }
+
+    LookupKey key;
+    key_init(key, cmd[2]);
+    HNode* node = db_lookup(key); // don't touch it
+    if(!node){
+        return out_nil(buf);
+    }
+    return out_int(buf, (int64_t)entry_mem_usage(container_of(node, Entry, node), (size_t)samples));
+}
+
+static void append_mem(std::string &out, const char* name, size_t bytes){
+    const char* units[] = {"B", "K", "M", "G", "T"};
+    double val = (double)bytes;
+    size_t u = 0;
+    while(val >= 1024 && u + 1 < sizeof(units) / sizeof(units[0])){
+        val /= 1024;
+        u++;
+    }
+    append_fmt(out, "%s:%zu\r\n%s_human:%.2f%s\r\n", name, bytes, name, val, units[u]);
+}
+
+// snapshots (SAVE, BGSAVE). there is no fork() on Windows, so the point-in-time
+// copy is made by encoding the keyspace into memory. SAVE (and a full sync)
+// encodes it while the event loop waits, split by hash slot over the thread
+// pool like do_zcombine(). BGSAVE encodes it over many ticks instead, see
+// snap_scan(). writing, checksumming and fsync then happen off the loop for
+// BGSAVE. the longest pause is reported as latest_fork_usec and the encoded
+// copy as rdb_last_cow_size, the costs that fork() and copy-on-write pages
+// would have.
+
+// the number of keys above which the encoding runs on the thread pool, and
+// the snapshot is split into sections that load in parallel too
+const size_t k_rdb_parallel_min = 10000;
+const size_t k_rdb_parts = 16; // a power of 2
+const uint64_t k_bgsave_poll_ms = 10;
+
+struct RdbEncode{
+    size_t nparts = 1;
+    uint64_t now_ms = 0;  // monotonic, the TTL heap's clock
+    uint64_t wall_ms = 0;
+    std::vector<RdbSection>* sects = nullptr;
+};
+
+// a record up to the value, false if the entry is expired and left out.
+// `heap` has its TTL, g_data.heap unless the keyspace was detached.
+static bool rdb_put_head(std::string &out, Entry* ent, const std::vector<HeapItem> &heap,
+    uint64_t now_ms, uint64_t wall_ms)
+{
+    bool ttl = ent->heap_idx != (size_t)-1;
+    if(ttl && heap[ent->heap_idx].val <= now_ms){
+        return false; // due, the timers haven't got to it yet
+    }
+    rdb_put_u8(out, ent->type == T_ZSET ? RDB_TYPE_ZSET : RDB_TYPE_STR);
+    rdb_put_u8(out, ttl ? RDB_FLAG_TTL : 0);
+    if(ttl){
+        // the monotonic clock doesn't survive a restart
+        uint64_t left = heap[ent->heap_idx].val - now_ms;
+        rdb_put_u64(out, wall_ms + left);
+    }
+    rdb_put_str(out, ent->key.data(), ent->key.size());
+    return true;
+}
+
+// the members ranked [start, start + n) of a zset record
+static void rdb_put_members(std::string &out, ZSet* zset, size_t start, size_t n){
+    ZIter it;
+    zset_select(zset, start, &it);
+    for(size_t i = 0; i < n && it.valid; ++i, zset_offset(&it, 1)){
+        rdb_put_dbl(out, it.score);
+        rdb_put_str(out, it.name, it.len);
+    }
+}
+
+// a whole record, false if the entry is expired and left out
+static bool rdb_put_record(std::string &out, Entry* ent, const std::vector<HeapItem> &heap,
+    uint64_t now_ms, uint64_t wall_ms)
+{
+    if(!rdb_put_head(out, ent, heap, now_ms, wall_ms)){
+        return false;
+    }
+    if(ent->type == T_STR){
+        rdb_put_str(out, ent->str.data(), ent->str.size());
+        return true;
+    }
+    size_t n = zset_size(ent->zset);
+    rdb_put_varint(out, n);
+    rdb_put_members(out, ent->zset, 0, n);
+    return true;
+}
+
+static void rdb_put_entry(RdbEncode* enc, RdbSection &sect, Entry* ent){
+    size_t offset = sect.data.size();
+    if(rdb_put_record(sect.data, ent, g_data.heap, enc->now_ms, enc->wall_ms)){
+        rdb_put_index(sect, ent->node.hcode, offset);
+    }
+}
+
+static void cb_rdb_collect(HNode* node, void* arg){
+    ((std::vector<HNode*>*)arg)->push_back(node);
+}
+
+static bool hnode_hcode_less(HNode* lhs, HNode* rhs){
+    return lhs->hcode < rhs->hcode;
+}
+
+// read-only, so the workers can scan the keyspace together.
+// a part is exactly the keys of one section, written in hcode order.
+static void rdb_encode_part(void* arg, size_t part){
+    RdbEncode* enc = (RdbEncode*)arg;
+    std::vector<HNode*> nodes;
+    hm_foreach_part(&g_data.db, part, enc->nparts, &cb_rdb_collect, &nodes);
+    std::sort(nodes.begin(), nodes.end(), &hnode_hcode_less);
+    for(HNode* node : nodes){
+        rdb_put_entry(enc, (*enc->sects)[part], container_of(node, Entry, node));
+    }
+}
+
+// the point-in-time copy of the keyspace
+static void rdb_encode(std::vector<RdbSection> &sects){
+    uint64_t start_us = get_monotonic_usec();
+    RdbEncode enc;
+    enc.nparts = hm_size(&g_data.db) >= k_rdb_parallel_min ? k_rdb_parts : 1;
+    enc.now_ms = get_monotonic_msec();
+    enc.wall_ms = get_wall_msec();
+    enc.sects = &sects;
+    sects.assign(enc.nparts, RdbSection());
+    if(enc.nparts > 1){
+        thread_pool_run(&g_data.thread_pool, enc.nparts, &rdb_encode_part, &enc);
+    }else{
+        rdb_encode_part(&enc, 0);
+    }
+    g_data.stat_fork_usec = get_monotonic_usec() - start_us;
+    g_data.stat_rdb_cow_bytes = 0;
+    for(RdbSection &sect : sects){
+        g_data.stat_rdb_cow_bytes += sect.data.size() + sect.index.size();
+    }
+}
+
+// save
+static void do_save(std::vector<std::string>&, Ring_buf &buf){
+    if(g_data.bgsave_job){
+        return out_err(buf, ERR_BUSY, "background save already in progress");
+    }
+    std::vector<RdbSection> sects;
+    rdb_encode(sects);
+    std::string err;
+    if(!rdb_write_file(g_conf.dbfilename, sects, err)){
+        fprintf(stderr, "save failed: %s\n", err.c_str());
+        return out_err(buf, ERR_IO, err);
+    }
+    g_data.rdb_last_save_time = get_wall_msec() / 1000;
+    return out_nil(buf);
+}
+
+static void rdb_save_func(void* arg){
+    RdbJob* job = (RdbJob*)arg;
+    // BGSAVE wrote the records in scan order
+    for(size_t i = 0; i < job->recs.size(); ++i){
+        rdb_sort_section(job->sects[i], job->recs[i]);
+    }
+    std::vector<std::vector<RdbIndexEntry>>().swap(job->recs);
+    job->ok = rdb_write_file(job->path, job->sects, job->err);
+    std::vector<RdbSection>().swap(job->sects); // release the copy here
+}
+
+// incremental snapshots, for BGSAVE and the AOF rewrite: the keyspace is
+// scanned within a time budget per tick, and an entry that is about to change
+// or go away is encoded first if the scan hasn't got to it yet, so the
+// snapshot is the keyspace as of its start. Entry::snap_epoch tells which
+// ones are done: the epoch flips when a snapshot starts and entries created
+// since count as done. the records go to the sink in scan order, a large
+// zset is encoded in batches and handed over once complete.
+
+// zsets up to this size are encoded in one go, larger ones in batches
+const size_t k_snap_inline_members = 1000;
+const uint64_t k_snap_budget_us = 1000;
+const uint64_t k_snap_tick_ms = 1;
+
+static void snap_start(SnapScan* snap, uint32_t kind, const SnapSink &sink){
+    *snap = SnapScan();
+    snap->kind = kind;
+    snap->sink = sink;
+    snap->scanning = true;
+    g_data.snap_epoch[kind] ^= 1; // every entry is now pending
+}
+
+static HMap* snap_db(SnapScan* snap){
+    return snap->db ? snap->db : &g_data.db;
+}
+
+static const std::vector<HeapItem> &snap_heap(SnapScan* snap){
+    return snap->db ? snap->heap : g_data.heap;
+}
+
+// the record of the large zset is complete
+static void snap_zset_done(SnapScan* snap){
+    std::string &out = snap->sink.buf(snap->sink.arg, snap->zhcode);
+    size_t offset = out.size();
+    out += snap->zrec;
+    std::string().swap(snap->zrec);
+    snap->zkey.clear();
+    snap->sink.added(snap->sink.arg, snap->zhcode, offset);
+}
+
+// continue the large zset with up to `n` members
+static void snap_zset_step(SnapScan* snap, size_t n){
+    LookupKey key;
+    key.key = snap->zkey;
+    key.node.hcode = snap->zhcode;
+    HNode* node = hm_lookup(snap_db(snap), &key.node, &entry_eq);
+    Entry* ent = node ? container_of(node, Entry, node) : nullptr;
+    if(!ent || ent->type != T_ZSET){
+        // can't happen, changes finish it first
+        snap->err = "lost the zset " + snap->zkey;
+        snap->zkey.clear();
+        return;
+    }
+    size_t size = zset_size(ent->zset);
+    n = std::min(n, size - snap->zrank);
+    rdb_put_members(snap->zrec, ent->zset, snap->zrank, n);
+    snap->zrank += n;
+    if(snap->zrank == size){
+        snap_zset_done(snap);
+    }
+}
+
+// encode the entry, a large zset is continued by snap_zset_step() unless
+// `whole`. the records are independent, so others don't wait for it.
+static void snap_emit(SnapScan* snap, Entry* ent, bool whole){
+    ent->snap_epoch[snap->kind] = g_data.snap_epoch[snap->kind];
+    uint64_t now_ms = get_monotonic_msec();
+    uint64_t wall_ms = get_wall_msec();
+    if(whole || ent->type != T_ZSET || !snap->zkey.empty()
+        || zset_size(ent->zset) <= k_snap_inline_members)
+    {
+        std::string &out = snap->sink.buf(snap->sink.arg, ent->node.hcode);
+        size_t offset = out.size();
+        if(rdb_put_record(out, ent, snap_heap(snap), now_ms, wall_ms)){
+            snap->sink.added(snap->sink.arg, ent->node.hcode, offset);
+        }
+        return;
+    }
+    if(!rdb_put_head(snap->zrec, ent, snap_heap(snap), now_ms, wall_ms)){
+        return;
+    }
+    rdb_put_varint(snap->zrec, zset_size(ent->zset));
+    snap->zkey = ent->key;
+    snap->zrank = 0;
+    snap->zhcode = ent->node.hcode;
+}
+
+static void snap_save(SnapScan* snap, Entry* ent){
+    if(!snap->scanning || snap->db){
+        return; // nothing changes a detached keyspace
+    }
+    if(ent->snap_epoch[snap->kind] != g_data.snap_epoch[snap->kind]){
+        snap_emit(snap, ent, true);
+    }else if(!snap->zkey.empty() && snap->zkey == ent->key){
+        snap_zset_step(snap, (size_t)-1); // the rest of it, as it is now
+    }
+}
+
+// called before the entry changes or goes away
+static void snap_save_entry(Entry* ent){
+    if(g_data.bgsave_job){
+        snap_save(&g_data.bgsave_job->scan, ent);
+    }
+    if(g_data.repl_sync_job){
+        snap_save(&g_data.repl_sync_job->scan, ent);
+    }
+    snap_save(&g_data.rewrite_scan, ent);
+}
+
+// before a write command runs
+static void snap_save_cmd(const std::vector<std::string> &cmd){
+    if(cmd[0] == "flushall"){
+        // BGSAVE goes on with the detached keyspace, see db_flush(). the
+        // rewrite and a full sync have it in the tail, only a half written
+        // zset must be completed
+        ReplSync* job = g_data.repl_sync_job;
+        SnapScan* snaps[] = {&g_data.rewrite_scan, job ? &job->scan : nullptr};
+        for(SnapScan* snap : snaps){
+            if(snap && snap->scanning && !snap->zkey.empty()){
+                snap_zset_step(snap, (size_t)-1);
+            }
+        }
+        return;
+    }
+    if(cmd[0] == "restore"){
+        return; // do_restore() saves the keys it replaces
+    }
+    // every other write command changes only the key at cmd[1]
+    LookupKey key;
+    key.key = cmd[1];
+    key.node.hcode = str_hash((const uint8_t*)key.key.data(), key.key.size());
+    HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if(node){
+        snap_save_entry(container_of(node, Entry, node));
+    }
+}
+
+static void cb_snap_key(HNode** from, void* arg){
+    SnapScan* snap = (SnapScan*)arg;
+    Entry* ent = container_of(*from, Entry, node);
+    if(snap->zkey.empty() && ent->snap_epoch[snap->kind] != g_data.snap_epoch[snap->kind]){
+        snap_emit(snap, ent, false);
+    }
+}
+
+// scan for up to `budget_us`, true once every entry is encoded
+static bool snap_scan(SnapScan* snap, uint64_t budget_us){
+    HMap* db = snap_db(snap);
+    uint64_t start_us = get_monotonic_usec();
+    bool done = false;
+    for(size_t steps = 1; !done; ++steps){
+        if(!snap->zkey.empty()){
+            snap_zset_step(snap, k_snap_inline_members);
+        }else{
+            if(snap->cursor == 0){
+                snap->pass_stable = db->older.tab == nullptr;
+                snap->pass_tab = db->newer.tab;
+            }
+            size_t next = hm_scan(db, snap->cursor, &cb_snap_key, snap);
+            if(!snap->zkey.empty()){
+                continue; // scan this slot again once the zset is done
+            }
+            snap->cursor = next;
+            // a resize during the pass may have moved entries behind the
+            // cursor, then another pass picks them up
+            done = next == 0 && snap->pass_stable && db->older.tab == nullptr
+                && db->newer.tab == snap->pass_tab;
+        }
+        if(steps % 16 == 0 && get_monotonic_usec() - start_us >= budget_us){
+            break;
+        }
+    }
+    snap->pause_us = std::max(snap->pause_us, get_monotonic_usec() - start_us);
+    snap->scanning = !done;
+    return done;
+}
+
+// BGSAVE puts each record in its section, the thread pool sorts them by
+// hcode before writing the file
+static std::string &bgsave_sink_buf(void* arg, uint64_t hcode){
+    RdbJob* job = (RdbJob*)arg;
+    return job->sects[hcode & (job->sects.size() - 1)].data;
+}
+
+static void bgsave_sink_added(void* arg, uint64_t hcode, size_t offset){
+    RdbJob* job = (RdbJob*)arg;
+    RdbIndexEntry rec;
+    rec.hcode = hcode;
+    rec.offset = offset;
+    job->recs[hcode & (job->sects.size() - 1)].push_back(rec);
+}
+
+// the copy is complete, write it on the thread pool
+static void bgsave_scan_done(RdbJob* job){
+    if(job->scan.db){
+        // the keyspace a flush detached isn't needed anymore
+        lazyfree_queue(&db_del_func, job->scan.db, 0);
+        job->scan.db = nullptr;
+        std::vector<HeapItem>().swap(job->scan.heap);
+    }
+    if(!job->scan.err.empty()){
+        job->err = job->scan.err;
+    }
+    g_data.stat_fork_usec = job->scan.pause_us;
+    g_data.stat_rdb_cow_bytes = 0;
+    for(size_t i = 0; i < job->sects.size(); ++i){
+        // and the index it will have
+        g_data.stat_rdb_cow_bytes += job->sects[i].data.size() + job->recs[i].size() * 16;
+    }
+    if(!job->err.empty()){
+        job->done.done = true; // nothing to write
+        return;
+    }
+    thread_pool_submit(&g_data.thread_pool, TP_PRIO_NORMAL, &rdb_save_func, job, &job->done);
+}
+
+// a flush detached the keyspace, the scan goes on with it. false if no
+// BGSAVE needs it
+static bool bgsave_adopt(HMap* db, std::vector<HeapItem> &heap){
+    RdbJob* job = g_data.bgsave_job;
+    if(!job || !job->scan.scanning || job->scan.db){
+        return false; // the keys of a second flush came after the start
+    }
+    job->scan.db = db;
+    job->scan.heap.swap(heap);
+    return true;
+}
+
+// bgsave
+static void do_bgsave(std::vector<std::string>&, Ring_buf &buf){
+    if(g_data.bgsave_job){
+        return out_err(buf, ERR_BUSY, "background save already in progress");
+    }
+    RdbJob* job = new RdbJob();
+    job->path = g_conf.dbfilename;
+    job->start_us = get_monotonic_usec();
+    size_t nparts = hm_size(&g_data.db) >= k_rdb_parallel_min ? k_rdb_parts : 1;
+    job->sects.resize(nparts);
+    job->recs.resize(nparts);
+    SnapSink sink;
+    sink.buf = &bgsave_sink_buf;
+    sink.added = &bgsave_sink_added;
+    sink.arg = job;
+    snap_start(&job->scan, SNAP_BGSAVE, sink);
+    g_data.bgsave_job = job;
+    const char* reply = "Background saving started";
+    return out_str(buf, reply, strlen(reply));
+}
+
+// called by the timers until the BGSAVE is done
+static void bgsave_cycle(){
+    RdbJob* job = g_data.bgsave_job;
+    if(job && job->scan.scanning){
+        if(snap_scan(&job->scan, k_snap_budget_us)){
+            bgsave_scan_done(job);
+        }
+        return;
+    }
+    if(!job || !tp_future_done(&job->done)){
+        return;
+    }
+    g_data.rdb_last_bgsave_ok = job->ok;
+    g_data.rdb_last_bgsave_usec = get_monotonic_usec() - job->start_us;
+    if(job->ok){
+        g_data.rdb_last_save_time = get_wall_msec() / 1000;
+    }else{
+        fprintf(stderr, "background save failed: %s\n", job->err.c_str());
+    }
+    delete job;
+    g_data.bgsave_job = nullptr;
+}
+
+// one record after the type byte, false if it's malformed. `*out` is the new
+// entry (null if it expired while the server was down), not in the keyspace
+// yet, and `*ttl_ms` its TTL or -1.
+static bool rdb_load_entry(RdbReader* r, uint8_t type, uint64_t wall_ms,
+    std::vector<ZAddItem> &items, Entry** out, int64_t* ttl_ms)
+{
+    *out = nullptr;
+    *ttl_ms = -1;
+    uint8_t flags = 0;
+    uint64_t expire_at = 0;
+    const char* key = nullptr;
+    size_t key_len = 0;
+    if(!rdb_get_u8(r, &flags)
+        || ((flags & RDB_FLAG_TTL) && !rdb_get_u64(r, &expire_at))
+        || !rdb_get_str(r, &key, &key_len))
+    {
+        return false;
+    }
+    const char* str = nullptr;
+    size_t str_len = 0;
+    items.clear();
+    if(type == RDB_TYPE_STR){
+        if(!rdb_get_str(r, &str, &str_len)){
+            return false;
+        }
+    }else if(type == RDB_TYPE_ZSET){
+        uint64_t n = 0;
+        // a member takes at least 9 bytes
+        if(!rdb_get_varint(r, &n) || n > (uint64_t)(r->end - r->pos) / 9){
+            return false;
+        }
+        items.resize((size_t)n);
+        for(ZAddItem &item : items){
+            if(!rdb_get_dbl(r, &item.score) || !rdb_get_str(r, &item.name, &item.len)){
+                return false;
+            }
+        }
+    }else{
+        return false;
+    }
+    if((flags & RDB_FLAG_TTL) && expire_at <= wall_ms){
+        return true; // expired while the server was down
+    }
+
+    Entry* ent = entry_new(type == RDB_TYPE_ZSET ? T_ZSET : T_STR);
+    ent->key.assign(key, key_len);
+    ent->node.hcode = str_hash((const uint8_t*)key, key_len);
+    // sorted already, one bulk index build
+    if(type == RDB_TYPE_STR){
+        ent->str.assign(str, str_len);
+    }else if(!zset_insert_sorted(ent->zset, items.data(), items.size())){
+        entry_del_sync(ent);
+        return false;
+    }
+    *out = ent;
+    if(flags & RDB_FLAG_TTL){
+        *ttl_ms = (int64_t)(expire_at - wall_ms);
+    }
+    return true;
+}
+
+// the records of a stream up to and including RDB_OP_EOF, or up to the end
+// of the input if that comes first between two records. `*eof` tells which.
+static bool rdb_load_part(RdbReader* r, bool* eof){
+    uint64_t wall_ms = get_wall_msec();
+    std::vector<ZAddItem> items;
+    uint8_t type = 0;
+    *eof = false;
+    while(r->pos < r->end && rdb_get_u8(r, &type)){
+        if(type == RDB_OP_EOF){
+            *eof = true;
+            break;
+        }
+        Entry* ent = nullptr;
+        int64_t ttl_ms = -1;
+        if(!rdb_load_entry(r, type, wall_ms, items, &ent, &ttl_ms)){
+            r->err = true;
+            break;
+        }
+        if(ent){
+            db_insert(ent);
+            entry_set_ttl(ent, ttl_ms);
+        }
+    }
+    return !r->err;
+}
+
+// the records of a stream up to and including RDB_OP_EOF
+static bool rdb_load_records(RdbReader* r){
+    bool eof = false;
+    return rdb_load_part(r, &eof) && eof;
+}
+
+// sections decode on the thread pool straight into g_data.db, presized for
+// all keys with at least one slot per section, so the sections fill disjoint
+// slots and nothing is rehashed. the TTLs are collected per section and
+// become the heap at the end.
+struct RdbLoad{
+    const RdbFile* file = nullptr;
+    const std::vector<RdbSectionInfo>* sects = nullptr;
+    uint64_t wall_ms = 0;
+    uint64_t now_ms = 0;
+    std::vector<size_t> nkeys;                // per section, inserted
+    std::vector<std::vector<HeapItem>> ttls;  // per section
+    std::vector<char> ok;                     // per section
+};
+
+static void rdb_load_section(void* arg, size_t i){
+    RdbLoad* ld = (RdbLoad*)arg;
+    const RdbSectionInfo &sect = (*ld->sects)[i];
+    const uint8_t* data = ld->file->data + sect.offset;
+    if(crc64(0, data, (size_t)sect.size) != sect.crc){
+        return;
+    }
+    size_t mask = ld->sects->size() - 1;
+    RdbReader r;
+    r.pos = data;
+    r.end = ld->file->data + sect.index;
+    std::vector<ZAddItem> items;
+    uint64_t nrecords = 0;
+    uint8_t type = 0;
+    while(r.pos < r.end){
+        Entry* ent = nullptr;
+        int64_t ttl_ms = -1;
+        if(!rdb_get_u8(&r, &type) || !rdb_load_entry(&r, type, ld->wall_ms, items, &ent, &ttl_ms)){
+            return;
+        }
+        nrecords++;
+        if(!ent){
+            continue;
+        }
+        if((ent->node.hcode & mask) != i){
+            entry_del_sync(ent); // would share slots with another section
+            return;
+        }
+        hm_insert_part(&g_data.db, &ent->node);
+        ld->nkeys[i]++;
+        if(ttl_ms >= 0){
+            HeapItem item = {ld->now_ms + (uint64_t)ttl_ms, &ent->heap_idx};
+            ld->ttls[i].push_back(item);
+        }
+    }
+    ld->ok[i] = nrecords == sect.nkeys;
+}
+
+static bool heap_item_less(const HeapItem &lhs, const HeapItem &rhs){
+    return lhs.val < rhs.val;
+}
+
+static bool cb_link_slot(HNode* node, void*){
+    Entry* ent = container_of(node, Entry, node);
+    uint32_t slot = entry_slot(ent);
+    dlist_insert_before(&g_data.slot_keys[slot], entry_slot_node(ent));
+    g_data.slot_nkeys[slot]++;
+    return true;
+}
+
+static bool rdb_load_sections(const RdbFile &file, const std::vector<RdbSectionInfo> &sects){
+    RdbLoad ld;
+    ld.file = &file;
+    ld.sects = &sects;
+    ld.wall_ms = get_wall_msec();
+    ld.now_ms = get_monotonic_msec();
+    ld.nkeys.assign(sects.size(), 0);
+    ld.ttls.resize(sects.size());
+    ld.ok.assign(sects.size(), 0);
+    size_t total = 0;
+    for(const RdbSectionInfo &sect : sects){
+        total += (size_t)sect.nkeys;
+    }
+    assert(hm_size(&g_data.db) == 0);
+    hm_reserve_parts(&g_data.db, total, sects.size());
+    thread_pool_run(&g_data.thread_pool, sects.size(), &rdb_load_section, &ld);
+
+    bool ok = true;
+    for(size_t i = 0; i < sects.size(); ++i){
+        hm_add_count(&g_data.db, ld.nkeys[i]);
+        ok = ok && ld.ok[i];
+    }
+    if(!ok){
+        return false;
+    }
+    if(g_conf.cluster_enabled){
+        // the slot lists are shared by all the sections
+        hm_foreach(&g_data.db, &cb_link_slot, nullptr);
+    }
+    // a sorted array is a valid min-heap
+    std::vector<HeapItem> &heap = g_data.heap;
+    for(std::vector<HeapItem> &ttl : ld.ttls){
+        heap.insert(heap.end(), ttl.begin(), ttl.end());
+    }
+    std::sort(heap.begin(), heap.end(), &heap_item_less);
+    for(size_t i = 0; i < heap.size(); ++i){
+        *heap[i].ref = i;
+    }
+    return true;
+}
+
+// load the snapshot at startup, a missing file is an empty keyspace
+static bool rdb_load(const std::string &path){
+    if(access(path.c_str(), 0) != 0){
+        return true;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    std::string err;
+    RdbFile file;
+    if(!rdb_map_file(path, &file, err)){
+        fprintf(stderr, "can't load %s: %s\n", path.c_str(), err.c_str());
+        return false;
+    }
+    bool ok = false;
+    RdbReader r;
+    std::vector<RdbSectionInfo> sects;
+    if(file.size >= sizeof(k_rdb_magic) && memcmp(file.data, k_rdb_magic, sizeof(k_rdb_magic)) == 0){
+        // the older format, one stream of records
+        ok = rdb_read_stream(file, &r, err);
+        if(ok && (!rdb_load_records(&r) || r.pos != r.end)){
+            ok = false;
+            err = "bad record";
+        }
+    }else if(rdb_read_sections(file, sects, err)){
+        ok = rdb_load_sections(file, sects);
+        if(!ok){
+            err = "bad section";
+        }
+    }
+    size_t size = file.size;
+    rdb_unmap_file(&file);
+    if(!ok){
+        fprintf(stderr, "can't load %s: %s\n", path.c_str(), err.c_str());
+        return false;
+    }
+    uint64_t usec = get_monotonic_usec() - start_us;
+    fprintf(stderr, "loaded %zu keys from %s in %llu ms (%zu sections, %.1f MB/s)\n",
+        hm_size(&g_data.db), path.c_str(), (unsigned long long)usec / 1000,
+        sects.empty() ? (size_t)1 : sects.size(), (double)size / (usec + 1));
+    return true;
+}
+
+// warm start: serve while the snapshot loads. the thread pool decodes the
+// records in batches, in file order, and the event loop adds them to the
+// keyspace between requests. a command on a key that isn't loaded yet loads it
+// first through the section index (warm_fault()). from then on the key belongs
+// to the commands, and its copy in a batch is dropped. commands that need the
+// whole keyspace get ERR_BUSY until the end. a section's checksum is checked
+// once its batches are handed out, so keys loaded on demand are served before.
+
+const size_t k_warm_batch_keys = 4096;
+const size_t k_warm_max_jobs = 8; // in flight, more than the pool has threads
+const uint64_t k_warm_tick_ms = 1;
+const uint64_t k_warm_budget_us = 1000; // splicing per tick
+
+// part of the snapshot is served already, there is no keyspace to fall back to
+static void warm_fatal(const char* what){
+    fprintf(stderr, "can't load %s: %s\n", g_data.warm->path.c_str(), what);
+    exit(1);
+}
+
+// the key of a record, the rest isn't decoded
+static bool rdb_get_key(RdbReader r, const char** key, size_t* len){
+    uint8_t type = 0, flags = 0;
+    uint64_t expire_at = 0;
+    return rdb_get_u8(&r, &type) && rdb_get_u8(&r, &flags)
+        && (!(flags & RDB_FLAG_TTL) || rdb_get_u64(&r, &expire_at))
+        && rdb_get_str(&r, key, len);
+}
+
+// on the thread pool, only reads the mapped file
+static void warm_decode(void* arg){
+    WarmJob* job = (WarmJob*)arg;
+    const WarmLoad* wl = job->wl;
+    const RdbSectionInfo &sect = wl->sects[job->sect];
+    if(job->first == job->last){
+        job->ok = crc64(0, wl->file.data + sect.offset, (size_t)sect.size) == sect.crc;
+        job->done.store(true, std::memory_order_release);
+        return;
+    }
+    size_t mask = wl->sects.size() - 1;
+    std::vector<ZAddItem> items;
+    job->items.reserve(job->last - job->first);
+    job->ok = true;
+    for(size_t i = job->first; i < job->last && job->ok; ++i){
+        RdbIndexEntry e;
+        if(!rdb_index_at(wl->file, sect, i, &e)){
+            job->ok = false;
+            break;
+        }
+        RdbReader r;
+        r.pos = wl->file.data + e.offset;
+        r.end = wl->file.data + sect.index;
+        uint8_t type = 0;
+        WarmItem item;
+        item.idx = i;
+        job->ok = rdb_get_u8(&r, &type)
+            && rdb_load_entry(&r, type, job->wall_ms, items, &item.ent, &item.ttl_ms);
+        if(job->delay_us){
+            usleep(job->delay_us);
+        }
+        if(item.ent){
+            job->items.push_back(item);
+            // the index or another section would miss it
+            job->ok = job->ok && item.ent->node.hcode == e.hcode && (e.hcode & mask) == job->sect;
+        }
+    }
+    job->done.store(true, std::memory_order_release);
+}
+
+// add a finished batch to the keyspace
+static void warm_splice(WarmJob* job){
+    WarmLoad* wl = g_data.warm;
+    if(!job->ok){
+        warm_fatal(job->first == job->last ? "bad section checksum" : "bad record");
+    }
+    std::vector<bool> &done = wl->done[job->sect];
+    int64_t elapsed = (int64_t)(get_wall_msec() - job->wall_ms);
+    for(WarmItem &item : job->items){
+        if(done[item.idx] || (item.ttl_ms >= 0 && item.ttl_ms <= elapsed)){
+            entry_del(item.ent); // settled by a command meanwhile, or expired
+            continue;
+        }
+        done[item.idx] = true;
+        db_insert(item.ent);
+        entry_set_ttl(item.ent, item.ttl_ms >= 0 ? item.ttl_ms - elapsed : -1);
+        wl->loaded_keys++;
+    }
+}
+
+static void warm_end(){
+    WarmLoad* wl = g_data.warm;
+    fprintf(stderr, "loaded %zu keys from %s in %llu ms, %zu of them on demand\n",
+        wl->loaded_keys + wl->faulted_keys, wl->path.c_str(),
+        (unsigned long long)(get_monotonic_usec() - wl->start_us) / 1000, wl->faulted_keys);
+    rdb_unmap_file(&wl->file);
+    delete wl;
+    g_data.warm = nullptr;
+}
+
+// called by the timers: collect the finished jobs and keep the pool busy
+static void warm_cycle(){
+    WarmLoad* wl = g_data.warm;
+    if(!wl){
+        return;
+    }
+    std::vector<WarmJob*> &jobs = wl->jobs;
+    uint64_t start_us = get_monotonic_usec();
+    size_t n = 0;
+    for(WarmJob* job : jobs){
+        if(get_monotonic_usec() - start_us < k_warm_budget_us
+            && job->done.load(std::memory_order_acquire))
+        {
+            warm_splice(job);
+            delete job;
+        }else{
+            jobs[n++] = job;
+        }
+    }
+    jobs.resize(n);
+    while(jobs.size() < k_warm_max_jobs && wl->sect < wl->sects.size()){
+        WarmJob* job = new WarmJob();
+        job->wl = wl;
+        job->sect = wl->sect;
+        job->wall_ms = get_wall_msec();
+        job->delay_us = g_conf.key_load_delay;
+        job->first = wl->next;
+        job->last = std::min(wl->next + k_warm_batch_keys, (size_t)wl->sects[wl->sect].nkeys);
+        if(job->first == job->last){
+            // every batch is out, this job checks the checksum
+            wl->sect++;
+            wl->next = 0;
+        }else{
+            wl->next = job->last;
+        }
+        jobs.push_back(job);
+        thread_pool_queue(&g_data.thread_pool, &warm_decode, job);
+    }
+    if(jobs.empty()){
+        warm_end();
+    }
+}
+
+// load a key the batches haven't got to yet, null if there is no such key
+static HNode* warm_fault(LookupKey &key){
+    WarmLoad* wl = g_data.warm;
+    uint64_t hcode = key.node.hcode;
+    size_t s = hcode & (wl->sects.size() - 1);
+    const RdbSectionInfo &sect = wl->sects[s];
+    std::vector<ZAddItem> items;
+    for(size_t i = rdb_index_lower_bound(wl->file, sect, hcode); i < sect.nkeys; ++i){
+        RdbIndexEntry e;
+        if(!rdb_index_at(wl->file, sect, i, &e)){
+            warm_fatal("bad index");
+        }
+        if(e.hcode != hcode){
+            break;
+        }
+        if(wl->done[s][i]){
+            continue; // loaded, maybe deleted since
+        }
+        RdbReader r;
+        r.pos = wl->file.data + e.offset;
+        r.end = wl->file.data + sect.index;
+        const char* name = nullptr;
+        size_t len = 0;
+        if(!rdb_get_key(r, &name, &len)){
+            warm_fatal("bad record");
+        }
+        if(len != key.key.size() || memcmp(name, key.key.data(), len) != 0){
+            continue; // a hash collision
+        }
+        uint8_t type = 0;
+        Entry* ent = nullptr;
+        int64_t ttl_ms = -1;
+        if(!rdb_get_u8(&r, &type) || !rdb_load_entry(&r, type, get_wall_msec(), items, &ent, &ttl_ms)){
+            warm_fatal("bad record");
+        }
+        wl->done[s][i] = true;
+        if(!ent){
+            return nullptr; // expired
+        }
+        db_insert(ent);
+        entry_set_ttl(ent, ttl_ms);
+        wl->faulted_keys++;
+        return &ent->node;
+    }
+    return nullptr;
+}
+
+// start serving before the snapshot is loaded, a missing file is an empty keyspace
+static bool warm_start(const std::string &path){
+    if(access(path.c_str(), 0) != 0){
+        return true;
+    }
+    WarmLoad* wl = new WarmLoad();
+    wl->path = path;
+    std::string err;
+    bool stream = false;
+    if(rdb_map_file(path, &wl->file, err)){
+        stream = wl->file.size >= sizeof(k_rdb_magic)
+            && memcmp(wl->file.data, k_rdb_magic, sizeof(k_rdb_magic)) == 0;
+        if(stream || rdb_read_sections(wl->file, wl->sects, err)){
+            err.clear();
+        }
+    }
+    if(stream || !err.empty()){
+        rdb_unmap_file(&wl->file);
+        delete wl;
+        if(stream){
+            return rdb_load(path); // no index, load it all
+        }
+        fprintf(stderr, "can't load %s: %s\n", path.c_str(), err.c_str());
+        return false;
+    }
+    wl->done.resize(wl->sects.size());
+    for(size_t i = 0; i < wl->sects.size(); ++i){
+        wl->done[i].assign((size_t)wl->sects[i].nkeys, false);
+        wl->total_keys += (size_t)wl->sects[i].nkeys;
+    }
+    wl->start_us = get_monotonic_usec();
+    hm_reserve(&g_data.db, wl->total_keys);
+    g_data.warm = wl;
+    fprintf(stderr, "serving while loading %zu keys from %s\n", wl->total_keys, path.c_str());
+    return true;
+}
+
+// the append-only file. write commands are encoded into aof_buf as they run
+// and written once per event loop tick, before sleeping. with appendfsync
+// always the replies of the tick are held until one fsync covers all of
+// them (group commit), with everysec a thread pool job fsyncs once a second.
+
+const uint64_t k_aof_fsync_interval_ms = 1000;
+const uint64_t k_aof_retry_ms = 10;
+
+// AOF rewrite without fork(): the keyspace is scanned over many ticks into a
+// snapshot preamble like BGSAVE's, see snap_scan(), and the commands since
+// the start are appended after it. entries created since the start count as
+// done, their commands are in the tail.
+
+enum{
+    REWRITE_SCAN = 0,  // writing the preamble
+    REWRITE_FSYNC = 1, // the thread pool syncs the file, then it's swapped in
+};
+
+const size_t k_rewrite_chunk = 1 << 20;
+
+// write out the preamble buffer
+static void rewrite_write(const char* data, size_t len){
+    size_t written = 0;
+    if(!g_data.rewrite_failed && !aof_write(g_data.rewrite_fd, data, len, &written)){
+        fprintf(stderr, "can't write the rewritten append-only file\n");
+        g_data.rewrite_failed = true;
+    }
+    g_data.rewrite_size += written;
+}
+
+static void rewrite_flush_out(){
+    std::string &out = g_data.rewrite_out;
+    g_data.rewrite_crc = crc64(g_data.rewrite_crc, out.data(), out.size());
+    rewrite_write(out.data(), out.size());
+    out.clear();
+}
+
+// the preamble is one stream, written out in chunks
+static std::string &rewrite_sink_buf(void*, uint64_t){
+    return g_data.rewrite_out;
+}
+
+static void rewrite_sink_added(void*, uint64_t, size_t){
+    if(g_data.rewrite_out.size() >= k_rewrite_chunk){
+        rewrite_flush_out();
+    }
+}
+
+// replication: the primary sends its replicas the same commands as go to
+// the append-only file. the backlog exists from the first replica on, and a
+// replica passes on the primary's stream byte for byte (repl_apply()), so
+// the offsets mean the same on every server of the same history.
+// a new history, 40 hex digits
+static std::string repl_new_id(){
+    std::random_device rd;
+    std::string id;
+    while(id.size() < 40){
+        char tmp[9];
+        snprintf(tmp, sizeof(tmp), "%08x", (unsigned)rd());
+        id += tmp;
+    }
+    return id;
+}
+
+static bool repl_feeding(){
+    return !g_data.repl_backlog.buf.empty() && !g_data.repl_applying;
+}
+
+static void repl_feed(const char* data, size_t len){
+    ReplBacklog &bl = g_data.repl_backlog;
+    backlog_append(&bl, data, len);
+    if(g_data.replicas.empty()){
+        return;
+    }
+    const size_t k_repl_samples_max = 1 << 16;
+    uint64_t now_ms = get_monotonic_msec();
+    std::deque<ReplSample> &samples = g_data.repl_samples;
+    if(!samples.empty() && samples.back().ms == now_ms){
+        samples.back().offset = bl.offset;
+    }else{
+        samples.push_back(ReplSample{bl.offset, now_ms});
+        if(samples.size() > k_repl_samples_max){
+            samples.pop_front();
+        }
+    }
+    if(g_data.repl_sync_job){
+        g_data.repl_sync_job->tail.append(data, len);
+    }
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync != REPL_SYNC_NONE){
+            continue; // after its snapshot
+        }
+        buf_append(conn->outgoing, (const uint8_t*)data, len);
+        conn->want_write = true;
+    }
+}
+
+// encode a write command before it runs, the handlers consume `cmd`
+static bool aof_prepare(const std::vector<std::string> &cmd){
+    g_data.aof_cmd.clear();
+    if(cmd.empty() || !cmd_is_write(cmd[0]) || (cmd.size() < 2 && cmd[0] != "flushall")){
+        return false; // the latter fail anyway
+    }
+    snap_save_cmd(cmd);
+    if(g_data.aof_loading || (g_data.aof_fd < 0 && !g_data.rewrite_running && !repl_feeding())){
+        return false;
+    }
+    int64_t ttl_ms = 0;
+    if(cmd[0] == "pexpire" && cmd.size() == 3 && str2int(cmd[2], ttl_ms) && ttl_ms >= 0){
+        // the replay happens at another time
+        std::string at = std::to_string(get_wall_msec() + (uint64_t)ttl_ms);
+        aof_put_cmd(g_data.aof_cmd, {"pexpireat", cmd[1], at});
+    }else{
+        aof_put_cmd(g_data.aof_cmd, cmd);
+    }
+    return true;
+}
+
+// after it ran, after any keys it expired or evicted. a failed command
+// changed nothing.
+static void aof_commit(bool failed){
+    if(!failed){
+        if(g_data.aof_fd >= 0){
+            g_data.aof_buf += g_data.aof_cmd;
+        }
+        if(g_data.rewrite_running){
+            g_data.rewrite_buf += g_data.aof_cmd;
+        }
+        if(repl_feeding()){
+            repl_feed(g_data.aof_cmd.data(), g_data.aof_cmd.size());
+        }
+    }
+    g_data.aof_cmd.clear();
+}
+
+// keys removed by expiration, eviction or migration
+static void aof_feed_del(Entry* ent){
+    snap_save_entry(ent);
+    if(g_data.aof_loading){
+        return;
+    }
+    if(g_data.rewrite_running){
+        aof_put_cmd(g_data.rewrite_buf, {"del", ent->key});
+    }
+    if(g_data.aof_fd >= 0){
+        aof_put_cmd(g_data.aof_buf, {"del", ent->key});
+    }
+    if(repl_feeding()){
+        std::string del;
+        aof_put_cmd(del, {"del", ent->key});
+        repl_feed(del.data(), del.size());
+    }
+}
+
+// the replies wait for the group fsync
+static bool aof_hold_replies(){
+    return g_data.aof_fd >= 0 && g_conf.appendfsync == AOF_FSYNC_ALWAYS && !g_data.aof_buf.empty();
+}
+
+static void aof_fsync_func(void* arg){
+    file_fsync((int)(intptr_t)arg);
+    g_data.stat_aof_fsyncs++;
+    g_data.aof_fsync_pending.store(false, std::memory_order_release);
+}
+
+// before sleeping
+static void aof_flush(){
+    if(g_data.aof_fd < 0){
+        return;
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    if(!g_data.aof_buf.empty()){
+        size_t written = 0;
+        bool ok = aof_write(g_data.aof_fd, g_data.aof_buf.data(), g_data.aof_buf.size(), &written);
+        g_data.aof_size += written;
+        g_data.aof_buf.erase(0, written);
+        if(written){
+            g_data.aof_dirty = true;
+        }
+        if(!ok){
+            if(g_conf.appendfsync == AOF_FSYNC_ALWAYS){
+                die("can't write the append-only file with appendfsync always");
+            }
+            if(g_data.aof_last_write_ok){
+                fprintf(stderr, "can't write the append-only file, retrying\n");
+            }
+            g_data.aof_last_write_ok = false;
+            return;
+        }
+        g_data.aof_last_write_ok = true;
+    }
+    if(!g_data.aof_dirty){
+        return;
+    }
+    if(g_conf.appendfsync == AOF_FSYNC_ALWAYS){
+        if(!file_fsync(g_data.aof_fd)){
+            die("can't fsync the append-only file with appendfsync always");
+        }
+        g_data.stat_aof_fsyncs++;
+        g_data.aof_dirty = false;
+        g_data.aof_last_fsync_ms = now_ms;
+    }else if(g_conf.appendfsync == AOF_FSYNC_EVERYSEC
+        && now_ms >= g_data.aof_last_fsync_ms + k_aof_fsync_interval_ms
+        && !g_data.aof_fsync_pending.load(std::memory_order_acquire))
+    {
+        g_data.aof_fsync_pending.store(true);
+        g_data.aof_dirty = false;
+        g_data.aof_last_fsync_ms = now_ms;
+        thread_pool_queue(&g_data.thread_pool, &aof_fsync_func, (void*)(intptr_t)g_data.aof_fd);
+    }
+}
+
+static bool rewrite_start(std::string &err){
+    if(g_data.rewrite_running){
+        err = "rewrite already in progress";
+        return false;
+    }
+    std::string tmp = g_conf.appendfilename + ".rewrite";
+    remove(tmp.c_str());
+    if(!aof_open(tmp, &g_data.rewrite_fd, err)){
+        return false;
+    }
+    g_data.rewrite_running = true;
+    g_data.rewrite_stage = REWRITE_SCAN;
+    SnapSink sink;
+    sink.buf = &rewrite_sink_buf;
+    sink.added = &rewrite_sink_added;
+    snap_start(&g_data.rewrite_scan, SNAP_REWRITE, sink);
+    g_data.rewrite_failed = false;
+    g_data.rewrite_size = 0;
+    g_data.rewrite_out.assign(k_rdb_magic, sizeof(k_rdb_magic));
+    g_data.rewrite_crc = 0;
+    g_data.rewrite_buf.clear();
+    g_data.rewrite_start_us = get_monotonic_usec();
+    return true;
+}
+
+static void rewrite_end(bool ok){
+    if(g_data.rewrite_fd >= 0){
+        aof_close(g_data.rewrite_fd);
+        g_data.rewrite_fd = -1;
+        std::string tmp = g_conf.appendfilename + ".rewrite";
+        remove(tmp.c_str());
+    }
+    g_data.rewrite_running = false;
+    g_data.aof_last_rewrite_ok = ok;
+    g_data.aof_last_rewrite_usec = get_monotonic_usec() - g_data.rewrite_start_us;
+    if(ok){
+        g_data.stat_aof_rewrites++;
+    }else if(g_data.aof_fd < 0){
+        g_conf.appendonly = false; // it was being turned on
+    }
+    std::string().swap(g_data.rewrite_out);
+    std::string().swap(g_data.rewrite_buf);
+    g_data.rewrite_scan = SnapScan();
+}
+
+static void rewrite_fsync_func(void* arg){
+    if(!file_fsync((int)(intptr_t)arg)){
+        g_data.rewrite_failed = true;
+    }
+}
+
+// the preamble is complete, sync it with the commands so far
+static void rewrite_base_done(){
+    if(!g_data.rewrite_scan.err.empty()){
+        fprintf(stderr, "rewrite failed: %s\n", g_data.rewrite_scan.err.c_str());
+        g_data.rewrite_failed = true;
+    }
+    g_data.rewrite_out.push_back((char)RDB_OP_EOF);
+    rewrite_flush_out();
+    uint64_t crc = g_data.rewrite_crc;
+    rewrite_write((const char*)&crc, 8);
+    rewrite_write(g_data.rewrite_buf.data(), g_data.rewrite_buf.size());
+    g_data.rewrite_buf.clear();
+    if(g_data.rewrite_failed){
+        return rewrite_end(false);
+    }
+    g_data.rewrite_stage = REWRITE_FSYNC;
+    thread_pool_submit(&g_data.thread_pool, TP_PRIO_NORMAL, &rewrite_fsync_func,
+        (void*)(intptr_t)g_data.rewrite_fd, &g_data.rewrite_fsync);
+}
+
+// append the last commands and replace the log
+static void rewrite_switch(){
+    if(g_data.aof_fsync_pending.load(std::memory_order_acquire)){
+        return; // the old file is in use, next tick
+    }
+    rewrite_write(g_data.rewrite_buf.data(), g_data.rewrite_buf.size());
+    g_data.rewrite_buf.clear();
+    if(g_data.rewrite_failed){
+        return rewrite_end(false);
+    }
+    // Windows can't rename open files
+    aof_close(g_data.rewrite_fd);
+    g_data.rewrite_fd = -1;
+    bool was_on = g_data.aof_fd >= 0;
+    if(was_on){
+        aof_close(g_data.aof_fd);
+        g_data.aof_fd = -1;
+    }
+    const std::string &path = g_conf.appendfilename;
+    std::string tmp = path + ".rewrite", err;
+    if(!file_rename(tmp, path)){
+        fprintf(stderr, "can't rename %s to %s\n", tmp.c_str(), path.c_str());
+        remove(tmp.c_str());
+        if(was_on && !aof_open(path, &g_data.aof_fd, err)){
+            die("can't reopen the append-only file");
+        }
+        return rewrite_end(false);
+    }
+    if(g_conf.appendonly && !aof_open(path, &g_data.aof_fd, err)){
+        die("can't reopen the append-only file");
+    }
+    g_data.aof_buf.clear(); // these commands are in the tail already
+    g_data.aof_size = g_data.aof_base_size = g_data.rewrite_size;
+    g_data.aof_dirty = true; // the tail isn't synced
+    rewrite_end(true);
+}
+
+static bool rewrite_wanted(){
+    size_t base = g_data.aof_base_size;
+    return g_data.aof_fd >= 0 && g_conf.auto_aof_rewrite_percentage > 0
+        && g_data.aof_size >= g_conf.auto_aof_rewrite_min_size
+        && g_data.aof_size >= base + base / 100 * g_conf.auto_aof_rewrite_percentage;
+}
+
+// incremental AOF rewrite: scan the keyspace into the preamble within a time
+// budget per tick, then swap the file in once the thread pool synced it
+static void rewrite_cycle(){
+    if(!g_data.rewrite_running){
+        std::string err;
+        if(rewrite_wanted() && !rewrite_start(err)){
+            fprintf(stderr, "can't start the AOF rewrite: %s\n", err.c_str());
+            g_data.aof_base_size = g_data.aof_size; // don't retry every tick
+        }
+        return;
+    }
+    if(g_data.rewrite_stage == REWRITE_FSYNC){
+        if(tp_future_done(&g_data.rewrite_fsync)){
+            g_data.rewrite_failed ? rewrite_end(false) : rewrite_switch();
+        }
+        return;
+    }
+    if(snap_scan(&g_data.rewrite_scan, k_snap_budget_us)){
+        rewrite_base_done();
+    }
+}
+
+// bgrewriteaof
+static void do_bgrewriteaof(std::vector<std::string>&, Ring_buf &buf){
+    std::string err;
+    if(!rewrite_start(err)){
+        return out_err(buf, g_data.rewrite_running ? ERR_BUSY : ERR_IO, err);
+    }
+    const char* reply = "Background append only file rewriting started";
+    return out_str(buf, reply, strlen(reply));
+}
+
+static void info_memory(std::string &out){
+    SlabStats st;
+    slab_stats(&st);
+    size_t used = used_memory();
+    size_t rss = zmalloc_get_rss();
+
+    size_t clients = 0;
+    for(auto &kv : g_data.fd2conn_map){
+        clients += sizeof(Conn) + kv.second->incoming.cap + kv.second->outgoing.cap;
+    }
+
+    out += "# Memory\r\n";
+    append_mem(out, "used_memory", used);
+    append_mem(out, "used_memory_rss", rss);
+    append_mem(out, "maxmemory", g_conf.maxmemory);
+    append_fmt(out, "maxmemory_policy:%s\r\n", k_policy_names[g_conf.maxmemory_policy]);
+    append_fmt(out, "mem_fragmentation_ratio:%.2f\r\n", used ? (double)rss / used : 0.0);
+    append_fmt(out, "mem_allocator_bytes:%zu\r\n", zmalloc_used_memory());
+    append_fmt(out, "mem_slab_used:%zu\r\n", st.used_bytes);
+    append_fmt(out, "mem_slab_reserved:%zu\r\n", st.reserved_bytes);
+    append_fmt(out, "mem_slab_fragmentation_ratio:%.2f\r\n",
+        st.used_bytes ? (double)st.reserved_bytes / st.used_bytes : 0.0);
+    append_fmt(out, "mem_keyspace_table:%zu\r\n", hm_mem_usage(&g_data.db));
+    append_fmt(out, "mem_ttl_heap:%zu\r\n", g_data.heap.capacity() * sizeof(HeapItem));
+    append_fmt(out, "mem_clients:%zu\r\n", clients);
+    append_fmt(out, "mem_entry_size:%zu\r\n", slab_usable_size(entry_size()));
+    append_fmt(out, "lazyfree_pending_objects:%llu\r\n", (unsigned long long)g_data.lazyfree_pending.load());
+    append_mem(out, "lazyfree_pending", (size_t)g_data.lazyfree_pending_bytes.load());
+    append_fmt(out, "active_defrag_running:%d\r\n", g_data.defrag_running ? 1 : 0);
+    append_fmt(out, "active_defrag_hits:%llu\r\n", (unsigned long long)g_data.stat_defrag_hits);
+    append_fmt(out, "active_defrag_scanned:%llu\r\n", (unsigned long long)g_data.stat_defrag_scanned);
+}
+
+static void info_stats(std::string &out){
+    out += "# Stats\r\n";
+    append_fmt(out, "evicted_keys:%llu\r\n", (unsigned long long)g_data.stat_evicted_keys);
+    append_fmt(out, "expired_keys:%llu\r\n", (unsigned long long)g_data.stat_expired_keys);
+    append_fmt(out, "expired_time_cap_reached_count:%llu\r\n",
+        (unsigned long long)g_data.stat_expired_time_cap);
+    append_fmt(out, "lazyfreed_objects:%llu\r\n", (unsigned long long)g_data.stat_lazyfreed.load());
+    append_fmt(out, "io_threads_active:%u\r\n", g_conf.io_threads);
+    append_fmt(out, "io_threaded_reads_processed:%llu\r\n", (unsigned long long)g_data.stat_io_reads);
+    append_fmt(out, "io_threaded_writes_processed:%llu\r\n", (unsigned long long)g_data.stat_io_writes);
+    append_fmt(out, "async_cmds_processed:%llu\r\n", (unsigned long long)g_data.stat_async_cmds);
+    append_fmt(out, "async_cmds_inflight:%llu\r\n", (unsigned long long)g_data.cq.inflight.load());
+    append_fmt(out, "async_cmds_usec:%llu\r\n", (unsigned long long)g_data.stat_async_usec);
+    append_fmt(out, "async_wakeups:%llu\r\n", (unsigned long long)g_data.cq.wakeups);
+}
+
+// the background pool: lazy free, snapshots, fsync, parallel commands
+static void info_threads(std::string &out){
+    const TheadPool &tp = g_data.thread_pool;
+    uint64_t up_us = std::max<uint64_t>(get_monotonic_usec() - tp.start_us, 1);
+    out += "# Threads\r\n";
+    for(size_t i = 0; i < tp.stats.size(); ++i){
+        const TpWorkerStats* st = tp.stats[i];
+        append_fmt(out, "bg_worker%zu:tasks=%llu,steals=%llu,busy_pct=%.2f\r\n", i,
+            (unsigned long long)st->tasks.load(), (unsigned long long)st->steals.load(),
+            100.0 * st->busy_us.load() / up_us);
+    }
+    append_fmt(out, "bg_queued_tasks:%zu\r\n", tp.queued.load());
+}
+
+static void info_persistence(std::string &out){
+    out += "# Persistence\r\n";
+    append_fmt(out, "rdb_bgsave_in_progress:%d\r\n", g_data.bgsave_job ? 1 : 0);
+    append_fmt(out, "rdb_last_save_time:%llu\r\n", (unsigned long long)g_data.rdb_last_save_time);
+    append_fmt(out, "rdb_last_bgsave_status:%s\r\n", g_data.rdb_last_bgsave_ok ? "ok" : "err");
+    append_fmt(out, "rdb_last_bgsave_time_usec:%llu\r\n",
+        (unsigned long long)g_data.rdb_last_bgsave_usec);
+    // what fork() would cost: the pause to take the copy, and its size
+    append_fmt(out, "latest_fork_usec:%llu\r\n", (unsigned long long)g_data.stat_fork_usec);
+    append_fmt(out, "rdb_last_cow_size:%zu\r\n", g_data.stat_rdb_cow_bytes);
+    WarmLoad* wl = g_data.warm;
+    size_t loaded = wl ? wl->loaded_keys + wl->faulted_keys : 0;
+    append_fmt(out, "loading:%d\r\n", wl ? 1 : 0);
+    append_fmt(out, "loading_keys_total:%zu\r\n", wl ? wl->total_keys : 0);
+    append_fmt(out, "loading_keys_loaded:%zu\r\n", loaded);
+    append_fmt(out, "loading_keys_on_demand:%zu\r\n", wl ? wl->faulted_keys : 0);
+    append_fmt(out, "loading_loaded_perc:%.2f\r\n",
+        wl && wl->total_keys ? 100.0 * loaded / wl->total_keys : 0.0);
+    append_fmt(out, "aof_enabled:%d\r\n", g_data.aof_fd >= 0 ? 1 : 0);
+    append_fmt(out, "aof_current_size:%zu\r\n", g_data.aof_size);
+    append_fmt(out, "aof_buffer_length:%zu\r\n", g_data.aof_buf.size());
+    append_fmt(out, "aof_last_write_status:%s\r\n", g_data.aof_last_write_ok ? "ok" : "err");
+    append_fmt(out, "aof_pending_fsync:%d\r\n", g_data.aof_fsync_pending.load() ? 1 : 0);
+    append_fmt(out, "aof_fsyncs:%llu\r\n", (unsigned long long)g_data.stat_aof_fsyncs.load());
+    append_fmt(out, "aof_base_size:%zu\r\n", g_data.aof_base_size);
+    append_fmt(out, "aof_rewrite_in_progress:%d\r\n", g_data.rewrite_running ? 1 : 0);
+    append_fmt(out, "aof_rewrite_buffer_length:%zu\r\n", g_data.rewrite_buf.size());
+    append_fmt(out, "aof_rewrites:%llu\r\n", (unsigned long long)g_data.stat_aof_rewrites);
+    append_fmt(out, "aof_last_bgrewrite_status:%s\r\n", g_data.aof_last_rewrite_ok ? "ok" : "err");
+    append_fmt(out, "aof_last_rewrite_time_usec:%llu\r\n",
+        (unsigned long long)g_data.aof_last_rewrite_usec);
+}
+
+static void info_keyspace(std::string &out){
+    out += "# Keyspace\r\n";
+    append_fmt(out, "keys:%zu\r\n", hm_size(&g_data.db));
+    append_fmt(out, "expires:%zu\r\n", g_data.heap.size());
+}
+
+static void repl_drop_link();
+
+// replicaof host port
+// replicaof no one
+static void do_replicaof(std::vector<std::string> &cmd, Ring_buf &buf){
+    if(cmd[1] == "no" && cmd[2] == "one"){
+        if(g_data.repl_state != REPL_NONE){
+            repl_drop_link();
+            g_data.repl_state = REPL_NONE;
+            // our own writes from now on, in a new history. the replicas of
+            // the old one continue from it, ours reconnect to learn the new id
+            g_data.repl_id2 = g_data.repl_id;
+            g_data.repl_offset2 = g_data.repl_backlog.offset;
+            g_data.repl_id = repl_new_id();
+            std::vector<Conn*> stale = g_data.replicas;
+            for(Conn* conn : stale){
+                conn_destroy(conn);
+            }
+            fprintf(stderr, "replication stopped, serving writes\n");
+        }
+        return out_nil(buf);
+    }
+    int64_t port = 0;
+    if(!str2int(cmd[2], port) || port <= 0 || port > 65535){
+        return out_err(buf, ERR_BAD_ARG, "expect a port");
+    }
+    if(g_data.warm){
+        return out_err(buf, ERR_BUSY, "the snapshot is still loading");
+    }
+    if(g_data.repl_state != REPL_NONE && g_data.repl_host == cmd[1] && g_data.repl_port == port){
+        return out_nil(buf); // already
+    }
+    repl_drop_link();
+    g_data.repl_host = cmd[1];
+    g_data.repl_port = (uint16_t)port;
+    g_data.repl_state = REPL_CONNECT;
+    g_data.repl_retry_ms = 0; // by the next timer tick
+    g_data.repl_down_since_ms = get_monotonic_msec();
+    fprintf(stderr, "replicating %s:%u\n", g_data.repl_host.c_str(), g_data.repl_port);
+    return out_nil(buf);
+}
+
+// ip:port of the other end
+static std::string conn_peer(Conn* conn){
+    sockaddr_in addr{};
+    int addrlen = sizeof(addr);
+    if(getpeername(conn->fd, (sockaddr*)&addr, &addrlen) != 0){
+        return "?";
+    }
+    uint32_t ip = ntohl(addr.sin_addr.s_addr);
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%u.%u.%u.%u:%u", (ip >> 24) & 255, (ip >> 16) & 255,
+        (ip >> 8) & 255, ip & 255, ntohs(addr.sin_port));
+    return tmp;
+}
+
+// since the first write a replica hasn't acknowledged
+static uint64_t repl_lag_ms(uint64_t ack_offset, uint64_t now_ms){
+    for(const ReplSample &sample : g_data.repl_samples){
+        if(sample.offset > ack_offset){
+            return now_ms - sample.ms;
+        }
+    }
+    return 0;
+}
+
+static void info_replication(std::string &out){
+    static const char* k_repl_states[] = {"none", "connect", "handshake", "transfer", "connected"};
+    const ReplBacklog &bl = g_data.repl_backlog;
+    uint64_t now_ms = get_monotonic_msec();
+    out += "# Replication\r\n";
+    if(g_data.repl_state == REPL_NONE){
+        out += "role:master\r\n";
+    }else{
+        bool up = g_data.repl_state == REPL_CONNECTED;
+        out += "role:replica\r\n";
+        append_fmt(out, "master_host:%s\r\n", g_data.repl_host.c_str());
+        append_fmt(out, "master_port:%u\r\n", g_data.repl_port);
+        append_fmt(out, "master_link_status:%s\r\n", up ? "up" : "down");
+        append_fmt(out, "master_sync_state:%s\r\n", k_repl_states[g_data.repl_state]);
+        append_fmt(out, "master_sync_read_bytes:%llu\r\n", g_data.repl_state == REPL_TRANSFER
+            ? (unsigned long long)g_data.repl_sync_bytes : 0ULL);
+        append_fmt(out, "master_last_io_ms_ago:%lld\r\n",
+            g_data.repl_master ? (long long)(now_ms - g_data.repl_last_io_ms) : -1LL);
+        append_fmt(out, "master_link_down_since_ms:%llu\r\n",
+            up ? 0ULL : (unsigned long long)(now_ms - g_data.repl_down_since_ms));
+    }
+    append_fmt(out, "connected_replicas:%zu\r\n", g_data.replicas.size());
+    for(size_t i = 0; i < g_data.replicas.size(); ++i){
+        Conn* conn = g_data.replicas[i];
+        uint64_t acked = std::min(conn->repl_ack_offset, bl.offset);
+        append_fmt(out, "replica%zu:addr=%s,state=%s,offset=%llu,lag_bytes=%llu,lag_ms=%llu\r\n",
+            i, conn_peer(conn).c_str(), conn->repl_online ? "online" : "sync",
+            (unsigned long long)conn->repl_ack_offset, (unsigned long long)(bl.offset - acked),
+            (unsigned long long)repl_lag_ms(acked, now_ms));
+    }
+    append_fmt(out, "master_replid:%s\r\n", g_data.repl_id.c_str());
+    append_fmt(out, "master_replid2:%s\r\n", g_data.repl_id2.c_str());
+    append_fmt(out, "second_repl_offset:%llu\r\n", (unsigned long long)g_data.repl_offset2);
+    append_fmt(out, "master_repl_offset:%llu\r\n", (unsigned long long)bl.offset);
+    append_fmt(out, "repl_backlog_active:%d\r\n", bl.buf.empty() ? 0 : 1);
+    append_fmt(out, "repl_backlog_size:%zu\r\n", g_conf.repl_backlog_size);
+    append_fmt(out, "repl_backlog_first_byte_offset:%llu\r\n",
+        (unsigned long long)(bl.offset - bl.histlen));
+    append_fmt(out, "repl_backlog_histlen:%llu\r\n", (unsigned long long)bl.histlen);
+    append_fmt(out, "sync_full:%llu\r\n", (unsigned long long)g_data.stat_sync_full);
+    append_fmt(out, "sync_partial_ok:%llu\r\n", (unsigned long long)g_data.stat_sync_partial_ok);
+    append_fmt(out, "sync_partial_err:%llu\r\n", (unsigned long long)g_data.stat_sync_partial_err);
+}
+
+// cluster mode: the keys are split into hash slots (cluster.h), and a node
+// serves the slots it owns. a key of another node's slot is answered with
+// "MOVED slot ip:port", as in Redis Cluster, so the client learns the
+// layout. there is no gossip, every node is told the layout with CLUSTER
+// SETSLOT. a slot moves while it's served:
+//   target: cluster setslot S importing <source>
+//   source: cluster setslot S migrating <target>
+//   source: cluster migrate S <count>, until it replies 0
+//   both:   cluster setslot S node <target>
+// meanwhile the source serves the keys it still has and answers the others
+// with "ASK slot ip:port", which the target serves after an ASKING only.
+const uint64_t k_migrate_timeout_ms = 5000; // for the target to take a batch
+const size_t k_migrate_max_bytes = 4 << 20; // the payload of one RESTORE
+
+static void cluster_init(uint16_t port){
+    g_data.slot_keys.resize(k_cluster_slots);
+    for(DList &keys : g_data.slot_keys){
+        dlist_init(&keys);
+    }
+    g_data.slot_nkeys.assign(k_cluster_slots, 0);
+    g_data.cluster_nodes.assign(1, g_conf.cluster_announce_ip + ":" + std::to_string(port));
+    g_data.slot_owner.assign(k_cluster_slots, k_no_node);
+    g_data.slot_migrating.assign(k_cluster_slots, k_no_node);
+    g_data.slot_importing.assign(k_cluster_slots, k_no_node);
+}
+
+// "host:port"
+static bool addr_split(const std::string &addr, std::string &host, std::string &port){
+    size_t colon = addr.rfind(':');
+    int64_t val = 0;
+    if(colon == std::string::npos || colon == 0 || !str2int(addr.substr(colon + 1), val)
+        || val <= 0 || val > 65535)
+    {
+        return false;
+    }
+    host = addr.substr(0, colon);
+    port = addr.substr(colon + 1);
+    return true;
+}
+
+// the index of a node in cluster_nodes, added if new
+static uint16_t cluster_node(const std::string &addr){
+    std::vector<std::string> &nodes = g_data.cluster_nodes;
+    for(size_t i = 0; i < nodes.size(); ++i){
+        if(nodes[i] == addr){
+            return (uint16_t)i;
+        }
+    }
+    if(nodes.size() >= k_no_node){
+        return k_no_node;
+    }
+    nodes.push_back(addr);
+    return (uint16_t)(nodes.size() - 1);
+}
+
+// the keys a command reads or writes
+static void cmd_keys(const std::vector<std::string> &cmd, std::vector<const std::string*> &keys){
+    const std::string &name = cmd[0];
+    if(name == "zunionstore" || name == "zinterstore" || name == "zdiffstore"){
+        keys.push_back(&cmd[1]);
+        int64_t numkeys = 0;
+        if(cmd.size() >= 3 && str2int(cmd[2], numkeys) && numkeys > 0
+            && (size_t)numkeys <= cmd.size() - 3)
+        {
+            for(size_t i = 0; i < (size_t)numkeys; ++i){
+                keys.push_back(&cmd[3 + i]);
+            }
+        }
+    }else if(name == "zunion" || name == "zinter" || name == "zdiff" || name == "zintercard"){
+        int64_t numkeys = 0;
+        if(str2int(cmd[1], numkeys) && numkeys > 0 && (size_t)numkeys <= cmd.size() - 2){
+            for(size_t i = 0; i < (size_t)numkeys; ++i){
+                keys.push_back(&cmd[2 + i]);
+            }
+        }
+    }else if(name == "memory"){
+        if(cmd.size() >= 3 && cmd[1] == "usage"){
+            keys.push_back(&cmd[2]);
+        }
+    }else if(name == "get" || name == "set" || name == "del" || name == "unlink"
+        || name == "pexpire" || name == "pexpireat" || name == "pttl" || name[0] == 'z')
+    {
+        keys.push_back(&cmd[1]); // every other z* command has one key, the first
+    }
+}
+
+// the key is here, and not due to expire
+static bool cluster_has_key(const std::string &name){
+    LookupKey key;
+    key.key = name;
+    key.node.hcode = str_hash((const uint8_t*)name.data(), name.size());
+    HNode* node = db_lookup(key);
+    return node && !entry_expired(container_of(node, Entry, node), get_monotonic_msec());
+}
+
+// false if the command was answered with a redirect or an error instead
+static bool cluster_route(Conn* conn, const std::vector<std::string> &cmd, Ring_buf &buf){
+    bool asking = conn->asking;
+    conn->asking = false;
+    std::vector<const std::string*> keys;
+    if(cmd.size() >= 2){
+        cmd_keys(cmd, keys);
+    }
+    if(keys.empty()){
+        return true;
+    }
+    uint32_t slot = key_hash_slot(keys[0]->data(), keys[0]->size());
+    for(const std::string* key : keys){
+        if(key_hash_slot(key->data(), key->size()) != slot){
+            out_err(buf, ERR_BAD_ARG, "CROSSSLOT keys in request don't hash to the same slot");
+            return false;
+        }
+    }
+    uint16_t owner = g_data.slot_owner[slot];
+    std::string where = std::to_string(slot) + " ";
+    if(owner != 0){
+        if(asking && g_data.slot_importing[slot] != k_no_node){
+            return true;
+        }
+        if(owner == k_no_node){
+            out_err(buf, ERR_CLUSTERDOWN, "CLUSTERDOWN hash slot " + where + "not served");
+        }else{
+            out_err(buf, ERR_MOVED, "MOVED " + where + g_data.cluster_nodes[owner]);
+        }
+        return false;
+    }
+    uint16_t target = g_data.slot_migrating[slot];
+    if(target == k_no_node){
+        return true;
+    }
+    // the keys missing here have moved already, or are new
+    size_t missing = 0;
+    for(const std::string* key : keys){
+        missing += cluster_has_key(*key) ? 0 : 1;
+    }
+    if(missing == 0){
+        return true;
+    }
+    if(missing == keys.size()){
+        out_err(buf, ERR_ASK, "ASK " + where + g_data.cluster_nodes[target]);
+    }else{
+        out_err(buf, ERR_BUSY, "TRYAGAIN the keys are split while slot " + where + "moves");
+    }
+    return false;
+}
+
+static void conn_resume(Conn* conn);
+static void response_begin(Ring_buf& buf, size_t *header);
+static void response_end(Ring_buf& buf, size_t header);
+
+// a new link, the connect completes in the event loop
+static bool migrate_connect(const std::string &addr, std::string &err){
+    std::string host, port;
+    addr_split(addr, host, port);
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res){
+        err = "can't resolve " + host;
+        return false;
+    }
+    SOCKET fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == INVALID_SOCKET){
+        freeaddrinfo(res);
+        err = "socket() failed";
+        return false;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, res->ai_addr, (int)res->ai_addrlen);
+    freeaddrinfo(res);
+    if(rv == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK
+        && WSAGetLastError() != WSAEINPROGRESS)
+    {
+        closesocket(fd);
+        err = "can't connect to " + addr;
+        return false;
+    }
+    g_data.migrate_link = conn_new(fd);
+    g_data.migrate_link->role = CONN_MIGRATE;
+    g_data.migrate_addr = addr;
+    g_data.migrate_in.clear();
+    return true;
+}
+
+// the batch is done: the keys the target took are removed here, the client
+// gets the count or `err`, and the writes to the slot run again
+static void migrate_finish(const std::string &err){
+    MigrateBatch* batch = g_data.migrate_batch;
+    g_data.migrate_batch = nullptr;
+    if(err.empty()){
+        for(const std::string &name : batch->keys){
+            LookupKey key;
+            key.key = name;
+            key.node.hcode = str_hash((const uint8_t*)name.data(), name.size());
+            HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+            if(!node){
+                continue; // expired or evicted meanwhile
+            }
+            Entry* ent = container_of(node, Entry, node);
+            aof_feed_del(ent);
+            db_remove(ent);
+            entry_del(ent);
+        }
+        g_data.stat_migrated_keys += batch->keys.size();
+    }
+    std::vector<Conn*> waiters;
+    waiters.swap(g_data.migrate_waiters);
+    if(Conn* conn = batch->conn){
+        conn->migrating = false;
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        if(err.empty()){
+            out_int(conn->outgoing, (int64_t)batch->keys.size());
+        }else{
+            out_err(conn->outgoing, ERR_IO, err);
+        }
+        response_end(conn->outgoing, header_pos);
+        conn_resume(conn);
+    }
+    delete batch;
+    for(Conn* conn : waiters){
+        conn->slot_wait = false;
+        conn_resume(conn);
+    }
+}
+
+// closed by the event loop, which may be reading it right now
+static void migrate_drop_link(){
+    Conn* link = g_data.migrate_link;
+    g_data.migrate_link = nullptr;
+    link->want_close = true;
+    link->want_write = true; // polled at once
+}
+
+static void migrate_link_closed(){
+    g_data.migrate_link = nullptr;
+    if(g_data.migrate_batch){
+        migrate_finish("can't reach " + g_data.migrate_addr);
+    }
+}
+
+// the reply to the RESTORE of the batch
+static void migrate_read(Conn* link){
+    if(link != g_data.migrate_link){
+        return; // dropped, about to close
+    }
+    char tmp[4096];
+    int rv = recv(link->fd, tmp, sizeof(tmp), 0);
+    if(rv == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK){
+        return;
+    }
+    if(rv <= 0){
+        link->want_close = true; // see migrate_link_closed()
+        return;
+    }
+    // | len | reply |
+    std::string &in = g_data.migrate_in;
+    in.append(tmp, (size_t)rv);
+    uint32_t len = 0;
+    if(in.size() < 4){
+        return;
+    }
+    memcpy(&len, in.data(), 4);
+    if(in.size() - 4 < len){
+        return;
+    }
+    std::string reply = in.substr(4, len);
+    in.erase(0, 4 + len);
+    MigrateBatch* batch = g_data.migrate_batch;
+    if(!batch){
+        return migrate_drop_link(); // nothing was asked
+    }
+    int64_t n = -1;
+    if(reply.size() == 9 && (uint8_t)reply[0] == TAG_INT){
+        memcpy(&n, &reply[1], 8);
+    }else if(reply.size() >= 9 && (uint8_t)reply[0] == TAG_ERR){
+        return migrate_finish("the target refused: " + reply.substr(9));
+    }
+    if(n != (int64_t)batch->keys.size()){
+        migrate_drop_link();
+        return migrate_finish("bad reply from the target");
+    }
+    migrate_finish("");
+}
+
+// the target is too slow, the keys stay here
+static void migrate_cron(uint64_t now_ms){
+    if(!g_data.migrate_batch || now_ms < g_data.migrate_batch->deadline_ms){
+        return;
+    }
+    Conn* link = g_data.migrate_link;
+    g_data.migrate_link = nullptr; // the reply may still come
+    migrate_finish("timeout");
+    if(link){
+        conn_destroy(link);
+    }
+}
+
+// a client writing to the slot of the batch on its way waits for it
+static bool migrate_write_waits(Conn* conn, const std::vector<std::string> &cmd){
+    MigrateBatch* batch = g_data.migrate_batch;
+    if(!batch || cmd.size() < 2 || conn->role != CONN_CLIENT || !cmd_is_write(cmd[0])){
+        return false;
+    }
+    std::vector<const std::string*> keys;
+    cmd_keys(cmd, keys);
+    for(const std::string* key : keys){
+        if(key_hash_slot(key->data(), key->size()) == batch->slot){
+            conn->slot_wait = true;
+            conn->want_read = false;
+            g_data.migrate_waiters.push_back(conn);
+            return true;
+        }
+    }
+    return false;
+}
+
+// cluster migrate slot count
+// move up to `count` keys of the slot to the node it's migrating to, the
+// reply is the number moved, 0 once the slot is empty here. the client waits
+// for the target's reply while the event loop goes on with the others.
+static void cluster_migrate(uint32_t slot, int64_t count, Ring_buf &buf){
+    uint16_t target = g_data.slot_migrating[slot];
+    if(target == k_no_node){
+        return out_err(buf, ERR_BAD_ARG, "the slot isn't migrating");
+    }
+    if(g_data.migrate_batch){
+        return out_err(buf, ERR_BUSY, "TRYAGAIN a migration batch is on its way");
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    uint64_t wall_ms = get_wall_msec();
+    std::string payload;
+    std::vector<std::string> keys;
+    DList* head = &g_data.slot_keys[slot];
+    DList* node = head->next;
+    while(node != head && (int64_t)keys.size() < count && payload.size() < k_migrate_max_bytes){
+        Entry* ent = slot_node_entry(node);
+        node = node->next;
+        if(!rdb_put_record(payload, ent, g_data.heap, now_ms, wall_ms)){
+            entry_expire(ent); // would never leave otherwise
+            continue;
+        }
+        keys.push_back(ent->key);
+    }
+    if(keys.empty()){
+        return out_int(buf, 0);
+    }
+    const std::string &addr = g_data.cluster_nodes[target];
+    if(g_data.migrate_link && g_data.migrate_addr != addr){
+        migrate_drop_link();
+    }
+    std::string err;
+    if(!g_data.migrate_link && !migrate_connect(addr, err)){
+        return out_err(buf, ERR_IO, err);
+    }
+    std::string req;
+    aof_put_cmd(req, {"restore", payload});
+    Conn* link = g_data.migrate_link;
+    buf_append(link->outgoing, (const uint8_t*)req.data(), req.size());
+    link->want_write = true;
+    MigrateBatch* batch = new MigrateBatch();
+    batch->conn = g_data.cmd_conn;
+    batch->slot = slot;
+    batch->keys.swap(keys);
+    batch->deadline_ms = now_ms + k_migrate_timeout_ms;
+    g_data.migrate_batch = batch;
+    if(batch->conn){
+        batch->conn->migrating = true; // replied by migrate_finish()
+        batch->conn->want_read = false;
+    }
+}
+
+// restore payload
+// the records sent by CLUSTER MIGRATE, replacing the keys of the same name.
+// the reply is the number of records.
+static void do_restore(std::vector<std::string> &cmd, Ring_buf &buf){
+    RdbReader r;
+    r.pos = (const uint8_t*)cmd[1].data();
+    r.end = r.pos + cmd[1].size();
+    uint64_t wall_ms = get_wall_msec();
+    std::vector<ZAddItem> items;
+    std::vector<std::pair<Entry*, int64_t>> ents; // and their TTLs
+    int64_t nrecords = 0;
+    const char* bad = nullptr;
+    while(r.pos < r.end && !bad){
+        uint8_t type = 0;
+        Entry* ent = nullptr;
+        int64_t ttl_ms = -1;
+        if(!rdb_get_u8(&r, &type) || !rdb_load_entry(&r, type, wall_ms, items, &ent, &ttl_ms)){
+            bad = "bad payload";
+        }else if(ent){
+            ents.push_back(std::make_pair(ent, ttl_ms));
+        }
+        nrecords++;
+    }
+    // the log and the primary's stream ran it before
+    if(g_conf.cluster_enabled && !g_data.aof_loading && !g_data.repl_applying){
+        for(size_t i = 0; i < ents.size() && !bad; ++i){
+            uint32_t slot = entry_slot(ents[i].first);
+            if(g_data.slot_owner[slot] != 0 && g_data.slot_importing[slot] == k_no_node){
+                bad = "the slot isn't importing";
+            }
+        }
+    }
+    if(bad){
+        for(std::pair<Entry*, int64_t> &it : ents){
+            entry_del_sync(it.first);
+        }
+        return out_err(buf, ERR_BAD_ARG, bad);
+    }
+    if(!evict_or_refuse(buf)){
+        for(std::pair<Entry*, int64_t> &it : ents){
+            entry_del_sync(it.first);
+        }
+        return;
+    }
+    for(std::pair<Entry*, int64_t> &it : ents){
+        LookupKey key;
+        key.key = it.first->key;
+        key.node.hcode = it.first->node.hcode;
+        HNode* node = db_lookup(key);
+        if(node){
+            Entry* old = container_of(node, Entry, node);
+            snap_save_entry(old);
+            db_remove(old);
+            entry_del(old);
+        }
+        db_insert(it.first);
+        entry_set_ttl(it.first, it.second);
+    }
+    g_data.stat_imported_keys += ents.size();
+    return out_int(buf, nrecords);
+}
+
+// cluster setslot slot|first-last node ip:port
+// cluster setslot slot migrating|importing ip:port
+// cluster setslot slot stable
+static void cluster_setslot(std::vector<std::string> &cmd, uint32_t first, uint32_t last,
+    Ring_buf &buf)
+{
+    MigrateBatch* batch = g_data.migrate_batch;
+    if(batch && first <= batch->slot && batch->slot <= last){
+        return out_err(buf, ERR_BUSY, "TRYAGAIN a migration batch of the slot is on its way");
+    }
+    std::string host, port;
+    if(cmd.size() == 4 && cmd[3] == "stable" && first == last){
+        g_data.slot_migrating[first] = k_no_node;
+        g_data.slot_importing[first] = k_no_node;
+        return out_nil(buf);
+    }
+    if(cmd.size() != 5 || !addr_split(cmd[4], host, port)){
+        return out_err(buf, ERR_BAD_ARG, "expect node, migrating, importing or stable");
+    }
+    uint16_t node = cluster_node(cmd[4]);
+    if(node == k_no_node){
+        return out_err(buf, ERR_BAD_ARG, "too many nodes");
+    }
+    if(cmd[3] == "node"){
+        for(uint32_t slot = first; slot <= last; ++slot){
+            if(node != 0 && g_data.slot_owner[slot] == 0 && g_data.slot_nkeys[slot] > 0){
+                return out_err(buf, ERR_BAD_ARG,
+                    "slot " + std::to_string(slot) + " still has keys here, migrate them first");
+            }
+        }
+        for(uint32_t slot = first; slot <= last; ++slot){
+            g_data.slot_owner[slot] = node;
+            g_data.slot_migrating[slot] = k_no_node;
+            g_data.slot_importing[slot] = k_no_node;
+        }
+        return out_nil(buf);
+    }
+    if(first != last || node == 0){
+        return out_err(buf, ERR_BAD_ARG, "expect one slot and another node");
+    }
+    if(cmd[3] == "migrating"){
+        if(g_data.slot_owner[first] != 0){
+            return out_err(buf, ERR_BAD_ARG, "not my slot");
+        }
+        g_data.slot_migrating[first] = node;
+    }else if(cmd[3] == "importing"){
+        if(g_data.slot_owner[first] == 0){
+            return out_err(buf, ERR_BAD_ARG, "my slot already");
+        }
+        g_data.slot_importing[first] = node;
+    }else{
+        return out_err(buf, ERR_BAD_ARG, "expect node, migrating, importing or stable");
+    }
+    return out_nil(buf);
+}
+
+// [first, last, ip:port] for each run of slots served by the same node
+static void cluster_slots(Ring_buf &buf){
+    size_t ctx = out_begin_arr(buf);
+    uint32_t n = 0;
+    uint32_t first = 0;
+    for(uint32_t slot = 0; slot < k_cluster_slots; ++slot){
+        uint16_t owner = g_data.slot_owner[slot];
+        if(slot + 1 < k_cluster_slots && g_data.slot_owner[slot + 1] == owner){
+            continue;
+        }
+        if(owner != k_no_node){
+            const std::string &addr = g_data.cluster_nodes[owner];
+            out_arr(buf, 3);
+            out_int(buf, first);
+            out_int(buf, slot);
+            out_str(buf, addr.data(), addr.size());
+            n++;
+        }
+        first = slot + 1;
+    }
+    out_end_arr(buf, ctx, n);
+}
+
+static void cluster_info(Ring_buf &buf){
+    size_t assigned = 0, mine = 0, migrating = 0, importing = 0;
+    for(uint32_t slot = 0; slot < k_cluster_slots; ++slot){
+        assigned += g_data.slot_owner[slot] != k_no_node ? 1 : 0;
+        mine += g_data.slot_owner[slot] == 0 ? 1 : 0;
+        migrating += g_data.slot_migrating[slot] != k_no_node ? 1 : 0;
+        importing += g_data.slot_importing[slot] != k_no_node ? 1 : 0;
+    }
+    std::string out;
+    append_fmt(out, "cluster_state:%s\r\n", assigned == k_cluster_slots ? "ok" : "fail");
+    append_fmt(out, "cluster_slots_assigned:%zu\r\n", assigned);
+    append_fmt(out, "cluster_known_nodes:%zu\r\n", g_data.cluster_nodes.size());
+    append_fmt(out, "cluster_myself:%s\r\n", g_data.cluster_nodes[0].c_str());
+    append_fmt(out, "cluster_my_slots:%zu\r\n", mine);
+    append_fmt(out, "cluster_migrating_slots:%zu\r\n", migrating);
+    append_fmt(out, "cluster_importing_slots:%zu\r\n", importing);
+    append_fmt(out, "cluster_migrated_keys:%llu\r\n", (unsigned long long)g_data.stat_migrated_keys);
+    append_fmt(out, "cluster_imported_keys:%llu\r\n", (unsigned long long)g_data.stat_imported_keys);
+    return out_str(buf, out.data(), out.size());
+}
+
+// cluster keyslot key
+// cluster slots
+// cluster info
+// cluster setslot ...
+// cluster countkeysinslot slot
+// cluster getkeysinslot slot count
+// cluster migrate slot count
+static void do_cluster(std::vector<std::string> &cmd, Ring_buf &buf){
+    if(!g_conf.cluster_enabled){
+        return out_err(buf, ERR_BAD_ARG, "cluster support disabled");
+    }
+    const std::string &sub = cmd[1];
+    if(cmd.size() == 3 && sub == "keyslot"){
+        return out_int(buf, key_hash_slot(cmd[2].data(), cmd[2].size()));
+    }else if(cmd.size() == 2 && sub == "slots"){
+        return cluster_slots(buf);
+    }else if(cmd.size() == 2 && sub == "info"){
+        return cluster_info(buf);
+    }
+    uint32_t first = 0, last = 0;
+    if(cmd.size() < 3 || !parse_slot_range(cmd[2], &first, &last)){
+        return out_err(buf, ERR_BAD_ARG, "expect a slot");
+    }
+    if(sub == "setslot"){
+        return cluster_setslot(cmd, first, last, buf);
+    }
+    int64_t count = 0;
+    if(first != last || (cmd.size() == 4 && (!str2int(cmd[3], count) || count <= 0))){
+        return out_err(buf, ERR_BAD_ARG, "expect a slot and a count");
+    }
+    if(g_data.warm){
+        return out_err(buf, ERR_BUSY, "the snapshot is still loading"); // the slot lists are partial
+    }
+    if(cmd.size() == 3 && sub == "countkeysinslot"){
+        return out_int(buf, g_data.slot_nkeys[first]);
+    }else if(cmd.size() == 4 && sub == "getkeysinslot"){
+        size_t ctx = out_begin_arr(buf);
+        uint32_t n = 0;
+        DList* head = &g_data.slot_keys[first];
+        for(DList* node = head->next; node != head && n < count; node = node->next, ++n){
+            const std::string &key = slot_node_entry(node)->key;
+            out_str(buf, key.data(), key.size());
+        }
+        return out_end_arr(buf, ctx, n);
+    }else if(cmd.size() == 4 && sub == "migrate"){
+        if(g_data.repl_state != REPL_NONE){
+            return out_err(buf, ERR_READONLY, "a replica takes writes from its primary only");
+        }
+        return cluster_migrate(first, count, buf);
+    }
+    return out_err(buf, ERR_UNKNOWN, "unknown command.");
+}
+
+// info [section]
+static void do_info(std::vector<std::string> &cmd, Ring_buf &buf){
+    std::string section = cmd.size() > 1 ? cmd[1] : "all";
+    bool all = section == "all";
+    std::string out;
+    if(all || section == "memory"){
+        info_memory(out);
+    }
+    if(all || section == "stats"){
+        info_stats(out);
+    }
+    if(all || section == "persistence"){
+        info_persistence(out);
+    }
+    if(all || section == "replication"){
+        info_replication(out);
+    }
+    if(all || section == "cluster"){
+        append_fmt(out, "# Cluster\r\ncluster_enabled:%d\r\n", g_conf.cluster_enabled ? 1 : 0);
+    }
+    if(all || section == "threads"){
+        info_threads(out);
+    }
+    if(all || section == "keyspace"){
+        info_keyspace(out);
+    }
+    return out_str(buf, out.data(), out.size());
+}
+
+static void do_request(std::vector<std::string> &cmd,Ring_buf &buf){
+    if(!cmd.empty() && g_data.repl_state != REPL_NONE && !g_data.repl_applying && cmd_is_write(cmd[0])){
+        return out_err(buf, ERR_READONLY, "a replica takes writes from its primary only");
+    }
+    if(!cmd.empty() && g_data.warm && cmd_is_keyspace(cmd[0])){
+        return out_err(buf, ERR_BUSY, "the snapshot is still loading");
+    }
+    if(!cmd.empty() && g_data.repl_state == REPL_TRANSFER && !cmd_is_admin(cmd[0])){
+        return out_err(buf, ERR_BUSY, "loading the snapshot from the primary");
+    }
+    if(cmd.size() == 2 && cmd[0] == "get"){
+        do_get(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "set"){
+        do_set(cmd, buf);
+    }else if(cmd.size() == 2 && (cmd[0] == "del" || cmd[0] == "unlink")){
+        do_del(cmd, buf);
+    }else if(!cmd.empty() && cmd.size() <= 2 && cmd[0] == "flushall"){
+        return do_flushall(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "pexpire"){
+        return do_expire(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "pexpireat"){
+        return do_pexpireat(cmd, buf);
+    }else if(cmd.size() == 2 && cmd[0] == "pttl"){
+        return do_ttl(cmd, buf);
+    }else if(cmd.size() == 1 && cmd[0] == "keys"){
+        do_keys(cmd, buf);
+    }else if(cmd.size() >= 4 && cmd[0] == "zadd"){
+        return do_zadd(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "zrem"){
+        return do_zrem(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "zscore"){
+        return do_zscore(cmd, buf);
+    }else if (cmd.size() == 6 && cmd[0] == "zquery"){
+        return do_zquery(cmd, buf);
+    }else if(cmd.size() == 2 && cmd[0] == "zcard"){
+        return do_zcard(cmd, buf);
+    }else if(cmd.size() == 3 && (cmd[0] == "zrank" || cmd[0] == "zrevrank")){
+        return do_zrank(cmd, buf);
+    }else if(cmd.size() >= 4 && cmd.size() <= 6 && cmd[0] == "zrange"){
+        return do_zrange(cmd, buf);
+    }else if(cmd.size() == 4 && cmd[0] == "zcount"){
+        return do_zcount(cmd, buf);
+    }else if(cmd.size() >= 4 && (cmd[0] == "zrangebyscore" || cmd[0] == "zrevrangebyscore")){
+        return do_zrangebyscore(cmd, buf);
+    }else if(cmd.size() >= 4 && cmd[0] == "zrangebylex"){
+        return do_zrangebylex(cmd, buf);
+    }else if(cmd.size() >= 4 && (cmd[0] == "zunionstore" || cmd[0] == "zinterstore" || cmd[0] == "zdiffstore")){
+        return do_zcombine(cmd, buf);
+    }else if(cmd.size() >= 3 && (cmd[0] == "zunion" || cmd[0] == "zinter" || cmd[0] == "zdiff"
+        || cmd[0] == "zintercard"))
+    {
+        return do_zcombine_reply(cmd, buf);
+    }else if((cmd.size() == 5 || cmd.size() == 6) && cmd[0] == "zagg"){
+        return do_zagg(cmd, buf);
+    }else if(cmd.size() == 4 && cmd[0] == "zremrangebyrank"){
+        return do_zremrangebyrank(cmd, buf);
+    }else if(cmd.size() == 4 && cmd[0] == "zremrangebyscore"){
+        return do_zremrangebyscore(cmd, buf);
+    }else if(cmd.size() == 2 && cmd[0] == "memory" && cmd[1] == "malloc-stats"){
+        return do_malloc_stats(cmd, buf);
+    }else if(cmd.size() >= 3 && cmd[0] == "memory" && cmd[1] == "usage"){
+        return do_memory_usage(cmd, buf);
+    }else if(cmd.size() == 1 && cmd[0] == "save"){
+        return do_save(cmd, buf);
+    }else if(cmd.size() == 1 && cmd[0] == "bgsave"){
+        return do_bgsave(cmd, buf);
+    }else if(cmd.size() == 1 && cmd[0] == "bgrewriteaof"){
+        return do_bgrewriteaof(cmd, buf);
+    }else if(!cmd.empty() && cmd.size() <= 2 && cmd[0] == "info"){
+        return do_info(cmd, buf);
+    }else if(cmd.size() >= 3 && cmd[0] == "config"){
+        return do_config(cmd, buf);
+    }else if(cmd.size() == 3 && cmd[0] == "replicaof"){
+        return do_replicaof(cmd, buf);
+    }else if(cmd.size() >= 2 && cmd[0] == "cluster"){
+        return do_cluster(cmd, buf);
+    }else if(cmd.size() == 2 && cmd[0] == "restore"){
+        return do_restore(cmd, buf);
+    }else{
+        return out_err(buf, ERR_UNKNOWN, "unknown command.");    
+    }
+};
+
+static void response_begin(Ring_buf& buf, size_t *header){
+    *header = buf.size(); // message header position
+    buf_append_u32(buf, 0);
+}
+
+static size_t response_size(Ring_buf& buf, size_t header){
+    return buf.size() - header - 4;
+}
+
+static void response_end(Ring_buf& buf, size_t header){
+    size_t msg_size = response_size(buf, header);
+    if(msg_size > k_max_msg){
+        // drop only this response, earlier pipelined ones are still queued
+        buf.tail = (buf.tail + buf.cap - msg_size) % buf.cap;
+        out_err(buf, ERR_TOO_BIG, "response too big");
+        msg_size = response_size(buf, header);
+    }
+    uint32_t len = (uint32_t)msg_size;
+    // buf_append(buf, (const uint8_t*)&len, sizeof(len));
+
+    size_t pos = (buf.head + header) % buf.cap;
+    size_t first = std::min(buf.cap - pos, sizeof(len));
+    memcpy(&buf.buf[pos], &len, first);
+    if(first < sizeof(len)){
+        memcpy(&buf.buf[0], (uint8_t*)&len + first, sizeof(len)-first);}
+}
+
+// no reply after all, it comes later
+static void response_cancel(Ring_buf& buf, size_t header){
+    buf.tail = (buf.head + header) % buf.cap;
+}
+
+static bool response_is_err(Ring_buf& buf, size_t header){
+    return response_size(buf, header) > 0 && buf.buf[(buf.head + header + 4) % buf.cap] == TAG_ERR;
+}
+
+
+const uint64_t k_repl_tick_ms = 100;
+const uint64_t k_repl_ping_ms = 1000;       // the primary's heartbeat
+const uint64_t k_repl_ack_ms = 1000;        // a replica's acks, besides one per batch
+const uint64_t k_repl_retry_ms = 1000;      // reconnecting to the primary
+const uint64_t k_repl_timeout_ms = 10 * 1000;
+const size_t k_repl_read_max = 1 << 20;     // from the primary per batch
+
+const size_t k_repl_sync_chunk = 256 << 10;      // a frame of the full sync
+const size_t k_repl_sync_buffered = 16 << 20;   // unsent per replica, the scan waits above
+const uint64_t k_repl_sync_wait_ms = 200;       // for more replicas to share a full sync
+
+// a reply outside of a request, to PSYNC
+static void repl_reply(Conn* conn, uint32_t code, const char* msg){
+    size_t header = 0;
+    response_begin(conn->outgoing, &header);
+    if(code){
+        out_err(conn->outgoing, code, msg);
+    }else{
+        out_str(conn->outgoing, msg, strlen(msg));
+    }
+    response_end(conn->outgoing, header);
+    conn->want_write = true;
+}
+
+// psync replid offset
+// a replica asks for the stream from `offset` of history `replid`, which
+// works while the backlog still has it, also for the history before a
+// promotion up to where it ended. otherwise it waits for the next full
+// sync, see repl_sync_start(). either way the link then carries only the
+// stream one way and acks the other way, no replies.
+static void repl_psync(Conn* conn, std::vector<std::string> &cmd){
+    int64_t offset = 0;
+    if(!str2int(cmd[2], offset) || offset < 0){
+        return repl_reply(conn, ERR_BAD_ARG, "expect an offset");
+    }
+    if(g_data.warm || (g_data.repl_state != REPL_NONE && g_data.repl_state != REPL_CONNECTED)){
+        // a replica itself serves once it is in sync
+        return repl_reply(conn, ERR_BUSY, "not in sync yet");
+    }
+    ReplBacklog &bl = g_data.repl_backlog;
+    if(bl.buf.empty()){
+        backlog_resize(&bl, g_conf.repl_backlog_size);
+    }
+    bool ours = cmd[1] == g_data.repl_id || (!g_data.repl_id2.empty()
+        && cmd[1] == g_data.repl_id2 && (uint64_t)offset <= g_data.repl_offset2);
+    std::string tail;
+    conn->role = CONN_REPLICA;
+    conn->repl_ack_offset = (uint64_t)offset;
+    conn->repl_ack_ms = get_monotonic_msec();
+    g_data.replicas.push_back(conn);
+    if(ours && backlog_read(&bl, (uint64_t)offset, tail)){
+        char reply[128];
+        snprintf(reply, sizeof(reply), "continue %s %llu", g_data.repl_id.c_str(),
+            (unsigned long long)offset);
+        repl_reply(conn, 0, reply);
+        buf_append(conn->outgoing, (const uint8_t*)tail.data(), tail.size());
+        g_data.stat_sync_partial_ok++;
+        fprintf(stderr, "replica %s: %s\n", conn_peer(conn).c_str(), reply);
+        return;
+    }
+    if(cmd[1] != "?"){
+        g_data.stat_sync_partial_err++;
+    }
+    // the replicas asking meanwhile share the next one
+    conn->repl_sync = REPL_SYNC_WAIT;
+    g_data.stat_sync_full++;
+    fprintf(stderr, "replica %s: waits for a full sync\n", conn_peer(conn).c_str());
+}
+
+// the full sync: the snapshot goes out in the stream format while the
+// keyspace is scanned, framed as | len | whole records |, the stream since
+// its start follows. the scan waits while a replica reads slower.
+static std::string &repl_sync_sink_buf(void* arg, uint64_t){
+    return ((ReplSync*)arg)->out;
+}
+
+static void repl_sync_send(ReplSync* job){
+    if(job->out.empty()){
+        return;
+    }
+    job->crc = crc64(job->crc, job->out.data(), job->out.size());
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync == REPL_SYNC_SEND){
+            buf_append_u32(conn->outgoing, (uint32_t)job->out.size());
+            buf_append(conn->outgoing, (const uint8_t*)job->out.data(), job->out.size());
+            conn->want_write = true;
+        }
+    }
+    job->out.clear();
+}
+
+static void repl_sync_sink_added(void* arg, uint64_t, size_t){
+    ReplSync* job = (ReplSync*)arg;
+    if(job->out.size() >= k_repl_sync_chunk){
+        repl_sync_send(job);
+    }
+}
+
+static size_t repl_sync_count(uint32_t state){
+    size_t n = 0;
+    for(Conn* conn : g_data.replicas){
+        n += conn->repl_sync == state;
+    }
+    return n;
+}
+
+// a replica waited long enough for others to join it
+static bool repl_sync_due(uint64_t now_ms){
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync == REPL_SYNC_WAIT && now_ms >= conn->repl_ack_ms + k_repl_sync_wait_ms){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void repl_sync_start(){
+    ReplSync* job = new ReplSync();
+    job->offset = g_data.repl_backlog.offset;
+    job->out.assign(k_rdb_magic, sizeof(k_rdb_magic));
+    SnapSink sink;
+    sink.buf = &repl_sync_sink_buf;
+    sink.added = &repl_sync_sink_added;
+    sink.arg = job;
+    snap_start(&job->scan, SNAP_SYNC, sink);
+    g_data.repl_sync_job = job;
+    char reply[128];
+    snprintf(reply, sizeof(reply), "fullresync %s %llu", g_data.repl_id.c_str(),
+        (unsigned long long)job->offset);
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync == REPL_SYNC_WAIT){
+            conn->repl_sync = REPL_SYNC_SEND;
+            conn->repl_ack_offset = job->offset;
+            conn->repl_ack_ms = get_monotonic_msec();
+            repl_reply(conn, 0, reply);
+            fprintf(stderr, "replica %s: %s\n", conn_peer(conn).c_str(), reply);
+        }
+    }
+}
+
+static void repl_sync_end(){
+    delete g_data.repl_sync_job;
+    g_data.repl_sync_job = nullptr;
+}
+
+// the snapshot is out, the replicas go on with the stream
+static void repl_sync_done(ReplSync* job){
+    if(!job->scan.err.empty()){
+        fprintf(stderr, "full sync failed: %s\n", job->scan.err.c_str());
+        for(Conn* conn : g_data.replicas){
+            if(conn->repl_sync == REPL_SYNC_SEND){
+                conn->want_close = true; // they retry
+            }
+        }
+        return repl_sync_end();
+    }
+    job->out.push_back((char)RDB_OP_EOF);
+    rdb_put_u64(job->out, crc64(job->crc, job->out.data(), job->out.size()));
+    repl_sync_send(job);
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync == REPL_SYNC_SEND){
+            buf_append(conn->outgoing, (const uint8_t*)job->tail.data(), job->tail.size());
+            conn->repl_sync = REPL_SYNC_NONE;
+        }
+    }
+    repl_sync_end();
+}
+
+static bool repl_sync_backlogged(){
+    for(Conn* conn : g_data.replicas){
+        if(conn->repl_sync == REPL_SYNC_SEND && conn->outgoing.size() >= k_repl_sync_buffered){
+            return true;
+        }
+    }
+    return false;
+}
+
+// called by the timers, scans within the budget like BGSAVE
+static void repl_sync_cycle(){
+    ReplSync* job = g_data.repl_sync_job;
+    if(!job){
+        if(repl_sync_due(get_monotonic_msec())){
+            repl_sync_start();
+        }
+        return;
+    }
+    if(repl_sync_backlogged()){
+        return;
+    }
+    if(snap_scan(&job->scan, k_snap_budget_us)){
+        return repl_sync_done(job);
+    }
+    repl_sync_send(job);
+}
+
+// the samples every replica has acknowledged
+static void repl_trim_samples(){
+    uint64_t acked = (uint64_t)-1;
+    for(Conn* conn : g_data.replicas){
+        acked = std::min(acked, conn->repl_ack_offset);
+    }
+    std::deque<ReplSample> &samples = g_data.repl_samples;
+    while(!samples.empty() && samples.front().offset <= acked){
+        samples.pop_front();
+    }
+}
+
+// replconf ack offset, from a replica
+static void repl_replica_cmd(Conn* conn, std::vector<std::string> &cmd){
+    int64_t offset = 0;
+    if(cmd.size() == 3 && cmd[0] == "replconf" && cmd[1] == "ack" && str2int(cmd[2], offset)){
+        conn->repl_ack_offset = (uint64_t)offset;
+        conn->repl_ack_ms = get_monotonic_msec();
+        conn->repl_online = true;
+        repl_trim_samples();
+    }
+}
+
+static void repl_conn_closed(Conn* conn){
+    if(conn->role == CONN_REPLICA){
+        std::vector<Conn*> &v = g_data.replicas;
+        v.erase(std::find(v.begin(), v.end(), conn));
+        if(v.empty()){
+            g_data.repl_samples.clear();
+        }
+        if(conn->repl_sync == REPL_SYNC_SEND && repl_sync_count(REPL_SYNC_SEND) == 0){
+            repl_sync_end(); // nobody left to send it to
+        }
+        fprintf(stderr, "replica %s is gone\n", conn_peer(conn).c_str());
+    }else if(conn == g_data.repl_master){
+        g_data.repl_master = nullptr;
+        std::string().swap(g_data.repl_in);
+        if(g_data.repl_state == REPL_TRANSFER){
+            db_flush(true); // half a snapshot
+        }
+        if(g_data.repl_state != REPL_NONE){
+            uint64_t now_ms = get_monotonic_msec();
+            g_data.repl_state = REPL_CONNECT;
+            g_data.repl_retry_ms = now_ms + k_repl_retry_ms;
+            g_data.repl_down_since_ms = now_ms;
+            fprintf(stderr, "lost the link to the primary at offset %llu\n",
+                (unsigned long long)g_data.repl_backlog.offset);
+        }
+    }
+}
+
+static void repl_drop_link(){
+    if(g_data.repl_master){
+        conn_destroy(g_data.repl_master);
+    }
+}
+
+static void repl_fail(const char* why){
+    fprintf(stderr, "replication: %s\n", why);
+    g_data.repl_master->want_close = true;
+}
+
+// a request to the primary, no reply comes back after the handshake
+static void repl_send(const std::vector<std::string> &cmd){
+    std::string req;
+    aof_put_cmd(req, cmd);
+    buf_append(g_data.repl_master->outgoing, (const uint8_t*)req.data(), req.size());
+    g_data.repl_master->want_write = true;
+}
+
+static void repl_send_ack(){
+    repl_send({"replconf", "ack", std::to_string(g_data.repl_backlog.offset)});
+    g_data.repl_ack_sent_ms = get_monotonic_msec();
+}
+
+static void repl_connect(){
+    uint64_t now_ms = get_monotonic_msec();
+    g_data.repl_retry_ms = now_ms + k_repl_retry_ms; // if this fails
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    std::string port = std::to_string(g_data.repl_port);
+    if(getaddrinfo(g_data.repl_host.c_str(), port.c_str(), &hints, &res) != 0 || !res){
+        fprintf(stderr, "can't resolve %s\n", g_data.repl_host.c_str());
+        return;
+    }
+    SOCKET fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == INVALID_SOCKET){
+        freeaddrinfo(res);
+        return;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, res->ai_addr, (int)res->ai_addrlen);
+    freeaddrinfo(res);
+    if(rv == SOCKET_ERROR){
+        int err = WSAGetLastError();
+        if(err != WSAEWOULDBLOCK && err != WSAEINPROGRESS){
+            fprintf(stderr, "[%d] can't connect to the primary\n", err);
+            closesocket(fd);
+            return;
+        }
+    }
+    g_data.repl_master = conn_new(fd);
+    g_data.repl_master->role = CONN_MASTER;
+    g_data.repl_state = REPL_HANDSHAKE;
+    g_data.repl_last_io_ms = now_ms;
+    g_data.repl_in.clear();
+    // goes out once connected. our own history, or the primary's from the
+    // last sync, may still be in its backlog. a fresh server has none.
+    const ReplBacklog &bl = g_data.repl_backlog;
+    repl_send({"psync", bl.offset ? g_data.repl_id : "?", std::to_string(bl.offset)});
+}
+
+// kept on a replica too, so its own replicas and those of its primary can
+// continue from it once it is promoted
+static void repl_backlog_init(){
+    ReplBacklog &bl = g_data.repl_backlog;
+    if(bl.buf.empty()){
+        backlog_resize(&bl, g_conf.repl_backlog_size);
+    }
+}
+
+// the keyspace is replaced by the snapshot from the primary as it arrives,
+// see repl_load_frame(). the keyspace commands wait for the end.
+static void repl_load_begin(){
+    // our replicas followed the old history
+    std::vector<Conn*> stale = g_data.replicas;
+    for(Conn* conn : stale){
+        conn_destroy(conn);
+    }
+    backlog_reset(&g_data.repl_backlog, 0); // a sync cut short starts over
+    bool aof_on = g_conf.appendonly;
+    if(g_data.rewrite_running){
+        rewrite_end(false); // of the old keyspace, restarted at the end
+        g_conf.appendonly = aof_on;
     }
-};
+    db_flush(true);
+    g_data.repl_sync_bytes = 0;
+    g_data.repl_sync_crc = 0;
+    g_data.repl_sync_start_us = get_monotonic_usec();
+}
 
-static void response_begin(Ring_buf& buf, size_t *header){
-    *header = buf.size(); // message header position
-    buf_append_u32(buf, 0);
+// a frame of whole records, false if it's bad. `*done` after the last one.
+static bool repl_load_frame(const uint8_t* data, size_t len, bool* done){
+    RdbReader r;
+    r.pos = data;
+    r.end = data + len;
+    if(g_data.repl_sync_bytes == 0){
+        if(len < sizeof(k_rdb_magic) || memcmp(data, k_rdb_magic, sizeof(k_rdb_magic)) != 0){
+            return false;
+        }
+        r.pos += sizeof(k_rdb_magic);
+    }
+    if(!rdb_load_part(&r, done)){
+        return false;
+    }
+    g_data.repl_sync_crc = crc64(g_data.repl_sync_crc, data, (size_t)(r.pos - data));
+    g_data.repl_sync_bytes += len;
+    uint64_t crc = 0;
+    return !*done || (rdb_get_u64(&r, &crc) && r.pos == r.end && crc == g_data.repl_sync_crc);
 }
 
-static size_t response_size(Ring_buf& buf, size_t header){
-    return buf.size() - header - 4;
+static void repl_load_end(){
+    g_data.repl_id = g_data.repl_sync_id;
+    g_data.repl_id2.clear();
+    g_data.repl_offset2 = 0;
+    backlog_reset(&g_data.repl_backlog, g_data.repl_sync_offset);
+    repl_backlog_init();
+    std::string err;
+    if(g_conf.appendonly && !rewrite_start(err)){
+        fprintf(stderr, "can't rewrite the append-only file: %s\n", err.c_str());
+    }
+    fprintf(stderr, "loaded %zu keys from the primary in %llu ms\n", hm_size(&g_data.db),
+        (unsigned long long)(get_monotonic_usec() - g_data.repl_sync_start_us) / 1000);
 }
 
-static void response_end(Ring_buf& buf, size_t header){
-    size_t msg_size = response_size(buf, header);
-    if(msg_size > k_max_msg){
-        // buf.tail = (buf.tail + buf.cap - msg_size) % buf.cap ;
-        buf.clear();
-        out_err(buf, ERR_TOO_BIG, "response too big");
-        msg_size = response_size(buf, header);
+// the primary's reply to PSYNC
+static bool repl_handshake(const std::string &reply){
+    if(reply.size() >= 9 && (uint8_t)reply[0] == TAG_ERR){
+        fprintf(stderr, "the primary refused to sync: %s\n", reply.substr(9).c_str());
+        return false;
     }
-    uint32_t len = (uint32_t)msg_size;
-    // buf_append(buf, (const uint8_t*)&len, sizeof(len));
+    uint32_t len = 0;
+    if(reply.size() < 5 || (uint8_t)reply[0] != TAG_STR){
+        return false;
+    }
+    memcpy(&len, &reply[1], 4);
+    if(len != reply.size() - 5){
+        return false;
+    }
+    std::string msg = reply.substr(5);
+    char id[64];
+    unsigned long long offset = 0;
+    if(sscanf(msg.c_str(), "fullresync %40s %llu", id, &offset) == 2){
+        g_data.repl_state = REPL_TRANSFER;
+        g_data.repl_sync_id = id;
+        g_data.repl_sync_offset = offset;
+        repl_load_begin();
+    }else if(sscanf(msg.c_str(), "continue %40s %llu", id, &offset) == 2
+        && g_data.repl_backlog.offset == offset)
+    {
+        if(g_data.repl_id != id){
+            // the primary was promoted, its history goes on from ours
+            g_data.repl_id2 = g_data.repl_id;
+            g_data.repl_offset2 = offset;
+            g_data.repl_id = id;
+        }
+        repl_backlog_init();
+        g_data.repl_state = REPL_CONNECTED;
+    }else{
+        return false;
+    }
+    fprintf(stderr, "primary: %s\n", msg.c_str());
+    return true;
+}
 
-    size_t pos = (buf.head + header) % buf.cap;
-    size_t first = std::min(buf.cap - pos, sizeof(len));
-    memcpy(&buf.buf[pos], &len, first);
-    if(first < sizeof(len)){
-        memcpy(&buf.buf[0], (uint8_t*)&len + first, sizeof(len)-first);}
+// run the complete commands from `*pos` on. the replies are dropped, and
+// the same bytes go on to our own backlog and replicas.
+static bool repl_apply(const std::string &in, size_t* pos){
+    size_t start = *pos;
+    Ring_buf scratch;
+    const uint8_t* payload = nullptr;
+    size_t len = 0;
+    bool ok = true;
+    g_data.repl_applying = true;
+    while(aof_next(in, pos, k_max_req, &payload, &len) == AOF_NEXT_OK){
+        std::vector<std::string> cmd;
+        if(parse_req(payload, len, cmd) < 0 || cmd.empty()){
+            *pos -= 4 + len;
+            ok = false;
+            break;
+        }
+        if(cmd.size() == 1 && cmd[0] == "ping"){
+            continue;
+        }
+        size_t header = 0;
+        response_begin(scratch, &header);
+        bool logged = aof_prepare(cmd);
+        do_request(cmd, scratch);
+        if(logged){
+            aof_commit(response_is_err(scratch, header));
+        }
+        scratch.clear();
+    }
+    g_data.repl_applying = false;
+    repl_feed(in.data() + start, *pos - start);
+    return ok;
 }
 
+// everything the primary sent this tick, as one batch
+static void repl_read_master(Conn* conn){
+    std::string &in = g_data.repl_in;
+    char buf[64 * 1024];
+    size_t total = 0;
+    while(total < k_repl_read_max){
+        int rv = recv(conn->fd, buf, sizeof(buf), 0);
+        if(rv == 0){
+            msg("connection closed by the primary");
+            conn->want_close = true;
+            break;
+        }
+        if(rv == SOCKET_ERROR){
+            int err = WSAGetLastError();
+            if(err != WSAEWOULDBLOCK){
+                msg("recv() error");
+                conn->want_close = true;
+            }
+            break;
+        }
+        in.append(buf, (size_t)rv);
+        total += (size_t)rv;
+    }
+    if(total == 0){
+        return;
+    }
+    g_data.repl_last_io_ms = get_monotonic_msec();
+
+    size_t pos = 0;
+    if(g_data.repl_state == REPL_HANDSHAKE){
+        // | len | reply |
+        uint32_t len = 0;
+        if(in.size() < 4){
+            return;
+        }
+        memcpy(&len, in.data(), 4);
+        if(len > k_max_msg){
+            return repl_fail("bad reply to psync");
+        }
+        if(in.size() < 4 + (size_t)len){
+            return;
+        }
+        if(!repl_handshake(in.substr(4, len))){
+            return repl_fail("can't sync");
+        }
+        pos = 4 + len;
+    }
+    if(g_data.repl_state == REPL_TRANSFER){
+        // | len | records |, loaded as they come
+        bool done = false;
+        uint32_t len = 0;
+        while(!done && in.size() - pos >= 4){
+            memcpy(&len, &in[pos], 4);
+            if(in.size() - pos - 4 < len){
+                break;
+            }
+            if(!repl_load_frame((const uint8_t*)in.data() + pos + 4, len, &done)){
+                return repl_fail("bad snapshot from the primary");
+            }
+            pos += 4 + len;
+        }
+        if(!done){
+            in.erase(0, pos);
+            return;
+        }
+        repl_load_end();
+        g_data.repl_state = REPL_CONNECTED;
+    }
+    if(g_data.repl_state == REPL_CONNECTED){
+        bool ok = repl_apply(in, &pos);
+        repl_send_ack();
+        if(!ok){
+            return repl_fail("bad command in the stream");
+        }
+    }
+    in.erase(0, pos);
+}
 
-static bool try_one_requests(Conn* conn){
+static void repl_cron(){
+    repl_sync_cycle();
+    uint64_t now_ms = get_monotonic_msec();
+    if(g_data.repl_state == REPL_CONNECT && !g_data.repl_master && now_ms >= g_data.repl_retry_ms){
+        repl_connect();
+    }
+    if(g_data.repl_master && now_ms >= g_data.repl_last_io_ms + k_repl_timeout_ms){
+        msg("the primary timed out");
+        repl_drop_link();
+    }
+    if(g_data.repl_state == REPL_CONNECTED && now_ms >= g_data.repl_ack_sent_ms + k_repl_ack_ms){
+        repl_send_ack();
+    }
+    // lets a replica tell a quiet primary from a dead one. a replica passes
+    // on its primary's.
+    if(g_data.repl_state == REPL_NONE && !g_data.replicas.empty()
+        && now_ms >= g_data.repl_ping_ms + k_repl_ping_ms)
+    {
+        g_data.repl_ping_ms = now_ms;
+        std::string ping;
+        aof_put_cmd(ping, {"ping"});
+        repl_feed(ping.data(), ping.size());
+    }
+}
+
+// cut the next request off the incoming buffer, false if it isn't all there
+// or it's bad. only touches the connection, the I/O threads call it too.
+static bool conn_parse_one(Conn* conn, std::vector<std::string> &cmd){
     if(conn->incoming.size() < 4) return false;
     uint32_t len = 0;
 
@@ -737,7 +5404,7 @@ static bool try_one_requests(Conn* conn){
     }
 
 
-    if(len > k_max_msg){
+    if(len > k_max_req){
         msg("message too long");
         conn->want_close = true;
         return false;
@@ -753,25 +5420,82 @@ static bool try_one_requests(Conn* conn){
         memcpy(request.data() + first,&conn->incoming.buf[0],len - first);
     }
 
-    printf("client request: len: %u \n", len);
     // hex_dump(request.data(),len);
 
-    std::vector<std::string> cmd;
     if(parse_req(request.data(), len, cmd)<0){
         msg("parse_req failed");
         conn->want_close = true;
         return false;
     }
 
-    // Response
-    size_t header_pos = 0;
-    response_begin(conn->outgoing, &header_pos);
-    do_request(cmd, conn->outgoing);
-    response_end(conn->outgoing, header_pos);
-
     // make_response(resp,conn->outgoing);
     buf_consume(conn->incoming,4+len);
+    return true;
+}
+
+static bool zset_write_waits(Conn* conn, const std::vector<std::string> &cmd);
+
+// the client is waiting for a job, its requests stay queued
+static bool conn_suspended(Conn* conn){
+    return conn->async || conn->frozen_wait || conn->migrating || conn->slot_wait;
+}
+
+// run a request and queue its reply, on the main thread. false if the
+// request waits and must run again later
+static bool conn_run(Conn* conn, std::vector<std::string> &cmd){
+    if(zset_write_waits(conn, cmd) || migrate_write_waits(conn, cmd)){
+        return false;
+    }
+    if(conn->role == CONN_REPLICA){
+        repl_replica_cmd(conn, cmd); // acks, nothing goes into the stream
+    }else if(cmd.size() == 3 && cmd[0] == "psync"){
+        repl_psync(conn, cmd);
+    }else if(cmd.size() == 1 && cmd[0] == "asking"){
+        conn->asking = true; // for the next command only
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        out_nil(conn->outgoing);
+        response_end(conn->outgoing, header_pos);
+    }else{
+        // Response
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        if(!g_conf.cluster_enabled || cluster_route(conn, cmd, conn->outgoing)){
+            bool logged = aof_prepare(cmd);
+            g_data.cmd_conn = conn;
+            do_request(cmd, conn->outgoing);
+            g_data.cmd_conn = nullptr;
+            if(logged){
+                aof_commit(response_is_err(conn->outgoing, header_pos));
+            }
+        }
+        if(conn->async || conn->migrating){
+            response_cancel(conn->outgoing, header_pos); // see async_done(), migrate_finish()
+        }else{
+            response_end(conn->outgoing, header_pos);
+        }
+    }
+    return true;
+}
+
+// the requests parsed by an I/O thread, up to a suspended one
+static void conn_run_pending(Conn* conn){
+    size_t n = 0;
+    while(n < conn->pending.size() && !conn_suspended(conn) && conn_run(conn, conn->pending[n])){
+        ++n;
+    }
+    conn->pending.erase(conn->pending.begin(), conn->pending.begin() + n);
+}
 
+static bool try_one_requests(Conn* conn){
+    std::vector<std::string> cmd;
+    if(conn_suspended(conn) || !conn_parse_one(conn, cmd)){
+        return false;
+    }
+    if(!conn_run(conn, cmd)){
+        conn->pending.insert(conn->pending.begin(), std::move(cmd)); // runs first once resumed
+        return false;
+    }
     return true;
 }
 
@@ -796,46 +5520,284 @@ static void handle_write(Conn* conn){
     send_all(conn, conn->outgoing);
     // buf_consume(conn->outgoing, rv);
     if(conn->outgoing.empty()){
-        conn->want_read = true;
+        conn->want_read = !conn_suspended(conn);
         conn->want_write = false;
     }
 }
 
-static void handle_read(Conn* conn){
+// false if nothing was read
+static bool conn_recv(Conn* conn){
     uint8_t buf[64*1024];
     int rv = recv(conn->fd, (char*)buf, sizeof(buf), 0);
     if(rv == 0){
         msg("connection closed by client");
         conn->want_close = true;
-        return;
+        return false;
     }
     if(rv == SOCKET_ERROR){
         int err = WSAGetLastError();
-        if(err == WSAEWOULDBLOCK) return;
+        if(err == WSAEWOULDBLOCK) return false;
         msg("recv() error");
         conn->want_close = true;
-        return;
+        return false;
     }
 
     buf_append(conn->incoming, buf, rv);
-    while(try_one_requests(conn)){}
+    return true;
+}
+
+// the replies are queued, stop reading until they're out
+static void conn_replying(Conn* conn){
     if(!conn->outgoing.empty()){
         conn->want_write = true;
-        conn->want_read = false;
-        handle_write(conn);
+        conn->want_read = conn->role == CONN_REPLICA; // the acks come while the stream goes out
+    }
+}
+
+static void handle_read(Conn* conn){
+    if(conn->role == CONN_MASTER){
+        return repl_read_master(conn);
+    }
+    if(conn->role == CONN_MIGRATE){
+        return migrate_read(conn);
+    }
+    if(!conn_recv(conn)){
+        return;
+    }
+    while(try_one_requests(conn)){}
+    conn_replying(conn);
+    if(!conn->outgoing.empty() && !aof_hold_replies()){
+        handle_write(conn); // otherwise after aof_flush(), on POLLOUT
+    }
+}
+
+// a command may hand its work to the thread pool and suspend its client:
+// no reading, no requests run, until the reply is written from the
+// completion queue. the other clients go on meanwhile.
+
+// the requests that came meanwhile
+static void conn_resume(Conn* conn){
+    conn_run_pending(conn);
+    while(try_one_requests(conn)){}
+    conn_replying(conn);
+    if(!conn->outgoing.empty() && !aof_hold_replies()){
+        handle_write(conn); // otherwise after aof_flush(), on POLLOUT
+    }
+    if(conn->outgoing.empty()){
+        conn->want_read = !conn_suspended(conn);
+    }
+    if(conn->want_close){
+        conn_destroy(conn);
+    }
+}
+
+static void async_done(CqJob* job){
+    AsyncCmd* ac = container_of(job, AsyncCmd, job);
+    g_data.stat_async_usec += get_monotonic_usec() - ac->start_us;
+    if(ac->release){
+        ac->release(ac);
+    }
+    Conn* conn = ac->conn;
+    if(conn){
+        conn->async = nullptr;
+        size_t header_pos = 0;
+        response_begin(conn->outgoing, &header_pos);
+        ac->reply(ac, conn->outgoing);
+        response_end(conn->outgoing, header_pos);
+        conn_resume(conn);
+    }
+    ac->del(ac);
+}
+
+// the client of the command running waits for `ac`, set up but for `done`
+static void async_suspend(AsyncCmd* ac){
+    Conn* conn = g_data.cmd_conn;
+    ac->conn = conn;
+    ac->job.done = &async_done;
+    ac->start_us = get_monotonic_usec();
+    conn->async = ac;
+    conn->want_read = false;
+    g_data.stat_async_cmds++;
+    cq_submit(&g_data.cq, &g_data.thread_pool, TP_PRIO_NORMAL, &ac->job);
+}
+
+// a job may read a zset in place instead of a copy: until zset_thaw() the
+// zset doesn't change. the lookups on the event loop don't rehash it, the
+// clients writing to it wait, a key deleted or overwritten meanwhile leaves
+// it to zset_thaw() to free, and the other writers copy it first.
+static void zset_freeze(ZSet* zset, const std::string &key){
+    zset_settle(zset);
+    zset->readers++;
+    FrozenZSet frozen;
+    frozen.zset = zset;
+    frozen.key = key;
+    g_data.frozen.push_back(frozen);
+}
+
+static void zset_thaw(ZSet* zset){
+    for(size_t i = 0; i < g_data.frozen.size(); ++i){
+        if(g_data.frozen[i].zset == zset){
+            g_data.frozen.erase(g_data.frozen.begin() + i);
+            break;
+        }
+    }
+    if(--zset->readers > 0){
+        return;
+    }
+    std::vector<ZSet*> &orphans = g_data.frozen_orphans;
+    std::vector<ZSet*>::iterator it = std::find(orphans.begin(), orphans.end(), zset);
+    if(it != orphans.end()){
+        orphans.erase(it);
+        zset_del(zset);
+    }
+}
+
+// the waiting writes run again, the zsets still frozen keep them waiting
+static void zset_thaw_wake(){
+    std::vector<Conn*> waiters;
+    waiters.swap(g_data.frozen_waiters);
+    for(Conn* conn : waiters){
+        conn->frozen_wait = false;
+        conn_resume(conn);
+    }
+}
+
+// a client writing to a frozen zset waits, without running the command
+static bool zset_write_waits(Conn* conn, const std::vector<std::string> &cmd){
+    if(g_data.frozen.empty() || cmd.size() < 2 || conn->role != CONN_CLIENT){
+        return false;
+    }
+    const std::string &name = cmd[0];
+    if(name != "zadd" && name != "zrem" && name != "zremrangebyrank" && name != "zremrangebyscore"){
+        return false; // the others replace the zset, if anything
+    }
+    for(FrozenZSet &frozen : g_data.frozen){
+        if(frozen.key == cmd[1]){
+            conn->frozen_wait = true;
+            conn->want_read = false;
+            g_data.frozen_waiters.push_back(conn);
+            return true;
+        }
+    }
+    return false;
+}
+
+// I/O threads: the clients ready in one tick are read and their requests
+// parsed in parallel, then the commands run on the main thread one client
+// at a time, as without them, and the replies are sent in parallel again.
+// the keyspace stays with the main thread, an I/O thread touches nothing
+// but the buffers and flags of the clients given to it.
+struct IoBatch{
+    std::vector<IoReady>* ready = nullptr;
+    size_t nparts = 1;
+};
+
+static void io_read_part(void* arg, size_t part){
+    IoBatch* batch = (IoBatch*)arg;
+    std::vector<IoReady> &ready = *batch->ready;
+    for(size_t i = part; i < ready.size(); i += batch->nparts){
+        Conn* conn = ready[i].conn;
+        if(!(ready[i].events & POLLIN) || !conn_recv(conn)){
+            continue;
+        }
+        std::vector<std::string> cmd;
+        while(conn_parse_one(conn, cmd)){
+            conn->pending.push_back(std::vector<std::string>());
+            conn->pending.back().swap(cmd);
+        }
+    }
+}
+
+static void io_write_part(void* arg, size_t part){
+    IoBatch* batch = (IoBatch*)arg;
+    std::vector<IoReady> &ready = *batch->ready;
+    for(size_t i = part; i < ready.size(); i += batch->nparts){
+        if(ready[i].write){
+            handle_write(ready[i].conn);
+        }
     }
 }
 
+static void io_run(void (*f)(void*, size_t)){
+    IoBatch batch;
+    batch.ready = &g_data.io_ready;
+    batch.nparts = std::min<size_t>(g_conf.io_threads, g_data.io_ready.size());
+    thread_pool_run(&g_data.io_pool, batch.nparts, f, &batch);
+}
+
+static void io_handle_clients(){
+    std::vector<IoReady> &ready = g_data.io_ready;
+    io_run(&io_read_part);
+    for(IoReady &r : ready){
+        Conn* conn = r.conn;
+        if(r.events & POLLIN){
+            g_data.stat_io_reads++;
+        }
+        conn_run_pending(conn);
+        conn_replying(conn);
+    }
+    // the group fsync holds every reply of the tick
+    bool hold = aof_hold_replies();
+    for(IoReady &r : ready){
+        bool replied = (r.events & POLLIN) && !hold && !r.conn->outgoing.empty();
+        r.write = !r.conn->want_close && ((r.events & POLLOUT) || replied);
+        g_data.stat_io_writes += r.write ? 1 : 0;
+    }
+    io_run(&io_write_part);
+    for(IoReady &r : ready){
+        if((r.events & POLLERR) || r.conn->want_close){
+            conn_destroy(r.conn);
+        }
+    }
+    ready.clear();
+}
+
 const uint64_t k_idle_timeout_ms = 60*1000;
 
 static int32_t next_timer_ms(){
-    if(dlist_empty(&g_data.idle_list)){
+    uint64_t now_ms = get_monotonic_msec();
+    uint64_t next_ms = (uint64_t)-1;
+    if(!dlist_empty(&g_data.idle_list)){
+        Conn* conn = container_of(g_data.idle_list.next, Conn, idle_node);
+        next_ms = conn->last_active_msec + k_idle_timeout_ms;
+    }
+    if(!g_data.heap.empty() && g_data.repl_state == REPL_NONE){
+        next_ms = std::min(next_ms, g_data.heap[0].val);
+    }
+    if(g_data.repl_state != REPL_NONE || !g_data.replicas.empty()){
+        next_ms = std::min(next_ms, now_ms + k_repl_tick_ms);
+    }
+    if(g_conf.activedefrag){
+        // keep ticking to check or continue the defrag
+        next_ms = std::min(next_ms, std::max(g_data.defrag_next_ms, now_ms + 1));
+    }
+    if(g_data.bgsave_job){
+        // continue the scan, or wait for the file
+        uint64_t tick = g_data.bgsave_job->scan.scanning ? k_snap_tick_ms : k_bgsave_poll_ms;
+        next_ms = std::min(next_ms, now_ms + tick);
+    }
+    if(g_data.warm){
+        next_ms = std::min(next_ms, now_ms + k_warm_tick_ms);
+    }
+    if(g_data.migrate_batch){
+        next_ms = std::min(next_ms, g_data.migrate_batch->deadline_ms);
+    }
+    if(g_data.repl_sync_job){
+        next_ms = std::min(next_ms, now_ms + k_snap_tick_ms);
+    }
+    if(g_data.rewrite_running){
+        uint64_t tick = g_data.rewrite_stage == REWRITE_SCAN ? k_snap_tick_ms : k_bgsave_poll_ms;
+        next_ms = std::min(next_ms, now_ms + tick);
+    }
+    if(!g_data.aof_buf.empty()){
+        next_ms = std::min(next_ms, now_ms + k_aof_retry_ms); // a failed write
+    }else if(g_data.aof_dirty && g_conf.appendfsync == AOF_FSYNC_EVERYSEC){
+        next_ms = std::min(next_ms,
+            std::max(g_data.aof_last_fsync_ms + k_aof_fsync_interval_ms, now_ms + k_aof_retry_ms));
+    }
+    if(next_ms == (uint64_t)-1){
         return -1; // no timers, no timeouts
     }
-
-    uint64_t now_ms = get_monotonic_msec();
-    Conn* conn = container_of(g_data.idle_list.next, Conn, idle_node);
-    uint64_t next_ms = conn->last_active_msec + k_idle_timeout_ms;
     if(next_ms <= now_ms){
         return 0; // miss?
     }
@@ -855,8 +5817,160 @@ static void debug_idle_list() {
     fprintf(stderr, "\nIdle-list size=%d\n", cnt);
 }
 
-static bool hnode_same(HNode* node, HNode* key){
-    return node == key;
+
+// move an Entry out of a sparse slab page, `from` is its incoming hashtable link
+static Entry* defrag_entry(HNode** from){
+    Entry* ent = container_of(*from, Entry, node);
+    Entry* fresh = (Entry*)slab_defrag_alloc(ent, entry_size());
+    if(!fresh){
+        return ent;
+    }
+    new (fresh) Entry();
+    fresh->node = ent->node;
+    fresh->key.swap(ent->key);
+    fresh->type = ent->type;
+    fresh->lru = ent->lru;
+    fresh->heap_idx = ent->heap_idx;
+    memcpy(fresh->snap_epoch, ent->snap_epoch, sizeof(fresh->snap_epoch));
+    if(ent->type == T_STR){
+        new (&fresh->str) std::string();
+        fresh->str.swap(ent->str);
+        ent->str.~basic_string();
+    }else if(ent->type == T_ZSET){
+        fresh->zset = ent->zset;
+    }
+    // fix the intrusive references
+    if(fresh->heap_idx != (size_t)-1){
+        g_data.heap[fresh->heap_idx].ref = &fresh->heap_idx;
+    }
+    if(g_conf.cluster_enabled){
+        DList* node = entry_slot_node(fresh);
+        *node = *entry_slot_node(ent);
+        node->prev->next = node;
+        node->next->prev = node;
+    }
+    *from = &fresh->node;
+
+    ent->~Entry();
+    slab_defrag_free(ent, entry_size());
+    g_data.stat_defrag_hits++;
+    return fresh;
+}
+
+// zsets up to this size are walked in one go
+const size_t k_defrag_inline_members = 1000;
+
+static void cb_defrag_key(HNode** from, void*){
+    Entry* ent = defrag_entry(from);
+    g_data.stat_defrag_scanned++;
+    if(ent->type != T_ZSET || ent->zset->readers){
+        return; // a job may be reading its members, see zset_freeze()
+    }
+    // the ZSet header has no back pointers, a plain copy will do
+    ZSet* fresh = (ZSet*)slab_defrag_alloc(ent->zset, sizeof(ZSet));
+    if(fresh){
+        memcpy((void*)fresh, ent->zset, sizeof(ZSet));
+        slab_defrag_free(ent->zset, sizeof(ZSet));
+        ent->zset = fresh;
+        g_data.stat_defrag_hits++;
+    }
+    if(zset_size(ent->zset) > k_defrag_inline_members){
+        g_data.defrag_zsets.push_back(ent->key);
+        return;
+    }
+    size_t moved = 0;
+    size_t cursor = 0;
+    do{
+        cursor = zset_defrag(ent->zset, cursor, &moved);
+    }while(cursor);
+    g_data.stat_defrag_hits += moved;
+}
+
+static bool defrag_wanted(){
+    if(!g_conf.activedefrag){
+        return false;
+    }
+    SlabStats st;
+    slab_stats(&st);
+    size_t waste = st.reserved_bytes > st.used_bytes ? st.reserved_bytes - st.used_bytes : 0;
+    return waste >= g_conf.active_defrag_ignore_bytes
+        && waste * 100 >= (size_t)g_conf.active_defrag_threshold_lower * st.used_bytes;
+}
+
+const uint64_t k_defrag_tick_ms = 10;
+const uint64_t k_defrag_idle_ms = 1000;
+
+// incremental active defrag: walk the keyspace and the zset members,
+// relocating objects out of sparse slab pages within a CPU budget
+static void defrag_cycle(uint64_t now_ms){
+    if(now_ms < g_data.defrag_next_ms){
+        return;
+    }
+    g_data.defrag_next_ms = now_ms + k_defrag_tick_ms;
+    if(!g_data.defrag_running){
+        if(!defrag_wanted()){
+            return;
+        }
+        g_data.defrag_running = true;
+        g_data.defrag_cursor = 0;
+        g_data.defrag_pass_hits = g_data.stat_defrag_hits;
+    }
+
+    uint64_t budget_us = k_defrag_tick_ms * 1000 * g_conf.active_defrag_cycle_max / 100;
+    uint64_t start_us = get_monotonic_usec();
+    for(size_t steps = 1; ; ++steps){
+        if(!g_data.defrag_zsets.empty()){
+            // continue with a large zset, it may be gone since
+            LookupKey key;
+            key_init(key, g_data.defrag_zsets.back());
+            HNode* node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+            Entry* ent = node ? container_of(node, Entry, node) : nullptr;
+            size_t moved = 0;
+            if(ent && ent->type == T_ZSET && !ent->zset->readers){
+                g_data.defrag_zcursor = zset_defrag(ent->zset, g_data.defrag_zcursor, &moved);
+                g_data.stat_defrag_hits += moved;
+            }else{
+                g_data.defrag_zcursor = 0;
+            }
+            if(g_data.defrag_zcursor == 0){
+                g_data.defrag_zsets.pop_back();
+            }else{
+                key.key.swap(g_data.defrag_zsets.back()); // still in progress
+            }
+        }else{
+            g_data.defrag_cursor = hm_scan(&g_data.db, g_data.defrag_cursor, &cb_defrag_key, nullptr);
+            if(g_data.defrag_cursor == 0){
+                g_data.defrag_running = false; // a full pass is done
+                if(g_data.stat_defrag_hits == g_data.defrag_pass_hits){
+                    // nothing left to move, don't rescan in a loop
+                    g_data.defrag_next_ms = now_ms + k_defrag_idle_ms;
+                }
+                break;
+            }
+        }
+        if(steps % 16 == 0 && get_monotonic_usec() - start_us >= budget_us){
+            break;
+        }
+    }
+}
+
+// time budget of one active expire cycle
+const uint64_t k_expire_budget_us = 1000;
+
+// TTL timers using a heap. the heap gives the due keys in order, so the
+// work is bounded by time instead of a fixed count: a large backlog is
+// drained over back-to-back cycles (see next_timer_ms()) with I/O in between.
+static void expire_cycle(uint64_t now_ms){
+    const vector<HeapItem> &heap = g_data.heap;
+    uint64_t start_us = get_monotonic_usec();
+    for(size_t nworks = 1; !heap.empty() && heap[0].val <= now_ms; ++nworks){
+        entry_expire(container_of(heap[0].ref, Entry, heap_idx));
+        if(nworks % 16 == 0 && get_monotonic_usec() - start_us >= k_expire_budget_us){
+            // don't stall the server if too many keys are expiring at once
+            g_data.stat_expired_time_cap++;
+            break;
+        }
+    }
 }
 
 static void process_timers(){
@@ -874,28 +5988,118 @@ static void process_timers(){
     }
     // debug_idle_list();
 
-    // TTL timers using a heap
-    const size_t k_max_works = 2000;
-    size_t nworks = 0;
-    const vector<HeapItem> &heap = g_data.heap;
-    while(!heap.empty() && heap[0].val < now_ms){
-        Entry* ent = container_of(heap[0].ref, Entry, heap_idx);
-        HNode* node = hm_delete(&g_data.db, &ent->node, &hnode_same);
-        assert(node == &ent->node);
-        fprintf(stderr, "removing expired key: %s\n", ent->key.c_str());
-        // delte the key
-        entry_del(ent);
-        if(nworks++ >= k_max_works){
-            // don't stall the server if too many keys are expiring at once
-            break;
+    if(g_data.repl_state == REPL_NONE){
+        expire_cycle(now_ms); // a replica's keys expire by the primary's DELs
+    }
+    defrag_cycle(now_ms);
+    bgsave_cycle();
+    warm_cycle();
+    rewrite_cycle();
+    repl_cron();
+    migrate_cron(now_ms);
+}
+
+// replay the append-only file at startup, a missing file is an empty keyspace
+static bool aof_load(const std::string &path){
+    std::string data, err;
+    if(!aof_read(path, data, err)){
+        if(err.empty()){
+            return true;
+        }
+        fprintf(stderr, "can't load %s: %s\n", path.c_str(), err.c_str());
+        return false;
+    }
+    uint64_t start_us = get_monotonic_usec();
+    g_data.aof_loading = true;
+    size_t pos = 0, ncmds = 0;
+    if(data.size() >= sizeof(k_rdb_magic) && memcmp(data.data(), k_rdb_magic, sizeof(k_rdb_magic)) == 0){
+        // a rewritten file, the snapshot preamble then the commands
+        RdbReader r;
+        r.pos = (const uint8_t*)data.data() + sizeof(k_rdb_magic);
+        r.end = (const uint8_t*)data.data() + data.size();
+        uint64_t crc = 0;
+        if(rdb_load_records(&r) && rdb_get_u64(&r, &crc)){
+            pos = (const char*)r.pos - data.data();
+        }
+        if(pos == 0 || crc64(0, data.data(), pos - 8) != crc){
+            fprintf(stderr, "can't load %s: bad snapshot preamble\n", path.c_str());
+            return false;
+        }
+    }
+    Ring_buf scratch; // the replies
+    const uint8_t* payload = nullptr;
+    size_t len = 0;
+    int rv = AOF_NEXT_OK;
+    while((rv = aof_next(data, &pos, k_max_req, &payload, &len)) == AOF_NEXT_OK){
+        std::vector<std::string> cmd;
+        if(parse_req(payload, len, cmd) < 0){
+            fprintf(stderr, "can't load %s: bad command before offset %zu\n", path.c_str(), pos);
+            return false;
+        }
+        do_request(cmd, scratch);
+        scratch.clear();
+        ncmds++;
+    }
+    g_data.aof_loading = false;
+    if(rv == AOF_NEXT_TRUNCATED){
+        // a crash in the middle of a write, the command was never acknowledged
+        fprintf(stderr, "%s ends with a partial command, dropping %zu bytes\n",
+            path.c_str(), data.size() - pos);
+        if(!aof_truncate(path, pos)){
+            fprintf(stderr, "can't truncate %s\n", path.c_str());
+            return false;
         }
     }
+    g_data.aof_size = g_data.aof_base_size = pos;
+    fprintf(stderr, "replayed %zu commands from %s in %llu ms\n", ncmds, path.c_str(),
+        (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+    return true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // ./server [--port 1234] [--name value]...
+    uint16_t port = 6379;
+    if(argc % 2 == 0){
+        fprintf(stderr, "usage: %s [--port 1234] [--name value]...\n", argv[0]);
+        return 1;
+    }
+    for(int i = 1; i + 1 < argc; i += 2){
+        std::string name = argv[i];
+        if(name.compare(0, 2, "--") != 0){
+            fprintf(stderr, "bad argument: %s\n", argv[i]);
+            return 1;
+        }
+        name = name.substr(2);
+        if(name == "port"){
+            port = (uint16_t)atoi(argv[i + 1]);
+        }else if(!config_set(name, argv[i + 1])){
+            fprintf(stderr, "bad config: %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+    }
+
     // initialization
     dlist_init(&g_data.idle_list);
     thread_pool_init(&g_data.thread_pool, 4);
+    if(g_conf.io_threads > 1){
+        thread_pool_init(&g_data.io_pool, g_conf.io_threads - 1);
+    }
+    g_data.repl_id = repl_new_id();
+    if(g_conf.cluster_enabled){
+        cluster_init(port);
+    }
+    if(g_conf.appendonly){
+        std::string err;
+        if(!aof_load(g_conf.appendfilename)){
+            return 1;
+        }
+        if(!aof_open(g_conf.appendfilename, &g_data.aof_fd, err)){
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+    }else if(!(g_conf.warm_start ? warm_start(g_conf.dbfilename) : rdb_load(g_conf.dbfilename))){
+        return 1;
+    }
 
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0){
@@ -909,7 +6113,7 @@ int main() {
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(6379);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     int opt = 1;
@@ -922,10 +6126,15 @@ int main() {
         die("listen() failed");
 
     fd_set_nb(fd);
-    cout << "Server listening on port 6379..." << endl;
+    std::string cq_err;
+    if(!cq_init(&g_data.cq, cq_err)){
+        die(cq_err.c_str());
+    }
+    cout << "Server listening on port " << port << "..." << endl;
 
     // unordered_map<SOCKET, Conn*> fd2conn_map;
     vector<WSAPOLLFD> poll_args;
+    g_data.started = true;
 
 while (true) {
     poll_args.clear();
@@ -936,6 +6145,12 @@ while (true) {
     pfd_listen.events = POLLIN;  // 只监听读事件
     poll_args.push_back(pfd_listen);
 
+    // the thread pool's results
+    WSAPOLLFD pfd_cq{};
+    pfd_cq.fd = g_data.cq.rfd;
+    pfd_cq.events = POLLIN;
+    poll_args.push_back(pfd_cq);
+
     // 连接 socket
     for (auto &kv : g_data.fd2conn_map) {
         SOCKET cfd = kv.first;
@@ -968,7 +6183,7 @@ while (true) {
     }
 
     // 处理连接 sockets
-    for (size_t i = 1; i < poll_args.size(); ++i) {
+    for (size_t i = 2; i < poll_args.size(); ++i) {
         uint32_t ready = poll_args[i].revents;
         if (ready == 0) continue;
 
@@ -980,6 +6195,10 @@ while (true) {
         dlist_detach(&conn->idle_node);
         dlist_insert_before(&g_data.idle_list, &conn->idle_node);
 
+        if (g_conf.io_threads > 1 && conn->role == CONN_CLIENT) {
+            g_data.io_ready.push_back(IoReady{conn, ready, false});
+            continue;
+        }
         if (ready & POLLIN)  handle_read(conn);
         if (ready & POLLOUT) handle_write(conn);
 
@@ -987,10 +6206,22 @@ while (true) {
             conn_destroy(conn);
         }
     }
+    if (!g_data.io_ready.empty()) {
+        io_handle_clients();
+    }
+    if (poll_args[1].revents & POLLIN) {
+        cq_run(&g_data.cq); // replies to the suspended clients
+    }
 
     process_timers();
+    aof_flush(); // before sleeping
 }
     closesocket(fd);
     WSACleanup();
+    if(g_conf.io_threads > 1){
+        thread_pool_shutdown(&g_data.io_pool);
+    }
+    thread_pool_shutdown(&g_data.thread_pool);
+    cq_close(&g_data.cq);
     return 0;
 }
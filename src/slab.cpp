@@ -0,0 +1,315 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "slab.h"
+#include "zmalloc.h"
+#include "list.h"
+#include "common.h"
+
+// +------------+-----+-----+-----+-----+
+// | SlabPage   | obj | obj | ... | obj |   one k_slab_page_size aligned page
+// +------------+-----+-----+-----+-----+
+struct SlabPage{
+    DList node;            // linked in SlabClass::partial while it has free objects
+    void* free = nullptr;  // free objects inside this page (singly linked)
+    uint32_t used = 0;     // objects out of the page (in use or in a thread cache)
+    uint32_t total = 0;
+    uint32_t cls = 0;
+};
+
+struct SlabClass{
+    pthread_mutex_t mutex;
+    DList partial;         // pages with at least one free object
+    size_t nempty = 0;     // pages with used == 0, we keep one of them around
+    std::atomic<size_t> npages{0};
+    std::atomic<uint64_t> allocs{0};
+    std::atomic<uint64_t> frees{0};
+};
+
+static struct SlabGlobal{
+    SlabClass cls[k_slab_nclass];
+    std::atomic<size_t> large_bytes{0};
+    std::atomic<uint64_t> page_allocs{0};
+    std::atomic<uint64_t> page_frees{0};
+
+    SlabGlobal(){
+        for(size_t i = 0; i < k_slab_nclass; ++i){
+            pthread_mutex_init(&cls[i].mutex, nullptr);
+            dlist_init(&cls[i].partial);
+        }
+    }
+} g_slab;
+
+// per-thread cache, refilled from and flushed to the pages in batches
+const uint32_t k_cache_max = 64;
+const uint32_t k_cache_batch = 32;
+
+struct SlabCache{
+    void* items[k_slab_nclass][k_cache_max];
+    uint32_t n[k_slab_nclass];
+};
+
+static thread_local SlabCache t_cache;
+
+static size_t class_of(size_t size){
+    return (size + k_slab_align - 1) / k_slab_align - 1;
+}
+
+static size_t class_size(size_t cls){
+    return (cls + 1) * k_slab_align;
+}
+
+static SlabPage* page_of(void* ptr){
+    return (SlabPage*)((uintptr_t)ptr & ~(uintptr_t)(k_slab_page_size - 1));
+}
+
+static void* page_mem_alloc(){
+#ifdef _WIN32
+    // VirtualAlloc() hands out 64K aligned regions
+    return VirtualAlloc(nullptr, k_slab_page_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* p = nullptr;
+    return posix_memalign(&p, k_slab_page_size, k_slab_page_size) == 0 ? p : nullptr;
+#endif
+}
+
+static void page_mem_free(void* p){
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    free(p);
+#endif
+}
+
+// a fresh page with all objects on its free list. class lock held.
+static SlabPage* page_new(size_t cls){
+    void* mem = page_mem_alloc();
+    assert(mem);
+    SlabPage* page = new (mem) SlabPage();
+    page->cls = (uint32_t)cls;
+
+    size_t size = class_size(cls);
+    size_t start = (sizeof(SlabPage) + k_slab_align - 1) & ~(k_slab_align - 1);
+    page->total = (uint32_t)((k_slab_page_size - start) / size);
+    // build the free list backwards so objects are handed out in address order
+    for(size_t i = page->total; i > 0; --i){
+        void* obj = (char*)mem + start + (i - 1) * size;
+        *(void**)obj = page->free;
+        page->free = obj;
+    }
+
+    SlabClass &sc = g_slab.cls[cls];
+    dlist_insert_before(sc.partial.next, &page->node); // use it first
+    sc.nempty++;
+    sc.npages++;
+    g_slab.page_allocs++;
+    return page;
+}
+
+// take one object out of a page with free objects. class lock held.
+static void* page_get(SlabClass &sc, SlabPage* page){
+    if(page->used == 0){
+        sc.nempty--;
+    }
+    void* obj = page->free;
+    page->free = *(void**)obj;
+    page->used++;
+    if(!page->free){
+        dlist_detach(&page->node); // the page is full
+    }
+    return obj;
+}
+
+// put an object back into its page. class lock held.
+static void page_put(SlabClass &sc, void* obj){
+    SlabPage* page = page_of(obj);
+    assert(page->used > 0);
+    if(!page->free){
+        dlist_insert_before(&sc.partial, &page->node); // full -> partial
+    }
+    *(void**)obj = page->free;
+    page->free = obj;
+    page->used--;
+    if(page->used > 0){
+        return;
+    }
+    if(sc.nempty == 0){
+        sc.nempty++; // keep one empty page to avoid thrashing
+    }else{
+        dlist_detach(&page->node);
+        page->~SlabPage();
+        page_mem_free(page);
+        sc.npages--;
+        g_slab.page_frees++;
+    }
+}
+
+static void cache_refill(size_t cls){
+    SlabClass &sc = g_slab.cls[cls];
+    uint32_t &n = t_cache.n[cls];
+
+    pthread_mutex_lock(&sc.mutex);
+    while(n < k_cache_batch){
+        if(dlist_empty(&sc.partial)){
+            page_new(cls);
+        }
+        SlabPage* page = container_of(sc.partial.next, SlabPage, node);
+        t_cache.items[cls][n++] = page_get(sc, page);
+    }
+    pthread_mutex_unlock(&sc.mutex);
+}
+
+// return the `k` oldest cached objects to their pages
+static void cache_flush(size_t cls, uint32_t k){
+    SlabClass &sc = g_slab.cls[cls];
+    uint32_t &n = t_cache.n[cls];
+    void** items = t_cache.items[cls];
+    if(k > n){
+        k = n;
+    }
+
+    pthread_mutex_lock(&sc.mutex);
+    for(uint32_t i = 0; i < k; ++i){
+        assert(page_of(items[i])->cls == cls);
+        page_put(sc, items[i]);
+    }
+    pthread_mutex_unlock(&sc.mutex);
+
+    memmove(&items[0], &items[k], (n - k) * sizeof(void*));
+    n -= k;
+}
+
+void* slab_alloc(size_t size){
+    if(size == 0){
+        size = 1;
+    }
+    if(size > k_slab_max_size){
+        void* p = zmalloc(size);
+        assert(p);
+        g_slab.large_bytes.fetch_add(size, std::memory_order_relaxed);
+        return p;
+    }
+
+    size_t cls = class_of(size);
+    if(t_cache.n[cls] == 0){
+        cache_refill(cls);
+    }
+    g_slab.cls[cls].allocs.fetch_add(1, std::memory_order_relaxed);
+    return t_cache.items[cls][--t_cache.n[cls]];
+}
+
+void slab_free(void* ptr, size_t size){
+    if(!ptr){
+        return;
+    }
+    if(size == 0){
+        size = 1;
+    }
+    if(size > k_slab_max_size){
+        zfree(ptr);
+        g_slab.large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        return;
+    }
+
+    size_t cls = class_of(size);
+    if(t_cache.n[cls] == k_cache_max){
+        cache_flush(cls, k_cache_batch);
+    }
+    t_cache.items[cls][t_cache.n[cls]++] = ptr;
+    g_slab.cls[cls].frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* slab_defrag_alloc(void* ptr, size_t size){
+    if(size == 0){
+        size = 1;
+    }
+    if(size > k_slab_max_size){
+        return nullptr;
+    }
+    size_t cls = class_of(size);
+    SlabClass &sc = g_slab.cls[cls];
+    SlabPage* page = page_of(ptr);
+
+    pthread_mutex_lock(&sc.mutex);
+    // only objects in pages below the class average are worth a move
+    uint64_t npages = sc.npages.load(std::memory_order_relaxed);
+    uint64_t live = sc.allocs.load(std::memory_order_relaxed) - sc.frees.load(std::memory_order_relaxed);
+    bool sparse = npages > 1 && page->used * npages * 100 < k_defrag_util_pct * live;
+    // move it into the fullest of the first few partial pages
+    SlabPage* target = nullptr;
+    size_t nscan = 0;
+    for(DList* it = sc.partial.next; sparse && it != &sc.partial && nscan < 16; it = it->next, ++nscan){
+        SlabPage* cand = container_of(it, SlabPage, node);
+        if(cand != page && cand->used > page->used && (!target || cand->used > target->used)){
+            target = cand;
+        }
+    }
+    void* obj = target ? page_get(sc, target) : nullptr;
+    pthread_mutex_unlock(&sc.mutex);
+
+    if(obj){
+        sc.allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return obj;
+}
+
+void slab_defrag_free(void* ptr, size_t size){
+    if(size == 0){
+        size = 1;
+    }
+    size_t cls = class_of(size);
+    SlabClass &sc = g_slab.cls[cls];
+    pthread_mutex_lock(&sc.mutex);
+    page_put(sc, ptr); // bypass the cache so the sparse page can drain
+    pthread_mutex_unlock(&sc.mutex);
+    sc.frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t slab_usable_size(size_t size){
+    if(size == 0){
+        size = 1;
+    }
+    return size > k_slab_max_size ? size : class_size(class_of(size));
+}
+
+void slab_thread_flush(){
+    for(size_t cls = 0; cls < k_slab_nclass; ++cls){
+        cache_flush(cls, t_cache.n[cls]);
+    }
+}
+
+void slab_class_stats(SlabClassStats* out){
+    for(size_t cls = 0; cls < k_slab_nclass; ++cls){
+        SlabClass &sc = g_slab.cls[cls];
+        out[cls].obj_size = class_size(cls);
+        out[cls].pages = sc.npages.load(std::memory_order_relaxed);
+        out[cls].allocs = sc.allocs.load(std::memory_order_relaxed);
+        out[cls].frees = sc.frees.load(std::memory_order_relaxed);
+        // the counters are updated independently, don't underflow
+        out[cls].live = out[cls].allocs > out[cls].frees
+            ? (size_t)(out[cls].allocs - out[cls].frees) : 0;
+    }
+}
+
+void slab_stats(SlabStats* out){
+    SlabClassStats cs[k_slab_nclass];
+    slab_class_stats(cs);
+
+    *out = SlabStats{};
+    for(size_t cls = 0; cls < k_slab_nclass; ++cls){
+        out->pages += cs[cls].pages;
+        out->used_bytes += cs[cls].live * cs[cls].obj_size;
+        out->allocs += cs[cls].allocs;
+        out->frees += cs[cls].frees;
+    }
+    out->reserved_bytes = out->pages * k_slab_page_size;
+    out->large_bytes = g_slab.large_bytes.load(std::memory_order_relaxed);
+    out->page_allocs = g_slab.page_allocs.load(std::memory_order_relaxed);
+    out->page_frees = g_slab.page_frees.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// size-class slab allocator for the small fixed-size objects of the keyspace
+// (Entry, ZSet, ZNode). objects of one class are carved out of aligned pages,
+// so the owning page of any object is found by masking its address.
+//
+// every thread keeps a small per-class cache, so the event loop and the
+// background deleters in the thread pool only take the class lock once per batch.
+
+const size_t k_slab_page_size = 64 * 1024; // also the page alignment
+const size_t k_slab_align = 16;            // class granularity
+const size_t k_slab_max_size = 512;        // larger requests go to zmalloc()
+const size_t k_slab_nclass = k_slab_max_size / k_slab_align;
+
+struct SlabClassStats{
+    size_t obj_size = 0;
+    size_t pages = 0;      // pages owned by the class
+    size_t live = 0;       // objects handed out and not yet freed
+    uint64_t allocs = 0;   // total allocations
+    uint64_t frees = 0;    // total frees
+};
+
+struct SlabStats{
+    size_t pages = 0;
+    size_t reserved_bytes = 0; // pages * k_slab_page_size
+    size_t used_bytes = 0;     // live objects * their class size
+    size_t large_bytes = 0;    // live requests above k_slab_max_size
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+    uint64_t page_allocs = 0;  // pages taken from the OS
+    uint64_t page_frees = 0;   // pages given back to the OS
+};
+
+void* slab_alloc(size_t size);
+void slab_free(void* ptr, size_t size);
+
+// active defrag: a new home for `ptr` in a denser page of the same class,
+// or nullptr if the object is fine where it is. the caller moves the data,
+// fixes its references and releases the old copy with slab_defrag_free().
+const uint32_t k_defrag_util_pct = 100; // pages below this % of the average utilization are sparse
+void* slab_defrag_alloc(void* ptr, size_t size);
+void slab_defrag_free(void* ptr, size_t size);
+
+// the class size that backs a request of `size` bytes
+size_t slab_usable_size(size_t size);
+
+// give this thread's cached objects back to their pages
+void slab_thread_flush();
+
+void slab_stats(SlabStats* out);
+// fills one item per size class (k_slab_nclass items)
+void slab_class_stats(SlabClassStats* out);
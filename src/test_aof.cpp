@@ -0,0 +1,99 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "aof.h"
+#include "fileio.h"
+
+typedef std::vector<std::string> Cmd;
+
+static Cmd decode(const uint8_t* p, size_t len){
+    uint32_t n = 0;
+    memcpy(&n, p, 4);
+    size_t off = 4;
+    Cmd cmd;
+    for(uint32_t i = 0; i < n; ++i){
+        uint32_t l = 0;
+        memcpy(&l, p + off, 4);
+        cmd.push_back(std::string((const char*)p + off + 4, l));
+        off += 4 + l;
+    }
+    assert(off == len);
+    return cmd;
+}
+
+static void test_framing(){
+    const std::vector<Cmd> cmds = {
+        {"set", "k", "v"},
+        {"del", "k"},
+        {"zadd", "z", "1", std::string(1000, 'x'), "2", ""},
+    };
+    std::string data;
+    for(const Cmd &cmd : cmds){
+        aof_put_cmd(data, cmd);
+    }
+    size_t pos = 0;
+    const uint8_t* payload = nullptr;
+    size_t len = 0;
+    for(const Cmd &cmd : cmds){
+        assert(aof_next(data, &pos, 1 << 20, &payload, &len) == AOF_NEXT_OK);
+        assert(decode(payload, len) == cmd);
+    }
+    assert(aof_next(data, &pos, 1 << 20, &payload, &len) == AOF_NEXT_END);
+
+    // every cut inside the last command is a truncated tail
+    size_t last = data.size();
+    aof_put_cmd(data, {"set", "a", "b"});
+    for(size_t cut = last + 1; cut < data.size(); ++cut){
+        std::string part = data.substr(0, cut);
+        pos = last;
+        assert(aof_next(part, &pos, 1 << 20, &payload, &len) == AOF_NEXT_TRUNCATED);
+        assert(pos == last);
+    }
+    // and so is a length over the limit
+    pos = 0;
+    assert(aof_next(data, &pos, 4, &payload, &len) == AOF_NEXT_TRUNCATED);
+}
+
+static void test_file(){
+    const std::string path = "test_aof.tmp.aof";
+    remove(path.c_str());
+    std::string data, err;
+    assert(!aof_read(path, data, err) && err.empty()); // missing
+
+    int fd = -1;
+    std::string one, two;
+    aof_put_cmd(one, {"set", "k", "1"});
+    aof_put_cmd(two, {"set", "k", "2"});
+    size_t written = 0;
+    assert(aof_open(path, &fd, err));
+    assert(aof_write(fd, one.data(), one.size(), &written) && written == one.size());
+    assert(file_fsync(fd));
+    aof_close(fd);
+    // appends
+    assert(aof_open(path, &fd, err));
+    assert(aof_write(fd, two.data(), two.size(), &written));
+    aof_close(fd);
+    assert(aof_read(path, data, err) && data == one + two);
+
+    assert(aof_truncate(path, one.size()));
+    assert(aof_read(path, data, err) && data == one);
+
+    // a rewritten file replaces the old one
+    const std::string tmp = path + ".rewrite";
+    assert(aof_open(tmp, &fd, err));
+    assert(aof_write(fd, two.data(), two.size(), &written));
+    aof_close(fd);
+    assert(file_rename(tmp, path));
+    assert(aof_read(path, data, err) && data == two);
+    assert(!aof_read(tmp, data, err) && err.empty());
+    remove(path.c_str());
+}
+
+int main(){
+    test_framing();
+    test_file();
+    printf("test_aof ok\n");
+    return 0;
+}
@@ -159,6 +159,29 @@ static void test_remove(uint32_t sz) {
     }
 }
 
+// cut out the ranks [lo, hi) and join the rest back together
+static void test_split_join(uint32_t sz) {
+    for (uint32_t lo = 0; lo <= sz; ++lo) {
+        for (uint32_t hi = lo; hi <= sz; ++hi) {
+            Container c;
+            std::multiset<uint32_t> ref, mid_ref;
+            for (uint32_t i = 0; i < sz; ++i) {
+                add(c, i);
+                (i >= lo && i < hi ? mid_ref : ref).insert(i);
+            }
+            AVLNode *head = nullptr, *rest = nullptr, *tail = nullptr;
+            Container mid;
+            avl_split(c.root, lo, &head, &rest);
+            avl_split(rest, hi - lo, &mid.root, &tail);
+            c.root = avl_concat(head, tail);
+            container_verify(c, ref);
+            container_verify(mid, mid_ref);
+            dispose(c);
+            dispose(mid);
+        }
+    }
+}
+
 int main() {
     Container c;
 
@@ -205,6 +228,9 @@ int main() {
         test_insert_dup(i);
         test_remove(i);
     }
+    for (uint32_t i = 0; i < 40; ++i) {
+        test_split_join(i);
+    }
 
     dispose(c);
     return 0;
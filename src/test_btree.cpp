@@ -0,0 +1,213 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <set>
+#include <vector>
+#include "btree.h"
+
+// items are the integers themselves
+static int cmp_int(void* item, const void* key){
+    intptr_t a = (intptr_t)item;
+    intptr_t b = *(const intptr_t*)key;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void add(BTree &t, std::set<intptr_t> &ref, intptr_t v){
+    if(ref.count(v)){
+        return;
+    }
+    btree_insert(&t, (void*)v, &v, &cmp_int);
+    ref.insert(v);
+}
+
+static void del(BTree &t, std::set<intptr_t> &ref, intptr_t v){
+    bool found = btree_delete(&t, &v, &cmp_int);
+    assert(found == (ref.erase(v) == 1));
+}
+
+static void verify(BTree &t, std::set<intptr_t> &ref){
+    assert(t.size == ref.size());
+    // walk the linked leaves
+    BIter it;
+    intptr_t lo = INTPTR_MIN;
+    btree_seekge(&t, &lo, &cmp_int, &it);
+    size_t rank = 0;
+    for(intptr_t v : ref){
+        assert((intptr_t)biter_item(&it) == v);
+        assert(btree_rank(&it) == rank);
+        BIter sel;
+        assert(btree_select(&t, rank, &sel));
+        assert(sel.leaf == it.leaf && sel.idx == it.idx);
+        btree_offset(&t, &it, 1);
+        ++rank;
+    }
+    assert(!it.leaf);
+
+    // seek and far offsets
+    std::vector<intptr_t> vals(ref.begin(), ref.end());
+    for(size_t i = 0; i < vals.size(); i += 3){
+        BIter a;
+        assert(btree_seekge(&t, &vals[i], &cmp_int, &a));
+        for(int64_t off = -(int64_t)i - 2; off < (int64_t)(vals.size() - i) + 2; off += 5){
+            BIter b = a;
+            int64_t j = (int64_t)i + off;
+            bool ok = btree_offset(&t, &b, off);
+            assert(ok == (j >= 0 && j < (int64_t)vals.size()));
+            if(ok){
+                assert((intptr_t)biter_item(&b) == vals[j]);
+            }
+        }
+    }
+}
+
+// parents, keys, counts, leaf links and the node counts
+static size_t check_node(BNode* node, BNode* parent, int depth, int &leaf_depth,
+    std::vector<BLeaf*> &leaves, size_t &ninner)
+{
+    assert(node->parent == parent);
+    assert(node->n > 0);
+    if(node->leaf){
+        assert(node->n < k_bleaf_max);
+        assert(leaf_depth < 0 || leaf_depth == depth);
+        leaf_depth = depth;
+        leaves.push_back((BLeaf*)node);
+        return node->n;
+    }
+    assert(node->n < k_binner_max);
+    ++ninner;
+    BInner* inner = (BInner*)node;
+    size_t size = 0;
+    for(uint32_t i = 0; i < node->n; ++i){
+        BNode* kid = inner->kids[i];
+        size_t cnt = check_node(kid, node, depth + 1, leaf_depth, leaves, ninner);
+        assert(inner->cnt[i] == cnt);
+        void* min = kid->leaf ? ((BLeaf*)kid)->items[0] : ((BInner*)kid)->keys[0];
+        assert(inner->keys[i] == min);
+        size += cnt;
+    }
+    return size;
+}
+
+static void check_tree(BTree &t){
+    if(!t.root){
+        assert(!t.first && t.size == 0 && t.nleaf == 0 && t.ninner == 0);
+        return;
+    }
+    assert(!t.root->parent);
+    assert(t.root->leaf || t.root->n > 1);
+    int leaf_depth = -1;
+    std::vector<BLeaf*> leaves;
+    size_t ninner = 0;
+    assert(check_node(t.root, nullptr, 0, leaf_depth, leaves, ninner) == t.size);
+    assert(t.nleaf == leaves.size() && t.ninner == ninner);
+    assert(t.first == leaves[0] && !leaves[0]->prev && !leaves.back()->next);
+    for(size_t i = 1; i < leaves.size(); ++i){
+        assert(leaves[i - 1]->next == leaves[i] && leaves[i]->prev == leaves[i - 1]);
+    }
+}
+
+static void fill(BTree &t, std::set<intptr_t> &ref, intptr_t lo, size_t n){
+    for(size_t i = 0; i < n; ++i){
+        add(t, ref, lo + (intptr_t)(rand() % (n * 2 + 1)));
+    }
+}
+
+// split at every kind of rank, join trees of different heights
+static void test_split_join(size_t n){
+    BTree t;
+    std::set<intptr_t> ref;
+    fill(t, ref, 0, n);
+    for(size_t round = 0; round < 10; ++round){
+        size_t rank = ref.empty() ? 0 : (size_t)rand() % (ref.size() + 1);
+        if(round == 0){
+            rank = 0;
+        }else if(round == 1){
+            rank = ref.size();
+        }
+        std::set<intptr_t> lref, rref;
+        size_t i = 0;
+        for(intptr_t v : ref){
+            (i++ < rank ? lref : rref).insert(v);
+        }
+        BTree right;
+        btree_split(&t, rank, &right);
+        check_tree(t);
+        check_tree(right);
+        verify(t, lref);
+        verify(right, rref);
+
+        // drop a random part of the right side, then join it back
+        BTree tail;
+        size_t cut = rref.empty() ? 0 : (size_t)rand() % (rref.size() + 1);
+        btree_split(&right, cut, &tail);
+        i = 0;
+        for(auto it = rref.begin(); it != rref.end(); ++i){
+            it = i < cut ? rref.erase(it) : std::next(it);
+        }
+        btree_clear(&right, [](void*, void*){}, nullptr);
+        btree_join(&t, &tail);
+        assert(!tail.root && tail.size == 0 && tail.nleaf == 0 && tail.ninner == 0);
+        ref = lref;
+        ref.insert(rref.begin(), rref.end());
+        check_tree(t);
+        verify(t, ref);
+
+        // join a tree of another size on either side
+        BTree other;
+        std::set<intptr_t> oref;
+        intptr_t top = ref.empty() ? 0 : *ref.rbegin() + 1;
+        fill(other, oref, top, (size_t)rand() % (n + 1));
+        btree_join(&t, &other);
+        ref.insert(oref.begin(), oref.end());
+        check_tree(t);
+        verify(t, ref);
+        oref.clear();
+        intptr_t bottom = ref.empty() ? 0 : *ref.begin();
+        size_t m = (size_t)rand() % (n / 2 + 1);
+        fill(other, oref, bottom - (intptr_t)(m * 2 + 1), m);
+        btree_join(&other, &t);
+        t = other;
+        other = BTree{};
+        ref.insert(oref.begin(), oref.end());
+        check_tree(t);
+        verify(t, ref);
+    }
+    btree_clear(&t, [](void*, void*){}, nullptr);
+}
+
+static void test_case(size_t n){
+    BTree t;
+    std::set<intptr_t> ref;
+    for(size_t i = 0; i < n; ++i){
+        add(t, ref, rand() % (n * 4));
+    }
+    verify(t, ref);
+    for(size_t i = 0; i < n * 2; ++i){
+        del(t, ref, rand() % (n * 4));
+    }
+    verify(t, ref);
+    // in order, the worst case for the splits
+    for(size_t i = 0; i < n; ++i){
+        add(t, ref, (intptr_t)(n * 4 + i));
+    }
+    verify(t, ref);
+    while(!ref.empty()){
+        del(t, ref, *ref.begin());
+    }
+    verify(t, ref);
+    assert(!t.root && t.nleaf == 0 && t.ninner == 0);
+    btree_clear(&t, [](void*, void*){}, nullptr);
+}
+
+int main(){
+    for(size_t n = 1; n < 2000; n = n * 3 / 2 + 1){
+        test_case(n);
+    }
+    for(size_t n = 0; n < 2000; n = n * 2 + 1){
+        test_split_join(n);
+    }
+    printf("test_btree ok\n");
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "cluster.h"
+
+static uint32_t slot(const char* key){
+    return key_hash_slot(key, strlen(key));
+}
+
+static void test_slots(){
+    // the check value of crc-16/xmodem, and slots from the Redis Cluster spec
+    assert(crc16("123456789", 9) == 0x31c3);
+    assert(slot("foo") == 12182);
+    assert(slot("bar") == 5061);
+    assert(slot("") == 0);
+    // hash tags
+    assert(slot("{user1000}.following") == slot("user1000"));
+    assert(slot("{user1000}.followers") == slot("{user1000}.following"));
+    assert(slot("foo{}{bar}") == crc16("foo{}{bar}", 10) % k_cluster_slots); // empty tag
+    assert(slot("foo{{bar}}zap") == slot("{bar"));                          // up to the first }
+    assert(slot("foo{bar}{zap}") == slot("bar"));                           // the first tag
+    assert(slot("foo{bar") == crc16("foo{bar", 7) % k_cluster_slots);       // not closed
+}
+
+static void test_ranges(){
+    uint32_t first = 0, last = 0;
+    assert(parse_slot_range("0", &first, &last) && first == 0 && last == 0);
+    assert(parse_slot_range("16383", &first, &last) && first == 16383 && last == 16383);
+    assert(parse_slot_range("100-200", &first, &last) && first == 100 && last == 200);
+    assert(!parse_slot_range("16384", &first, &last));
+    assert(!parse_slot_range("200-100", &first, &last));
+    assert(!parse_slot_range("", &first, &last));
+    assert(!parse_slot_range("1-", &first, &last));
+    assert(!parse_slot_range("-1", &first, &last));
+    assert(!parse_slot_range("12a", &first, &last));
+    assert(!parse_slot_range("0000000001", &first, &last));
+}
+
+int main(){
+    test_slots();
+    test_ranges();
+    printf("test_cluster ok\n");
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include "completion.h"
+
+struct SumJob{
+    CqJob job;
+    uint64_t n = 0;
+    uint64_t sum = 0;
+    bool* done = nullptr;
+};
+
+static void job_work(CqJob* job){
+    SumJob* sj = (SumJob*)job;
+    for(uint64_t i = 1; i <= sj->n; ++i){
+        sj->sum += i;
+    }
+}
+
+static void job_done(CqJob* job){
+    SumJob* sj = (SumJob*)job;
+    assert(sj->sum == sj->n * (sj->n + 1) / 2);
+    assert(!*sj->done);
+    *sj->done = true;
+    delete sj;
+}
+
+// wait until the loop would be woken, then run what's done
+static size_t poll_run(CompletionQueue* cq, int timeout_ms){
+    WSAPOLLFD pfd{};
+    pfd.fd = cq->rfd;
+    pfd.events = POLLIN;
+    int rv = WSAPoll(&pfd, 1, timeout_ms);
+    assert(rv >= 0);
+    return rv > 0 ? cq_run(cq) : 0;
+}
+
+static void test_jobs(){
+    CompletionQueue cq;
+    std::string err;
+    assert(cq_init(&cq, err));
+    TheadPool tp;
+    thread_pool_init(&tp, 4);
+
+    // nothing to wake for
+    assert(poll_run(&cq, 0) == 0);
+
+    const size_t n = 5000;
+    bool done[n] = {};
+    for(size_t i = 0; i < n; ++i){
+        SumJob* sj = new SumJob();
+        sj->job.work = &job_work;
+        sj->job.done = &job_done;
+        sj->n = i * 10;
+        sj->done = &done[i];
+        cq_submit(&cq, &tp, TP_PRIO_NORMAL, &sj->job);
+    }
+    size_t got = 0;
+    while(got < n){
+        got += poll_run(&cq, 5000);
+    }
+    assert(got == n && cq.inflight == 0);
+    for(size_t i = 0; i < n; ++i){
+        assert(done[i]);
+    }
+    // the wakeups are coalesced, no more than one per job
+    assert(cq.wakeups > 0 && cq.wakeups <= n);
+    // and all read, the loop wouldn't spin
+    assert(poll_run(&cq, 0) == 0);
+
+    thread_pool_shutdown(&tp);
+    cq_close(&cq);
+}
+
+int main(){
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+    test_jobs();
+    WSACleanup();
+    printf("test_completion ok\n");
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "rdb.h"
+
+static void test_crc64(){
+    // the check value of crc-64-jones
+    assert(crc64(0, "123456789", 9) == 0xe9c6d914c4b8d9caULL);
+    // incremental over any split
+    std::string data;
+    for(size_t i = 0; i < 1000; ++i){
+        data.push_back((char)(i * 31 + 7));
+    }
+    uint64_t whole = crc64(0, data.data(), data.size());
+    for(size_t cut = 0; cut <= data.size(); cut += 13){
+        uint64_t crc = crc64(0, data.data(), cut);
+        assert(crc64(crc, data.data() + cut, data.size() - cut) == whole);
+    }
+}
+
+static void test_codec(){
+    const uint64_t k_ints[] = {0, 1, 127, 128, 300, 1ULL << 35, ~0ULL};
+    std::string out;
+    for(uint64_t v : k_ints){
+        rdb_put_varint(out, v);
+        rdb_put_u64(out, v);
+    }
+    rdb_put_u8(out, 0xab);
+    rdb_put_dbl(out, -1.5);
+    rdb_put_str(out, "hello", 5);
+    rdb_put_str(out, "", 0);
+
+    RdbReader r;
+    r.pos = (const uint8_t*)out.data();
+    r.end = r.pos + out.size();
+    for(uint64_t v : k_ints){
+        uint64_t a = 0, b = 0;
+        assert(rdb_get_varint(&r, &a) && a == v);
+        assert(rdb_get_u64(&r, &b) && b == v);
+    }
+    uint8_t u8 = 0;
+    double dbl = 0;
+    const char* s = nullptr;
+    size_t len = 0;
+    assert(rdb_get_u8(&r, &u8) && u8 == 0xab);
+    assert(rdb_get_dbl(&r, &dbl) && dbl == -1.5);
+    assert(rdb_get_str(&r, &s, &len) && len == 5 && memcmp(s, "hello", 5) == 0);
+    assert(rdb_get_str(&r, &s, &len) && len == 0);
+    assert(r.pos == r.end && !r.err);
+    // reading past the end fails and stays failed
+    assert(!rdb_get_u8(&r, &u8) && r.err);
+
+    // a string longer than the input
+    std::string bad;
+    rdb_put_varint(bad, 100);
+    bad += "short";
+    r.pos = (const uint8_t*)bad.data();
+    r.end = r.pos + bad.size();
+    r.err = false;
+    assert(!rdb_get_str(&r, &s, &len));
+}
+
+static void test_file(){
+    const std::string path = "test_rdb.tmp.rdb";
+    std::vector<RdbSection> sects(4);
+    for(size_t i = 0; i < sects.size(); ++i){
+        for(size_t k = 0; k < i; ++k){
+            rdb_put_index(sects[i], k * 2, sects[i].data.size()); // in hcode order
+            rdb_put_u8(sects[i].data, RDB_TYPE_STR);
+            rdb_put_u8(sects[i].data, 0);
+            rdb_put_str(sects[i].data, "key", 3);
+        }
+        sects[i].data += std::string(i * (1 << 19), 'x'); // more than one write chunk
+    }
+    std::string err;
+    assert(!rdb_write_file(path, std::vector<RdbSection>(3), err)); // not a power of 2
+    assert(rdb_write_file(path, sects, err));
+
+    RdbFile file;
+    std::vector<RdbSectionInfo> info;
+    assert(rdb_map_file(path, &file, err));
+    assert(rdb_read_sections(file, info, err) && info.size() == sects.size());
+    for(size_t i = 0; i < sects.size(); ++i){
+        std::string data((const char*)file.data + info[i].offset, info[i].size);
+        assert(data == sects[i].data + sects[i].index && info[i].nkeys == sects[i].nkeys);
+        assert(info[i].crc == crc64(0, data.data(), data.size()));
+        assert(info[i].index == info[i].offset + sects[i].data.size());
+        // every record is found by its hcode
+        for(size_t k = 0; k < i; ++k){
+            RdbIndexEntry e;
+            assert(rdb_index_lower_bound(file, info[i], k * 2) == k);
+            assert(rdb_index_lower_bound(file, info[i], k * 2 + 1) == k + 1);
+            assert(rdb_index_at(file, info[i], k, &e) && e.hcode == k * 2);
+            assert(file.data[e.offset] == RDB_TYPE_STR);
+        }
+    }
+    RdbReader r;
+    assert(!rdb_read_stream(file, &r, err)); // the other format
+    std::string whole((const char*)file.data, file.size);
+    rdb_unmap_file(&file);
+    // the same bytes built in memory, as sent to a replica
+    std::string mem;
+    rdb_put_header(mem, sects);
+    for(const RdbSection &sect : sects){
+        mem += sect.data + sect.index;
+    }
+    assert(mem == whole);
+
+    // a flipped bit in the header fails its checksum
+    FILE* fp = fopen(path.c_str(), "r+b");
+    assert(fp);
+    fseek(fp, 20, SEEK_SET);
+    fputc(whole[20] ^ 1, fp);
+    fclose(fp);
+    assert(rdb_map_file(path, &file, err));
+    assert(!rdb_read_sections(file, info, err));
+    rdb_unmap_file(&file);
+    // and so does a truncated file
+    fp = fopen(path.c_str(), "wb");
+    fwrite(whole.data(), 1, whole.size() - 1, fp);
+    fclose(fp);
+    assert(rdb_map_file(path, &file, err));
+    assert(!rdb_read_sections(file, info, err));
+    rdb_unmap_file(&file);
+
+    // the stream format
+    std::string stream(k_rdb_magic, sizeof(k_rdb_magic));
+    stream += sects[1].data;
+    rdb_put_u8(stream, RDB_OP_EOF);
+    rdb_put_u64(stream, crc64(0, stream.data(), stream.size()));
+    fp = fopen(path.c_str(), "wb");
+    fwrite(stream.data(), 1, stream.size(), fp);
+    fclose(fp);
+    assert(rdb_map_file(path, &file, err));
+    assert(rdb_read_stream(file, &r, err));
+    assert(std::string(r.pos, r.end) == sects[1].data + (char)RDB_OP_EOF);
+    assert(!rdb_read_sections(file, info, err));
+    rdb_unmap_file(&file);
+
+    remove(path.c_str());
+    assert(!rdb_map_file(path, &file, err));
+}
+
+// records appended in any order come out as if written in hcode order
+static void test_sort_section(){
+    RdbSection sorted, mixed;
+    std::vector<RdbIndexEntry> recs;
+    const uint64_t k_hcodes[] = {7, 3, 9, 3, 0, 12, 5};
+    auto put = [](RdbSection &sect, size_t i){
+        std::string key(i + 1, (char)('a' + i));
+        rdb_put_u8(sect.data, RDB_TYPE_STR);
+        rdb_put_str(sect.data, key.data(), key.size());
+    };
+    for(size_t i = 0; i < 7; ++i){
+        RdbIndexEntry e;
+        e.hcode = k_hcodes[i];
+        e.offset = mixed.data.size();
+        recs.push_back(e);
+        put(mixed, i);
+    }
+    // stable, the two records with hcode 3 keep their order
+    for(size_t i : {4, 1, 3, 6, 0, 2, 5}){
+        rdb_put_index(sorted, k_hcodes[i], sorted.data.size());
+        put(sorted, i);
+    }
+    rdb_sort_section(mixed, recs);
+    assert(mixed.data == sorted.data && mixed.index == sorted.index);
+    assert(mixed.nkeys == sorted.nkeys);
+
+    RdbSection empty;
+    rdb_sort_section(empty, {});
+    assert(empty.data.empty() && empty.index.empty() && empty.nkeys == 0);
+}
+
+int main(){
+    test_crc64();
+    test_codec();
+    test_file();
+    test_sort_section();
+    printf("test_rdb ok\n");
+    return 0;
+}
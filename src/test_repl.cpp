@@ -0,0 +1,65 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include "repl.h"
+
+static std::string stream_bytes(uint64_t from, uint64_t to){
+    std::string s;
+    for(uint64_t i = from; i < to; ++i){
+        s.push_back((char)(i * 7 + 3));
+    }
+    return s;
+}
+
+static void test_ring(){
+    ReplBacklog bl;
+    // no ring, only the offset moves
+    std::string data = stream_bytes(0, 10);
+    backlog_append(&bl, data.data(), data.size());
+    std::string out;
+    assert(bl.offset == 10 && backlog_read(&bl, 10, out) && out.empty());
+    assert(!backlog_read(&bl, 9, out));
+
+    backlog_resize(&bl, 100);
+    // appends of every size, wrapping around many times
+    for(uint64_t n = 1; n < 300; n += 17){
+        data = stream_bytes(bl.offset, bl.offset + n);
+        backlog_append(&bl, data.data(), data.size());
+        uint64_t first = bl.offset - bl.histlen;
+        assert(bl.histlen == std::min<uint64_t>(bl.offset - 10, 100));
+        for(uint64_t off = first; off <= bl.offset; ++off){
+            assert(backlog_read(&bl, off, out) && out == stream_bytes(off, bl.offset));
+        }
+        assert(!backlog_read(&bl, first - 1, out));
+        assert(!backlog_read(&bl, bl.offset + 1, out));
+    }
+}
+
+static void test_resize(){
+    ReplBacklog bl;
+    backlog_resize(&bl, 64);
+    std::string data = stream_bytes(0, 200);
+    backlog_append(&bl, data.data(), data.size());
+    std::string out;
+    // shrinking keeps the newest bytes
+    backlog_resize(&bl, 16);
+    assert(bl.histlen == 16 && backlog_read(&bl, 184, out) && out == stream_bytes(184, 200));
+    assert(!backlog_read(&bl, 183, out));
+    // and growing keeps them all
+    backlog_resize(&bl, 1000);
+    data = stream_bytes(200, 300);
+    backlog_append(&bl, data.data(), data.size());
+    assert(backlog_read(&bl, 184, out) && out == stream_bytes(184, 300));
+
+    backlog_reset(&bl, 5000);
+    assert(bl.histlen == 0 && !backlog_read(&bl, 299, out));
+    assert(backlog_read(&bl, 5000, out) && out.empty());
+}
+
+int main(){
+    test_ring();
+    test_resize();
+    printf("test_repl ok\n");
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+#include "thread_pool.h"
+
+static std::atomic<int> g_count{0};
+
+static void cb_count(void*){
+    g_count++;
+}
+
+static void test_futures(){
+    TheadPool tp;
+    thread_pool_init(&tp, 4);
+    // more than the initial deque size, so it grows
+    std::vector<TpFuture> futs(10000);
+    for(TpFuture &fut : futs){
+        thread_pool_submit(&tp, TP_PRIO_NORMAL, &cb_count, nullptr, &fut);
+    }
+    for(TpFuture &fut : futs){
+        thread_pool_wait(&tp, &fut);
+    }
+    assert(g_count == 10000);
+    thread_pool_shutdown(&tp);
+}
+
+struct Part{
+    TheadPool* tp;
+    std::vector<std::atomic<int>>* hits;
+};
+
+static void cb_inner(void* arg, size_t i){
+    (*((Part*)arg)->hits)[100 + i]++;
+}
+
+static void cb_part(void* arg, size_t i){
+    Part* p = (Part*)arg;
+    (*p->hits)[i]++;
+    if(i == 3){
+        thread_pool_run(p->tp, 8, &cb_inner, arg); // nested, from a worker
+    }
+}
+
+static void test_run(){
+    TheadPool tp;
+    thread_pool_init(&tp, 3);
+    std::vector<std::atomic<int>> hits(200);
+    Part p = {&tp, &hits};
+    for(int round = 0; round < 100; ++round){
+        thread_pool_run(&tp, 16, &cb_part, &p);
+    }
+    for(size_t i = 0; i < 16; ++i){
+        assert(hits[i] == 100);
+    }
+    for(size_t i = 100; i < 108; ++i){
+        assert(hits[i] == 100);
+    }
+    thread_pool_shutdown(&tp);
+}
+
+static std::atomic<bool> g_gate{false};
+static std::vector<int> g_order; // by the single worker only
+
+static void cb_gate(void*){
+    while(!g_gate.load()){
+        usleep(1000);
+    }
+}
+
+static void cb_record(void* arg){
+    g_order.push_back((int)(intptr_t)arg);
+}
+
+static void test_priority(){
+    TheadPool tp;
+    thread_pool_init(&tp, 1);
+    TpFuture gate;
+    thread_pool_submit(&tp, TP_PRIO_NORMAL, &cb_gate, nullptr, &gate);
+    while(tp.queued.load() != 0){
+        usleep(100); // the worker holds the gate
+    }
+    for(intptr_t i = 0; i < 10; ++i){
+        thread_pool_submit(&tp, TP_PRIO_LOW, &cb_record, (void*)(TP_PRIO_LOW * 100 + i));
+        thread_pool_submit(&tp, TP_PRIO_NORMAL, &cb_record, (void*)(TP_PRIO_NORMAL * 100 + i));
+        thread_pool_submit(&tp, TP_PRIO_HIGH, &cb_record, (void*)(TP_PRIO_HIGH * 100 + i));
+    }
+    g_gate = true;
+    thread_pool_shutdown(&tp); // runs them all first
+    assert(g_order.size() == 30);
+    // by priority, and in order within one: stolen from the top of our deque
+    for(size_t i = 0; i < 30; ++i){
+        assert(g_order[i] == (int)(i / 10 * 100 + i % 10));
+    }
+    assert(tp_future_done(&gate));
+}
+
+struct Submitter{
+    TheadPool* tp;
+};
+
+static void* submitter(void* arg){
+    TheadPool* tp = ((Submitter*)arg)->tp;
+    std::vector<TpFuture> futs(1000);
+    for(size_t i = 0; i < futs.size(); ++i){
+        thread_pool_submit(tp, (uint32_t)(i % TP_PRIO_COUNT), &cb_count, nullptr, &futs[i]);
+    }
+    for(TpFuture &fut : futs){
+        thread_pool_wait(tp, &fut);
+    }
+    return nullptr;
+}
+
+static void test_submitters(){
+    // more threads than k_tp_submitters, the last ones share a deque
+    TheadPool tp;
+    thread_pool_init(&tp, 4);
+    g_count = 0;
+    Submitter s = {&tp};
+    std::vector<pthread_t> threads(k_tp_submitters + 4);
+    for(pthread_t &t : threads){
+        pthread_create(&t, nullptr, &submitter, &s);
+    }
+    for(pthread_t &t : threads){
+        pthread_join(t, nullptr);
+    }
+    assert(g_count == (int)(1000 * threads.size()));
+    uint64_t tasks = 0;
+    for(TpWorkerStats* st : tp.stats){
+        tasks += st->tasks.load();
+    }
+    // the waiters run some of the urgent ones themselves
+    assert(tasks <= 1000 * threads.size() && tasks > 0);
+    thread_pool_shutdown(&tp);
+}
+
+static void test_reinit(){
+    // the same address, fewer threads: an owner from the last pool is stale
+    TheadPool tp;
+    for(size_t round = 0; round < 6; ++round){
+        thread_pool_init(&tp, round % 2 ? 1 : 6);
+        TpFuture fut;
+        thread_pool_submit(&tp, TP_PRIO_NORMAL, &cb_count, nullptr, &fut);
+        thread_pool_wait(&tp, &fut);
+        assert(tp.nsubmitters.load() == 1);
+        thread_pool_shutdown(&tp);
+    }
+    // more pools than the cache holds, the ones used last stay in it
+    const size_t n = 6;
+    std::vector<TheadPool> pools(n);
+    for(TheadPool &p : pools){
+        thread_pool_init(&p, 1);
+    }
+    for(int round = 0; round < 2; ++round){
+        for(size_t i = 0; i < n; ++i){
+            TpFuture fut;
+            thread_pool_submit(&pools[i], TP_PRIO_NORMAL, &cb_count, nullptr, &fut);
+            thread_pool_wait(&pools[i], &fut);
+        }
+    }
+    for(TheadPool &p : pools){
+        assert(p.nsubmitters.load() == 2); // evicted before each second round
+    }
+    TpFuture fut;
+    thread_pool_submit(&pools[n - 1], TP_PRIO_NORMAL, &cb_count, nullptr, &fut);
+    thread_pool_wait(&pools[n - 1], &fut);
+    assert(pools[n - 1].nsubmitters.load() == 2);
+    for(TheadPool &p : pools){
+        thread_pool_shutdown(&p);
+    }
+}
+
+int main(){
+    test_futures();
+    test_run();
+    test_priority();
+    test_submitters();
+    test_reinit();
+    printf("test_thread_pool ok\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include "zcombine.h"
+
+typedef std::map<std::string, double> Ref;
+
+static void add(ZSet* zset, Ref &ref, const std::string &name, double score){
+    zset_insert(zset, name.data(), name.size(), score);
+    ref[name] = score;
+}
+
+// the result by name, whatever the order of the parts
+static Ref result_of(ZCombine* zc){
+    Ref out;
+    for(std::vector<ZAddItem> &part : zc->out){
+        for(ZAddItem &item : part){
+            bool added = out.emplace(std::string(item.name, item.len), item.score).second;
+            assert(added);
+        }
+    }
+    return out;
+}
+
+// the commands' semantics over plain maps
+static Ref combine_ref(const std::vector<Ref> &refs, uint32_t op, uint32_t aggregate,
+    const std::vector<double> &weights)
+{
+    Ref out;
+    for(auto &kv : refs[0]){
+        double score = kv.second * weights[0];
+        bool keep = true;
+        for(size_t i = 1; i < refs.size() && keep; ++i){
+            auto it = refs[i].find(kv.first);
+            if(op == ZOP_DIFF){
+                keep = it == refs[i].end();
+            }else if(op == ZOP_INTER){
+                keep = it != refs[i].end();
+            }
+        }
+        if(keep){
+            out[kv.first] = std::isnan(score) ? 0 : score;
+        }
+    }
+    if(op == ZOP_DIFF){
+        return out;
+    }
+    for(size_t i = 1; i < refs.size(); ++i){
+        for(auto &kv : refs[i]){
+            double score = kv.second * weights[i];
+            score = std::isnan(score) ? 0 : score;
+            auto it = out.find(kv.first);
+            if(it == out.end()){
+                if(op == ZOP_UNION){
+                    out[kv.first] = score;
+                }
+                continue;
+            }
+            double &acc = it->second;
+            if(aggregate == ZAGG_MIN){
+                acc = std::min(acc, score);
+            }else if(aggregate == ZAGG_MAX){
+                acc = std::max(acc, score);
+            }else{
+                acc = std::isnan(acc + score) ? 0 : acc + score;
+            }
+        }
+    }
+    return out;
+}
+
+static void setup(ZCombine* zc, uint32_t op, uint32_t aggregate, const std::vector<ZSet*> &inputs,
+    const std::vector<double> &weights)
+{
+    zc->op = op;
+    zc->aggregate = aggregate;
+    zc->inputs = inputs;
+    zc->weights.assign(weights.begin(), weights.begin() + inputs.size());
+}
+
+// ZINTERCARD by lookups, and by the parts from a copy of the first input,
+// against the reference
+static void test_card(TheadPool* tp, const std::vector<ZSet*> &inputs, size_t want){
+    for(size_t limit : {(size_t)0, (size_t)1, (size_t)100, want, want + 1}){
+        ZCombine zc;
+        setup(&zc, ZOP_INTER, ZAGG_SUM, inputs, std::vector<double>(inputs.size(), 1));
+        zc.card = true;
+        zc.limit = limit;
+        size_t expect = limit ? std::min(want, limit) : want;
+        size_t found = 0;
+        assert(zcombine_card(&zc, SIZE_MAX, &found) && found == expect);
+        // a few lookups are enough only when the limit comes first
+        if(zcombine_card(&zc, 10, &found)){
+            assert(found == expect && limit);
+        }
+
+        ZCombine copied;
+        setup(&copied, ZOP_INTER, ZAGG_SUM, inputs, zc.weights);
+        copied.card = true;
+        copied.limit = limit;
+        zcombine_copy_first(&copied);
+        assert(copied.first.size() == zset_size(inputs[0]));
+        zcombine_run(&copied, tp);
+        found = copied.found.load();
+        assert((limit ? std::min(found, limit) : found) == expect);
+        for(std::vector<ZAddItem> &part : copied.out){
+            assert(part.empty()); // counted only
+        }
+    }
+    // the slices of the copy add up, however many parts
+    ZCombine sliced;
+    setup(&sliced, ZOP_INTER, ZAGG_SUM, inputs, std::vector<double>(inputs.size(), 1));
+    sliced.card = true;
+    zcombine_copy_first(&sliced);
+    sliced.nparts = k_zcombine_parts;
+    sliced.out.resize(sliced.nparts);
+    for(size_t part = 0; part < sliced.nparts; ++part){
+        zcombine_part(&sliced, part);
+    }
+    assert(sliced.found.load() == want);
+}
+
+static void test_combine(TheadPool* tp, uint32_t engine){
+    zset_set_engine(engine);
+    // two indexed zsets and a listpack, 52k members in all
+    ZSet a, b, c;
+    std::vector<Ref> refs(3);
+    for(int i = 0; i < 30000; ++i){
+        double score = i % 1000 == 0 ? INFINITY : (double)(rand() % 100);
+        add(&a, refs[0], "m" + std::to_string(i), score);
+    }
+    for(int i = 15000; i < 37000; ++i){
+        double score = i % 777 == 0 ? -INFINITY : (double)(rand() % 100) / 4;
+        add(&b, refs[1], "m" + std::to_string(i), score);
+    }
+    for(int i = 0; i < 40; ++i){
+        add(&c, refs[2], "m" + std::to_string(rand() % 40000), (double)(rand() % 10));
+    }
+    assert(a.encoding == engine && c.encoding == ZSET_LISTPACK);
+
+    const std::vector<std::vector<double>> weights = {{1, 1, 1}, {2, 0, -1.5}, {0, 1, 1}};
+    for(uint32_t op : {ZOP_UNION, ZOP_INTER, ZOP_DIFF}){
+        for(uint32_t aggregate : {ZAGG_SUM, ZAGG_MIN, ZAGG_MAX}){
+            for(const std::vector<double> &w : weights){
+                if(op == ZOP_DIFF && (aggregate != ZAGG_SUM || w[0] != 1)){
+                    continue; // neither applies
+                }
+                for(size_t ninputs : {2, 3}){
+                    std::vector<ZSet*> inputs = {&a, &b, &c};
+                    inputs.resize(ninputs);
+                    ZCombine zc, one;
+                    setup(&zc, op, aggregate, inputs, w);
+                    setup(&one, op, aggregate, inputs, w);
+
+                    // the parts on the thread pool
+                    assert(zcombine_total(&zc) >= k_zcombine_parallel_min);
+                    zcombine_run(&zc, tp);
+                    assert(zc.nparts == k_zcombine_parts);
+                    Ref got = result_of(&zc);
+
+                    // against a single part, and the commands' semantics
+                    one.out.resize(1);
+                    zcombine_part(&one, 0);
+                    assert(result_of(&one) == got);
+                    std::vector<Ref> in(refs.begin(), refs.begin() + ninputs);
+                    assert(combine_ref(in, op, aggregate, zc.weights) == got);
+                }
+            }
+        }
+    }
+    // the smallest input first, as ZINTERCARD orders them
+    std::vector<double> ones = {1, 1, 1};
+    test_card(tp, {&c, &a, &b}, combine_ref({refs[2], refs[0], refs[1]}, ZOP_INTER, ZAGG_SUM, ones).size());
+    test_card(tp, {&b, &a}, combine_ref({refs[1], refs[0]}, ZOP_INTER, ZAGG_SUM, ones).size());
+    test_card(tp, {&c}, refs[2].size());
+
+    // 0 * inf is 0, not nan
+    ZCombine zc;
+    zc.inputs = {&a};
+    zc.weights = {0};
+    zc.out.resize(1);
+    zcombine_part(&zc, 0);
+    for(ZAddItem &item : zc.out[0]){
+        assert(item.score == 0);
+    }
+    zset_clear(&a);
+    zset_clear(&b);
+    zset_clear(&c);
+}
+
+int main(){
+    TheadPool tp;
+    thread_pool_init(&tp, 4);
+    test_combine(&tp, ZSET_AVL);
+    test_combine(&tp, ZSET_BTREE);
+    thread_pool_shutdown(&tp);
+    printf("test_zcombine ok\n");
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <iterator>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "zset.h"
+
+// the reference: (score, name) pairs in order
+typedef std::set<std::pair<double, std::string>> Ref;
+
+static void verify(ZSet* zset, Ref &ref){
+    assert(zset_size(zset) == ref.size());
+    // walk everything in order
+    ZIter it;
+    zset_seekge(zset, -1e300, "", 0, &it);
+    for(auto &p : ref){
+        assert(it.valid);
+        assert(it.score == p.first);
+        assert(std::string(it.name, it.len) == p.second);
+        zset_offset(&it, 1);
+    }
+    assert(!it.valid);
+    // lookups and seeks from every position
+    size_t i = 0;
+    for(auto &p : ref){
+        assert(zset_lookup(zset, p.second.data(), p.second.size(), &it));
+        assert(it.score == p.first);
+        assert(zset_seekge(zset, p.first, p.second.data(), p.second.size(), &it));
+        assert(std::string(it.name, it.len) == p.second);
+        assert(zset_rank(&it) == i);
+        ZIter sel;
+        assert(zset_select(zset, i, &sel));
+        assert(std::string(sel.name, sel.len) == p.second);
+        ZIter back = it;
+        assert(!zset_offset(&back, -(int64_t)i - 1));
+        back = it;
+        assert(zset_offset(&back, -(int64_t)i));
+        assert(std::string(back.name, back.len) == ref.begin()->second);
+        ++i;
+    }
+    assert(!zset_lookup(zset, "nope", 4, &it));
+    assert(!zset_select(zset, ref.size(), &it));
+    // range aggregates
+    std::vector<double> scores;
+    for(auto &p : ref){
+        scores.push_back(p.first);
+    }
+    for(size_t k = 0; k < 20; ++k){
+        size_t lo = rand() % (ref.size() + 1), hi = rand() % (ref.size() + 2);
+        ZAgg agg;
+        zset_aggregate(zset, lo, hi, &agg);
+        hi = std::min(hi, ref.size());
+        if(lo >= hi){
+            assert(agg.count == 0);
+            continue;
+        }
+        double sum = 0;
+        for(size_t i = lo; i < hi; ++i){
+            sum += scores[i];
+        }
+        assert(agg.count == hi - lo);
+        assert(agg.sum == sum); // small integers, exact in any order
+        assert(agg.min == scores[lo] && agg.max == scores[hi - 1]);
+    }
+}
+
+static void ref_insert(Ref &ref, const std::string &name, double score){
+    for(auto it = ref.begin(); it != ref.end(); ++it){
+        if(it->second == name){
+            ref.erase(it);
+            break;
+        }
+    }
+    ref.insert(std::make_pair(score, name));
+}
+
+static void test_case(size_t n, size_t name_len){
+    ZSet zset;
+    Ref ref;
+    for(size_t i = 0; i < n; ++i){
+        std::string name = std::to_string(rand() % (n * 2)) + std::string(name_len, 'x');
+        double score = rand() % 16;
+        zset_insert(&zset, name.data(), name.size(), score);
+        ref_insert(ref, name, score);
+    }
+    bool small = ref.size() <= k_zset_max_listpack_entries && name_len < k_zset_max_listpack_value;
+    assert(zset.encoding == (small ? (uint32_t)ZSET_LISTPACK : zset_engine()));
+    assert(zset.aug == (!small && zset_engine() == ZSET_AVL && zset_avl_aggregates()));
+    verify(&zset, ref);
+
+    // delete half of them
+    for(size_t i = 0; i < n / 2; ++i){
+        std::string name = std::to_string(rand() % (n * 2)) + std::string(name_len, 'x');
+        ZIter it;
+        if(zset_lookup(&zset, name.data(), name.size(), &it)){
+            zset_delete(&zset, &it);
+            ref.erase(std::make_pair(it.score, name));
+        }
+    }
+    verify(&zset, ref);
+    zset_clear(&zset);
+    assert(zset_size(&zset) == 0);
+}
+
+static void* range_free_thread(void* arg){
+    zset_range_free((ZRange*)arg);
+    return nullptr;
+}
+
+// remove the ranks [lo, hi) and check the rest. `defer`: the range is freed
+// by another thread, which runs the hashtable pass unless the checks do first
+static void test_remove_range(size_t n, size_t name_len, size_t lo, size_t hi, bool defer){
+    ZSet zset;
+    Ref ref;
+    for(size_t i = 0; i < n; ++i){
+        std::string name = std::to_string(i) + std::string(name_len, 'x');
+        double score = rand() % 16;
+        zset_insert(&zset, name.data(), name.size(), score);
+        ref_insert(ref, name, score);
+    }
+    auto first = ref.begin(), last = ref.begin();
+    std::advance(first, std::min(lo, ref.size()));
+    std::advance(last, std::min(hi, ref.size()));
+    size_t expect = std::distance(first, last);
+    ref.erase(first, last);
+
+    ZRange range;
+    assert(zset_remove_range(&zset, lo, hi, &range, defer ? 0 : (size_t)-1) == expect);
+    if(defer){
+        pthread_t t;
+        pthread_create(&t, nullptr, &range_free_thread, &range);
+        verify(&zset, ref);
+        pthread_join(t, nullptr);
+    }else{
+        verify(&zset, ref);
+        zset_range_free(&range);
+    }
+    // still usable
+    zset_insert(&zset, "new", 3, 1);
+    ref_insert(ref, "new", 1);
+    verify(&zset, ref);
+    zset_clear(&zset);
+}
+
+// zset_insert_many() against zset_insert() one by one with the same flags
+static void test_insert_many(size_t existing, size_t n, uint32_t flags){
+    ZSet zset;
+    Ref ref;
+    for(size_t i = 0; i < existing; ++i){
+        std::string name = std::to_string(rand() % (existing * 2));
+        double score = rand() % 16 - 8;
+        zset_insert(&zset, name.data(), name.size(), score);
+        ref_insert(ref, name, score);
+    }
+    std::vector<std::string> names(n);
+    std::vector<ZAddItem> items(n);
+    for(size_t i = 0; i < n; ++i){
+        names[i] = std::to_string(rand() % (existing * 2 + n));
+        items[i].score = (rand() % 4 == 0) ? -0.0 : rand() % 16 - 8 + 0.5 * (rand() % 2);
+        items[i].name = names[i].data();
+        items[i].len = names[i].size();
+    }
+    size_t expect_added = 0, expect_updated = 0;
+    for(size_t i = 0; i < n; ++i){
+        auto it = ref.begin();
+        for(; it != ref.end() && it->second != names[i]; ++it){}
+        if(it == ref.end()){
+            if(!(flags & ZADD_XX)){
+                ref.insert(std::make_pair(items[i].score, names[i]));
+                expect_added++;
+            }
+            continue;
+        }
+        double old = it->first, score = items[i].score;
+        bool update = !(flags & ZADD_NX) && old != score
+            && !((flags & ZADD_GT) && !(score > old)) && !((flags & ZADD_LT) && !(score < old));
+        if(update){
+            ref_insert(ref, names[i], score);
+            expect_updated++;
+        }
+    }
+    size_t added = 0, updated = 0;
+    zset_insert_many(&zset, items.data(), n, flags, &added, &updated);
+    assert(added == expect_added && updated == expect_updated);
+    verify(&zset, ref);
+    zset_clear(&zset);
+}
+
+static void test_insert_sorted(size_t n, size_t name_len){
+    Ref ref;
+    for(size_t i = 0; i < n; ++i){
+        std::string name = std::string(name_len, 'x') + std::to_string(rand() % 100) + "_" + std::to_string(i);
+        ref.insert(std::make_pair((double)(rand() % 16 - 8), name));
+    }
+    std::vector<ZAddItem> items;
+    for(auto &p : ref){
+        ZAddItem item;
+        item.score = p.first;
+        item.name = p.second.data();
+        item.len = p.second.size();
+        items.push_back(item);
+    }
+    ZSet zset;
+    assert(zset_insert_sorted(&zset, items.data(), items.size()));
+    verify(&zset, ref);
+    zset_clear(&zset);
+    // out of order
+    if(items.size() > 1){
+        std::swap(items.front(), items.back());
+        assert(!zset_insert_sorted(&zset, items.data(), items.size()));
+        assert(zset_size(&zset) == 0);
+    }
+}
+
+int main(){
+    const uint32_t k_flags[] = {0, ZADD_NX, ZADD_XX, ZADD_GT, ZADD_LT, ZADD_XX | ZADD_GT};
+    // the engines, and the AVL with aggregates
+    struct Config{
+        uint32_t engine;
+        bool aggregates;
+    };
+    const Config k_configs[] = {{ZSET_AVL, false}, {ZSET_AVL, true}, {ZSET_BTREE, false}};
+    for(const Config &conf : k_configs){
+        zset_set_engine(conf.engine);
+        zset_set_avl_aggregates(conf.aggregates);
+        for(size_t n = 1; n < 300; n += 7){
+            test_case(n, 0);
+            test_case(n, 100); // names too long for the listpack
+        }
+        for(size_t n : {10, 200}){
+            for(size_t lo = 0; lo <= n; lo += n / 10){
+                for(bool defer : {false, true}){
+                    test_remove_range(n, 0, lo, lo + n / 3, defer);
+                    test_remove_range(n, 0, lo, lo + n * 2 / 3, defer);
+                    test_remove_range(n, 100, lo, n + 1, defer);
+                }
+            }
+        }
+        for(size_t n : {1, 100, 128, 129, 3000}){
+            test_insert_sorted(n, 0);
+            test_insert_sorted(n, 100);
+        }
+        for(uint32_t flags : k_flags){
+            for(size_t existing : {0, 5, 100, 1000}){
+                for(size_t n : {1, 70, 300, 2000}){
+                    test_insert_many(existing, n, flags);
+                }
+            }
+        }
+    }
+    printf("test_zset ok\n");
+    return 0;
+}
@@ -1,23 +1,238 @@
 #include <cassert>
+#include <ctime>
+#include <algorithm>
 #include "thread_pool.h"
 
+static uint64_t tp_now_us(){
+    struct timespec tv = {0,0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+const size_t k_ws_initial_cap = 64;
+
+static WsArray* ws_array_new(size_t cap){
+    WsArray* a = new WsArray();
+    a->cap = cap;
+    a->slots = new std::atomic<Work*>[cap];
+    return a;
+}
+
+static void ws_array_del(WsArray* a){
+    delete[] a->slots;
+    delete a;
+}
+
+// the owner only
+static void ws_push(WsDeque* d, Work* w){
+    int64_t b = d->bottom.load(std::memory_order_relaxed);
+    int64_t t = d->top.load(std::memory_order_acquire);
+    WsArray* a = d->array.load(std::memory_order_relaxed);
+    if(b - t > (int64_t)a->cap - 1){
+        // full, move to one twice the size. a thief may still read the old one.
+        WsArray* bigger = ws_array_new(a->cap * 2);
+        for(int64_t i = t; i < b; ++i){
+            Work* item = a->slots[i & (a->cap - 1)].load(std::memory_order_relaxed);
+            bigger->slots[i & (bigger->cap - 1)].store(item, std::memory_order_relaxed);
+        }
+        d->retired.push_back(a);
+        d->array.store(bigger, std::memory_order_release);
+        a = bigger;
+    }
+    a->slots[b & (a->cap - 1)].store(w, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    d->bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+// the owner only, the newest task
+static Work* ws_pop(WsDeque* d){
+    int64_t b = d->bottom.load(std::memory_order_relaxed) - 1;
+    WsArray* a = d->array.load(std::memory_order_relaxed);
+    d->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = d->top.load(std::memory_order_relaxed);
+    Work* w = nullptr;
+    if(t <= b){
+        w = a->slots[b & (a->cap - 1)].load(std::memory_order_relaxed);
+        if(t == b){
+            // the last one, the thieves may be after it too
+            if(!d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                std::memory_order_relaxed))
+            {
+                w = nullptr;
+            }
+            d->bottom.store(b + 1, std::memory_order_relaxed);
+        }
+    }else{
+        d->bottom.store(b + 1, std::memory_order_relaxed); // empty
+    }
+    return w;
+}
+
+// any thread, the oldest task. null if empty or another thread won it.
+static Work* ws_steal(WsDeque* d){
+    int64_t t = d->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = d->bottom.load(std::memory_order_acquire);
+    if(t >= b){
+        return nullptr;
+    }
+    WsArray* a = d->array.load(std::memory_order_acquire);
+    Work* w = a->slots[t & (a->cap - 1)].load(std::memory_order_relaxed);
+    if(!d->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+        std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    return w;
+}
+
+// the owner of each thread in the pools it has used last. a pool shut down
+// and initialized again at the same address is another pool, told apart by
+// its generation. past k_tp_slots pools the oldest slot is reused, and the
+// thread takes a new owner when it comes back to the pool that had it.
+struct TpSlot{
+    const TheadPool* tp;
+    uint64_t generation;
+    size_t owner;
+};
+
+const size_t k_tp_slots = 4;
+static std::atomic<uint64_t> g_tp_generation{0};
+static thread_local TpSlot t_slots[k_tp_slots];
+static thread_local size_t t_nslots = 0;
+static thread_local size_t t_next_slot = 0; // the next one reused when all are taken
+static thread_local size_t t_victim = 0; // where the next steal starts
+
+static void tp_remember(TheadPool* tp, size_t owner){
+    size_t i = 0;
+    while(i < t_nslots && t_slots[i].tp != tp){
+        ++i; // an earlier pool at this address is stale
+    }
+    if(i == t_nslots){
+        if(t_nslots < k_tp_slots){
+            t_nslots++;
+        }else{
+            i = t_next_slot++ % k_tp_slots;
+        }
+    }
+    t_slots[i] = TpSlot{tp, tp->generation, owner};
+}
+
+static size_t tp_self(TheadPool* tp){
+    for(size_t i = 0; i < t_nslots; ++i){
+        if(t_slots[i].tp == tp && t_slots[i].generation == tp->generation){
+            return t_slots[i].owner;
+        }
+    }
+    size_t k = tp->nsubmitters.fetch_add(1);
+    size_t owner = tp->threads.size() + std::min(k, k_tp_submitters - 1);
+    tp_remember(tp, owner);
+    return owner;
+}
+
+// the last owner is shared by the submitters past k_tp_submitters
+static bool tp_shared(TheadPool* tp, size_t owner){
+    return owner == tp->owners.size() - 1;
+}
+
+static void tp_push(TheadPool* tp, size_t self, uint32_t prio, Work* w){
+    WsDeque* d = &tp->owners[self]->deques[prio];
+    if(tp_shared(tp, self)){
+        pthread_mutex_lock(&tp->shared_mutex);
+        ws_push(d, w);
+        pthread_mutex_unlock(&tp->shared_mutex);
+    }else{
+        ws_push(d, w);
+    }
+}
+
+static Work* tp_pop(TheadPool* tp, size_t self, uint32_t prio){
+    WsDeque* d = &tp->owners[self]->deques[prio];
+    if(!tp_shared(tp, self)){
+        return ws_pop(d);
+    }
+    pthread_mutex_lock(&tp->shared_mutex);
+    Work* w = ws_pop(d);
+    pthread_mutex_unlock(&tp->shared_mutex);
+    return w;
+}
+
+// the most urgent task up to `max_prio`, the own deque first
+static Work* tp_take(TheadPool* tp, size_t self, uint32_t max_prio, bool* stolen){
+    size_t n = tp->owners.size();
+    for(uint32_t prio = 0; prio <= max_prio; ++prio){
+        Work* w = tp_pop(tp, self, prio);
+        *stolen = false;
+        if(!w){
+            size_t start = t_victim++;
+            for(size_t k = 0; k < n && !w; ++k){
+                size_t victim = (start + k) % n;
+                if(victim != self){
+                    w = ws_steal(&tp->owners[victim]->deques[prio]);
+                }
+            }
+            *stolen = true;
+        }
+        if(w){
+            tp->queued.fetch_sub(1);
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+static void tp_run_work(TheadPool* tp, Work* w){
+    w->f(w->arg);
+    TpFuture* fut = w->fut;
+    delete w;
+    if(fut){
+        // the waiter may free it as soon as it's set
+        fut->done.store(true, std::memory_order_seq_cst);
+        if(tp->waiters.load(std::memory_order_seq_cst) > 0){
+            pthread_mutex_lock(&tp->mutex);
+            pthread_cond_broadcast(&tp->task_done);
+            pthread_mutex_unlock(&tp->mutex);
+        }
+    }
+}
+
+struct WorkerArg{
+    TheadPool* tp = nullptr;
+    size_t idx = 0;
+};
+
 static void* worker(void* arg){
-    TheadPool* tp = (TheadPool*) arg;
+    WorkerArg* wa = (WorkerArg*)arg;
+    TheadPool* tp = wa->tp;
+    size_t self = wa->idx;
+    delete wa;
+    tp_remember(tp, self);
+    TpWorkerStats* st = tp->stats[self];
     while(true){
+        bool stolen = false;
+        Work* w = tp_take(tp, self, TP_PRIO_COUNT - 1, &stolen);
+        if(w){
+            uint64_t start_us = tp_now_us();
+            tp_run_work(tp, w);
+            st->busy_us.fetch_add(tp_now_us() - start_us, std::memory_order_relaxed);
+            st->tasks.fetch_add(1, std::memory_order_relaxed);
+            st->steals.fetch_add(stolen ? 1 : 0, std::memory_order_relaxed);
+            continue;
+        }
+        // sleep until something is pushed. thread_pool_submit() checks
+        // `sleepers` after `queued`, we check them the other way round.
         pthread_mutex_lock(&tp->mutex);
-
-        // wait for the condition : a non-empty queue
-        while(tp->queue.empty()){
+        tp->sleepers.fetch_add(1);
+        while(tp->queued.load() == 0 && !tp->stopping.load()){
             pthread_cond_wait(&tp->not_empty, &tp->mutex);
         }
-
-        // got the job
-        Work w = tp->queue.front();
-        tp->queue.pop_front();
+        tp->sleepers.fetch_sub(1);
+        bool stop = tp->stopping.load() && tp->queued.load() == 0;
         pthread_mutex_unlock(&tp->mutex);
-
-        // do the work
-        w.f(w.arg);
+        if(stop){
+            break;
+        }
     }
     return nullptr;
 }
@@ -27,19 +242,138 @@ void thread_pool_init(TheadPool* tp, size_t num_threads){
 
     int rv = pthread_mutex_init(&tp->mutex, nullptr);
     assert(rv == 0);
+    rv = pthread_mutex_init(&tp->shared_mutex, nullptr);
+    assert(rv == 0);
     rv = pthread_cond_init(&tp->not_empty, nullptr);
     assert(rv == 0);
+    rv = pthread_cond_init(&tp->task_done, nullptr);
+    assert(rv == 0);
+
+    tp->owners.resize(num_threads + k_tp_submitters);
+    for(WsOwner* &owner : tp->owners){
+        owner = new WsOwner();
+        for(WsDeque &d : owner->deques){
+            d.array.store(ws_array_new(k_ws_initial_cap));
+        }
+    }
+    tp->stats.resize(num_threads);
+    for(TpWorkerStats* &st : tp->stats){
+        st = new TpWorkerStats();
+    }
+    tp->start_us = tp_now_us();
+    tp->generation = g_tp_generation.fetch_add(1) + 1;
+    tp->nsubmitters.store(0);
+    tp->stopping.store(false);
 
     tp->threads.resize(num_threads);
     for(size_t i = 0; i < num_threads; ++i){
-        int rv = pthread_create(&tp->threads[i], nullptr, &worker, tp);
+        WorkerArg* wa = new WorkerArg();
+        wa->tp = tp;
+        wa->idx = i;
+        int rv = pthread_create(&tp->threads[i], nullptr, &worker, wa);
         assert(rv == 0);
     }
 }
 
+void thread_pool_submit(TheadPool* tp, uint32_t prio, void (*f)(void*), void* arg, TpFuture* fut){
+    assert(prio < TP_PRIO_COUNT && !tp->stopping.load());
+    if(fut){
+        fut->done.store(false, std::memory_order_relaxed);
+    }
+    Work* w = new Work();
+    w->f = f;
+    w->arg = arg;
+    w->fut = fut;
+    tp->queued.fetch_add(1); // before it can be taken
+    tp_push(tp, tp_self(tp), prio, w);
+    if(tp->sleepers.load() > 0){
+        pthread_mutex_lock(&tp->mutex);
+        pthread_cond_signal(&tp->not_empty);
+        pthread_mutex_unlock(&tp->mutex);
+    }
+}
+
 void thread_pool_queue(TheadPool* tp, void(*f)(void*), void* arg){
+    thread_pool_submit(tp, TP_PRIO_NORMAL, f, arg);
+}
+
+// only the urgent tasks are run meanwhile, a background one could take long
+void thread_pool_wait(TheadPool* tp, TpFuture* fut){
+    size_t self = tp_self(tp);
+    while(!tp_future_done(fut)){
+        bool stolen = false;
+        Work* w = tp_take(tp, self, TP_PRIO_HIGH, &stolen);
+        if(w){
+            tp_run_work(tp, w);
+            continue;
+        }
+        pthread_mutex_lock(&tp->mutex);
+        tp->waiters.fetch_add(1);
+        while(!fut->done.load()){
+            pthread_cond_wait(&tp->task_done, &tp->mutex);
+        }
+        tp->waiters.fetch_sub(1);
+        pthread_mutex_unlock(&tp->mutex);
+    }
+}
+
+struct ForkTask{
+    void (*f)(void*, size_t) = nullptr;
+    void* arg = nullptr;
+    size_t idx = 0;
+    TpFuture fut;
+};
+
+static void fork_task(void* arg){
+    ForkTask* t = (ForkTask*)arg;
+    t->f(t->arg, t->idx);
+}
+
+void thread_pool_run(TheadPool* tp, size_t n, void (*f)(void*, size_t), void* arg){
+    if(n == 0){
+        return;
+    }
+    std::vector<ForkTask> tasks(n);
+    for(size_t i = 1; i < n; ++i){
+        tasks[i].f = f;
+        tasks[i].arg = arg;
+        tasks[i].idx = i;
+        thread_pool_submit(tp, TP_PRIO_HIGH, &fork_task, &tasks[i], &tasks[i].fut);
+    }
+    f(arg, 0);
+    // the parts nobody has stolen are still at the bottom of our deque
+    for(size_t i = n - 1; i > 0; --i){
+        thread_pool_wait(tp, &tasks[i].fut);
+    }
+}
+
+void thread_pool_shutdown(TheadPool* tp){
     pthread_mutex_lock(&tp->mutex);
-    tp->queue.push_back(Work {f, arg});
-    pthread_cond_signal(&tp->not_empty);
+    tp->stopping.store(true);
+    pthread_cond_broadcast(&tp->not_empty);
     pthread_mutex_unlock(&tp->mutex);
-}
\ No newline at end of file
+    for(pthread_t &thread : tp->threads){
+        pthread_join(thread, nullptr);
+    }
+    assert(tp->queued.load() == 0);
+
+    for(WsOwner* owner : tp->owners){
+        for(WsDeque &d : owner->deques){
+            for(WsArray* a : d.retired){
+                ws_array_del(a);
+            }
+            ws_array_del(d.array.load());
+        }
+        delete owner;
+    }
+    for(TpWorkerStats* st : tp->stats){
+        delete st;
+    }
+    tp->owners.clear();
+    tp->stats.clear();
+    tp->threads.clear();
+    pthread_mutex_destroy(&tp->mutex);
+    pthread_mutex_destroy(&tp->shared_mutex);
+    pthread_cond_destroy(&tp->not_empty);
+    pthread_cond_destroy(&tp->task_done);
+}
@@ -2,20 +2,89 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <atomic>
 #include <vector>
-#include <deque>
+
+// a worker takes the most urgent task it can find, from its own deque first
+enum{
+    TP_PRIO_HIGH = 0,   // somebody waits for it: the parts of a thread_pool_run()
+    TP_PRIO_NORMAL = 1, // background persistence: snapshots, fsync, loading
+    TP_PRIO_LOW = 2,    // lazy free
+    TP_PRIO_COUNT = 3,
+};
+
+// the completion of a submitted task. owned by the submitter, it must
+// outlive the task.
+struct TpFuture{
+    std::atomic<bool> done{false};
+};
+
+inline bool tp_future_done(const TpFuture* fut){
+    return fut->done.load(std::memory_order_acquire);
+}
 
 struct Work{
     void (*f)(void*) = nullptr;
     void* arg = nullptr;
+    TpFuture* fut = nullptr;
+};
+
+// Chase-Lev work-stealing deque: the owner pushes and pops at the bottom,
+// the other threads steal from the top, all without a lock
+struct WsArray{
+    size_t cap = 0; // a power of 2
+    std::atomic<Work*>* slots = nullptr;
 };
 
+struct WsDeque{
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<WsArray*> array{nullptr};
+    std::vector<WsArray*> retired; // outgrown, a thief may still read them
+};
+
+// the deques of one owner: a worker, or a thread that submits work
+struct WsOwner{
+    WsDeque deques[TP_PRIO_COUNT];
+};
+
+struct TpWorkerStats{
+    std::atomic<uint64_t> tasks{0};
+    std::atomic<uint64_t> steals{0};  // of the tasks, taken from another owner
+    std::atomic<uint64_t> busy_us{0}; // running tasks
+};
+
+// the first `threads.size()` owners are the workers, then one per thread
+// that submits (up to k_tp_submitters, the rest share the last one)
 struct TheadPool{
     std::vector<pthread_t> threads;
-    std::deque<Work> queue;
-    pthread_mutex_t mutex;
+    std::vector<WsOwner*> owners;
+    std::vector<TpWorkerStats*> stats;
+    std::atomic<size_t> nsubmitters{0};
+    pthread_mutex_t shared_mutex;     // the last submitter owner, when shared
+    std::atomic<size_t> queued{0};    // pushed and not taken yet
+    std::atomic<size_t> sleepers{0};
+    std::atomic<size_t> waiters{0};   // in thread_pool_wait()
+    pthread_mutex_t mutex;            // for sleeping only
     pthread_cond_t not_empty;
+    pthread_cond_t task_done;
+    std::atomic<bool> stopping{false};
+    uint64_t start_us = 0;
+    uint64_t generation = 0;          // tells a pool from an earlier one at the same address
 };
 
+const size_t k_tp_submitters = 8;
+
 void thread_pool_init(TheadPool* tp, size_t num_threads);
-void thread_pool_queue(TheadPool* tp, void (*f)(void*), void *arg);
\ No newline at end of file
+// run f(arg) at some point, `fut` (optional) is set when it's done
+void thread_pool_submit(TheadPool* tp, uint32_t prio, void (*f)(void*), void* arg,
+    TpFuture* fut = nullptr);
+void thread_pool_queue(TheadPool* tp, void (*f)(void*), void *arg);
+// wait for a task, running other urgent tasks meanwhile
+void thread_pool_wait(TheadPool* tp, TpFuture* fut);
+// fork-join: run f(arg, 0) ... f(arg, n - 1) in parallel and wait for all of
+// them. the caller runs the first one and any that haven't started yet.
+void thread_pool_run(TheadPool* tp, size_t n, void (*f)(void*, size_t), void* arg);
+// run what's queued, then stop the workers. no submitting after it.
+void thread_pool_shutdown(TheadPool* tp);
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include "zcombine.h"
+#include "hashtable.h"
+#include "common.h"
+
+// a member of the result while it's being aggregated
+struct AggNode{
+    HNode node;
+    const char* name = nullptr;
+    size_t len = 0;
+    double score = 0;
+    size_t nsets = 0;  // the number of inputs that have it
+};
+
+// the state of one part
+struct AggPart{
+    ZCombine* zc = nullptr;
+    size_t part = 0;
+    size_t input = 0;  // the input being scanned
+    HMap map;
+    std::deque<AggNode> nodes; // stable addresses
+};
+
+static bool agg_eq(HNode* lhs, HNode* rhs){
+    AggNode* l = container_of(lhs, AggNode, node);
+    AggNode* r = container_of(rhs, AggNode, node);
+    return l->len == r->len && 0 == memcmp(l->name, r->name, l->len);
+}
+
+static double agg_combine(uint32_t aggregate, double acc, double score){
+    if(aggregate == ZAGG_MIN){
+        return std::min(acc, score);
+    }
+    if(aggregate == ZAGG_MAX){
+        return std::max(acc, score);
+    }
+    double sum = acc + score;
+    return std::isnan(sum) ? 0 : sum; // inf + -inf
+}
+
+// ZINTERCARD has counted enough
+static bool agg_stopped(ZCombine* zc){
+    return zc->limit && zc->found.load(std::memory_order_relaxed) >= zc->limit;
+}
+
+static void agg_member(AggPart* ap, const char* name, size_t len, double score, uint64_t hcode){
+    ZCombine* zc = ap->zc;
+    score *= zc->weights[ap->input];
+    if(std::isnan(score)){
+        score = 0; // 0 * inf
+    }
+    AggNode key;
+    // all hcodes of a part share the low bits, use the others for the slots
+    key.node.hcode = hcode >> 8 | hcode << 56;
+    key.name = name;
+    key.len = len;
+    HNode* found = hm_lookup(&ap->map, &key.node, &agg_eq);
+    if(found){
+        AggNode* agg = container_of(found, AggNode, node);
+        if(zc->op == ZOP_DIFF){
+            agg->nsets = 0; // removed
+        }else if(zc->op == ZOP_UNION || agg->nsets == ap->input){ // ZINTER: in all so far
+            agg->score = agg_combine(zc->aggregate, agg->score, score);
+            agg->nsets++;
+        }
+    }else if(ap->input == 0 || zc->op == ZOP_UNION){
+        // ZINTER and ZDIFF only keep the members of the first input
+        key.score = score;
+        key.nsets = 1;
+        ap->nodes.push_back(key);
+        hm_insert(&ap->map, &ap->nodes.back().node);
+    }
+}
+
+static void cb_agg_node(HNode* node, void* arg){
+    ZNode* znode = container_of(node, ZNode, hmap);
+    agg_member((AggPart*)arg, znode->name, znode->len, znode->score, node->hcode);
+}
+
+// ZINTERCARD: the members of one slice of `first` found in all the inputs
+static void card_part(ZCombine* zc, size_t part){
+    size_t n = zc->first.size();
+    size_t end = n * (part + 1) / zc->nparts;
+    for(size_t k = n * part / zc->nparts; k < end && !agg_stopped(zc); ++k){
+        const ZAddItem &item = zc->first[k];
+        size_t i = 1;
+        while(i < zc->inputs.size() && zset_contains(zc->inputs[i], item.name, item.len)){
+            ++i;
+        }
+        if(i == zc->inputs.size()){
+            zc->found.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void zcombine_part(void* arg, size_t part){
+    ZCombine* zc = (ZCombine*)arg;
+    if(zc->card){
+        return card_part(zc, part);
+    }
+    AggPart ap;
+    ap.zc = zc;
+    ap.part = part;
+    // ZINTER and ZDIFF never grow past the first input
+    size_t expect = zset_size(zc->inputs[0]);
+    for(size_t i = 1; zc->op == ZOP_UNION && i < zc->inputs.size(); ++i){
+        expect += zset_size(zc->inputs[i]);
+    }
+    hm_reserve(&ap.map, expect / zc->nparts);
+    for(ap.input = 0; ap.input < zc->inputs.size(); ++ap.input){
+        ZSet* zset = zc->inputs[ap.input];
+        if(zset->encoding != ZSET_LISTPACK){
+            hm_foreach_part(&zset->hmap, part, zc->nparts, &cb_agg_node, &ap);
+            continue;
+        }
+        // the listpack has no hashtable, hash the names
+        ZIter it;
+        for(zset_select(zset, 0, &it); it.valid; zset_offset(&it, 1)){
+            uint64_t hcode = str_hash((uint8_t*)it.name, it.len);
+            if((hcode & (zc->nparts - 1)) == part){
+                agg_member(&ap, it.name, it.len, it.score, hcode);
+            }
+        }
+    }
+
+    std::vector<ZAddItem> &out = zc->out[part];
+    size_t need = zc->op == ZOP_INTER ? zc->inputs.size() : 1;
+    for(AggNode &agg : ap.nodes){
+        if(agg.nsets >= need){
+            ZAddItem item;
+            item.score = agg.score;
+            item.name = agg.name;
+            item.len = agg.len;
+            out.push_back(item);
+        }
+    }
+    hm_clear(&ap.map);
+}
+
+size_t zcombine_total(ZCombine* zc){
+    if(zc->card){
+        return zc->first.size() * std::max<size_t>(zc->inputs.size() - 1, 1);
+    }
+    size_t total = 0;
+    for(ZSet* zset : zc->inputs){
+        total += zset_size(zset);
+    }
+    return total;
+}
+
+void zcombine_run(ZCombine* zc, TheadPool* tp){
+    for(ZSet* zset : zc->inputs){
+        zset_settle(zset); // the parts read the hashtables
+    }
+    zc->nparts = zcombine_total(zc) >= k_zcombine_parallel_min ? k_zcombine_parts : 1;
+    zc->out.resize(zc->nparts);
+    if(zc->nparts > 1){
+        thread_pool_run(tp, zc->nparts, &zcombine_part, zc);
+    }else{
+        zcombine_part(zc, 0);
+    }
+}
+
+bool zcombine_card(ZCombine* zc, size_t max_lookups, size_t* found){
+    *found = 0;
+    size_t lookups = 0;
+    ZIter it;
+    for(zset_select(zc->inputs[0], 0, &it); it.valid && !(zc->limit && *found >= zc->limit);
+        zset_offset(&it, 1))
+    {
+        size_t i = 1;
+        ZIter other;
+        while(i < zc->inputs.size() && zset_lookup(zc->inputs[i], it.name, it.len, &other)){
+            ++i;
+        }
+        *found += i == zc->inputs.size() ? 1 : 0;
+        lookups += i;
+        if(lookups > max_lookups){
+            return false;
+        }
+    }
+    return true;
+}
+
+void zcombine_copy_first(ZCombine* zc){
+    ZSet* zset = zc->inputs[0];
+    zc->first.reserve(zset_size(zset));
+    ZIter it;
+    for(zset_select(zset, 0, &it); it.valid; zset_offset(&it, 1)){
+        ZAddItem item;
+        item.score = it.score;
+        item.name = (const char*)zc->arena.size(); // an offset until the arena is done
+        item.len = it.len;
+        zc->first.push_back(item);
+        zc->arena.append(it.name, it.len);
+    }
+    for(ZAddItem &item : zc->first){
+        item.name = zc->arena.data() + (size_t)item.name;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "zset.h"
+#include "thread_pool.h"
+
+// the members of several zsets combined, for ZUNION, ZINTER, ZDIFF and their
+// STORE variants. the members are partitioned by their name hash, and each
+// part is aggregated into its own hashtable, by the thread pool when the
+// inputs are large.
+enum{
+    ZOP_UNION = 0,
+    ZOP_INTER = 1,
+    ZOP_DIFF = 2,
+};
+
+enum{
+    ZAGG_SUM = 0,
+    ZAGG_MIN = 1,
+    ZAGG_MAX = 2,
+};
+
+// the number of input members above which the parts run on the thread pool,
+// and the lookups after which ZINTERCARD leaves the event loop
+const size_t k_zcombine_parallel_min = 50000;
+const size_t k_zcombine_parts = 4; // a power of 2
+
+struct ZCombine{
+    uint32_t op = ZOP_UNION;
+    uint32_t aggregate = ZAGG_SUM;
+    size_t nparts = 1;
+    std::vector<ZSet*> inputs;
+    std::vector<double> weights;   // one per input
+    // the result of each part, the names point into the inputs
+    std::vector<std::vector<ZAddItem>> out;
+    // ZINTERCARD: only count the result into `found`, the parts stop once it
+    // reaches `limit` (0 for none). the inputs go smallest first. the parts
+    // look the members of `first`, a copy of the first input, up in the other
+    // inputs in place: nothing may write those meanwhile, see ZSet::readers.
+    bool card = false;
+    size_t limit = 0;
+    std::atomic<size_t> found{0};
+    std::string arena;             // the names of `first`
+    std::vector<ZAddItem> first;
+};
+
+// the number of input members, for ZINTERCARD the lookups
+size_t zcombine_total(ZCombine* zc);
+// aggregate the members with hash & (zc->nparts - 1) == part into
+// zc->out[part], which must exist. ZINTERCARD counts a slice of `first`
+// instead. parts can run at once.
+void zcombine_part(void* arg, size_t part);
+// all the parts, on `tp` when the inputs are large. the result is unsorted.
+void zcombine_run(ZCombine* zc, TheadPool* tp);
+// ZINTERCARD on the inputs themselves: look the members of the first one up
+// in the others until the limit. false if that takes more than `max_lookups`.
+bool zcombine_card(ZCombine* zc, size_t max_lookups, size_t* found);
+// ZINTERCARD: copy the first input into `first`, for zcombine_run()
+void zcombine_copy_first(ZCombine* zc);
@@ -0,0 +1,98 @@
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <cstdio>
+#include <malloc.h>   // _msize() / malloc_usable_size()
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+#include "zmalloc.h"
+
+static std::atomic<size_t> g_used_memory{0};
+
+static size_t zmalloc_size(void* ptr){
+#ifdef _WIN32
+    return _msize(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+void* zmalloc(size_t size){
+    void* ptr = malloc(size ? size : 1);
+    if(ptr){
+        g_used_memory.fetch_add(zmalloc_size(ptr), std::memory_order_relaxed);
+    }
+    return ptr;
+}
+
+void* zcalloc(size_t n, size_t size){
+    void* ptr = calloc(n ? n : 1, size ? size : 1);
+    if(ptr){
+        g_used_memory.fetch_add(zmalloc_size(ptr), std::memory_order_relaxed);
+    }
+    return ptr;
+}
+
+void zfree(void* ptr){
+    if(!ptr){
+        return;
+    }
+    g_used_memory.fetch_sub(zmalloc_size(ptr), std::memory_order_relaxed);
+    free(ptr);
+}
+
+size_t zmalloc_used_memory(){
+    return g_used_memory.load(std::memory_order_relaxed);
+}
+
+size_t zmalloc_get_rss(){
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))){
+        return 0;
+    }
+    return pmc.WorkingSetSize;
+#else
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(!fp){
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    return n == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+// route the C++ heap through the counters
+void* operator new(size_t size){
+    void* ptr = zmalloc(size);
+    if(!ptr){
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size){
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept{
+    zfree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept{
+    zfree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept{
+    zfree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept{
+    zfree(ptr);
+}
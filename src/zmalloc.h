@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+
+// counting wrappers around malloc(). the global operator new/delete are
+// routed through them too, so strings, vectors and hash table slots all
+// show up in zmalloc_used_memory().
+
+void* zmalloc(size_t size);
+void* zcalloc(size_t n, size_t size);
+void zfree(void* ptr);
+// bytes currently allocated through the wrappers (as reported by the allocator)
+size_t zmalloc_used_memory();
+// resident set size of the process as seen by the OS
+size_t zmalloc_get_rss();
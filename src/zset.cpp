@@ -1,13 +1,99 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 #include "zset.h"
 #include "common.h"
+#include "slab.h"
 
-static ZNode* znode_new(const char* name, size_t len, double score){
-    ZNode* node = (ZNode*)malloc(sizeof(ZNode)+len);
-    assert(node);
-    avl_init(&node->tree);
+// the hashtable pass of a removal, left by zset_remove_range(). the zset and
+// the removed range both hold it: whichever needs it first runs it, or waits
+// for the thread running it.
+struct ZUnlink{
+    ZSet* zset = nullptr;
+    bool rebuild = false;    // the kept members go into a new table, else the removed ones out
+    AVLNode* root = nullptr; // ZSET_AVL: the removed members
+    BTree btree;             // ZSET_BTREE: the removed members
+    size_t size = 0;         // of the zset, until it's done
+    std::atomic<uint32_t> state{0};
+    std::atomic<uint32_t> refs{2};
+};
+
+enum{
+    ZUNLINK_PENDING = 0,
+    ZUNLINK_RUNNING = 1,
+    ZUNLINK_DONE = 2,
+};
+
+// the index used when a zset outgrows the listpack
+static uint32_t g_engine = ZSET_AVL;
+// whether new AVL indexes keep score aggregates
+static bool g_avl_aggregates = false;
+
+void zset_set_engine(uint32_t encoding){
+    assert(encoding == ZSET_AVL || encoding == ZSET_BTREE);
+    g_engine = encoding;
+}
+
+uint32_t zset_engine(){
+    return g_engine;
+}
+
+void zset_set_avl_aggregates(bool on){
+    g_avl_aggregates = on;
+}
+
+bool zset_avl_aggregates(){
+    return g_avl_aggregates;
+}
+
+// ZSET_AVL keeps the AVLNode in front of the ZNode, and the AVLAug (if any)
+// in front of that: | AVLAug | AVLNode | ZNode |
+static_assert(sizeof(AVLNode) % alignof(ZNode) == 0, "ZNode after AVLNode must stay aligned");
+static_assert(sizeof(AVLAug) % alignof(AVLNode) == 0, "AVLNode after AVLAug must stay aligned");
+
+static AVLNode* znode_tree(ZNode* node){
+    return (AVLNode*)((char*)node - sizeof(AVLNode));
+}
+
+static ZNode* tree_znode(AVLNode* tree){
+    return (ZNode*)((char*)tree + sizeof(AVLNode));
+}
+
+static size_t znode_prefix(uint32_t encoding, bool aug){
+    if(encoding != ZSET_AVL){
+        return 0;
+    }
+    return sizeof(AVLNode) + (aug ? sizeof(AVLAug) : 0);
+}
+
+static size_t znode_size(uint32_t encoding, bool aug, size_t len){
+    return znode_prefix(encoding, aug) + sizeof(ZNode) + len;
+}
+
+// whether an existing node carries the AVLAug
+static bool znode_aug(uint32_t encoding, ZNode* node){
+    return encoding == ZSET_AVL && znode_tree(node)->aug;
+}
+
+static ZNode* znode_new(ZSet* zset, const char* name, size_t len, double score){
+    uint32_t encoding = zset->encoding;
+    char* mem = (char*)slab_alloc(znode_size(encoding, zset->aug, len));
+    assert(mem);
+    ZNode* node = (ZNode*)(mem + znode_prefix(encoding, zset->aug));
+    if(encoding == ZSET_AVL){
+        AVLNode* tnode = new (znode_tree(node)) AVLNode();
+        if(zset->aug){
+            tnode->aug = 1;
+            new (avl_aug(tnode)) AVLAug();
+            avl_aug(tnode)->val = score;
+        }
+        avl_init(tnode);
+    }
     node->hmap.next = nullptr;
     node->hmap.hcode = str_hash((uint8_t*)name, len);
     node->score = score;
@@ -16,8 +102,9 @@ static ZNode* znode_new(const char* name, size_t len, double score){
     return node;
 }
 
-static void znode_del(ZNode* node){
-    free(node);
+static void znode_del(uint32_t encoding, ZNode* node){
+    bool aug = znode_aug(encoding, node);
+    slab_free((char*)node - znode_prefix(encoding, aug), znode_size(encoding, aug, node->len));
 }
 
 static size_t min(size_t lhs, size_t rhs){
@@ -25,34 +112,205 @@ static size_t min(size_t lhs, size_t rhs){
 }
 
 // compare by the (score, name) tuple
-static bool zless(AVLNode* lhs, double score, const char* name, size_t len){
-    ZNode* zl = container_of(lhs, ZNode, tree);
-    if(zl->score != score){
-        return zl->score < score;
+static bool zless(double lscore, const char* lname, size_t llen,
+    double score, const char* name, size_t len)
+{
+    if(lscore != score){
+        return lscore < score;
     }
 
-    int rv = memcmp(zl->name, name, min(zl->len, len));
+    int rv = memcmp(lname, name, min(llen, len));
     if (rv != 0) {
         return rv < 0;
     }
-    return zl->len < len;
+    return llen < len;
+}
+
+static bool zless(AVLNode* lhs, double score, const char* name, size_t len){
+    ZNode* zl = tree_znode(lhs);
+    return zless(zl->score, zl->name, zl->len, score, name, len);
 }
 
 static bool zless(AVLNode* lhs, AVLNode* rhs){
-    ZNode* zr = container_of(rhs, ZNode, tree);
+    ZNode* zr = tree_znode(rhs);
     return zless(lhs, zr->score, zr->name, zr->len);
 }
 
+// the B+tree search key
+struct ZKey{
+    double score = 0;
+    const char* name = nullptr;
+    size_t len = 0;
+};
+
+static ZKey zkey_of(ZNode* node){
+    ZKey key;
+    key.score = node->score;
+    key.name = node->name;
+    key.len = node->len;
+    return key;
+}
+
+static int bcmp_znode(void* item, const void* key){
+    ZNode* node = (ZNode*)item;
+    const ZKey* k = (const ZKey*)key;
+    if(zless(node->score, node->name, node->len, k->score, k->name, k->len)){
+        return -1;
+    }
+    return zless(k->score, k->name, k->len, node->score, node->name, node->len) ? 1 : 0;
+}
+
+// listpack encoding, see zset.h
+const size_t k_pack_hdr = 1 + sizeof(double); // len + score
+
+static void pack_read(ZSet* zset, size_t pos, ZIter* it){
+    const uint8_t* p = zset->pack + pos;
+    it->len = p[0];
+    memcpy(&it->score, p + 1, sizeof(double));
+    it->name = (const char*)p + k_pack_hdr;
+}
+
+static size_t pack_next(ZSet* zset, size_t pos){
+    return pos + k_pack_hdr + zset->pack[pos];
+}
+
+static bool iter_at_pack(ZSet* zset, size_t idx, size_t pos, ZIter* it){
+    it->zset = zset;
+    it->node = nullptr;
+    it->idx = idx;
+    it->pos = pos;
+    it->valid = idx < zset->pack_n;
+    if(it->valid){
+        pack_read(zset, pos, it);
+    }
+    return it->valid;
+}
+
+static bool iter_at_btree(ZSet* zset, ZIter* it){
+    ZNode* node = (ZNode*)biter_item(&it->bit);
+    it->zset = zset;
+    it->node = node;
+    it->valid = node != nullptr;
+    if(it->valid){
+        it->name = node->name;
+        it->len = node->len;
+        it->score = node->score;
+    }
+    return it->valid;
+}
+
+static bool iter_at_node(ZSet* zset, ZNode* node, ZIter* it){
+    it->zset = zset;
+    it->node = node;
+    it->valid = node != nullptr;
+    if(it->valid){
+        it->name = node->name;
+        it->len = node->len;
+        it->score = node->score;
+    }
+    return it->valid;
+}
+
+static void pack_reserve(ZSet* zset, size_t need){
+    if(need <= zset->pack_cap){
+        return;
+    }
+    size_t cap = slab_usable_size(need > zset->pack_cap * 2 ? need : zset->pack_cap * 2);
+    uint8_t* pack = (uint8_t*)slab_alloc(cap);
+    if(zset->pack){
+        memcpy(pack, zset->pack, zset->pack_used);
+        slab_free(zset->pack, zset->pack_cap);
+    }
+    zset->pack = pack;
+    zset->pack_cap = (uint32_t)cap;
+}
+
+static void pack_free(ZSet* zset){
+    slab_free(zset->pack, zset->pack_cap);
+    zset->pack = nullptr;
+    zset->pack_n = zset->pack_used = zset->pack_cap = 0;
+}
+
+// the first member that is >= (score, name), or the end
+static size_t pack_seekge(ZSet* zset, double score, const char* name, size_t len, size_t* idx){
+    ZIter cur;
+    size_t pos = 0;
+    for(*idx = 0; *idx < zset->pack_n; ++*idx, pos = pack_next(zset, pos)){
+        pack_read(zset, pos, &cur);
+        if(!zless(cur.score, cur.name, cur.len, score, name, len)){
+            break;
+        }
+    }
+    return pos;
+}
+
+static void pack_insert(ZSet* zset, const char* name, size_t len, double score){
+    size_t idx = 0;
+    size_t pos = pack_seekge(zset, score, name, len, &idx);
+    size_t size = k_pack_hdr + len;
+    pack_reserve(zset, zset->pack_used + size);
+
+    uint8_t* p = zset->pack + pos;
+    memmove(p + size, p, zset->pack_used - pos);
+    p[0] = (uint8_t)len;
+    memcpy(p + 1, &score, sizeof(double));
+    memcpy(p + k_pack_hdr, name, len);
+    zset->pack_used += (uint32_t)size;
+    zset->pack_n++;
+}
+
+static void pack_delete(ZSet* zset, size_t pos){
+    size_t next = pack_next(zset, pos);
+    memmove(zset->pack + pos, zset->pack + next, zset->pack_used - next);
+    zset->pack_used -= (uint32_t)(next - pos);
+    zset->pack_n--;
+}
+
 static void tree_insert(ZSet* zset, ZNode* node){
+    if(zset->encoding == ZSET_BTREE){
+        ZKey key = zkey_of(node);
+        btree_insert(&zset->btree, node, &key, &bcmp_znode);
+        return;
+    }
+    AVLNode* tnode = znode_tree(node);
+    if(tnode->aug){
+        avl_aug(tnode)->val = node->score;
+    }
     AVLNode* parent = nullptr; // insert under this node
     AVLNode* *from = &zset->root; // the incoming pointer to the next node
     while(*from){ // tree search
         parent = *from;
-        from =  zless(&node->tree, parent) ? &parent->left : &parent->right;
+        from =  zless(tnode, parent) ? &parent->left : &parent->right;
+    }
+    *from = tnode;  // attach to this node
+    tnode->parent = parent;
+    zset->root = avl_fix(tnode);
+}
+
+static void tree_detach(ZSet* zset, ZNode* node){
+    if(zset->encoding == ZSET_BTREE){
+        ZKey key = zkey_of(node);
+        bool found = btree_delete(&zset->btree, &key, &bcmp_znode);
+        assert(found);
+        (void)found;
+        return;
+    }
+    zset->root = avl_del(znode_tree(node));
+    avl_init(znode_tree(node));
+}
+
+// the listpack is outgrown, move the members into the tree and hashtable
+static void zset_to_tree(ZSet* zset){
+    zset->encoding = g_engine;
+    zset->aug = g_engine == ZSET_AVL && g_avl_aggregates;
+    ZIter it;
+    for(size_t idx = 0, pos = 0; idx < zset->pack_n; ++idx, pos = pack_next(zset, pos)){
+        pack_read(zset, pos, &it);
+        ZNode* node = znode_new(zset, it.name, it.len, it.score);
+        hm_insert(&zset->hmap, &node->hmap);
+        tree_insert(zset, node);
     }
-    *from = &node->tree;  // attach to this node
-    node->tree.parent = parent;
-    zset->root = avl_fix(&node->tree);
+    pack_free(zset);
 }
 
 
@@ -60,24 +318,36 @@ static void tree_insert(ZSet* zset, ZNode* node){
 static void zset_update(ZSet* zset, ZNode* node, double score){
     if(node->score == score) 
         return; // no change
-    zset->root = avl_del(&node->tree);
-    avl_init(&node->tree);
+    tree_detach(zset, node);
     node->score = score;
     tree_insert(zset, node);
 }
 
 bool zset_insert(ZSet* zset, const char* name, size_t len, double score){
-    ZNode* node = zset_lookup(zset, name, len);
-    if(node){
-        zset_update(zset, node, score);
-        return false; // update existing node
+    ZIter it;
+    if(zset_lookup(zset, name, len, &it)){
+        // update existing member
+        if(it.node){
+            zset_update(zset, it.node, score);
+        }else if(it.score != score){
+            pack_delete(zset, it.pos); // `name` is the caller's copy
+            pack_insert(zset, name, len, score);
+        }
+        return false;
+    }
+    if(zset->encoding == ZSET_LISTPACK
+        && (len > k_zset_max_listpack_value || zset->pack_n + 1 > k_zset_max_listpack_entries))
+    {
+        zset_to_tree(zset);
     }
-    else{
-        node = znode_new(name, len, score);
+    if(zset->encoding == ZSET_LISTPACK){
+        pack_insert(zset, name, len, score);
+    }else{
+        ZNode* node = znode_new(zset, name, len, score);
         hm_insert(&zset->hmap, &node->hmap);
         tree_insert(zset, node);
-        return true;
     }
+    return true;
 }
 
 // a helper structure for the hashtable lookup
@@ -97,20 +367,311 @@ static bool hcmp(HNode* node, HNode* key){
 }
 
 // lookup by name
-ZNode* zset_lookup(ZSet* zset, const char* name, size_t len){
-    if(!zset->root)
-        return nullptr;
+bool zset_lookup(ZSet* zset, const char* name, size_t len, ZIter* it){
+    zset_settle(zset);
+    if(zset->encoding == ZSET_LISTPACK){
+        // a linear scan, the listpack is short
+        for(size_t idx = 0, pos = 0; idx < zset->pack_n; ++idx, pos = pack_next(zset, pos)){
+            if(zset->pack[pos] == len && 0 == memcmp(zset->pack + pos + k_pack_hdr, name, len)){
+                return iter_at_pack(zset, idx, pos, it);
+            }
+        }
+        return iter_at_pack(zset, zset->pack_n, zset->pack_used, it);
+    }
+    if(!hm_size(&zset->hmap))
+        return iter_at_node(zset, nullptr, it);
     
     HKey key;
     key.node.hcode = str_hash((uint8_t*)name, len);
     key.name = name;
     key.len = len;
-    HNode* found = hm_lookup(&zset->hmap, &key.node, &hcmp);
-    return found ? container_of(found, ZNode, hmap) : nullptr ;
+    // no rehashing step while a job reads the table
+    HNode* found = zset->readers ? hm_find(&zset->hmap, &key.node, &hcmp)
+        : hm_lookup(&zset->hmap, &key.node, &hcmp);
+    if(!found){
+        return iter_at_node(zset, nullptr, it);
+    }
+    ZNode* node = container_of(found, ZNode, hmap);
+    if(zset->encoding == ZSET_BTREE){
+        // position the iterator too
+        ZKey zkey = zkey_of(node);
+        btree_seekge(&zset->btree, &zkey, &bcmp_znode, &it->bit);
+        assert(biter_item(&it->bit) == node);
+    }
+    return iter_at_node(zset, node, it);
+}
+
+bool zset_contains(ZSet* zset, const char* name, size_t len){
+    if(zset->encoding == ZSET_LISTPACK){
+        for(size_t idx = 0, pos = 0; idx < zset->pack_n; ++idx, pos = pack_next(zset, pos)){
+            if(zset->pack[pos] == len && 0 == memcmp(zset->pack + pos + k_pack_hdr, name, len)){
+                return true;
+            }
+        }
+        return false;
+    }
+    HKey key;
+    key.node.hcode = str_hash((uint8_t*)name, len);
+    key.name = name;
+    key.len = len;
+    return hm_find(&zset->hmap, &key.node, &hcmp) != nullptr;
+}
+
+// whether ZADD changes the score of an existing member
+static bool zadd_should_update(uint32_t flags, double old, double score){
+    if(flags & ZADD_NX){
+        return false;
+    }
+    if((flags & ZADD_GT) && !(score > old)){
+        return false;
+    }
+    if((flags & ZADD_LT) && !(score < old)){
+        return false;
+    }
+    return score != old;
+}
+
+// rebuilding the index costs O(size + n), inserting O(n log size)
+static bool zset_bulk_wanted(ZSet* zset, const ZAddItem* items, size_t n, uint32_t flags){
+    if(n < k_zset_bulk_min || n * k_zset_bulk_ratio < zset_size(zset)){
+        return false;
+    }
+    if(zset->encoding != ZSET_LISTPACK){
+        return zset->encoding == ZSET_AVL;
+    }
+    if(g_engine != ZSET_AVL || (flags & ZADD_XX)){
+        return false;
+    }
+    // only if the batch outgrows the listpack anyway
+    bool long_name = false;
+    for(size_t i = 0; i < n && !long_name; ++i){
+        long_name = items[i].len > k_zset_max_listpack_value;
+    }
+    return long_name || zset->pack_n + n > k_zset_max_listpack_entries;
+}
+
+// a member and its score mapped to an unsigned integer with the same order
+struct ZSortItem{
+    uint64_t key = 0;
+    ZNode* node = nullptr;
+};
+
+static uint64_t score_key(double score){
+    if(score == 0){
+        score = 0; // -0.0 == 0.0
+    }
+    uint64_t bits = 0;
+    memcpy(&bits, &score, sizeof(bits));
+    // negative numbers are sign-magnitude, flip them all
+    return (bits >> 63) ? ~bits : bits | ((uint64_t)1 << 63);
+}
+
+// LSD radix sort by score, 8 bits per pass. the histograms of all passes
+// are taken in a single scan, and passes where every key has the same digit
+// (e.g. the high bytes of small integer scores) are skipped.
+static void radix_sort(std::vector<ZSortItem> &a){
+    std::vector<size_t> count(8 * 256, 0);
+    for(const ZSortItem &x : a){
+        for(uint32_t d = 0; d < 8; ++d){
+            count[d * 256 + ((x.key >> (d * 8)) & 0xff)]++;
+        }
+    }
+    std::vector<ZSortItem> tmp(a.size());
+    for(uint32_t d = 0; d < 8; ++d){
+        size_t* c = &count[d * 256];
+        if(c[(a[0].key >> (d * 8)) & 0xff] == a.size()){
+            continue;
+        }
+        size_t pos = 0;
+        for(size_t i = 0; i < 256; ++i){
+            size_t k = c[i];
+            c[i] = pos;
+            pos += k;
+        }
+        for(const ZSortItem &x : a){
+            tmp[c[(x.key >> (d * 8)) & 0xff]++] = x;
+        }
+        a.swap(tmp);
+    }
+}
+
+static bool cb_collect(HNode* node, void* arg){
+    ZSortItem item;
+    item.node = container_of(node, ZNode, hmap);
+    item.key = score_key(item.node->score);
+    ((std::vector<ZSortItem>*)arg)->push_back(item);
+    return true;
+}
+
+static bool zsort_less(const ZSortItem &lhs, const ZSortItem &rhs){
+    return zless(lhs.node->score, lhs.node->name, lhs.node->len,
+        rhs.node->score, rhs.node->name, rhs.node->len);
+}
+
+// sort by (score, name): radix sort by score, then the runs of equal scores by name
+static void zsort(std::vector<ZSortItem> &a){
+    if(a.empty()){
+        return;
+    }
+    radix_sort(a);
+    for(size_t i = 0, j = 0; i < a.size(); i = j){
+        for(j = i + 1; j < a.size() && a[j].key == a[i].key; ++j){}
+        if(j - i > 1){
+            std::sort(a.begin() + i, a.begin() + j, &zsort_less);
+        }
+    }
 }
 
-// delete by name
-void zset_delete(ZSet* zset, ZNode* node){
+static void tree_collect(AVLNode* node, std::vector<ZSortItem> &out){
+    for(; node; node = node->right){
+        tree_collect(node->left, out);
+        ZSortItem item;
+        item.node = tree_znode(node);
+        out.push_back(item);
+    }
+}
+
+// apply the batch to the hashtable only, then rebuild the AVL index.
+// if no existing score has changed, the index is still in order and only
+// the new members are sorted and merged into it, otherwise all are sorted.
+static void zset_insert_bulk(ZSet* zset, const ZAddItem* items, size_t n, uint32_t flags,
+    size_t* added, size_t* updated)
+{
+    if(zset->encoding == ZSET_LISTPACK){
+        zset_to_tree(zset);
+    }
+    assert(zset->encoding == ZSET_AVL);
+    hm_reserve(&zset->hmap, hm_size(&zset->hmap) + n);
+    std::vector<ZSortItem> fresh;
+    fresh.reserve(n);
+    for(size_t i = 0; i < n; ++i){
+        HKey key;
+        key.node.hcode = str_hash((uint8_t*)items[i].name, items[i].len);
+        key.name = items[i].name;
+        key.len = items[i].len;
+        HNode* found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+        if(found){
+            ZNode* node = container_of(found, ZNode, hmap);
+            if(zadd_should_update(flags, node->score, items[i].score)){
+                node->score = items[i].score;
+                if(zset->aug){
+                    avl_aug(znode_tree(node))->val = node->score;
+                }
+                (*updated)++;
+            }
+        }else if(!(flags & ZADD_XX)){
+            ZNode* node = znode_new(zset, items[i].name, items[i].len, items[i].score);
+            hm_insert(&zset->hmap, &node->hmap);
+            ZSortItem item;
+            item.node = node;
+            fresh.push_back(item);
+            (*added)++;
+        }
+    }
+    if(*added == 0 && *updated == 0){
+        return;
+    }
+
+    std::vector<ZSortItem> sorted;
+    sorted.reserve(hm_size(&zset->hmap));
+    if(*updated == 0){
+        for(ZSortItem &item : fresh){
+            item.key = score_key(item.node->score);
+        }
+        zsort(fresh);
+        tree_collect(zset->root, sorted);
+        size_t mid = sorted.size();
+        sorted.insert(sorted.end(), fresh.begin(), fresh.end());
+        std::inplace_merge(sorted.begin(), sorted.begin() + mid, sorted.end(), &zsort_less);
+    }else{
+        hm_foreach(&zset->hmap, &cb_collect, &sorted);
+        zsort(sorted);
+    }
+    std::vector<AVLNode*> tnodes(sorted.size());
+    for(size_t i = 0; i < sorted.size(); ++i){
+        tnodes[i] = znode_tree(sorted[i].node);
+    }
+    zset->root = avl_build(tnodes.data(), tnodes.size());
+}
+
+void zset_insert_many(ZSet* zset, const ZAddItem* items, size_t n, uint32_t flags,
+    size_t* added, size_t* updated)
+{
+    zset_settle(zset);
+    *added = *updated = 0;
+    if(zset_bulk_wanted(zset, items, n, flags)){
+        return zset_insert_bulk(zset, items, n, flags, added, updated);
+    }
+    for(size_t i = 0; i < n; ++i){
+        const ZAddItem &item = items[i];
+        ZIter it;
+        if(zset_lookup(zset, item.name, item.len, &it)){
+            if(zadd_should_update(flags, it.score, item.score)){
+                zset_insert(zset, item.name, item.len, item.score);
+                (*updated)++;
+            }
+        }else if(!(flags & ZADD_XX)){
+            zset_insert(zset, item.name, item.len, item.score);
+            (*added)++;
+        }
+    }
+}
+
+bool zset_insert_sorted(ZSet* zset, const ZAddItem* items, size_t n){
+    assert(zset_size(zset) == 0 && zset->encoding == ZSET_LISTPACK);
+    bool fits = n <= k_zset_max_listpack_entries;
+    size_t bytes = 0;
+    for(size_t i = 0; i < n; ++i){
+        if(i > 0 && !zless(items[i - 1].score, items[i - 1].name, items[i - 1].len,
+            items[i].score, items[i].name, items[i].len))
+        {
+            return false; // also rejects duplicates and NaN
+        }
+        fits = fits && items[i].len <= k_zset_max_listpack_value;
+        bytes += k_pack_hdr + items[i].len;
+    }
+    if(fits){
+        pack_reserve(zset, bytes);
+        for(size_t i = 0; i < n; ++i){
+            uint8_t* p = zset->pack + zset->pack_used;
+            p[0] = (uint8_t)items[i].len;
+            memcpy(p + 1, &items[i].score, sizeof(double));
+            memcpy(p + k_pack_hdr, items[i].name, items[i].len);
+            zset->pack_used += (uint32_t)(k_pack_hdr + items[i].len);
+        }
+        zset->pack_n = (uint32_t)n;
+        return true;
+    }
+    zset->encoding = g_engine;
+    zset->aug = g_engine == ZSET_AVL && g_avl_aggregates;
+    hm_reserve(&zset->hmap, n);
+    std::vector<AVLNode*> tnodes;
+    tnodes.reserve(zset->encoding == ZSET_AVL ? n : 0);
+    for(size_t i = 0; i < n; ++i){
+        ZNode* node = znode_new(zset, items[i].name, items[i].len, items[i].score);
+        hm_insert(&zset->hmap, &node->hmap);
+        if(zset->encoding == ZSET_AVL){
+            tnodes.push_back(znode_tree(node));
+        }else{
+            tree_insert(zset, node); // always at the right edge
+        }
+    }
+    if(zset->encoding == ZSET_AVL){
+        zset->root = avl_build(tnodes.data(), tnodes.size());
+    }
+    return true;
+}
+
+// delete the member the iterator points to
+void zset_delete(ZSet* zset, ZIter* it){
+    assert(it->valid);
+    it->valid = false;
+    if(zset->encoding == ZSET_LISTPACK){
+        pack_delete(zset, it->pos);
+        return;
+    }
+    zset_settle(zset);
+    ZNode* node = it->node;
     // remove from the hashtable
     HKey key;
     key.node.hcode = node->hmap.hcode;
@@ -118,13 +679,26 @@ void zset_delete(ZSet* zset, ZNode* node){
     key.len = node->len;
     HNode* found = hm_delete(&zset->hmap, &key.node, &hcmp);
     assert(found);
-    // remove from the AVL tree
-    zset->root = avl_del(&node->tree);
-    znode_del(node);
+    // remove from the sorted index
+    tree_detach(zset, node);
+    znode_del(zset->encoding, node);
 }
 
 // find the first (score, name) tuple that is >= key.
-ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len){
+bool zset_seekge(ZSet* zset, double score, const char* name, size_t len, ZIter* it){
+    if(zset->encoding == ZSET_LISTPACK){
+        size_t idx = 0;
+        size_t pos = pack_seekge(zset, score, name, len, &idx);
+        return iter_at_pack(zset, idx, pos, it);
+    }
+    if(zset->encoding == ZSET_BTREE){
+        ZKey key;
+        key.score = score;
+        key.name = name;
+        key.len = len;
+        btree_seekge(&zset->btree, &key, &bcmp_znode, &it->bit);
+        return iter_at_btree(zset, it);
+    }
     AVLNode* found = nullptr;
     for(AVLNode* node = zset->root; node;){
         if(zless(node, score, name, len))
@@ -137,13 +711,102 @@ ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len){
             node = node->left;
         }
     }
-    return found ? container_of(found, ZNode, tree) : nullptr;
+    return iter_at_node(zset, found ? tree_znode(found) : nullptr, it);
 }
 
 // offset into the succeeding or preceding node
 ZNode* znode_offset(ZNode* node, int64_t offset){
-    AVLNode* tnode = node ? avl_offset(&node->tree, offset) : nullptr;
-    return tnode ? container_of(tnode, ZNode, tree) : nullptr;
+    AVLNode* tnode = node ? avl_offset(znode_tree(node), offset) : nullptr;
+    return tnode ? tree_znode(tnode) : nullptr;
+}
+
+bool zset_offset(ZIter* it, int64_t offset){
+    if(!it->valid){
+        return false;
+    }
+    ZSet* zset = it->zset;
+    if(zset->encoding == ZSET_BTREE){
+        btree_offset(&zset->btree, &it->bit, offset);
+        return iter_at_btree(zset, it);
+    }
+    if(zset->encoding == ZSET_AVL){
+        return iter_at_node(zset, znode_offset(it->node, offset), it);
+    }
+    int64_t target = (int64_t)it->idx + offset;
+    if(target < 0 || target >= (int64_t)zset->pack_n){
+        it->valid = false;
+        return false;
+    }
+    // no back links, walk backwards from the start
+    size_t idx = it->idx;
+    size_t pos = it->pos;
+    if(target < (int64_t)idx){
+        idx = pos = 0;
+    }
+    for(; (int64_t)idx < target; ++idx){
+        pos = pack_next(zset, pos);
+    }
+    return iter_at_pack(zset, idx, pos, it);
+}
+
+size_t zset_rank(ZIter* it){
+    assert(it->valid);
+    switch(it->zset->encoding){
+    case ZSET_BTREE:
+        return btree_rank(&it->bit);
+    case ZSET_AVL:
+        return avl_rank(znode_tree(it->node));
+    default:
+        return it->idx;
+    }
+}
+
+bool zset_select(ZSet* zset, size_t rank, ZIter* it){
+    if(rank >= zset_size(zset)){
+        it->zset = zset;
+        it->valid = false;
+        return false;
+    }
+    if(zset->encoding == ZSET_BTREE){
+        btree_select(&zset->btree, rank, &it->bit);
+        return iter_at_btree(zset, it);
+    }
+    if(zset->encoding == ZSET_AVL){
+        // the root's rank is the size of its left subtree
+        AVLNode* root = zset->root;
+        int64_t offset = (int64_t)rank - (int64_t)avl_cnt(root->left);
+        return iter_at_node(zset, tree_znode(avl_offset(root, offset)), it);
+    }
+    iter_at_pack(zset, 0, 0, it);
+    return zset_offset(it, (int64_t)rank);
+}
+
+size_t zset_size(ZSet* zset){
+    if(zset->unlink){
+        return zset->unlink->size;
+    }
+    return zset->encoding == ZSET_LISTPACK ? zset->pack_n : hm_size(&zset->hmap);
+}
+
+void zset_aggregate(ZSet* zset, size_t lo, size_t hi, ZAgg* out){
+    *out = ZAgg{};
+    hi = min(hi, zset_size(zset));
+    if(lo >= hi){
+        return;
+    }
+    if(zset->aug){
+        out->count = avl_aggregate(zset->root, lo, hi, &out->sum, &out->min, &out->max);
+        return;
+    }
+    ZIter it;
+    zset_select(zset, lo, &it);
+    // the scores are in order
+    out->min = it.score;
+    for(size_t i = lo; i < hi && it.valid; ++i, zset_offset(&it, 1)){
+        out->sum += it.score;
+        out->max = it.score;
+        out->count++;
+    }
 }
 
 static void tree_dispose(AVLNode* node){
@@ -153,12 +816,291 @@ static void tree_dispose(AVLNode* node){
     }
     tree_dispose(node->left);
     tree_dispose(node->right);
-    znode_del(container_of(node, ZNode, tree));
+    znode_del(ZSET_AVL, tree_znode(node));
+}
+
+static void cb_btree_dispose(void* item, void*){
+    znode_del(ZSET_BTREE, (ZNode*)item);
 }
 
 // destory the zset
 void zset_clear(ZSet* zset){
+    if(zset->encoding == ZSET_LISTPACK){
+        pack_free(zset);
+        return;
+    }
+    zset_settle(zset);
     hm_clear(&zset->hmap);
-    tree_dispose(zset->root);
-    zset->root = nullptr;
+    if(zset->encoding == ZSET_BTREE){
+        btree_clear(&zset->btree, &cb_btree_dispose, nullptr);
+    }else{
+        tree_dispose(zset->root);
+        zset->root = nullptr;
+    }
+    zset->encoding = ZSET_LISTPACK;
+    zset->aug = false;
+}
+
+// hashtable removal by identity, the node is known
+static bool hnode_same(HNode* node, HNode* key){
+    return node == key;
+}
+
+static void hm_unlink(HMap* hmap, ZNode* node){
+    HNode* found = hm_delete(hmap, &node->hmap, &hnode_same);
+    assert(found);
+    (void)found;
+}
+
+static void tree_walk(AVLNode* node, void (*f)(ZNode*, void*), void* arg){
+    if(!node){
+        return;
+    }
+    tree_walk(node->left, f, arg);
+    tree_walk(node->right, f, arg);
+    f(tree_znode(node), arg);
+}
+
+static void btree_walk(BTree* tree, void (*f)(ZNode*, void*), void* arg){
+    for(BLeaf* leaf = tree->first; leaf; leaf = leaf->next){
+        for(uint32_t i = 0; i < leaf->hdr.n; ++i){
+            f((ZNode*)leaf->items[i], arg);
+        }
+    }
+}
+
+static void cb_hm_unlink(ZNode* node, void* arg){
+    hm_unlink((HMap*)arg, node);
+}
+
+static void cb_hm_insert(ZNode* node, void* arg){
+    hm_insert((HMap*)arg, &node->hmap);
+}
+
+static void zunlink_pass(ZUnlink* u){
+    ZSet* zset = u->zset;
+    bool btree = zset->encoding == ZSET_BTREE;
+    if(u->rebuild){
+        hm_reserve(&zset->hmap, u->size);
+        if(btree){
+            btree_walk(&zset->btree, &cb_hm_insert, &zset->hmap);
+        }else{
+            tree_walk(zset->root, &cb_hm_insert, &zset->hmap);
+        }
+    }else if(btree){
+        btree_walk(&u->btree, &cb_hm_unlink, &zset->hmap);
+    }else{
+        tree_walk(u->root, &cb_hm_unlink, &zset->hmap);
+    }
+}
+
+// run the pass unless the other holder has, and wait if it's running it
+static void zunlink_finish(ZUnlink* u){
+    uint32_t state = ZUNLINK_PENDING;
+    if(u->state.compare_exchange_strong(state, ZUNLINK_RUNNING, std::memory_order_acquire)){
+        zunlink_pass(u);
+        u->state.store(ZUNLINK_DONE, std::memory_order_release);
+        return;
+    }
+    while(u->state.load(std::memory_order_acquire) != ZUNLINK_DONE){
+        sched_yield();
+    }
+}
+
+static void zunlink_release(ZUnlink* u){
+    if(u->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        delete u;
+    }
+}
+
+void zset_settle(ZSet* zset){
+    if(!zset->unlink){
+        return;
+    }
+    zunlink_finish(zset->unlink);
+    zunlink_release(zset->unlink);
+    zset->unlink = nullptr;
+}
+
+static size_t pack_remove_range(ZSet* zset, size_t start, size_t stop){
+    size_t pos = 0, idx = 0;
+    for(; idx < start; ++idx){
+        pos = pack_next(zset, pos);
+    }
+    size_t end = pos;
+    for(; idx < stop; ++idx){
+        end = pack_next(zset, end);
+    }
+    memmove(zset->pack + pos, zset->pack + end, zset->pack_used - end);
+    zset->pack_used -= (uint32_t)(end - pos);
+    zset->pack_n -= (uint32_t)(stop - start);
+    return stop - start;
+}
+
+size_t zset_remove_range(ZSet* zset, size_t start, size_t stop, ZRange* out, size_t defer){
+    zset_settle(zset);
+    size_t n = zset_size(zset);
+    stop = min(stop, n);
+    out->encoding = zset->encoding;
+    out->size = 0;
+    if(start >= stop){
+        return 0;
+    }
+    if(zset->encoding == ZSET_LISTPACK){
+        return pack_remove_range(zset, start, stop);
+    }
+    size_t k = stop - start;
+    out->size = k;
+    // cut out the middle and join the rest
+    bool btree = zset->encoding == ZSET_BTREE;
+    if(btree){
+        BTree tail;
+        btree_split(&zset->btree, start, &out->btree);
+        btree_split(&out->btree, k, &tail);
+        btree_join(&zset->btree, &tail);
+    }else{
+        AVLNode* head = nullptr;
+        AVLNode* rest = nullptr;
+        AVLNode* tail = nullptr;
+        avl_split(zset->root, start, &head, &rest);
+        avl_split(rest, k, &out->root, &tail);
+        zset->root = avl_concat(head, tail);
+    }
+    // the hashtable has no order, it's either the removed nodes out of it,
+    // or the remaining ones into a new one
+    ZUnlink local;
+    bool later = min(k, n - k) > defer;
+    ZUnlink* u = later ? new ZUnlink() : &local;
+    u->zset = zset;
+    u->rebuild = k > n - k;
+    u->root = out->root;
+    u->btree = out->btree;
+    u->size = n - k;
+    if(u->rebuild){
+        out->hmap = zset->hmap;
+        zset->hmap = HMap{};
+    }
+    if(later){
+        zset->unlink = u;
+        out->unlink = u;
+    }else{
+        zunlink_pass(u);
+    }
+    return k;
+}
+
+void zset_range_free(ZRange* range){
+    if(range->unlink){
+        zunlink_finish(range->unlink);
+        zunlink_release(range->unlink);
+        range->unlink = nullptr;
+    }
+    tree_dispose(range->root);
+    range->root = nullptr;
+    btree_clear(&range->btree, &cb_btree_dispose, nullptr);
+    hm_clear(&range->hmap);
+    range->size = 0;
+}
+
+struct MemSample{
+    uint32_t encoding = ZSET_AVL;
+    size_t bytes = 0;
+    size_t seen = 0;
+    size_t limit = 0;
+};
+
+static bool cb_mem_sample(HNode* node, void* arg){
+    MemSample* ms = (MemSample*)arg;
+    ZNode* znode = container_of(node, ZNode, hmap);
+    bool aug = znode_aug(ms->encoding, znode);
+    ms->bytes += slab_usable_size(znode_size(ms->encoding, aug, znode->len));
+    ms->seen++;
+    return ms->limit == 0 || ms->seen < ms->limit;
+}
+
+size_t zset_mem_usage(ZSet* zset, size_t samples){
+    if(zset->encoding == ZSET_LISTPACK){
+        return slab_usable_size(sizeof(ZSet)) + zset->pack_cap;
+    }
+    zset_settle(zset);
+    size_t bytes = slab_usable_size(sizeof(ZSet)) + hm_mem_usage(&zset->hmap)
+        + btree_mem_usage(&zset->btree);
+    size_t n = hm_size(&zset->hmap);
+    if(n == 0){
+        return bytes;
+    }
+    MemSample ms;
+    ms.encoding = zset->encoding;
+    ms.limit = samples;
+    hm_foreach(&zset->hmap, &cb_mem_sample, &ms);
+    // each member carries its HNode, name and AVLNode (if any) in one slab object
+    return bytes + (size_t)((double)ms.bytes / ms.seen * n);
+}
+
+struct DefragArg{
+    ZSet* zset = nullptr;
+    size_t* moved = nullptr;
+};
+
+// relocate one node, the index and hashtable links are fixed in place
+static void cb_defrag(HNode** from, void* arg){
+    ZSet* zset = ((DefragArg*)arg)->zset;
+    size_t* moved = ((DefragArg*)arg)->moved;
+    ZNode* node = container_of(*from, ZNode, hmap);
+    bool aug = znode_aug(zset->encoding, node);
+    size_t prefix = znode_prefix(zset->encoding, aug);
+    size_t size = znode_size(zset->encoding, aug, node->len);
+    char* mem = (char*)slab_defrag_alloc((char*)node - prefix, size);
+    if(!mem){
+        return;
+    }
+    memcpy(mem, (char*)node - prefix, size);
+    ZNode* fresh = (ZNode*)(mem + prefix);
+    *from = &fresh->hmap;
+
+    if(zset->encoding == ZSET_BTREE){
+        BIter it;
+        ZKey key = zkey_of(fresh);
+        btree_seekge(&zset->btree, &key, &bcmp_znode, &it);
+        assert(biter_item(&it) == node);
+        btree_replace(&it, fresh);
+    }else{
+        AVLNode* old = znode_tree(node);
+        AVLNode* tnode = znode_tree(fresh);
+        AVLNode* parent = tnode->parent;
+        if(!parent){
+            zset->root = tnode;
+        }else if(parent->left == old){
+            parent->left = tnode;
+        }else{
+            parent->right = tnode;
+        }
+        if(tnode->left){
+            tnode->left->parent = tnode;
+        }
+        if(tnode->right){
+            tnode->right->parent = tnode;
+        }
+    }
+    slab_defrag_free((char*)node - prefix, size);
+    (*moved)++;
+}
+
+size_t zset_defrag(ZSet* zset, size_t cursor, size_t* moved){
+    if(zset->encoding == ZSET_LISTPACK){
+        // a single object, nullptr when it's a zmalloc() one
+        uint8_t* fresh = zset->pack ? (uint8_t*)slab_defrag_alloc(zset->pack, zset->pack_cap) : nullptr;
+        if(fresh){
+            memcpy(fresh, zset->pack, zset->pack_used);
+            slab_defrag_free(zset->pack, zset->pack_cap);
+            zset->pack = fresh;
+            (*moved)++;
+        }
+        return 0;
+    }
+    zset_settle(zset);
+    DefragArg arg;
+    arg.zset = zset;
+    arg.moved = moved;
+    return hm_scan(&zset->hmap, cursor, &cb_defrag, &arg);
 }
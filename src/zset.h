@@ -1,24 +1,150 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 
+// small zsets are kept in one score-ordered byte array (the listpack encoding):
+//   | len (1 byte) | score (8 bytes) | name (len bytes) | len | score | name | ...
+// and converted to a sorted index + hashtable once they outgrow these limits.
+const size_t k_zset_max_listpack_entries = 128;
+const size_t k_zset_max_listpack_value = 64; // longest name in bytes
+
+enum{
+    ZSET_LISTPACK = 0,
+    ZSET_AVL = 1,   // one AVLNode per member
+    ZSET_BTREE = 2, // wide B+tree nodes holding ZNode pointers
+};
+
+struct ZUnlink; // see zset_remove_range()
+
 struct ZSet{
-    AVLNode* root = nullptr; // index by (score, name)
+    uint32_t encoding = ZSET_LISTPACK;
+    bool aug = false;        // ZSET_AVL: the nodes keep score aggregates (AVLAug)
+    uint32_t pack_n = 0;     // listpack: number of members
+    uint32_t pack_used = 0;  // listpack: bytes in use
+    uint32_t pack_cap = 0;   // listpack: bytes allocated
+    uint8_t* pack = nullptr;
+    AVLNode* root = nullptr; // ZSET_AVL: index by (score, name)
+    BTree btree;             // ZSET_BTREE: index by (score, name)
     HMap hmap; // index by name
+    // jobs looking members up off the event loop, see zset_contains(). the
+    // lookups on the event loop don't rehash meanwhile.
+    uint32_t readers = 0;
+    // a removal whose hashtable pass isn't done yet, see zset_settle()
+    ZUnlink* unlink = nullptr;
 };
 
+// with ZSET_AVL the AVLNode is placed right before the ZNode in the same object
 struct ZNode{
-    AVLNode tree;
     HNode hmap;
     double score = 0;
     size_t len = 0;
     char name[0]; // flexible array
 };
 
+// a member of either encoding, valid until the zset is modified
+struct ZIter{
+    ZSet* zset = nullptr;
+    bool valid = false;
+    ZNode* node = nullptr;  // AVL or B+tree: the member
+    BIter bit;              // B+tree: its position
+    size_t idx = 0;         // listpack: rank of the member
+    size_t pos = 0;         // listpack: byte offset of the member
+    // the member itself
+    const char* name = nullptr;
+    size_t len = 0;
+    double score = 0;
+};
+
+// members detached by zset_remove_range(), released by zset_range_free()
+struct ZRange{
+    uint32_t encoding = ZSET_LISTPACK;
+    bool aug = false;        // ZSET_AVL: the nodes keep score aggregates (AVLAug)
+    size_t size = 0;
+    AVLNode* root = nullptr; // ZSET_AVL: the detached subtree
+    BTree btree;             // ZSET_BTREE: the detached items
+    HMap hmap;               // a replaced hashtable, only the slots are freed
+    ZUnlink* unlink = nullptr; // the hashtable pass, when left to zset_range_free()
+};
+
+// ZADD conditions, see zset_insert_many()
+enum{
+    ZADD_NX = 1, // only add new members
+    ZADD_XX = 2, // only update existing members
+    ZADD_GT = 4, // only update to a greater score
+    ZADD_LT = 8, // only update to a lower score
+};
+
+struct ZAddItem{
+    double score = 0;
+    const char* name = nullptr;
+    size_t len = 0;
+};
+
+// an AVL index is rebuilt from the sorted members, instead of inserting one
+// by one, when a batch is at least this large and 1/k of the zset
+const size_t k_zset_bulk_min = 64;
+const size_t k_zset_bulk_ratio = 8;
+
 bool zset_insert(ZSet* zset, const char* name, size_t len, double score);
-ZNode* zset_lookup(ZSet* zset, const char* name, size_t len);
-void zset_delete(ZSet* zset, ZNode* node);
-ZNode* zset_seekge(ZSet* zset, double score, const char* name, size_t len);
+// add or update the members in order, as zset_insert() would with the ZADD_*
+// `flags`. `added` and `updated` count the new members and the changed scores.
+void zset_insert_many(ZSet* zset, const ZAddItem* items, size_t n, uint32_t flags,
+    size_t* added, size_t* updated);
+// fill an empty zset with members already in (score, name) order, as a
+// snapshot has them: appended to the listpack, or an AVL index built bottom-up
+// in O(n) with no sorting. false (and nothing added) if they are out of order.
+bool zset_insert_sorted(ZSet* zset, const ZAddItem* items, size_t n);
+bool zset_lookup(ZSet* zset, const char* name, size_t len, ZIter* it);
+// whether the member is there. the zset isn't modified, so threads can look
+// up at once while nothing writes it
+bool zset_contains(ZSet* zset, const char* name, size_t len);
+void zset_delete(ZSet* zset, ZIter* it);
+// find the first (score, name) tuple that is >= key.
+bool zset_seekge(ZSet* zset, double score, const char* name, size_t len, ZIter* it);
+// move to the succeeding or preceding member, false when out of range
+bool zset_offset(ZIter* it, int64_t offset);
+// the number of members before the one at `it`
+size_t zset_rank(ZIter* it);
+// position `it` at the member with this rank, false when out of range
+bool zset_select(ZSet* zset, size_t rank, ZIter* it);
+size_t zset_size(ZSet* zset);
+// the scores of the members ranked [lo, hi)
+struct ZAgg{
+    size_t count = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+};
+// O(log n) for ZSET_AVL with aggregates, a scan of the range otherwise
+void zset_aggregate(ZSet* zset, size_t lo, size_t hi, ZAgg* out);
+// remove the members ranked [start, stop). the listpack is edited in place,
+// the members of the other encodings are moved to `out` for zset_range_free(),
+// which doesn't touch the zset and can run on another thread.
+// both indexes detach the range with split/join in O(log n). the hashtable
+// costs O(min(k, n - k)) for k removed: the removed members are unlinked, or
+// the remaining ones are moved to a new table and the old slots freed later.
+// when that's over `defer` members, it's left to zset_range_free(), which
+// can run on another thread: the zset keeps its size and order meanwhile,
+// the functions that need the hashtable call zset_settle() first.
+size_t zset_remove_range(ZSet* zset, size_t start, size_t stop, ZRange* out,
+    size_t defer = (size_t)-1);
+void zset_range_free(ZRange* range);
+// finish the hashtable pass of a removal, or wait for the thread doing it
+void zset_settle(ZSet* zset);
 void zset_clear(ZSet* zset);
-ZNode* znode_offset(ZNode* node, int64_t offset);
\ No newline at end of file
+// AVL only
+ZNode* znode_offset(ZNode* node, int64_t offset);
+// the index (ZSET_AVL or ZSET_BTREE) for zsets that outgrow the listpack from now on
+void zset_set_engine(uint32_t encoding);
+uint32_t zset_engine();
+// whether AVL indexes created from now on keep the sum, min and max of the
+// scores in each subtree, 32 more bytes per member for O(log n) zset_aggregate()
+void zset_set_avl_aggregates(bool on);
+bool zset_avl_aggregates();
+// active defrag: move the members of one hash slot into denser slab pages.
+// returns the next cursor (0 when done), `moved` counts the relocated objects.
+size_t zset_defrag(ZSet* zset, size_t cursor, size_t* moved);
+// bytes used by the zset, averaging `samples` members (0 means all of them)
+size_t zset_mem_usage(ZSet* zset, size_t samples);
@@ -0,0 +1,100 @@
+// compares the zset indexes (AVL vs B+tree): range scans like zquery,
+// rank jumps and memory, and bulk loading with zset_insert_many().
+// usage: bench_zset [members]
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include "../src/zset.h"
+
+static volatile double g_sink; // keeps the loops from being optimized out
+
+static double now_sec(){
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench(uint32_t engine, const char* label, size_t n){
+    zset_set_engine(engine);
+    ZSet zset;
+    std::vector<std::string> names(n);
+    srand(1);
+    double t0 = now_sec();
+    for(size_t i = 0; i < n; ++i){
+        names[i] = "member:" + std::to_string(i);
+        zset_insert(&zset, names[i].data(), names[i].size(), (double)(rand() % 1000000));
+    }
+    double t_insert = now_sec() - t0;
+    size_t mem = zset_mem_usage(&zset, 0);
+
+    // zquery zset score "" 0 100, from random scores
+    const size_t k_queries = 200000;
+    const int64_t k_limit = 100;
+    double sum = 0;
+    t0 = now_sec();
+    for(size_t q = 0; q < k_queries; ++q){
+        ZIter it;
+        zset_seekge(&zset, (double)(rand() % 1000000), "", 0, &it);
+        for(int64_t k = 0; k < k_limit && it.valid; ++k){
+            sum += it.score;
+            zset_offset(&it, 1);
+        }
+    }
+    double t_range = now_sec() - t0;
+
+    // zquery with a large offset, a rank jump
+    t0 = now_sec();
+    for(size_t q = 0; q < k_queries; ++q){
+        ZIter it;
+        zset_seekge(&zset, 0, "", 0, &it);
+        zset_offset(&it, rand() % (int64_t)n);
+        sum += it.valid ? it.score : 0;
+    }
+    double t_jump = now_sec() - t0;
+
+    g_sink = sum;
+    printf("%-6s n=%zu insert %.0f/s | range(100) %.0f queries/s | offset jump %.0f/s | memory %.1f bytes/member\n",
+        label, n, n / t_insert, k_queries / t_range, k_queries / t_jump, (double)mem / n);
+    zset_clear(&zset);
+}
+
+// load in ZADD sized batches: one by one vs zset_insert_many()
+static void bench_bulk(size_t n, size_t batch){
+    zset_set_engine(ZSET_AVL);
+    std::vector<std::string> names(n);
+    std::vector<ZAddItem> items(n);
+    srand(1);
+    for(size_t i = 0; i < n; ++i){
+        names[i] = "member:" + std::to_string(i);
+        items[i].score = (double)(rand() % 1000000);
+        items[i].name = names[i].data();
+        items[i].len = names[i].size();
+    }
+    ZSet one, many;
+    double t0 = now_sec();
+    for(size_t i = 0; i < n; ++i){
+        zset_insert(&one, items[i].name, items[i].len, items[i].score);
+    }
+    double t_one = now_sec() - t0;
+    t0 = now_sec();
+    for(size_t i = 0; i < n; i += batch){
+        size_t added = 0, updated = 0;
+        zset_insert_many(&many, &items[i], std::min(batch, n - i), 0, &added, &updated);
+    }
+    double t_many = now_sec() - t0;
+    printf("bulk   n=%zu batch=%zu insert %.0f/s | insert_many %.0f/s (%.1fx)\n",
+        n, batch, n / t_one, n / t_many, t_one / t_many);
+    zset_clear(&one);
+    zset_clear(&many);
+}
+
+int main(int argc, char** argv){
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+    bench(ZSET_AVL, "avl", n);
+    bench(ZSET_BTREE, "btree", n);
+    bench_bulk(n, n);
+    bench_bulk(n, 100000);
+    return 0;
+}
@@ -0,0 +1,110 @@
+# AOF rewrite round trip: writes served while the rewrite scans the keyspace,
+# the switch to the new file, more writes, then a restart replays the new file
+# and must give back the same keyspace
+from testlib import Server, info, wait_until
+
+PORT = 7363
+NKEYS = 150000
+BIG = 30000  # members of a zset written to the preamble in batches
+
+
+def batches(cmds, n=2000):
+    for i in range(0, len(cmds), n):
+        yield cmds[i:i + n]
+
+
+def zsorted(zset):
+    return sorted(zset.items(), key=lambda m: (m[1], m[0]))
+
+
+def check(c, strs, zsets, ttls):
+    assert int(info(c, 'keyspace')['keys']) == len(strs) + len(zsets)
+    names = sorted(strs)
+    for part in batches(names):
+        got = c.pipeline([('get', k) for k in part])
+        assert got == [strs[k] for k in part], part[0]
+    for key, zset in zsets.items():
+        want = zsorted(zset)
+        assert c('zcard', key) == len(want), key
+        for i in range(0, len(want), 200):
+            got = c('zrange', key, i, i + 199, 'withscores')
+            assert got == [x for m in want[i:i + 200] for x in m], (key, i)
+    for key in ttls:
+        assert c('pttl', key) > 0, key
+
+
+def main():
+    srv = Server(PORT, '--appendonly', 'yes', '--appendfsync', 'everysec')
+    try:
+        c = srv.client()
+        strs = {'k%d' % i: 'v%d' % i for i in range(NKEYS)}
+        for part in batches([('set', k, v) for k, v in strs.items()]):
+            c.pipeline(part)
+        zsets = {'big': {}, 'small': {'a': 1.0, 'b': 2.0}}
+        for i in range(0, BIG, 500):
+            args = []
+            for m in range(i, i + 500):
+                zsets['big']['m%d' % m] = float(m % 100)
+                args += [m % 100, 'm%d' % m]
+            c('zadd', 'big', *args)
+        c('zadd', 'small', 1, 'a', 2, 'b')
+        ttls = {'k0', 'k1'}
+        c('pexpire', 'k0', 3600 * 1000)
+        c('pexpire', 'k1', 3600 * 1000)
+
+        # writes right behind the start, before the scan reaches the keys
+        writes = [('bgrewriteaof',)]
+        for i in range(0, NKEYS, 7):
+            writes.append(('set', 'k%d' % i, 'changed'))
+            strs['k%d' % i] = 'changed'
+        for i in range(3, NKEYS, 7):
+            writes.append(('del', 'k%d' % i))
+            del strs['k%d' % i]
+        for i in range(1000):
+            writes.append(('set', 'new%d' % i, 'x'))
+            strs['new%d' % i] = 'x'
+        big = zsets['big']
+        writes.append(('zadd', 'big', -1, 'extra'))
+        big['extra'] = -1.0
+        writes += [('zrem', 'big', 'm5'), ('zrem', 'big', 'm6')]
+        del big['m5'], big['m6']
+        writes.append(('zremrangebyrank', 'big', 10, 999))
+        for name, _ in zsorted(big)[10:1000]:
+            del big[name]
+        writes.append(('del', 'small'))
+        del zsets['small']
+        writes.append(('zadd', 'fresh', 5, 'z'))
+        zsets['fresh'] = {'z': 5.0}
+        writes.append(('info', 'persistence'))
+        replies = c.pipeline(writes)
+        assert replies[0] == 'Background append only file rewriting started', replies[0]
+        assert 'aof_rewrite_in_progress:1' in replies[-1], 'the rewrite ended before the writes'
+
+        def rewritten():
+            return info(c, 'persistence')['aof_rewrite_in_progress'] == '0'
+        wait_until(rewritten, what='the rewrite')
+        st = info(c, 'persistence')
+        assert st['aof_last_bgrewrite_status'] == 'ok' and st['aof_rewrites'] == '1', st
+        check(c, strs, zsets, ttls)
+
+        # after the switch, the commands go to the new file
+        c.pipeline([('set', 'after%d' % i, 'y') for i in range(100)])
+        strs.update({'after%d' % i: 'y' for i in range(100)})
+        c('zadd', 'big', 1000, 'last')
+        big['last'] = 1000.0
+        c('del', 'k1')
+        del strs['k1']
+        ttls.discard('k1')
+        wait_until(lambda: info(c, 'persistence')['aof_buffer_length'] == '0',
+                   what='the AOF write')
+
+        srv.restart()
+        c = srv.client()
+        check(c, strs, zsets, ttls)
+        print('test_aof_rewrite ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
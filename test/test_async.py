@@ -0,0 +1,167 @@
+# ZINTERCARD on large inputs suspends its client while the thread pool
+# counts: the requests pipelined behind it wait and see its effects in order,
+# a client may close or reset before the reply, and ZUNION fails before the
+# work when its reply can't fit. the inputs but the smallest are read in
+# place: the event loop goes on meanwhile, and their writers wait
+import socket
+import struct
+import threading
+import time
+
+from testlib import Server, Client, Err, ERR_TOO_BIG, encode, info, wait_until
+
+PORT = 7371
+N = 60000      # members of each zset, the lookups leave the event loop
+COMMON = 30000
+BIG = 400000   # copying it a few times would stall the event loop
+STALL_S = 0.25
+
+
+def fill(c, key, first, n):
+    for i in range(first, first + n, 500):
+        args = []
+        for m in range(i, min(i + 500, first + n)):
+            args += [m % 1000, 'm%d' % m]
+        c('zadd', key, *args)
+
+
+def async_stats(c):
+    st = info(c, 'stats')
+    return int(st['async_cmds_processed']), int(st['async_cmds_inflight'])
+
+
+# reset the link while the job runs, true if it was caught running
+def reset_mid_job(c, key):
+    before = async_stats(c)[0]
+    s = socket.create_connection(('127.0.0.1', PORT))
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+    s.sendall(encode(('zintercard', 2, 'a', 'b')) + encode(('set', key, '1')))
+    running = False
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        done, inflight = async_stats(c)
+        if inflight or done > before:
+            running = inflight > 0
+            break
+    s.close()
+    wait_until(lambda: async_stats(c) == (before + 1, 0), what='the job of the reset client')
+    return running
+
+
+# run `f` once the job of `cmd` is running, then read its reply. true if it
+# was caught running
+def during_job(c, cmd, f):
+    before = async_stats(c)[0]
+    s = Client(PORT)
+    s.send(*cmd)
+    running = False
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        done, inflight = async_stats(c)
+        if inflight or done > before:
+            running = inflight > 0
+            break
+    f()
+    reply = s.read()
+    s.close()
+    return running, reply
+
+
+def main():
+    srv = Server(PORT)
+    try:
+        c = srv.client()
+        for key, first in (('a', 0), ('b', N - COMMON)):
+            fill(c, key, first, N)
+        assert c('zcard', 'a') == N and c('zcard', 'b') == N
+
+        # the requests behind it run after it, in order
+        outside = 'm%d' % (2 * N)
+        c('zadd', 'b', 1, outside)
+        replies = c.pipeline([
+            ('zintercard', 2, 'a', 'b'),
+            ('zadd', 'a', 1, outside),
+            ('zintercard', 2, 'b', 'a'),
+            ('zintercard', 2, 'a', 'b', 'limit', 10),
+            ('get', 'x'),
+            ('set', 'x', '1'),
+            ('get', 'x'),
+        ])
+        assert replies == [COMMON, 1, COMMON + 1, 10, None, None, '1'], replies
+        done, inflight = async_stats(c)
+        # the limit was reached without leaving the event loop
+        assert done == 2 and inflight == 0, (done, inflight)
+
+        # a client that stops waiting: its requests were sent, they still run
+        s = socket.create_connection(('127.0.0.1', PORT))
+        s.sendall(encode(('zintercard', 2, 'a', 'b')) + encode(('set', 'closed', '1')))
+        s.close()
+        wait_until(lambda: async_stats(c) == (3, 0), what='the job of the closed client')
+        wait_until(lambda: c('get', 'closed') == '1', what='the request behind the job')
+
+        # a reset drops the link at once, the job has nobody to reply to and
+        # the request behind it never runs
+        for attempt in range(5):
+            key = 'reset%d' % attempt
+            if reset_mid_job(c, key):
+                assert c('get', key) is None
+                break
+        else:
+            raise AssertionError('the job always ended before the reset')
+        other = Client(PORT)
+        assert other('zintercard', 2, 'a', 'b') == COMMON + 1
+        other.close()
+        done = async_stats(c)[0]
+
+        # no reply this large fits: ZUNION and ZDIFF know it before the work,
+        # ZINTER after it. none of them leaves the event loop
+        assert c('zunion', 2, 'a', 'b') == Err(ERR_TOO_BIG, '')
+        assert c('zdiff', 2, 'a', 'nokey') == Err(ERR_TOO_BIG, '')
+        assert c('zinter', 2, 'a', 'b', 'withscores') == Err(ERR_TOO_BIG, '')
+        assert async_stats(c) == (done, 0)
+        assert int(info(c, 'stats')['async_cmds_usec']) > 0
+
+        # only the smallest input is copied, the event loop goes on meanwhile:
+        # another client is answered in time, however many large inputs
+        fill(c, 'big', N - COMMON, BIG)
+        want = COMMON + 1  # the outside member too
+        big_job = ('zintercard', 6, 'a') + ('big',) * 5
+        stop = []
+        errors = []
+
+        def ping():
+            try:
+                o = Client(PORT, timeout=STALL_S)
+                while not stop:
+                    o('get', 'x')
+                o.close()
+            except Exception as e:
+                errors.append(repr(e))
+        pinger = threading.Thread(target=ping)
+        pinger.start()
+        try:
+            for _ in range(3):
+                assert c(*big_job) == want
+        finally:
+            stop.append(True)
+            pinger.join()
+        assert not errors, errors
+
+        # a write to an input read in place waits for the job
+        other = Client(PORT)
+        running, got = during_job(c, big_job, lambda: other('zadd', 'big', 1, 'm0'))
+        assert got == want if running else got in (want, want + 1), (running, got)
+        assert c(*big_job) == want + 1
+        # the keys flushed meanwhile, the job still has its inputs
+        running, got = during_job(c, big_job, lambda: other('flushall'))
+        assert got == want + 1 if running else got in (want + 1, 0), (running, got)
+        assert int(info(c, 'keyspace')['keys']) == 0
+        assert other('zcard', 'big') == 0
+        other.close()
+        print('test_async ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
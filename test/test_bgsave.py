@@ -0,0 +1,91 @@
+# BGSAVE encodes the keyspace over many ticks: the writes served meanwhile
+# must not leak into the snapshot, which is checked by loading it again. a
+# FLUSHALL meanwhile hands the old keyspace to the scan instead of waiting
+from testlib import Server, info, wait_until
+
+PORT = 7362
+NKEYS = 200000
+BIG = 30000  # members of the zset encoded in batches
+
+
+def batches(cmds, n=2000):
+    for i in range(0, len(cmds), n):
+        yield cmds[i:i + n]
+
+
+def main():
+    srv = Server(PORT)
+    try:
+        c = srv.client()
+        for part in batches([('set', 'k%d' % i, 'v%d' % i) for i in range(NKEYS)]):
+            c.pipeline(part)
+        for i in range(0, BIG, 500):
+            args = []
+            for m in range(i, i + 500):
+                args += [m % 100, 'm%d' % m]
+            c('zadd', 'big', *args)
+        c('zadd', 'small', 1, 'a', 2, 'b')
+        c('pexpire', 'k0', 3600 * 1000)
+
+        # the writes go right behind the BGSAVE, before its scan is over
+        writes = [('bgsave',)]
+        writes += [('set', 'k%d' % i, 'changed') for i in range(0, NKEYS, 7)]
+        writes += [('del', 'k%d' % i) for i in range(3, NKEYS, 7)]
+        writes += [('set', 'new%d' % i, 'x') for i in range(1000)]
+        writes += [('zadd', 'big', -1, 'extra'), ('zrem', 'big', 'm0'), ('zrem', 'big', 'm1'),
+                   ('zremrangebyrank', 'big', 0, 999), ('del', 'small'), ('pexpire', 'k1', 1)]
+        writes.append(('info', 'persistence'))
+        replies = c.pipeline(writes)
+        assert replies[0] == 'Background saving started', replies[0]
+        assert 'rdb_bgsave_in_progress:1' in replies[-1], 'the scan ended before the writes'
+
+        def saved():
+            return info(c, 'persistence')['rdb_bgsave_in_progress'] == '0'
+        wait_until(saved, what='the BGSAVE')
+        st = info(c, 'persistence')
+        assert st['rdb_last_bgsave_status'] == 'ok'
+        # the loop never waited for the whole copy
+        assert int(st['latest_fork_usec']) * 4 < int(st['rdb_last_bgsave_time_usec']), st
+
+        # the snapshot is the keyspace as of the BGSAVE
+        srv.restart()
+        c = srv.client()
+        assert int(info(c, 'keyspace')['keys']) == NKEYS + 2
+        for part in batches(list(range(NKEYS))):
+            got = c.pipeline([('get', 'k%d' % i) for i in part])
+            assert got == ['v%d' % i for i in part], part[0]
+        assert c('get', 'new0') is None
+        assert c('zrange', 'small', 0, -1) == ['a', 'b']
+        assert 0 < c('pttl', 'k0') <= 3600 * 1000
+        assert c('pttl', 'k1') == -1
+        assert c('zcard', 'big') == BIG
+        want = sorted(('m%d' % m for m in range(BIG)), key=lambda name: (int(name[1:]) % 100, name))
+        for i in range(0, BIG, 200):
+            assert c('zrange', 'big', i, i + 199) == want[i:i + 200], i
+
+        # the flush doesn't finish the scan, it goes on with the old keys
+        freed = int(info(c, 'stats')['lazyfreed_objects'])
+        replies = c.pipeline([('bgsave',), ('flushall', 'sync'), ('set', 'after', '1'),
+                              ('info', 'persistence')])
+        assert replies[:3] == ['Background saving started', None, None], replies[:3]
+        assert 'rdb_bgsave_in_progress:1' in replies[-1], 'the flush ended the scan'
+        wait_until(saved, what='the BGSAVE after the flush')
+        st = info(c, 'persistence')
+        assert st['rdb_last_bgsave_status'] == 'ok'
+        assert int(st['latest_fork_usec']) * 4 < int(st['rdb_last_bgsave_time_usec']), st
+        # then the old keys go the lazy free way
+        wait_until(lambda: int(info(c, 'stats')['lazyfreed_objects']) > freed,
+                   what='the old keyspace to be freed')
+        assert int(info(c, 'keyspace')['keys']) == 1
+        srv.restart()
+        c = srv.client()
+        assert int(info(c, 'keyspace')['keys']) == NKEYS + 2
+        assert c('get', 'after') is None
+        assert c('zcard', 'big') == BIG
+        print('test_bgsave ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
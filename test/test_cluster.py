@@ -0,0 +1,191 @@
+# two cluster nodes: MOVED for the other node's slots, CROSSSLOT for keys of
+# different slots, and a slot moved live with CLUSTER MIGRATE, the keys
+# answered with ASK once they are gone from the source. then a target slow
+# to reply: the source goes on meanwhile, the writes to the slot wait
+import socket
+import struct
+
+from testlib import (Server, Client, Err, ERR_BAD_ARG, ERR_BUSY, ERR_IO, ERR_MOVED,
+                     ERR_ASK, ERR_CLUSTERDOWN, info)
+
+PORT_A = 7368
+PORT_B = 7369
+PORT_SLOW = 7373
+ADDR_A = '127.0.0.1:%d' % PORT_A
+ADDR_B = '127.0.0.1:%d' % PORT_B
+ADDR_SLOW = '127.0.0.1:%d' % PORT_SLOW
+NKEYS = 500  # in the migrated slot
+NSLOW = 10
+
+
+def recv_exact(s, n):
+    data = b''
+    while len(data) < n:
+        chunk = s.recv(n - len(data))
+        assert chunk, 'the source closed the link'
+        data += chunk
+    return data
+
+
+# the link of the source and its next request, a RESTORE
+def take_batch(listener):
+    s, _ = listener.accept()
+    s.settimeout(10)
+    n, = struct.unpack('<I', recv_exact(s, 4))
+    recv_exact(s, n)
+    return s
+
+
+def still_waiting(c):
+    c.sock.settimeout(0.2)
+    try:
+        c.read()
+        return False
+    except socket.timeout:
+        return True
+    finally:
+        c.sock.settimeout(30)
+
+
+def key_in(c, lo, hi, prefix):
+    for i in range(10000):
+        key = '%s%d' % (prefix, i)
+        if lo <= c('cluster', 'keyslot', key) <= hi:
+            return key
+    raise AssertionError('no key in %d-%d' % (lo, hi))
+
+
+def main():
+    a = Server(PORT_A, '--cluster-enabled', 'yes')
+    b = Server(PORT_B, '--cluster-enabled', 'yes')
+    try:
+        ca, cb = a.client(), b.client()
+        got = ca('get', 'foo')
+        assert got == Err(ERR_CLUSTERDOWN, '') and got.msg.startswith('CLUSTERDOWN'), got
+        for c in (ca, cb):
+            assert c('cluster', 'setslot', '0-8191', 'node', ADDR_A) is None
+            assert c('cluster', 'setslot', '8192-16383', 'node', ADDR_B) is None
+            assert c('cluster', 'info').startswith('cluster_state:ok')
+
+        # each node serves its half, and redirects the other
+        ka, kb = key_in(ca, 0, 8191, 'a'), key_in(ca, 8192, 16383, 'b')
+        slot_b = ca('cluster', 'keyslot', kb)
+        assert ca('set', ka, '1') is None
+        assert cb('set', kb, '2') is None
+        got = ca('get', kb)
+        assert got == Err(ERR_MOVED, '') and got.msg == 'MOVED %d %s' % (slot_b, ADDR_B), got
+        assert cb('get', ka) == Err(ERR_MOVED, '')
+        assert ca('get', ka) == '1' and cb('get', kb) == '2'
+
+        # the keys of one command share a slot, {...} makes them
+        got = ca('zunionstore', ka, 2, ka, ka + 'x')
+        assert got == Err(ERR_BAD_ARG, '') and got.msg.startswith('CROSSSLOT'), got
+        tag = key_in(ca, 0, 8191, 't')
+        assert ca('zadd', '{%s}1' % tag, 1, 'x') == 1
+        assert ca('zadd', '{%s}2' % tag, 2, 'y') == 1
+        assert ca('zunionstore', '{%s}3' % tag, 2, '{%s}1' % tag, '{%s}2' % tag) == 2
+
+        # move a slot of A to B, with a zset and a TTL among its keys
+        m = '{%s}' % key_in(ca, 0, 8191, 'm')
+        slot = ca('cluster', 'keyslot', m)
+        keys = [m + str(i) for i in range(NKEYS)]
+        vals = {k: 'v' + k for k in keys}
+        ca.pipeline([('set', k, v) for k, v in vals.items()])
+        assert ca('zadd', m + 'z', 1, 'p', 2, 'q') == 2
+        assert ca('pexpire', keys[0], 3600 * 1000) == 1
+        assert ca('cluster', 'countkeysinslot', slot) == NKEYS + 1
+        assert cb('cluster', 'setslot', slot, 'importing', ADDR_A) is None
+        assert ca('cluster', 'setslot', slot, 'migrating', ADDR_B) is None
+
+        moved = ca('cluster', 'getkeysinslot', slot, 100)
+        assert ca('cluster', 'migrate', slot, 100) == 100
+        assert ca('cluster', 'countkeysinslot', slot) == NKEYS + 1 - 100
+        gone = moved[0]
+        here = [k for k in keys if k not in moved][0]
+        # the source still serves what it has, and sends the rest to the target
+        assert ca('get', here) == vals[here]
+        assert ca('set', here, 'late') is None
+        vals[here] = 'late'
+        got = ca('get', gone)
+        assert got == Err(ERR_ASK, '') and got.msg == 'ASK %d %s' % (slot, ADDR_B), got
+        assert ca('set', m + 'new', 'x') == Err(ERR_ASK, '')
+        assert ca('zunion', 2, gone, here) == Err(ERR_BUSY, '')
+        # the target only takes them after ASKING, once
+        assert cb('get', gone) == Err(ERR_MOVED, '')
+        assert cb.pipeline([('asking',), ('get', gone)]) == [None, vals[gone]]
+        assert cb('get', gone) == Err(ERR_MOVED, '')
+        assert cb.pipeline([('asking',), ('set', m + 'new', 'x')]) == [None, None]
+        vals[m + 'new'] = 'x'
+
+        total = 100
+        while True:
+            n = ca('cluster', 'migrate', slot, 100)
+            assert isinstance(n, int), n
+            if n == 0:
+                break
+            total += n
+        assert total == NKEYS + 1
+        for c in (ca, cb):
+            assert c('cluster', 'setslot', slot, 'node', ADDR_B) is None
+
+        # all of it on B now
+        assert ca('cluster', 'countkeysinslot', slot) == 0
+        assert cb('cluster', 'countkeysinslot', slot) == NKEYS + 2
+        assert ca('get', here) == Err(ERR_MOVED, '')
+        names = sorted(vals)
+        assert cb.pipeline([('get', k) for k in names]) == [vals[k] for k in names]
+        assert cb('zrange', m + 'z', 0, -1, 'withscores') == ['p', 1.0, 'q', 2.0]
+        assert 0 < cb('pttl', keys[0]) <= 3600 * 1000
+        assert cb('pttl', keys[1]) == -1
+        assert 'cluster_migrated_keys:%d' % (NKEYS + 1) in ca('cluster', 'info')
+        assert 'cluster_imported_keys:%d' % (NKEYS + 1) in cb('cluster', 'info')
+        assert int(info(ca, 'keyspace')['keys']) == 4  # ka and the tagged zsets
+
+        # a target slow to reply: the source serves the other slots meanwhile,
+        # and the writes to this one wait for the batch
+        listener = socket.socket()
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(('127.0.0.1', PORT_SLOW))
+        listener.listen(4)
+        listener.settimeout(10)
+        s = '{%s}' % key_in(ca, 0, 8191, 's')
+        slot = ca('cluster', 'keyslot', s)
+        ca.pipeline([('set', s + str(i), 'x') for i in range(NSLOW)])
+        assert ca('cluster', 'setslot', slot, 'migrating', ADDR_SLOW) is None
+        mover, writer = Client(PORT_A), Client(PORT_A)
+
+        # the link drops before the reply, the keys stay
+        mover.send('cluster', 'migrate', slot, 100)
+        link = take_batch(listener)
+        writer.send('set', s + '0', 'y')
+        assert still_waiting(writer)
+        assert ca('get', ka) == '1'
+        assert ca('cluster', 'migrate', slot, 100) == Err(ERR_BUSY, '')
+        link.close()
+        got = mover.read()
+        assert got == Err(ERR_IO, '') and 'reach' in got.msg, got
+        assert writer.read() is None
+        assert ca('cluster', 'countkeysinslot', slot) == NSLOW
+
+        # taken: the writes meanwhile find the keys gone
+        mover.send('cluster', 'migrate', slot, 100)
+        link = take_batch(listener)
+        writer.send('set', s + '1', 'y')
+        assert still_waiting(writer) and still_waiting(mover)
+        assert ca('get', ka) == '1'
+        link.sendall(struct.pack('<IBq', 9, 3, NSLOW))
+        assert mover.read() == NSLOW
+        assert writer.read() == Err(ERR_ASK, '')
+        assert ca('cluster', 'countkeysinslot', slot) == 0
+        link.close()
+        listener.close()
+        mover.close()
+        writer.close()
+        print('test_cluster ok')
+    finally:
+        b.close()
+        a.close()
+
+
+if __name__ == '__main__':
+    main()
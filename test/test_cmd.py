@@ -58,6 +58,148 @@ $ bin/client.exe zquery zset 1 "" 0 10
 (arr) len=2(str) n2
 (dbl) 2
 (arr) end
+$ bin/client.exe zadd rng 1 a 2 b 2 c 3 d 4 e
+(int) 5
+$ bin/client.exe zcount rng (1 (4
+(int) 3
+$ bin/client.exe zcount rng -inf +inf
+(int) 5
+$ bin/client.exe zrangebyscore rng (1 3 limit 1 2
+(arr) len=2(str) c
+(str) d
+(arr) end
+$ bin/client.exe zrevrangebyscore rng +inf (1 withscores limit 0 2
+(arr) len=4(str) e
+(dbl) 4
+(str) d
+(dbl) 3
+(arr) end
+$ bin/client.exe zadd lex 0 apple 0 banana 0 cherry 0 date
+(int) 4
+$ bin/client.exe zrangebylex lex [banana (date
+(arr) len=2(str) banana
+(str) cherry
+(arr) end
+$ bin/client.exe zrangebylex lex - [c limit 1 1
+(arr) len=1(str) banana
+(arr) end
+$ bin/client.exe zadd za 1 a 2 b inf c
+(int) 3
+$ bin/client.exe zadd zb 10 b 20 c 30 d
+(int) 3
+$ bin/client.exe zunionstore zu 2 za zb weights 0 1
+(int) 4
+$ bin/client.exe zrange zu 0 -1 withscores
+(arr) len=8(str) a
+(dbl) 0
+(str) b
+(dbl) 10
+(str) c
+(dbl) 20
+(str) d
+(dbl) 30
+(arr) end
+$ bin/client.exe zinterstore zi 2 za zb aggregate min
+(int) 2
+$ bin/client.exe zrange zi 0 -1 withscores
+(arr) len=4(str) b
+(dbl) 2
+(str) c
+(dbl) 20
+(arr) end
+$ bin/client.exe zinterstore zi 2 za zb weights 1 0.5 aggregate max
+(int) 2
+$ bin/client.exe zrange zi 0 -1 withscores
+(arr) len=4(str) b
+(dbl) 5
+(str) c
+(dbl) inf
+(arr) end
+$ bin/client.exe zdiffstore zd 2 za zb
+(int) 1
+$ bin/client.exe zrange zd 0 -1 withscores
+(arr) len=2(str) a
+(dbl) 1
+(arr) end
+$ bin/client.exe zunionstore za 2 za zb
+(int) 4
+$ bin/client.exe zrange za 0 -1 withscores
+(arr) len=8(str) a
+(dbl) 1
+(str) b
+(dbl) 12
+(str) d
+(dbl) 30
+(str) c
+(dbl) inf
+(arr) end
+$ bin/client.exe zunionstore zm 2 zb nokey
+(int) 3
+$ bin/client.exe zinterstore zm 2 zb nokey
+(int) 0
+$ bin/client.exe zcard zm
+(int) 0
+$ bin/client.exe zdiffstore zm 2 nokey zb
+(int) 0
+$ bin/client.exe zadd zx 1 a 2 b 3 c
+(int) 3
+$ bin/client.exe zadd zy 4 b 5 c 6 d
+(int) 3
+$ bin/client.exe zunion 2 zx zy withscores
+(arr) len=8(str) a
+(dbl) 1
+(str) b
+(dbl) 6
+(str) d
+(dbl) 6
+(str) c
+(dbl) 8
+(arr) end
+$ bin/client.exe zunion 2 zx zy weights 2 1 aggregate max withscores
+(arr) len=8(str) a
+(dbl) 2
+(str) b
+(dbl) 4
+(str) c
+(dbl) 6
+(str) d
+(dbl) 6
+(arr) end
+$ bin/client.exe zinter 2 zx zy
+(arr) len=2(str) b
+(str) c
+(arr) end
+$ bin/client.exe zinter 2 zx zy aggregate min withscores
+(arr) len=4(str) b
+(dbl) 2
+(str) c
+(dbl) 3
+(arr) end
+$ bin/client.exe zinter 2 zx nokey
+(arr) len=0(arr) end
+$ bin/client.exe zdiff 2 zx zy withscores
+(arr) len=2(str) a
+(dbl) 1
+(arr) end
+$ bin/client.exe zdiff 2 zy zx
+(arr) len=1(str) d
+(arr) end
+$ bin/client.exe zintercard 2 zx zy
+(int) 2
+$ bin/client.exe zintercard 2 zy zx limit 1
+(int) 1
+$ bin/client.exe zintercard 2 zx zy limit 0
+(int) 2
+$ bin/client.exe zintercard 1 zx limit 5
+(int) 3
+$ bin/client.exe zintercard 2 zx nokey
+(int) 0
+$ bin/client.exe zunion 2 zx zy limit 1
+(err) 4 syntax error
+$ bin/client.exe zdiff 2 zx zy weights 1 1
+(err) 4 syntax error
+$ bin/client.exe zintercard 2 zx zy withscores
+(err) 4 syntax error
 '''
 
 
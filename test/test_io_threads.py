@@ -0,0 +1,59 @@
+# I/O threads: clients pipelining at once, each must get its replies in the
+# order of its requests, whichever thread read and parsed them
+import threading
+
+from testlib import Server, info
+
+PORT = 7370
+NCLIENTS = 8
+ROUNDS = 5
+NREQS = 3000  # per pipeline, more than one read's worth
+
+
+def client_run(srv, n, errors):
+    try:
+        c = srv.client()
+        key = 'c%d' % n
+        for r in range(ROUNDS):
+            cmds = []
+            want = []
+            for i in range(NREQS):
+                val = '%d:%d:%d' % (n, r, i)
+                # a reply out of order reads another value
+                cmds += [('set', key, val), ('get', key)]
+                want += [None, val]
+            cmds.append(('zadd', key + 'z', r, 'r%d' % r))
+            want.append(1)
+            got = c.pipeline(cmds)
+            assert got == want, (n, r)
+        assert c('zrange', key + 'z', 0, -1) == ['r%d' % r for r in range(ROUNDS)]
+        c.close()
+    except Exception as e:
+        errors.append(repr(e))
+
+
+def main():
+    srv = Server(PORT, '--io-threads', 4)
+    try:
+        errors = []
+        threads = [threading.Thread(target=client_run, args=(srv, n, errors))
+                   for n in range(NCLIENTS)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert not errors, errors
+        c = srv.client()
+        for n in range(NCLIENTS):
+            assert c('get', 'c%d' % n) == '%d:%d:%d' % (n, ROUNDS - 1, NREQS - 1)
+        st = info(c, 'stats')
+        # the clients were ready together at least once
+        assert int(st['io_threaded_reads_processed']) > 0, st
+        assert int(st['io_threaded_writes_processed']) > 0, st
+        print('test_io_threads ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
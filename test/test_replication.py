@@ -0,0 +1,195 @@
+# replication between two servers: the full sync of a loaded primary, the
+# stream of writes after it, a partial resync from the backlog after the link
+# drops, and a replica refusing writes of its own. the link goes through a
+# proxy here, which can cut it. then a replica of the replica, which goes on
+# with a partial resync once its primary is promoted
+import socket
+import threading
+
+from testlib import Server, Err, ERR_READONLY, info, wait_until
+
+PRIMARY_PORT = 7365
+REPLICA_PORT = 7366
+PROXY_PORT = 7367
+CHAINED_PORT = 7372
+NKEYS = 20000
+
+
+class Proxy:
+    """forwards PROXY_PORT to the primary until cut, refuses links while paused"""
+
+    def __init__(self, port, target):
+        self.target = target
+        self.paused = False
+        self.socks = []
+        self.lock = threading.Lock()
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', port))
+        self.listener.listen(4)
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            try:
+                down, _ = self.listener.accept()
+            except OSError:
+                return
+            if self.paused:
+                down.close()
+                continue
+            up = socket.create_connection(('127.0.0.1', self.target))
+            with self.lock:
+                self.socks += [down, up]
+            threading.Thread(target=self.pump, args=(down, up), daemon=True).start()
+            threading.Thread(target=self.pump, args=(up, down), daemon=True).start()
+
+    @staticmethod
+    def pump(src, dst):
+        try:
+            while True:
+                data = src.recv(65536)
+                if not data:
+                    break
+                dst.sendall(data)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def cut(self):
+        with self.lock:
+            socks, self.socks = self.socks, []
+        for s in socks:
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            s.close()
+
+    def close(self):
+        self.listener.close()
+        self.cut()
+
+
+def batches(cmds, n=2000):
+    for i in range(0, len(cmds), n):
+        yield cmds[i:i + n]
+
+
+def check(r, strs, zsets):
+    assert int(info(r, 'keyspace')['keys']) == len(strs) + len(zsets)
+    names = sorted(strs)
+    for part in batches(names):
+        got = r.pipeline([('get', k) for k in part])
+        assert got == [strs[k] for k in part], part[0]
+    for key, zset in zsets.items():
+        want = sorted(zset.items(), key=lambda m: (m[1], m[0]))
+        assert r('zrange', key, 0, -1, 'withscores') == [x for m in want for x in m], key
+
+
+def in_sync(p, r):
+    def synced():
+        st = info(r, 'replication')
+        return (st['master_link_status'] == 'up'
+                and st['master_repl_offset'] == info(p, 'replication')['master_repl_offset'])
+    wait_until(synced, what='the replica to catch up')
+
+
+def main():
+    primary = Server(PRIMARY_PORT)
+    replica = Server(REPLICA_PORT)
+    chained = Server(CHAINED_PORT)
+    proxy = Proxy(PROXY_PORT, PRIMARY_PORT)
+    try:
+        p, r = primary.client(), replica.client()
+        strs = {'k%d' % i: 'v%d' % i for i in range(NKEYS)}
+        for part in batches([('set', k, v) for k, v in strs.items()]):
+            p.pipeline(part)
+        zsets = {'z': {'m%d' % i: float(i % 50) for i in range(200)}}
+        args = []
+        for name, score in zsets['z'].items():
+            args += [score, name]
+        p('zadd', 'z', *args)
+        p('pexpire', 'k0', 3600 * 1000)
+        assert r('set', 'mine', 'x') is None  # dropped by the full sync
+
+        # the full sync
+        assert r('replicaof', '127.0.0.1', PROXY_PORT) is None
+        in_sync(p, r)
+        check(r, strs, zsets)
+        assert 0 < r('pttl', 'k0') <= 3600 * 1000
+        assert info(p, 'replication')['sync_full'] == '1'
+
+        # the writes streamed after it
+        for i in range(0, NKEYS, 5):
+            strs['k%d' % i] = 'changed'
+        p.pipeline([('set', 'k%d' % i, 'changed') for i in range(0, NKEYS, 5)])
+        p.pipeline([('del', 'k%d' % i) for i in range(1, 1000, 5)])
+        for i in range(1, 1000, 5):
+            del strs['k%d' % i]
+        p('zadd', 'z', -1, 'first')
+        zsets['z']['first'] = -1.0
+        p('zrem', 'z', 'm7')
+        del zsets['z']['m7']
+        in_sync(p, r)
+        check(r, strs, zsets)
+
+        # writes go to the primary only
+        assert r('set', 'k2', 'x') == Err(ERR_READONLY, '')
+        assert r('del', 'k2') == Err(ERR_READONLY, '')
+        assert r('zadd', 'z', 1, 'x') == Err(ERR_READONLY, '')
+        assert r('get', 'k2') == 'v2'
+
+        # the link drops, the writes meanwhile come from the backlog
+        proxy.paused = True
+        proxy.cut()
+        wait_until(lambda: info(r, 'replication')['master_link_status'] == 'down',
+                   what='the replica to notice the drop')
+        p.pipeline([('set', 'gap%d' % i, 'g') for i in range(500)])
+        strs.update({'gap%d' % i: 'g' for i in range(500)})
+        p('del', 'k3')
+        del strs['k3']
+        p('zadd', 'z', 100, 'last')
+        zsets['z']['last'] = 100.0
+        assert r('get', 'gap0') is None
+        proxy.paused = False
+        in_sync(p, r)
+        check(r, strs, zsets)
+        st = info(p, 'replication')
+        assert st['sync_full'] == '1' and st['sync_partial_ok'] == '1', st
+        assert st['connected_replicas'] == '1', st
+
+        # a replica serves a full sync too, streamed like the primary's
+        c = chained.client()
+        assert c('replicaof', '127.0.0.1', REPLICA_PORT) is None
+        in_sync(r, c)
+        check(c, strs, zsets)
+        assert info(r, 'replication')['sync_full'] == '1'
+
+        # promoted, it takes writes again in a new history. its replica comes
+        # back with the old one and continues from where that ended
+        old_id = info(r, 'replication')['master_replid']
+        assert r('replicaof', 'no', 'one') is None
+        st = info(r, 'replication')
+        assert st['master_replid2'] == old_id and st['master_replid'] != old_id, st
+        assert r('set', 'k2', 'x') is None
+        strs['k2'] = 'x'
+        in_sync(r, c)
+        check(c, strs, zsets)
+        st = info(r, 'replication')
+        assert st['sync_full'] == '1' and st['sync_partial_ok'] == '1', st
+        assert info(c, 'replication')['master_replid'] == st['master_replid']
+        print('test_replication ok')
+    finally:
+        proxy.close()
+        chained.close()
+        replica.close()
+        primary.close()
+
+
+if __name__ == '__main__':
+    main()
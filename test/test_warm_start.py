@@ -0,0 +1,70 @@
+# warm start: the keys read or written before their section is loaded come
+# from the section index, the batches spliced later must not undo the writes,
+# and the commands that see every key wait for the end of the load
+from testlib import Server, Err, ERR_BUSY, info, wait_until
+
+PORT = 7364
+NKEYS = 50000  # 16 sections
+ZSIZE = 300
+DELAY_US = 200  # per key decoded, a batch takes about NKEYS / 16 * DELAY_US
+
+
+def batches(cmds, n=2000):
+    for i in range(0, len(cmds), n):
+        yield cmds[i:i + n]
+
+
+def main():
+    srv = Server(PORT)
+    try:
+        c = srv.client()
+        for part in batches([('set', 'k%d' % i, 'v%d' % i) for i in range(NKEYS)]):
+            c.pipeline(part)
+        args = []
+        for i in range(ZSIZE):
+            args += [i, 'm%d' % i]
+        c('zadd', 'z', *args)
+        assert c('save') is None
+        strs = {'k%d' % i: 'v%d' % i for i in range(NKEYS)}
+
+        srv.restart('--warm-start', 'yes', '--key-load-delay', DELAY_US)
+        c = srv.client()
+        st = info(c, 'persistence')
+        assert st['loading'] == '1' and st['loading_keys_total'] == str(NKEYS + 1), st
+
+        # faulted in, one key at a time
+        assert c('get', 'k10') == 'v10'
+        assert c('set', 'k20', 'new') is None
+        strs['k20'] = 'new'
+        assert c('del', 'k30') == 1
+        del strs['k30']
+        assert c('get', 'k30') is None
+        assert c('zadd', 'z', -1, 'extra') == 1
+        assert c('get', 'missing') is None
+
+        # the whole keyspace isn't there yet
+        for cmd in (('keys',), ('flushall',), ('save',), ('bgsave',), ('bgrewriteaof',)):
+            assert c(*cmd) == Err(ERR_BUSY, ''), cmd
+
+        # no batch had been spliced: the keys above came from the index
+        st = info(c, 'persistence')
+        assert st['loading'] == '1', 'the load ended before the commands'
+        assert st['loading_keys_on_demand'] == '4', st
+        assert st['loading_keys_loaded'] == '4', st
+
+        wait_until(lambda: info(c, 'persistence')['loading'] == '0', what='the warm start')
+        assert int(info(c, 'keyspace')['keys']) == len(strs) + 1
+        names = sorted(strs)
+        for part in batches(names):
+            got = c.pipeline([('get', k) for k in part])
+            assert got == [strs[k] for k in part], part[0]
+        assert c('zcard', 'z') == ZSIZE + 1
+        assert c('zrange', 'z', 0, 1, 'withscores') == ['extra', -1.0, 'm0', 0.0]
+        assert c('save') is None
+        print('test_warm_start ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,128 @@
+# ZCOUNT, ZRANGEBYSCORE, ZREVRANGEBYSCORE and ZRANGEBYLEX against a plain
+# scan of the members, for a listpack and for a larger zset
+import random
+import sys
+
+from testlib import Server, Err, ERR_BAD_ARG
+
+PORT = 7361
+
+
+def in_score_range(score, lo, hi):
+    (lo_val, lo_ex), (hi_val, hi_ex) = lo, hi
+    above = score > lo_val if lo_ex else score >= lo_val
+    below = score < hi_val if hi_ex else score <= hi_val
+    return above and below
+
+
+def bound_str(val, ex):
+    s = {float('inf'): '+inf', float('-inf'): '-inf'}.get(val, repr(val))
+    return ('(' if ex else '') + s
+
+
+def random_bound(scores):
+    val = random.choice(scores + [float('-inf'), float('inf'), random.uniform(-5, 25)])
+    return val, random.random() < 0.5
+
+
+def check_scores(c, key, members, rounds, all_fits):
+    members = sorted(members, key=lambda m: (m[1], m[0]))
+    scores = [s for _, s in members]
+    for _ in range(rounds):
+        lo, hi = random_bound(scores), random_bound(scores)
+        want = [m for m in members if in_score_range(m[1], lo, hi)]
+        got = c('zcount', key, bound_str(*lo), bound_str(*hi))
+        assert got == len(want), (lo, hi, got, len(want))
+
+        # no limit (-1) only while the whole range fits in a reply
+        offset, count = random.randint(0, 5), random.randint(-1 if all_fits else 0, 8)
+        sub = want[offset:] if count < 0 else want[offset:offset + count]
+        got = c('zrangebyscore', key, bound_str(*lo), bound_str(*hi), 'withscores',
+                'limit', offset, count)
+        assert got == [x for m in sub for x in m], (lo, hi, offset, count, got)
+
+        rev = want[::-1]
+        sub = rev[offset:] if count < 0 else rev[offset:offset + count]
+        got = c('zrevrangebyscore', key, bound_str(*hi), bound_str(*lo), 'limit', offset, count)
+        assert got == [m[0] for m in sub], (lo, hi, offset, count, got)
+
+
+def check_lex(c, key, names, rounds, all_fits):
+    names = sorted(names)
+    for _ in range(rounds):
+        bounds = []
+        for _ in range(2):
+            r = random.random()
+            if r < 0.1:
+                bounds.append(('-', None, False))
+            elif r < 0.2:
+                bounds.append(('+', None, False))
+            else:
+                name = random.choice(names + ['', 'a', 'm', 'zz'])
+                ex = random.random() < 0.5
+                bounds.append((('(' if ex else '[') + name, name, ex))
+        (lo_s, lo, lo_ex), (hi_s, hi, hi_ex) = bounds
+
+        def inside(n):
+            if lo_s == '+' or hi_s == '-':
+                return False
+            above = lo_s == '-' or (n > lo if lo_ex else n >= lo)
+            below = hi_s == '+' or (n < hi if hi_ex else n <= hi)
+            return above and below
+        want = [n for n in names if inside(n)]
+        offset, count = random.randint(0, 3), random.randint(-1 if all_fits else 0, 6)
+        sub = want[offset:] if count < 0 else want[offset:offset + count]
+        got = c('zrangebylex', key, lo_s, hi_s, 'limit', offset, count)
+        assert got == sub, (lo_s, hi_s, offset, count, got, sub)
+
+
+def main():
+    random.seed(int(sys.argv[1]) if len(sys.argv) > 1 else 1)
+    srv = Server(PORT)
+    try:
+        c = srv.client()
+        # a few fixed cases first
+        c('zadd', 's', 1, 'a', 2, 'b', 2, 'c', 3, 'd', 4, 'e')
+        assert c('zcount', 's', '(1', '(4') == 3
+        assert c('zcount', 's', '(2', '3') == 1
+        assert c('zcount', 's', '-inf', '+inf') == 5
+        assert c('zcount', 's', '(4', '+inf') == 0
+        assert c('zcount', 's', '3', '2') == 0
+        assert c('zcount', 'missing', '-inf', '+inf') == 0
+        assert c('zcount', 's', 'x', '1') == Err(ERR_BAD_ARG, '')
+        assert c('zrangebyscore', 's', '(1', '3', 'limit', 1, 2) == ['c', 'd']
+        assert c('zrevrangebyscore', 's', '+inf', '(1', 'withscores', 'limit', 0, 2) == ['e', 4.0, 'd', 3.0]
+        assert c('zrangebyscore', 's', 1, 2, 'limit', 0) == Err(ERR_BAD_ARG, '')
+        c('zadd', 'l', 0, 'apple', 0, 'banana', 0, 'cherry', 0, 'date')
+        assert c('zrangebylex', 'l', '[banana', '(date') == ['banana', 'cherry']
+        assert c('zrangebylex', 'l', '(banana', '+') == ['cherry', 'date']
+        assert c('zrangebylex', 'l', '-', '[c', 'limit', 1, 1) == ['banana']
+        assert c('zrangebylex', 'l', 'banana', '+') == Err(ERR_BAD_ARG, '')
+
+        # random ranges, on a listpack and on an indexed zset
+        for key, n in (('small', 40), ('big', 3000)):
+            members = {}
+            for i in range(n):
+                members['m%d' % i] = float(random.randint(0, 20)) + random.choice([0, 0.5])
+            items = list(members.items())
+            for i in range(0, len(items), 500):
+                args = []
+                for name, score in items[i:i + 500]:
+                    args += [score, name]
+                c('zadd', key, *args)
+            check_scores(c, key, items, 300, n < 100)
+
+            names = ['%s%d' % (random.choice('abcxyz'), i) for i in range(n)]
+            for i in range(0, n, 500):
+                args = []
+                for name in names[i:i + 500]:
+                    args += [0, name]
+                c('zadd', key + 'lex', *args)
+            check_lex(c, key + 'lex', names, 300, n < 100)
+        print('test_zrange ok')
+    finally:
+        srv.close()
+
+
+if __name__ == '__main__':
+    main()
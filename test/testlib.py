@@ -0,0 +1,173 @@
+# helpers for the tests that start their own servers: the binaries, the
+# request/reply encoding, INFO
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def binary(name):
+    return os.path.join(ROOT, 'bin', name + ('.exe' if os.name == 'nt' else ''))
+
+
+class Err:
+    def __init__(self, code, msg):
+        self.code = code
+        self.msg = msg
+
+    def __eq__(self, other):
+        return isinstance(other, Err) and self.code == other.code
+
+    def __repr__(self):
+        return 'Err(%d, %r)' % (self.code, self.msg)
+
+
+# the error codes of server.cpp
+ERR_UNKNOWN = 1
+ERR_TOO_BIG = 2
+ERR_BAD_TYP = 3
+ERR_BAD_ARG = 4
+ERR_BUSY = 6
+ERR_IO = 7
+ERR_READONLY = 8
+ERR_MOVED = 9
+ERR_ASK = 10
+ERR_CLUSTERDOWN = 11
+
+
+def encode(cmd):
+    args = [a if isinstance(a, bytes) else str(a).encode() for a in cmd]
+    body = struct.pack('<I', len(args)) + b''.join(struct.pack('<I', len(a)) + a for a in args)
+    return struct.pack('<I', len(body)) + body
+
+
+def decode(data, pos=0):
+    tag = data[pos]
+    pos += 1
+    if tag == 0:
+        return None, pos
+    if tag == 1:
+        code, n = struct.unpack_from('<iI', data, pos)
+        pos += 8
+        return Err(code, data[pos:pos + n].decode()), pos + n
+    if tag == 2:
+        n, = struct.unpack_from('<I', data, pos)
+        pos += 4
+        return data[pos:pos + n].decode(errors='replace'), pos + n
+    if tag == 3:
+        return struct.unpack_from('<q', data, pos)[0], pos + 8
+    if tag == 4:
+        return struct.unpack_from('<d', data, pos)[0], pos + 8
+    if tag == 5:
+        n, = struct.unpack_from('<I', data, pos)
+        pos += 4
+        out = []
+        for _ in range(n):
+            val, pos = decode(data, pos)
+            out.append(val)
+        return out, pos
+    raise ValueError('bad tag %d' % tag)
+
+
+class Client:
+    def __init__(self, port, timeout=30):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=timeout)
+        self.buf = b''
+
+    def send(self, *cmd):
+        self.sock.sendall(encode(cmd))
+
+    def read(self):
+        while True:
+            if len(self.buf) >= 4:
+                n, = struct.unpack_from('<I', self.buf)
+                if len(self.buf) >= 4 + n:
+                    val = decode(self.buf, 4)[0]
+                    self.buf = self.buf[4 + n:]
+                    return val
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise EOFError('connection closed')
+            self.buf += chunk
+
+    def __call__(self, *cmd):
+        self.send(*cmd)
+        return self.read()
+
+    # all the requests in one write, then their replies
+    def pipeline(self, cmds):
+        self.sock.sendall(b''.join(encode(c) for c in cmds))
+        return [self.read() for _ in cmds]
+
+    def close(self):
+        self.sock.close()
+
+
+def info(client, section):
+    out = {}
+    for line in client('info', section).split('\r\n'):
+        if ':' in line:
+            key, val = line.split(':', 1)
+            out[key] = val
+    return out
+
+
+def wait_until(cond, timeout=20, what='condition'):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if cond():
+            return
+        time.sleep(0.05)
+    raise AssertionError('timed out waiting for ' + what)
+
+
+class Server:
+    """a server on `port`, in its own directory unless given one"""
+
+    def __init__(self, port, *args, dir=None):
+        self.port = port
+        self.args = [str(a) for a in args]
+        self.own_dir = dir is None
+        self.dir = tempfile.mkdtemp(prefix='server%d_' % port) if dir is None else dir
+        self.proc = None
+        self.start()
+
+    def start(self):
+        log = open(os.path.join(self.dir, 'server.log'), 'ab')
+        self.proc = subprocess.Popen([binary('server'), '--port', str(self.port)] + self.args,
+                                     cwd=self.dir, stdout=log, stderr=log)
+        log.close()
+
+        def up():
+            try:
+                socket.create_connection(('127.0.0.1', self.port), timeout=1).close()
+                return True
+            except OSError:
+                assert self.proc.poll() is None, 'the server exited, see ' + self.dir
+                return False
+        wait_until(up, what='the server on port %d' % self.port)
+
+    def client(self):
+        return Client(self.port)
+
+    def stop(self):
+        if self.proc and self.proc.poll() is None:
+            self.proc.kill()
+            self.proc.wait()
+        self.proc = None
+
+    def restart(self, *args):
+        self.stop()
+        if args:
+            self.args = [str(a) for a in args]
+        self.start()
+
+    def close(self):
+        self.stop()
+        if self.own_dir:
+            shutil.rmtree(self.dir, ignore_errors=True)